@@ -1,53 +1,49 @@
-#include "modules/ext2.h"
-#include "modules/fat16.h"
+#include "modules/output.h"
+#include "modules/volume.h"
+#include "modules/serve.h"
 
-#define ERR_ARGS "Error. Please, provide correct arguments for fsutils to work. Use --help for more info.\n\n"
-#define ERR_FS_NOT_SUPPORTED "Error. %s does not exist or has a Filesystem not supported. Only EXT2 and FAT16 are supported.\n\n"
-#define HELP "\nFSUTILS HELP\n------------\nfsutils is a tool that provides multiple utilities for analyzing EXT2 & FAT16 filesystems.\nUsage: fsutils [OPTION] [FILESYSTEM PATH]\n\nOptions:\n\t--info\t\tPrints the information of the filesystem.\n\t--tree\t\tPrints the tree of the filesystem.\n\t--cat\t\tPrints the content of a file.\n\t--help\t\tPrints this help.\n\n"
-#define EXT2 0
-#define FAT16 1
+#define HELP "\nFSUTILS HELP\n------------\nfsutils is a tool that provides multiple utilities for analyzing EXT2 & FAT16 filesystems.\nUsage: fsutils [OPTION] [FILESYSTEM PATH]\n\nOptions:\n\t--info\t\tPrints the information of the filesystem.\n\t--usage\t\tCounts the used and free blocks & inodes (EXT2, from the bitmaps) or clusters (FAT16, from the FAT),\n\t\t\tand flags the counters of the filesystem that don't agree with them (exits with 1 if any).\n\t--frag\t\tReports how fragmented the files are: extents per file, a histogram and the most fragmented files.\n\t\t\tAdd --all after the path to list every file with its extents.\n\t--du\t\tSums the size and the space on disk of every directory in one walk (fsutils --du <image> [directory]),\n\t\t\tand prints them, the biggest first.\n\t--hash\t\tPrints the XXH64 digest, size and path of every file, hashed by a thread per CPU.\n\t--dups\t\tFinds the files with the same contents (same size, then same digest), and the space the copies waste.\n\t--find\t\tPrints the paths of the entries whose name matches a glob (fsutils --find <image> <pattern>), or\n\t\t\twhose path does if the pattern has a '/'. Add --regex to give a regular expression for the path,\n\t\t\t--type f or --type d to only look for files or directories, and --max-results <n> to stop after n.\n\t--tree\t\tPrints the tree of the filesystem. Add --stream after the path to print it as it's read,\n\t\t\tor --async to read the directories with many reads in flight (io_uring).\n\t--cat\t\tPrints the content of a file, given its path (/dir/file.txt) or just its name.\n\t\t\tAdd --index after the --tree or --cat arguments to answer from an index file kept beside the image\n\t\t\t(<image>.fsidx), built the first time and rebuilt whenever the image changes.\n\t--stat\t\tPrints the type, size and other metadata of a file or directory, given its path.\n\t--extract\tCopies the whole filesystem to a directory of the host (fsutils --extract <image> <directory>).\n\t--serve\t\tRuns as a daemon on a UNIX socket (fsutils --serve <socket>), keeping open the images it's asked about.\n\t\t\tWhen FSUTILS_SOCKET holds the socket of a daemon, the other commands are answered by it.\n\t--direct\tAdd it after the path of the image to read the image with O_DIRECT, around the page cache, with\n\t\t\ta fixed amount of memory (for big scans that shouldn't evict the cache of other programs).\n\t--help\t\tPrints this help.\n\n"
 
 int main(int argc, char *argv[]) {
+    //Every command prints through the buffered standard output
+    OUT_init();
 
     //Print help if the user asks for it
     if(argc == 2 && strcmp(argv[1], "--help") == 0){
-        printf(HELP);
+        OUT_printf(&OUT_stdout, HELP);
         return 0;
     }
 
-    //If the number of arguments is not correct, print an error and return
-    if(argc != 3 && argc != 4){
-        printf(ERR_ARGS);
-        return 1;
-    }
+    //Run as a daemon, answering the commands sent to the socket
+    if(argc == 3 && strcmp(argv[1], "--serve") == 0) return SERVE_run(argv[2]);
 
-    int fs; //0 = EXT2, 1 = FAT16
-    //Check if the file is EXT2 or FAT16
-    if(EXT2_isExt2(argv[2])){
-        fs = EXT2;
+    //--direct can go anywhere after the image: it changes how the image is read, not the command
+    int flags = 0;
+    for(int i = 3; i < argc; i++){
+        if(strcmp(argv[i], "--direct") != 0) continue;
+        flags |= IMAGE_DIRECT;
+        for(int j = i; j < argc - 1; j++) argv[j] = argv[j + 1];
+        argc--;
+        i--;
     }
-    else if(FAT16_isFat16(argv[2])){
-        fs = FAT16;
-    }
-    else{
-        printf(ERR_FS_NOT_SUPPORTED, argv[2]);
+
+    //If the number of arguments is not correct, print an error and return
+    if(argc < VOLUME_MIN_ARGS || argc > VOLUME_MAX_ARGS){
+        OUT_printf(&OUT_stdout, ERR_ARGS);
         return 1;
     }
 
-    //If the info option is selected, try to get the info from the file
-    if(argc == 3 && strcmp(argv[1], "--info") == 0){
-        if(fs == EXT2) EXT2_printInfo(argv[2]);
-        else FAT16_printInfo(argv[2]);
-    }
-    else if(argc == 3 && strcmp(argv[1], "--tree") == 0){
-        if(fs == EXT2) EXT2_printTree(argv[2]);
-        else FAT16_printTree(argv[2]);
-    }
-    else if(argc == 4 && strcmp(argv[1], "--cat") == 0){
-        if(fs == EXT2) EXT2_catFile(argv[2], argv[3]);
-        else FAT16_catFile(argv[2], argv[3]);
-    }
-    else{
-        printf(ERR_ARGS);
-    }
-}
\ No newline at end of file
+    //If there's a daemon, it answers the command (with the image already open); otherwise it runs here.
+    //Direct reads always run here: the daemon keeps its images in the page cache.
+    int status;
+    const char *socketPath = getenv(SERVE_SOCKET_ENV);
+    if(!(flags & IMAGE_DIRECT) && socketPath != NULL && *socketPath != '\0' && SERVE_forward(socketPath, argc, argv, &status)) return status;
+
+    //Open the image once, and mount the filesystem it holds
+    Volume vol;
+    if(!VOLUME_open(&vol, argv[2], flags, &OUT_stdout)) return 1;
+
+    status = VOLUME_run(&vol, argc, argv, &OUT_stdout);
+    VOLUME_close(&vol);
+    return status;
+}
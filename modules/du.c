@@ -0,0 +1,174 @@
+#include "du.h"
+
+// Totals of a directory, once it's been left
+typedef struct {
+    char *path;
+    uint64_t size;
+    uint64_t allocated;
+    uint64_t files;
+} DuDir;
+
+// Directory the walk is in: what's been summed below it so far
+typedef struct {
+    uint64_t size;
+    uint64_t allocated;
+    uint64_t files;
+    size_t pathLen;                 // Length of the path of its parent, restored when it's left
+} DuFrame;
+
+typedef struct {
+    DuFrame *frames;                // Directories from the start one to the one being walked
+    int numFrames;
+    int frameCapacity;
+    char *path;                     // Path of the directory being walked
+    size_t pathLen;
+    size_t pathCapacity;
+    DuDir *dirs;
+    uint64_t numDirs;
+    uint64_t dirCapacity;
+    int failed;                     // Set if memory ran out
+} DuWalk;
+
+static int appendName(DuWalk *walk, const char *name);
+static void visitEntry(void *ctx, int level, const char *name, int isDir, const TreeSizes *sizes);
+static void leaveDirectory(void *ctx, int level);
+static int compareDirs(const void *a, const void *b);
+
+/**
+ * Appends a name to the path of the directory being walked
+ * @param walk : The walk
+ * @param name : The name (the start directory's path, at level 0)
+ * @return Whether there was memory for it (1) or not (0)
+ */
+static int appendName(DuWalk *walk, const char *name){
+    size_t nameLen = strlen(name);
+    if(walk->pathLen + nameLen + 2 > walk->pathCapacity){
+        size_t capacity = (walk->pathLen + nameLen + 2) * 2;
+        char *bigger = (char *) realloc(walk->path, capacity);
+        if(bigger == NULL) return 0;
+        walk->path = bigger;
+        walk->pathCapacity = capacity;
+    }
+
+    if(walk->pathLen > 0 && walk->path[walk->pathLen - 1] != '/')
+        walk->path[walk->pathLen++] = '/';
+    memcpy(walk->path + walk->pathLen, name, nameLen + 1);
+    walk->pathLen += nameLen;
+    return 1;
+}
+
+/**
+ * Visitor of the walk: files are added to the directory they're in, and directories start a frame of their own
+ */
+static void visitEntry(void *ctx, int level, const char *name, int isDir, const TreeSizes *sizes){
+    DuWalk *walk = (DuWalk *) ctx;
+    if(walk->failed) return;
+
+    if(!isDir){
+        DuFrame *parent = &(walk->frames[level - 1]);
+        parent->size += sizes->size;
+        parent->allocated += sizes->allocated;
+        parent->files++;
+        return;
+    }
+
+    if(walk->numFrames == walk->frameCapacity){
+        int capacity = walk->frameCapacity == 0 ? 32 : walk->frameCapacity * 2;
+        DuFrame *bigger = (DuFrame *) realloc(walk->frames, capacity * sizeof(DuFrame));
+        if(bigger == NULL){
+            walk->failed = 1;
+            return;
+        }
+        walk->frames = bigger;
+        walk->frameCapacity = capacity;
+    }
+
+    size_t parentLen = walk->pathLen;
+    if(!appendName(walk, name)){
+        walk->failed = 1;
+        return;
+    }
+    walk->frames[walk->numFrames++] = (DuFrame) {sizes->size, sizes->allocated, 0, parentLen};
+}
+
+/**
+ * Visitor of the walk, once a directory has no more entries: its totals are kept, and added to its parent's
+ */
+static void leaveDirectory(void *ctx, int level){
+    DuWalk *walk = (DuWalk *) ctx;
+    if(walk->failed) return;
+
+    DuFrame frame = walk->frames[level];
+    walk->numFrames--;
+
+    if(walk->numDirs == walk->dirCapacity){
+        uint64_t capacity = walk->dirCapacity == 0 ? 256 : walk->dirCapacity * 2;
+        DuDir *bigger = (DuDir *) realloc(walk->dirs, capacity * sizeof(DuDir));
+        if(bigger == NULL){
+            walk->failed = 1;
+            return;
+        }
+        walk->dirs = bigger;
+        walk->dirCapacity = capacity;
+    }
+    char *copy = strdup(walk->path);
+    if(copy == NULL){
+        walk->failed = 1;
+        return;
+    }
+    walk->dirs[walk->numDirs++] = (DuDir) {copy, frame.size, frame.allocated, frame.files};
+
+    if(level > 0){
+        DuFrame *parent = &(walk->frames[level - 1]);
+        parent->size += frame.size;
+        parent->allocated += frame.allocated;
+        parent->files += frame.files;
+    }
+    walk->pathLen = frame.pathLen;
+    walk->path[walk->pathLen] = '\0';
+}
+
+/**
+ * Orders the directories by the bytes they hold on disk, then by their size, biggest first (qsort)
+ */
+static int compareDirs(const void *a, const void *b){
+    const DuDir *x = (const DuDir *) a, *y = (const DuDir *) b;
+    if(x->allocated != y->allocated) return x->allocated > y->allocated ? -1 : 1;
+    return x->size > y->size ? -1 : x->size < y->size;
+}
+
+/**
+ * Sums the sizes of the files below every directory of a subtree, in a single walk of the tree: each entry
+ * brings its size (EXT2 i_size, FAT16 fSize) and the bytes it holds on disk (EXT2 i_blocks, FAT16 clusters of
+ * its chain), and the sums of a directory are added to its parent's once the walk leaves it.
+ * Directories are printed with their totals (their own blocks included), the biggest ones on disk first.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2)
+ * @param path : The directory to start from ("/" for the whole filesystem)
+ * @param out : Output where the totals are printed
+ * @return Whether the directory could be summed (1) or not (0)
+ */
+int DU_run(Image *img, Ext2 *ext2, Fat16 *fat16, const char *path, Output *out){
+    DuWalk walk;
+    memset(&walk, 0, sizeof(DuWalk));
+    TreeVisitor visitor = {visitEntry, leaveDirectory, &walk, 1};
+
+    int found = ext2 != NULL ? EXT2_visitTree(img, ext2, path, &visitor) : FAT16_visitTree(img, fat16, path, &visitor);
+    int ok = found && !walk.failed;
+    if(!found) OUT_printf(out, ERR_DU_PATH, path);
+    else if(walk.failed) OUT_printf(out, ERR_DU_MEMORY);
+    else{
+        qsort(walk.dirs, walk.numDirs, sizeof(DuDir), compareDirs);
+        OUT_printf(out, DU_PRINT, "Allocated", "Size", "Files", "Directory");
+        for(uint64_t i = 0; i < walk.numDirs; i++)
+            OUT_printf(out, DU_PRINT_DIR, walk.dirs[i].allocated, walk.dirs[i].size, walk.dirs[i].files, walk.dirs[i].path);
+        OUT_printf(out, "\n");
+    }
+
+    for(uint64_t i = 0; i < walk.numDirs; i++) free(walk.dirs[i].path);
+    free(walk.dirs);
+    free(walk.frames);
+    free(walk.path);
+    return ok;
+}
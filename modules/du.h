@@ -0,0 +1,34 @@
+#ifndef DU_H
+#define DU_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "image.h"
+#include "output.h"
+#include "tree.h"
+#include "ext2.h"
+#include "fat16.h"
+
+#define ERR_DU_PATH "Error. %s is not a directory of the filesystem.\n\n"
+#define ERR_DU_MEMORY "Error. Not enough memory to sum the directories.\n\n"
+#define DU_PRINT "\n------ Disk usage ------\n\n%14s %14s %9s  %s\n"
+#define DU_PRINT_DIR "%14" PRIu64 " %14" PRIu64 " %9" PRIu64 "  %s\n"
+
+/**
+ * Sums the sizes of the files below every directory of a subtree, in a single walk of the tree: each entry
+ * brings its size (EXT2 i_size, FAT16 fSize) and the bytes it holds on disk (EXT2 i_blocks, FAT16 clusters of
+ * its chain), and the sums of a directory are added to its parent's once the walk leaves it.
+ * Directories are printed with their totals (their own blocks included), the biggest ones on disk first.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2)
+ * @param path : The directory to start from ("/" for the whole filesystem)
+ * @param out : Output where the totals are printed
+ * @return Whether the directory could be summed (1) or not (0)
+ */
+int DU_run(Image *img, Ext2 *ext2, Fat16 *fat16, const char *path, Output *out);
+
+#endif
@@ -1,27 +1,97 @@
 #include "ext2.h"
 #include "tree.h"
+#include "image.h"
+#include "walk.h"
+#include "output.h"
 
-static Inode getInode(FILE *fp, Ext2 *ext2, int inodeNum);
-static int pierceTree(FILE *fp, Ext2 *ext2, int nextInode, int catFile, char *fileName, struct TreeNode *parent);
-static void printFileContent(FILE *fp, Ext2 ext2, Inode inode);
+static Inode getInode(Image *img, Ext2 *ext2, int inodeNum, int concurrent);
+static int loadGroups(Image *img, Ext2 *ext2);
+static void freeCaches(Ext2 *ext2);
+static Ext2 beginCommand(const Ext2 *mounted);
+static int shouldSweep(Image *img, Ext2 *ext2);
+static int sweepInodes(Image *img, Ext2 *ext2);
+static void freeSweep(InodeSweep *sweep);
+static void planSubdir(ImagePlan *plan, Ext2 *ext2, const DirectoryEntry *de);
+static void planFrontier(Image *img, Ext2 *ext2, DirIterator *it);
+static int pierceTree(Image *img, Ext2 *ext2, int nextInode, int catFile, char *fileName, TreeVisitor *visitor, int level, Output *out);
+static void printFileContent(Image *img, Ext2 ext2, Inode inode, Output *out);
+static TreeSizes inodeSizes(Image *img, Ext2 *ext2, uint32_t inodeNum);
+static void expandDirectory(WalkPool *pool, int worker, void *ctx, uint64_t dir, struct TreeNode *node);
+static uint32_t lookup(Image *img, Ext2 *ext2, uint32_t dirInode, const char *name, size_t nameLen);
+static uint32_t resolvePath(Image *img, Ext2 *ext2, const char *path);
+static uint32_t mapBlock(BlockMap *map, uint64_t logical);
+static uint64_t mapExtent(BlockMap *map, uint64_t logical, uint32_t *physical);
+static uint64_t inodeOffset(Ext2 *ext2, uint32_t inodeNum);
+static int openDirectory(DirIterator *it, Image *img, Ext2 *ext2, uint32_t inodeNum, int concurrent);
+static int initDirectory(DirIterator *it, Image *img, Ext2 *ext2);
+static const DirectoryEntry * nextEntry(DirIterator *it);
+static void rewindDirectory(DirIterator *it);
+static void closeDirectory(DirIterator *it);
+static int fileRuns(Image *img, Ext2 *ext2, const Inode *inode, ImageRun **runs, uint32_t *count);
+static int htreeLookup(DirIterator *it, Ext2 *ext2, const char *name, size_t nameLen, uint32_t *inodeNum);
+static void indexDirectory(Image *img, Ext2 *ext2, uint32_t inodeNum, IndexWriter *writer, int level);
+
+typedef struct {
+    Image *img;
+    Ext2 *ext2;
+} WalkContext;
+
+// A directory of the asynchronous tree walk: first its inode is read, then all of its blocks
+typedef struct AsyncDir {
+    DirIterator it;
+    struct TreeNode *node;          // Tree node where its entries go
+    uint32_t pending;               // Reads of the directory not completed yet
+    int loaded;                     // Whether its inode was read (1) or not yet (0)
+} AsyncDir;
+
+// Asynchronous tree walk: the queue where every directory reads its inode and blocks
+typedef struct {
+    ImageQueue *queue;
+    Ext2 *ext2;
+    int failed;                     // Set if a read couldn't be queued or an entry couldn't be added (no memory)
+} AsyncWalk;
+
+// A file read a run at a time (see nextRun)
+typedef struct {
+    BlockMap map;
+    uint64_t size;                  // Bytes of the file (no more than its block pointers can address)
+    uint64_t logical;               // Block of the file where the next run starts
+} RunCursor;
+
+// Usage report: the groups are taken by the workers in order, and each one's free counts are kept
+typedef struct {
+    uint32_t freeBlocks;
+    uint32_t freeInodes;
+    int read;                       // Whether the bitmaps of the group could be read
+} UsageGroup;
+
+typedef struct {
+    Image *img;
+    Ext2 *ext2;
+    atomic_uint next;               // Next group to count
+    UsageGroup *groups;
+} UsageScan;
+
+static void * usageWorker(void *arg);
+static int asyncTree(Image *img, Ext2 *ext2, struct TreeNode *root);
+static int asyncOpen(AsyncWalk *walk, uint32_t inodeNum, struct TreeNode *node);
+static void asyncAdvance(AsyncWalk *walk, AsyncDir *dir);
+static void openRuns(RunCursor *cur, Image *img, Ext2 *ext2, const Inode *inode);
+static int nextRun(RunCursor *cur, ImageRun *run);
+static void closeRuns(RunCursor *cur);
 
 /**
- * Function that checks if a file is an EXT2 filesystem
- * @param filepath: String with the path to the file
+ * Function that checks if an image holds an EXT2 filesystem (from the bytes probed when it was opened)
+ * @param img: The opened image
  * @return Whether the filesystem is EXT2 (1) or not (0)
  */
-int EXT2_isExt2(char* filepath){
-    //Reading the EXT2 file information
-    FILE* fp = fopen(filepath, "rb"); // Binary Reading mode
-
-    //If there's an error while opening the file, return 0
-    if(fp == NULL) return 0;
+int EXT2_isExt2(Image *img){
+    //The superblock must be inside the probed bytes
+    if(img->probeLen < EXT2_SUPERBLOCK_OFFSET + EXT2_SUPERBLOCK_SIZE) return 0;
 
     // 1024 + 56 -> magic number per saber si es ext i llegir 2 bytes de mgnum
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + EXT2_MAGIC_NUMBER_OFFSET, SEEK_SET);
     uint16_t mgnum; // Magic number
-    fread(&mgnum, sizeof(uint16_t), 1, fp);
-    fclose(fp);
+    memcpy(&mgnum, img->probe + EXT2_SUPERBLOCK_OFFSET + EXT2_MAGIC_NUMBER_OFFSET, sizeof(uint16_t));
 
     //If the magic number is 0xEF53, it's an EXT2 filesystem
     if(mgnum == EXT2_MAGIC_NUMBER) return 1;
@@ -31,279 +101,1620 @@ int EXT2_isExt2(char* filepath){
 
 /**
  * Function that reads the information of an EXT2 filesystem
- * @param fp : File pointer to the EXT2 filesystem
+ * @param img : The image holding the EXT2 filesystem
  * @return EXT2 struct with the information of the filesystem
  */
-static Ext2 readInfo(FILE *fp){
+static Ext2 readInfo(Image *img){
     Ext2 ext2;
+    memset(&ext2, 0, sizeof(Ext2));
+
+    //The whole superblock was read when the image was opened: pick each field from it
+    if(img->probeLen < EXT2_SUPERBLOCK_OFFSET + EXT2_SUPERBLOCK_SIZE) return ext2;
+    const unsigned char *sb = img->probe + EXT2_SUPERBLOCK_OFFSET;
+
+    memcpy(&(ext2.mgnum), sb + EXT2_MAGIC_NUMBER_OFFSET, sizeof(uint16_t));
+
+    memcpy(&(ext2.inode.s_inode_size), sb + S_INODE_SIZE, sizeof(uint16_t));
+    memcpy(&(ext2.inode.s_inodes_per_group), sb + S_INODES_PER_GROUP, sizeof(uint32_t));
+    memcpy(&(ext2.inode.s_inode_count), sb + S_INODE_COUNT, sizeof(uint32_t));
+    memcpy(&(ext2.inode.s_first_ino), sb + S_FIRST_INO, sizeof(uint32_t));
+    memcpy(&(ext2.inode.s_free_inodes_count), sb + S_FREE_INODES_COUNT, sizeof(uint32_t));
+
+    memcpy(&(ext2.block.s_log_block_size), sb + S_LOG_BLOCK_SIZE, sizeof(uint32_t));
+    memcpy(&(ext2.block.s_r_blocks_count), sb + S_R_BLOCKS_COUNT, sizeof(uint32_t));
+    memcpy(&(ext2.block.s_free_blocks_count), sb + S_FREE_BLOCKS_COUNT, sizeof(uint32_t));
+    memcpy(&(ext2.block.s_blocks_count), sb + S_BLOCKS_COUNT, sizeof(uint32_t));
+    memcpy(&(ext2.block.s_first_data_block), sb + S_FIRST_DATA_BLOCK, sizeof(uint32_t));
+    memcpy(&(ext2.block.s_block_per_group), sb + S_BLOCK_PER_GROUP, sizeof(uint32_t));
+    memcpy(&(ext2.block.s_flags_per_group), sb + S_FLAGS_PER_GROUP, sizeof(uint32_t));
+
+    memcpy(&(ext2.volume.s_volume_name), sb + S_VOLUME_NAME, 16);
+    memcpy(&(ext2.volume.s_lastcheck), sb + S_LASTCHECK, sizeof(uint32_t));
+    memcpy(&(ext2.volume.s_mtime), sb + S_MTIME, sizeof(uint32_t));
+    memcpy(&(ext2.volume.s_wtime), sb + S_WTIME, sizeof(uint32_t));
 
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + EXT2_MAGIC_NUMBER_OFFSET, SEEK_SET);
-    fread(&(ext2.mgnum), sizeof(uint16_t), 1, fp);
-
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_INODE_SIZE, SEEK_SET);
-    fread(&(ext2.inode.s_inode_size), sizeof(uint16_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_INODES_PER_GROUP, SEEK_SET);
-    fread(&(ext2.inode.s_inodes_per_group), sizeof(uint32_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_INODE_COUNT, SEEK_SET);
-    fread(&(ext2.inode.s_inode_count), sizeof(uint32_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_FIRST_INO, SEEK_SET);
-    fread(&(ext2.inode.s_first_ino), sizeof(uint32_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_FREE_INODES_COUNT, SEEK_SET);
-    fread(&(ext2.inode.s_free_inodes_count), sizeof(uint32_t), 1, fp);
-
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_LOG_BLOCK_SIZE, SEEK_SET);
-    fread(&(ext2.block.s_log_block_size), sizeof(uint32_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_R_BLOCKS_COUNT, SEEK_SET);
-    fread(&(ext2.block.s_r_blocks_count), sizeof(uint32_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_FREE_BLOCKS_COUNT, SEEK_SET);
-    fread(&(ext2.block.s_free_blocks_count), sizeof(uint32_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_BLOCKS_COUNT, SEEK_SET);
-    fread(&(ext2.block.s_blocks_count), sizeof(uint32_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_FIRST_DATA_BLOCK, SEEK_SET);
-    fread(&(ext2.block.s_first_data_block), sizeof(uint32_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_BLOCK_PER_GROUP, SEEK_SET);
-    fread(&(ext2.block.s_block_per_group), sizeof(uint32_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_FLAGS_PER_GROUP, SEEK_SET);
-    fread(&(ext2.block.s_flags_per_group), sizeof(uint32_t), 1, fp);
-
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_VOLUME_NAME, SEEK_SET);
-    fread(&(ext2.volume.s_volume_name), 16, 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_LASTCHECK, SEEK_SET);
-    fread(&(ext2.volume.s_lastcheck), sizeof(uint32_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_MTIME, SEEK_SET);
-    fread(&(ext2.volume.s_mtime), sizeof(uint32_t), 1, fp);
-    fseek(fp, EXT2_SUPERBLOCK_OFFSET + S_WTIME, SEEK_SET);
-    fread(&(ext2.volume.s_wtime), sizeof(uint32_t), 1, fp);
+    memcpy(&(ext2.feature.s_rev_level), sb + S_REV_LEVEL, sizeof(uint32_t));
+    memcpy(&(ext2.feature.s_feature_compat), sb + S_FEATURE_COMPAT, sizeof(uint32_t));
+    memcpy(&(ext2.feature.s_hash_seed), sb + S_HASH_SEED, 4 * sizeof(uint32_t));
+    memcpy(&(ext2.feature.s_def_hash_version), sb + S_DEF_HASH_VERSION, sizeof(uint8_t));
+    memcpy(&(ext2.feature.s_flags), sb + S_FLAGS, sizeof(uint32_t));
+
+    //Revision 0 filesystems don't store the inode size: their inodes are always 128 bytes
+    if(ext2.inode.s_inode_size == 0) ext2.inode.s_inode_size = sizeof(Inode);
 
     return ext2;
 }
 
 /**
- * Function that prints the information of an EXT2 filesystem
- * @param filepath : String with the representation of the path to the file
+ * Function that loads the whole group descriptor table into memory, keeping only the fields we use
+ * @param img : The image holding the EXT2 filesystem
+ * @param ext2 : EXT2 information, where the table is stored
+ * @return Whether the table could be loaded (1) or not (0)
+ */
+static int loadGroups(Image *img, Ext2 *ext2){
+    uint32_t blockSz = 1024 << ext2->block.s_log_block_size;
+    if(ext2->block.s_block_per_group == 0 || ext2->inode.s_inodes_per_group == 0) return 0;
+
+    //The group descriptor table starts at the block after the superblock
+    ext2->groupCount = (ext2->block.s_blocks_count - ext2->block.s_first_data_block
+                        + ext2->block.s_block_per_group - 1) / ext2->block.s_block_per_group;
+    uint64_t tablePos = (uint64_t) (ext2->block.s_first_data_block + 1) * blockSz;
+
+    const GroupDescriptor *table = IMAGE_get(img, tablePos, (size_t) ext2->groupCount * sizeof(GroupDescriptor));
+    ext2->groups = (GroupInfo *) malloc(ext2->groupCount * sizeof(GroupInfo));
+    if(table == NULL || ext2->groups == NULL){
+        free(ext2->groups);
+        ext2->groups = NULL;
+        ext2->groupCount = 0;
+        return 0;
+    }
+
+    for(uint32_t i = 0; i < ext2->groupCount; i++){
+        GroupDescriptor gd;
+        memcpy(&gd, &table[i], sizeof(GroupDescriptor));
+        ext2->groups[i].bg_block_bitmap = gd.bg_block_bitmap;
+        ext2->groups[i].bg_inode_bitmap = gd.bg_inode_bitmap;
+        ext2->groups[i].bg_inode_table = gd.bg_inode_table;
+        ext2->groups[i].bg_free_blocks_count = gd.bg_free_blocks_count;
+        ext2->groups[i].bg_free_inodes_count = gd.bg_free_inodes_count;
+        ext2->groups[i].bg_used_dirs_count = gd.bg_used_dirs_count;
+    }
+
+    memset(&(ext2->inodeCache), 0, sizeof(InodeCache));
+    ext2->sweep = NULL;
+    return 1;
+}
+
+/**
+ * Function that frees the caches filled while running a command (the inode cache and the inode sweep)
+ * @param ext2 : EXT2 information of the command
+ */
+static void freeCaches(Ext2 *ext2){
+    for(int i = 0; i < EXT2_INODE_CACHE_SLOTS; i++){
+        free(ext2->inodeCache.slots[i].data);
+        ext2->inodeCache.slots[i].data = NULL;
+        ext2->inodeCache.slots[i].blockNum = 0;
+    }
+
+    freeSweep(ext2->sweep);
+    ext2->sweep = NULL;
+}
+
+/**
+ * Function that mounts an EXT2 filesystem: parses its superblock and loads its group descriptor table.
+ * A mounted filesystem is only read afterwards, so several commands (and threads) can share it.
+ * @param img : The opened image
+ * @param ext2 : Output, the mounted filesystem
+ * @return Whether the filesystem could be mounted (1) or not (0)
+ */
+int EXT2_mount(Image *img, Ext2 *ext2){
+    *ext2 = readInfo(img);
+    return loadGroups(img, ext2);
+}
+
+/**
+ * Function that frees what was loaded when the filesystem was mounted
+ * @param ext2 : The mounted filesystem
+ */
+void EXT2_unmount(Ext2 *ext2){
+    free(ext2->groups);
+    ext2->groups = NULL;
+    ext2->groupCount = 0;
+}
+
+/**
+ * Function that prepares the EXT2 information a command works with: the mounted filesystem, plus caches
+ * of its own (so commands running at the same time don't share them). They're freed with freeCaches.
+ * @param mounted : The mounted filesystem
+ * @return EXT2 information for the command
+ */
+static Ext2 beginCommand(const Ext2 *mounted){
+    Ext2 ext2 = *mounted;
+    memset(&(ext2.inodeCache), 0, sizeof(InodeCache));
+    ext2.sweep = NULL;
+    return ext2;
+}
+
+/**
+ * Function that decides whether a whole-image scan should start with an inode sweep.
+ * The sweep reads every inode table once; the alternative is one random read per directory.
+ * @param img : The image holding the EXT2 filesystem
+ * @param ext2 : EXT2 information (with the group descriptor table loaded)
+ * @return Whether to sweep (1) or not (0)
+ */
+static int shouldSweep(Image *img, Ext2 *ext2){
+    if(img->size < EXT2_SWEEP_MIN_IMAGE) return 0;
+
+    uint64_t dirs = 0;
+    for(uint32_t i = 0; i < ext2->groupCount; i++)
+        dirs += ext2->groups[i].bg_used_dirs_count;
+
+    uint64_t tableBytes = (uint64_t) ext2->groupCount * ext2->inode.s_inodes_per_group * ext2->inode.s_inode_size;
+    return dirs * EXT2_RANDOM_READ_COST >= tableBytes;
+}
+
+/**
+ * Function that reads every inode table front to back (in EXT2_SWEEP_CHUNK reads), like e2fsck pass 1 does.
+ * It keeps the metadata of every inode, and the block pointers of the directories, in ext2->sweep.
+ * @param img : The image holding the EXT2 filesystem
+ * @param ext2 : EXT2 information (with the group descriptor table loaded)
+ * @return Whether the sweep was completed (1) or not (0: nothing is kept, and inodes are read one by one)
+ */
+static int sweepInodes(Image *img, Ext2 *ext2){
+    uint32_t blockSz = 1024 << ext2->block.s_log_block_size;
+    uint32_t inodeSz = ext2->inode.s_inode_size;
+    uint32_t perGroup = ext2->inode.s_inodes_per_group;
+    if(inodeSz < sizeof(Inode) || inodeSz > EXT2_SWEEP_CHUNK) return 0;
+
+    InodeSweep *sweep = (InodeSweep *) calloc(1, sizeof(InodeSweep));
+    if(sweep == NULL) return 0;
+    sweep->count = ext2->groupCount * perGroup;
+    sweep->meta = (InodeMeta *) calloc(sweep->count, sizeof(InodeMeta));
+
+    //The directory counters of the group descriptors tell us how much room the block pointers need
+    uint32_t dirCapacity = 1;
+    for(uint32_t g = 0; g < ext2->groupCount; g++) dirCapacity += ext2->groups[g].bg_used_dirs_count;
+    sweep->dirBlocks = malloc(dirCapacity * sizeof(*(sweep->dirBlocks)));
+
+    if(sweep->meta == NULL || sweep->dirBlocks == NULL){
+        freeSweep(sweep);
+        return 0;
+    }
+
+    //Whole inodes per chunk, so no inode is split between two reads
+    uint32_t chunkInodes = EXT2_SWEEP_CHUNK / inodeSz;
+
+    for(uint32_t g = 0; g < ext2->groupCount; g++){
+        uint64_t tablePos = (uint64_t) ext2->groups[g].bg_inode_table * blockSz;
+
+        for(uint32_t first = 0; first < perGroup; first += chunkInodes){
+            uint32_t n = perGroup - first < chunkInodes ? perGroup - first : chunkInodes;
+            //An inode left out would be taken for a free one: without every inode, there is no sweep
+            const unsigned char *chunk = IMAGE_get(img, tablePos + (uint64_t) first * inodeSz, (size_t) n * inodeSz);
+            if(chunk == NULL){
+                freeSweep(sweep);
+                return 0;
+            }
+
+            for(uint32_t k = 0; k < n; k++){
+                Inode in;
+                memcpy(&in, chunk + (size_t) k * inodeSz, sizeof(Inode));
+                if(in.i_mode == 0 || in.i_links_count == 0) continue;
+
+                InodeMeta *meta = &(sweep->meta[g * perGroup + first + k]);
+                meta->i_mode = in.i_mode;
+                meta->i_links_count = in.i_links_count;
+                meta->i_blocks = in.i_blocks;
+                meta->size = in.i_size;
+                meta->dirIndex = EXT2_NO_DIR;
+
+                //Keep the block pointers of the directories (the counters may be stale, so grow if needed)
+                if((in.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR){
+                    if(sweep->dirCount == dirCapacity){
+                        uint32_t (*bigger)[15] = realloc(sweep->dirBlocks, 2 * dirCapacity * sizeof(*bigger));
+                        if(bigger == NULL){
+                            freeSweep(sweep);
+                            return 0;
+                        }
+                        sweep->dirBlocks = bigger;
+                        dirCapacity *= 2;
+                    }
+                    memcpy(sweep->dirBlocks[sweep->dirCount], in.i_block, sizeof(in.i_block));
+                    meta->dirIndex = sweep->dirCount++;
+                }
+                else meta->size |= (uint64_t) in.i_dir_acl << 32;
+            }
+        }
+    }
+
+    ext2->sweep = sweep;
+    return 1;
+}
+
+/**
+ * Function that frees the result of an inode sweep
+ * @param sweep : The sweep (may be NULL)
  */
-void EXT2_printInfo(char* filepath){
-    FILE* fp = fopen(filepath, "rb"); // Binary Reading mode
-    if(fp == NULL){
-        printf("Error while opening the file %s\n", filepath);
+static void freeSweep(InodeSweep *sweep){
+    if(sweep == NULL) return;
+    free(sweep->meta);
+    free(sweep->dirBlocks);
+    free(sweep);
+}
+
+/**
+ * Function that adds what a scan reads next for an entry to its hints, if the entry is a subdirectory (but . or
+ * ..): its inode, or its blocks once an inode sweep has every inode in memory. The blocks of the whole filesystem
+ * are hinted this way, a frontier at a time, as the scan gets to them.
+ * @param plan : The planner
+ * @param ext2 : EXT2 information
+ * @param de : Entry of the directory being read
+ */
+static void planSubdir(ImagePlan *plan, Ext2 *ext2, const DirectoryEntry *de){
+    if(!plan->enabled || de->file_type != 2 || strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0) return;
+
+    InodeSweep *sweep = ext2->sweep;
+    if(sweep == NULL){
+        IMAGE_planAdd(plan, inodeOffset(ext2, de->inode), ext2->inode.s_inode_size);
         return;
     }
+    if(de->inode == 0 || de->inode > sweep->count || sweep->meta[de->inode - 1].dirIndex == EXT2_NO_DIR) return;
 
-    printf(EXT2_PRINT_INFO); // Print the EXT2 information
-    //Reading the EXT2 file information
-    Ext2 ext2 = readInfo(fp);
-    printf("Filesystem: EXT2\n");
+    //Indirect blocks are hinted as well; the directory blocks behind them are hinted when the directory is opened
+    uint32_t blockSz = 1024 << ext2->block.s_log_block_size;
+    const uint32_t *blocks = sweep->dirBlocks[sweep->meta[de->inode - 1].dirIndex];
+    for(int k = 0; k < 15; k++){
+        if(blocks[k] != 0) IMAGE_planAdd(plan, (uint64_t) blocks[k] * blockSz, blockSz);
+    }
+}
+
+/**
+ * Function that hints the kernel about the inodes of the subdirectories of a directory walked depth first. Its
+ * first subdirectory is entered before the rest are found, so they are found beforehand: the directory is read
+ * into memory once (it->ahead), and the walk parses that copy again instead of reading the image twice.
+ * @param img : The image holding the EXT2 filesystem
+ * @param ext2 : EXT2 information
+ * @param it : The opened directory (rewound afterwards)
+ */
+static void planFrontier(Image *img, Ext2 *ext2, DirIterator *it){
+    ImagePlan plan;
+    IMAGE_planInit(&plan, img);
+    uint32_t blockSz = it->map.blockSize;
+    if(plan.enabled && it->numBlocks > 0) it->ahead = (unsigned char *) calloc(it->numBlocks, blockSz);
+    if(it->ahead == NULL){
+        IMAGE_planFree(&plan);
+        return;
+    }
+
+    //Holes and blocks that can't be read stay zeros, as nextEntry expects
+    for(uint64_t b = 0; b < it->numBlocks; b++){
+        uint32_t physical = mapBlock(&(it->map), b);
+        if(physical != 0) IMAGE_read(img, it->ahead + b * blockSz, blockSz, (uint64_t) physical * blockSz);
+    }
+
+    const DirectoryEntry *de;
+    while((de = nextEntry(it)) != NULL) planSubdir(&plan, ext2, de);
+    rewindDirectory(it);
+    IMAGE_planIssue(&plan);
+    IMAGE_planFree(&plan);
+}
+
+/**
+ * Function that prints the information of an EXT2 filesystem
+ * @param img : The opened image
+ * @param ext2 : The mounted filesystem
+ * @param out : Output where the information is printed
+ */
+void EXT2_printInfo(Image *img, Ext2 *ext2, Output *out){
+    (void) img;
+    char lastCheck[32], lastMount[32], lastWrite[32];
+    struct tm tm;
+
+    OUT_printf(out, EXT2_PRINT_INFO); // Print the EXT2 information
+    OUT_printf(out, "Filesystem: EXT2\n");
 
     // Inode print information
-    printf(EXT2_PRINT_INFO_INODE,
-           ext2.inode.s_inode_size,
-           ext2.inode.s_inode_count,
-           ext2.inode.s_first_ino,
-           ext2.inode.s_inodes_per_group,
-           ext2.inode.s_free_inodes_count);
+    OUT_printf(out, EXT2_PRINT_INFO_INODE,
+           ext2->inode.s_inode_size,
+           ext2->inode.s_inode_count,
+           ext2->inode.s_first_ino,
+           ext2->inode.s_inodes_per_group,
+           ext2->inode.s_free_inodes_count);
 
     // Block print information
-    printf(EXT2_PRINT_INFO_BLOCK,
-           1024 << ext2.block.s_log_block_size,
-           ext2.block.s_r_blocks_count,
-           ext2.block.s_free_blocks_count,
-           ext2.block.s_blocks_count,
-           ext2.block.s_first_data_block,
-           ext2.block.s_block_per_group,
-           ext2.block.s_flags_per_group);
+    OUT_printf(out, EXT2_PRINT_INFO_BLOCK,
+           1024 << ext2->block.s_log_block_size,
+           ext2->block.s_r_blocks_count,
+           ext2->block.s_free_blocks_count,
+           ext2->block.s_blocks_count,
+           ext2->block.s_first_data_block,
+           ext2->block.s_block_per_group,
+           ext2->block.s_flags_per_group);
+
+    // Volume print information (the reentrant time functions, since commands may run in parallel)
+    asctime_r(gmtime_r(&(time_t) {ext2->volume.s_lastcheck}, &tm), lastCheck);
+    asctime_r(gmtime_r(&(time_t) {ext2->volume.s_mtime}, &tm), lastMount);
+    asctime_r(gmtime_r(&(time_t) {ext2->volume.s_wtime}, &tm), lastWrite);
+    OUT_printf(out, EXT2_PRINT_INFO_VOLUME, ext2->volume.s_volume_name, lastCheck, lastMount, lastWrite);
+}
+
+/**
+ * Function that prints how many blocks and inodes of an EXT2 filesystem are in use, counted from the bitmaps
+ * of every group (by a pool of threads), and flags the counters of the superblock and of the group
+ * descriptors that don't agree with them
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param out : Output where the report is printed
+ * @return Whether the counters agree with the bitmaps (1) or not (0)
+ */
+int EXT2_printUsage(Image *img, Ext2 *mounted, Output *out){
+    uint32_t blockSz = 1024 << mounted->block.s_log_block_size;
+    UsageScan scan = {img, mounted, 0, calloc(mounted->groupCount + 1, sizeof(UsageGroup))};
+    if(scan.groups == NULL){
+        OUT_printf(out, "Error while allocating the groups\n");
+        return 0;
+    }
 
-    // Volume print information
-    printf(EXT2_PRINT_INFO_VOLUME,
-           ext2.volume.s_volume_name,
-           asctime(gmtime(&(time_t) {ext2.volume.s_lastcheck})),
-           asctime(gmtime(&(time_t) {ext2.volume.s_mtime})),
-           asctime(gmtime(&(time_t) {ext2.volume.s_wtime}))
-           );
+    //The bitmaps are spread over the image: hint them all, so a cold image is read front to back
+    ImagePlan plan;
+    IMAGE_planInit(&plan, img);
+    for(uint32_t g = 0; plan.enabled && g < mounted->groupCount; g++){
+        IMAGE_planAdd(&plan, (uint64_t) mounted->groups[g].bg_block_bitmap * blockSz, blockSz);
+        IMAGE_planAdd(&plan, (uint64_t) mounted->groups[g].bg_inode_bitmap * blockSz, blockSz);
+    }
+    IMAGE_planIssue(&plan);
+    IMAGE_planFree(&plan);
+
+    int threads = WALK_threads();
+    if((uint32_t) threads > mounted->groupCount) threads = mounted->groupCount > 0 ? (int) mounted->groupCount : 1;
+    pthread_t workers[WALK_MAX_THREADS];
+    int started = 0;
+    while(started < threads - 1 && pthread_create(&workers[started], NULL, usageWorker, &scan) == 0) started++;
+    usageWorker(&scan);
+    for(int i = 0; i < started; i++) pthread_join(workers[i], NULL);
 
-    fclose(fp);
+    //Add the groups up
+    uint64_t freeBlocks = 0, freeInodes = 0;
+    for(uint32_t g = 0; g < mounted->groupCount; g++){
+        freeBlocks += scan.groups[g].freeBlocks;
+        freeInodes += scan.groups[g].freeInodes;
+    }
+
+    //Blocks before the first group (the boot block, with 1 KB blocks) are in no bitmap, and are in use
+    uint64_t totalBlocks = mounted->block.s_blocks_count, totalInodes = mounted->inode.s_inode_count;
+    OUT_printf(out, USAGE_PRINT);
+    OUT_printf(out, "Filesystem: EXT2\nGroups: %" PRIu32 "\n\n", mounted->groupCount);
+    OUT_printf(out, USAGE_PRINT_LINE, "Blocks", totalBlocks - freeBlocks, freeBlocks, totalBlocks,
+               totalBlocks > 0 ? 100.0 * (double) (totalBlocks - freeBlocks) / (double) totalBlocks : 0.0);
+    OUT_printf(out, USAGE_PRINT_LINE, "Inodes", totalInodes - freeInodes, freeInodes, totalInodes,
+               totalInodes > 0 ? 100.0 * (double) (totalInodes - freeInodes) / (double) totalInodes : 0.0);
+    OUT_printf(out, "\n");
+
+    //Check every group against its descriptor, and the totals against the superblock
+    int agree = 1;
+    for(uint32_t g = 0; g < mounted->groupCount; g++){
+        const UsageGroup *group = &(scan.groups[g]);
+        const GroupInfo *info = &(mounted->groups[g]);
+        if(!group->read){
+            OUT_printf(out, EXT2_USAGE_UNREADABLE, g);
+            agree = 0;
+        }
+        else if(group->freeBlocks != info->bg_free_blocks_count || group->freeInodes != info->bg_free_inodes_count){
+            OUT_printf(out, EXT2_USAGE_GROUP_MISMATCH, g, group->freeBlocks, group->freeInodes,
+                       info->bg_free_blocks_count, info->bg_free_inodes_count);
+            agree = 0;
+        }
+    }
+    free(scan.groups);
+
+    if(freeBlocks != mounted->block.s_free_blocks_count){
+        OUT_printf(out, EXT2_USAGE_MISMATCH, "blocks", freeBlocks, mounted->block.s_free_blocks_count);
+        agree = 0;
+    }
+    if(freeInodes != mounted->inode.s_free_inodes_count){
+        OUT_printf(out, EXT2_USAGE_MISMATCH, "inodes", freeInodes, mounted->inode.s_free_inodes_count);
+        agree = 0;
+    }
+    OUT_printf(out, agree ? USAGE_PRINT_OK : "\n");
+    return agree;
+}
+
+/**
+ * Function run by each thread of the usage report: counts the free blocks and inodes of the groups it takes,
+ * from their bitmaps, until every group is taken
+ * @param arg : The scan (UsageScan)
+ * @return NULL
+ */
+static void * usageWorker(void *arg){
+    UsageScan *scan = (UsageScan *) arg;
+    Ext2 *ext2 = scan->ext2;
+    uint32_t blockSz = 1024 << ext2->block.s_log_block_size;
+    uint32_t perGroup = ext2->block.s_block_per_group;
+    uint64_t groupBlocks = (uint64_t) ext2->block.s_blocks_count - ext2->block.s_first_data_block;
+    unsigned char *buffer = NULL;
+
+    uint32_t g;
+    while((g = atomic_fetch_add(&(scan->next), 1)) < ext2->groupCount){
+        //The last group may be shorter than the others
+        uint64_t numBlocks = groupBlocks - (uint64_t) g * perGroup < perGroup ? groupBlocks - (uint64_t) g * perGroup : perGroup;
+        uint64_t numInodes = ext2->inode.s_inodes_per_group;
+        if(numBlocks > (uint64_t) blockSz * 8 || numInodes > (uint64_t) blockSz * 8) continue;
+
+        uint64_t blockBitmap = (uint64_t) ext2->groups[g].bg_block_bitmap * blockSz;
+        uint64_t inodeBitmap = (uint64_t) ext2->groups[g].bg_inode_bitmap * blockSz;
+        const unsigned char *blocks, *inodes;
+        if(scan->img->map != NULL){
+            //Counted straight from the mapping
+            if(blockBitmap + blockSz > scan->img->size || inodeBitmap + blockSz > scan->img->size) continue;
+            blocks = scan->img->map + blockBitmap;
+            inodes = scan->img->map + inodeBitmap;
+        }
+        else{
+            if(buffer == NULL) buffer = (unsigned char *) malloc((size_t) blockSz * 2);
+            if(buffer == NULL || IMAGE_read(scan->img, buffer, blockSz, blockBitmap) != blockSz
+               || IMAGE_read(scan->img, buffer + blockSz, blockSz, inodeBitmap) != blockSz) continue;
+            blocks = buffer;
+            inodes = buffer + blockSz;
+        }
+
+        scan->groups[g].freeBlocks = (uint32_t) (numBlocks - USAGE_countBits(blocks, numBlocks));
+        scan->groups[g].freeInodes = (uint32_t) (numInodes - USAGE_countBits(inodes, numInodes));
+        scan->groups[g].read = 1;
+    }
+    free(buffer);
+    return NULL;
 }
 
 /**
  * Function that prints the tree of an EXT2 filesystem
- * @param fspath : String with the representation of the path to the file
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param walk : How to walk the filesystem (TREE_WALK_*)
+ * @param out : Output where the tree is printed
+ * @return Whether the whole tree was printed (1) or not (0, memory ran out)
  */
-void EXT2_printTree(char* fspath){
+int EXT2_printTree(Image *img, Ext2 *mounted, int walk, Output *out){
     struct TreeNode rootNode;
-    rootNode.name = NULL;
-    rootNode.numChilds = 0;
+    Ext2 ext2 = beginCommand(mounted);
 
-    FILE* fp = fopen(fspath, "rb"); // Binary Reading mode
-    if(fp == NULL){
-        printf("Error while opening the file %s\n", fspath);
-        return;
+    // On big images, read all the inode tables sequentially first, so that
+    // walking the directories doesn't need a random read per directory inode
+    if(shouldSweep(img, &ext2)) sweepInodes(img, &ext2);
+
+    // With a single CPU, or when asked to, the entries are printed as the walk finds them (constant memory)
+    int threads = WALK_threads();
+    int printed = 1;
+    if(walk == TREE_WALK_STREAM || (walk == TREE_WALK_PARALLEL && threads == 1)){
+        TreeVisitor visitor = TREE_streamVisitor(out);
+        TREE_streamBegin(out);
+        // Reading the root inode (inode 2), don't cat a file
+        pierceTree(img, &ext2, 2, 0, NULL, &visitor, 1, out);
+        TREE_streamEnd(out);
     }
+    // Otherwise, fill the tree (with a thread per CPU, or with many reads in flight), and print it once it's complete
+    else if(TREE_init(&rootNode)){
+        int walked = 1;
+        // Without a queue of reads (or memory for them), the asynchronous walk falls back to the parallel one
+        if(walk != TREE_WALK_ASYNC || !asyncTree(img, &ext2, &rootNode)){
+            WalkContext ctx = {img, &ext2};
+            walked = WALK_run(threads, expandDirectory, &ctx, 2, &rootNode);
+        }
 
-    // Reading the EXT2 file information
-    Ext2 ext2 = readInfo(fp);
+        // Print & free the tree (a part of it would look like the whole one)
+        if(walked) TREE_print(&rootNode, out);
+        else OUT_printf(out, "Error while walking the tree\n");
+        TREE_free(&rootNode);
+        printed = walked;
+    }
+    else{
+        OUT_printf(out, "Error while allocating the tree\n");
+        printed = 0;
+    }
 
-    // Reading the root inode (inode 2)
-    // Fill the tree (don't cat a file)
-    pierceTree(fp, &ext2, 2, 0, NULL, &rootNode);
+    freeCaches(&ext2);
+    return printed;
+}
 
-    // Print & free the tree
-    TREE_print(&rootNode);
-    TREE_free(&rootNode);
-    fclose(fp);
+/**
+ * Function that walks a directory of an EXT2 filesystem, and everything below it, with a visitor. The directory
+ * itself is given first, at level 0 (with the path as its name), and left last.
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param path : The path of the directory (from the root directory)
+ * @param visitor : The visitor (when it asks for sizes, they are the inode sizes & the blocks it holds)
+ * @return Whether the directory could be walked (1) or not (0, it doesn't exist or isn't a directory)
+ */
+int EXT2_visitTree(Image *img, Ext2 *mounted, const char *path, TreeVisitor *visitor){
+    Ext2 ext2 = beginCommand(mounted);
+
+    uint32_t inodeNum = resolvePath(img, &ext2, path);
+    Inode inode = getInode(img, &ext2, (int) inodeNum, 0);
+    if(inodeNum == 0 || (inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR){
+        freeCaches(&ext2);
+        return 0;
+    }
+
+    // Every inode is read when the sizes are wanted: on big images, sweeping the inode tables always pays off
+    if(visitor->sizes ? img->size >= EXT2_SWEEP_MIN_IMAGE : shouldSweep(img, &ext2)) sweepInodes(img, &ext2);
+
+    TreeSizes sizes = inodeSizes(img, &ext2, inodeNum);
+    visitor->visit(visitor->ctx, 0, path, 1, visitor->sizes ? &sizes : NULL);
+    pierceTree(img, &ext2, (int) inodeNum, 0, NULL, visitor, 1, NULL);
+    if(visitor->leave != NULL) visitor->leave(visitor->ctx, 0);
+
+    freeCaches(&ext2);
+    return 1;
+}
+
+/**
+ * Function that gets the size of an inode, and the bytes of the blocks it holds (i_blocks, indirect blocks included)
+ * @param img : The image holding the EXT2 filesystem
+ * @param ext2 : EXT2 information (with the inode sweep, if it was done)
+ * @param inodeNum : The inode number
+ * @return The sizes
+ */
+static TreeSizes inodeSizes(Image *img, Ext2 *ext2, uint32_t inodeNum){
+    TreeSizes sizes = {0, 0};
+    if(ext2->sweep != NULL){
+        if(inodeNum == 0 || inodeNum > ext2->sweep->count) return sizes;
+        const InodeMeta *meta = &(ext2->sweep->meta[inodeNum - 1]);
+        sizes.size = meta->size;
+        sizes.allocated = (uint64_t) meta->i_blocks * 512;
+        return sizes;
+    }
+
+    Inode inode = getInode(img, ext2, (int) inodeNum, 0);
+    sizes.size = inode.i_size;
+    if((inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFREG) sizes.size |= (uint64_t) inode.i_dir_acl << 32;
+    sizes.allocated = (uint64_t) inode.i_blocks * 512;
+    return sizes;
 }
 
 /**
  * Pierce the EXT2 tree recursively. It can have two behaviors:
  *  1. If catFile is 1, it will cat the file fileName if found and return 1 if successful, 0 otherwise
- *  2. If catFile is 0, it will construct the tree recursively, from the parent node. Return value will always be 0
- * @param fp : File pointer
+ *  2. If catFile is 0, it will give every entry to the visitor, depth first. Return value will always be 0
+ * @param img : The image holding the filesystem
  * @param ext2 : EXT2 information
  * @param nextInode : Next inode to read (recursive call)
  * @param catFile : Whether to cat a file (1) or construct a tree (0)
  * @param fileName : The name of the file to cat
- * @param parent : The parent node to construct the tree (recursive call)
+ * @param visitor : The visitor that receives the entries when catFile is 0
+ * @param level : Level of the entries of this directory (1 for the root directory)
+ * @param out : Output where the file is printed when catFile is 1
  * @return Whether the cat was successful (1) or not (0)
  */
-static int pierceTree(FILE *fp, Ext2 *ext2, int nextInode, int catFile,
-                      char *fileName, struct TreeNode *parent){
-
-    //Get the inode
-    Inode inode = getInode(fp, ext2, nextInode);
-    //Get the block size using the s_log_block_size attribute from the superblock
-    int blockSz = 1024 << ext2->block.s_log_block_size;
+static int pierceTree(Image *img, Ext2 *ext2, int nextInode, int catFile,
+                      char *fileName, TreeVisitor *visitor, int level, Output *out){
 
-    uint32_t offset = 0;
-    DirectoryEntry de;
+    DirIterator it;
+    if(!openDirectory(&it, img, ext2, nextInode, 0)) return 0;
+    planFrontier(img, ext2, &it);
 
-    //Loop through the whole inode (in rec_len steps)
-    while(1){
-        //Read the next DirectoryEntry, until there are no more entries
-        fseek(fp, blockSz + blockSz*(inode.i_block[0]-1) + offset, SEEK_SET);
-        //Read the directory entry
-        fread(&de, sizeof(DirectoryEntry), 1, fp);
-        de.name[de.name_len] = '\0';
-        //Update the offset
-        offset += de.rec_len;
-        //Break if the offset is too big or if the rec_len is 0 -> no more entries to read
-        if(de.rec_len == 0 || offset > inode.i_size) break;
+    //Loop through every entry of every block of the directory
+    const DirectoryEntry *de;
+    int found = 0;
+    while(!found && (de = nextEntry(&it)) != NULL){
         // Skip the entry if it's not a file or a directory
-        if(strcmp(de.name, ".") != 0 && strcmp(de.name, "..") != 0 && strcmp(de.name, "lost+found") != 0){
-            //If we're in mode cat file
-            if(catFile){
-                //If we found the file we were searching, print it and return 1
-                if(de.file_type == 1 && strcmp(de.name, fileName) == 0){
-                    printFileContent(fp, *ext2, inode);
-                    return 1;
-                }
-                else if(de.file_type == 2){ //If the entry is a directory, call the function recursively
-                    if(pierceTree(fp, ext2, de.inode, 1, fileName, NULL))
-                        return 1;
-                }
+        if(strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0 || strcmp(de->name, "lost+found") == 0) continue;
+
+        //If we're in mode cat file
+        if(catFile){
+            //If we found the file we were searching, print it and stop
+            if(de->file_type == 1 && strcmp(de->name, fileName) == 0){
+                printFileContent(img, *ext2, getInode(img, ext2, de->inode, 0), out);
+                found = 1;
             }
-            else{ //If we're in mode build tree
-                //If the entry is a directory, call the function recursively
-                if(de.file_type == 2){
-                    struct TreeNode *newNode = TREE_addChild(parent, de.name);
-                    pierceTree(fp, ext2, de.inode, 0, NULL, newNode);
-                }
-                else if(de.file_type == 1){ //If the entry is a file, add it to the tree
-                    TREE_addChild(parent, de.name);
+            else if(de->file_type == 2){ //If the entry is a directory, call the function recursively
+                found = pierceTree(img, ext2, de->inode, 1, fileName, NULL, 0, out);
+            }
+        }
+        else{ //If we're in mode visit tree
+            //Sizes come from the inode sweep when there's one, and from the inode otherwise
+            TreeSizes sizes;
+            if(visitor->sizes && (de->file_type == 1 || de->file_type == 2)) sizes = inodeSizes(img, ext2, de->inode);
+
+            //If the entry is a directory, give it to the visitor and call the function recursively
+            if(de->file_type == 2){
+                visitor->visit(visitor->ctx, level, de->name, 1, visitor->sizes ? &sizes : NULL);
+                pierceTree(img, ext2, de->inode, 0, NULL, visitor, level + 1, out);
+                if(visitor->leave != NULL) visitor->leave(visitor->ctx, level);
+            }
+            else if(de->file_type == 1){ //If the entry is a file, give it to the visitor
+                visitor->visit(visitor->ctx, level, de->name, 0, visitor->sizes ? &sizes : NULL);
+            }
+        }
+    }
+    closeDirectory(&it);
+    return found;
+}
+
+/**
+ * Expands a directory for the parallel tree walk: adds its files and subdirectories to node, in directory
+ * order, and pushes the subdirectories to the walk. It only reads with IMAGE_read, which is safe to call
+ * from several threads. On planned images, the inodes of the subdirectories are hinted once the directory
+ * is read, and only then are they pushed.
+ * @param pool : The pool running the walk
+ * @param worker : Index of the worker running the function
+ * @param ctx : The WalkContext
+ * @param dir : Inode number of the directory
+ * @param node : Tree node of the directory
+ */
+static void expandDirectory(WalkPool *pool, int worker, void *ctx, uint64_t dir, struct TreeNode *node){
+    WalkContext *walk = (WalkContext *) ctx;
+
+    DirIterator it;
+    if(!openDirectory(&it, walk->img, walk->ext2, (uint32_t) dir, 1)) return;
+
+    ImagePlan plan;
+    IMAGE_planInit(&plan, walk->img);
+    WalkTask *subdirs = NULL;
+    size_t numSubdirs = 0, capSubdirs = 0;
+
+    const DirectoryEntry *de;
+    while((de = nextEntry(&it)) != NULL){
+        if(strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0 || strcmp(de->name, "lost+found") == 0) continue;
+
+        if(de->file_type == 2){
+            struct TreeNode *child = TREE_addChild(node, (char *) de->name);
+            if(child == NULL){
+                WALK_fail(pool);
+                continue;
+            }
+            planSubdir(&plan, walk->ext2, de);
+
+            //Subdirectories wait for the hints (when there are any, or without memory to keep them, they go right away)
+            if(plan.enabled && numSubdirs == capSubdirs){
+                size_t cap = capSubdirs == 0 ? 64 : capSubdirs * 2;
+                WalkTask *bigger = (WalkTask *) realloc(subdirs, cap * sizeof(WalkTask));
+                if(bigger != NULL){
+                    subdirs = bigger;
+                    capSubdirs = cap;
                 }
             }
+            if(numSubdirs < capSubdirs){
+                subdirs[numSubdirs].dir = de->inode;
+                subdirs[numSubdirs++].node = child;
+            }
+            else WALK_push(pool, worker, de->inode, child);
         }
+        else if(de->file_type == 1 && TREE_addChild(node, (char *) de->name) == NULL) WALK_fail(pool);
     }
-    return 0;
+    closeDirectory(&it);
+
+    IMAGE_planIssue(&plan);
+    IMAGE_planFree(&plan);
+    for(size_t i = 0; i < numSubdirs; i++) WALK_push(pool, worker, subdirs[i].dir, subdirs[i].node);
+    free(subdirs);
 }
 
 /**
- * This function aims to find the inode by its inode number in the inode table
- * @param fp : File pointer
+ * Builds the tree of the filesystem from a single thread, keeping many reads in flight (IMAGE_QUEUE_DEPTH)
+ * instead of reading one block at a time. It's an event loop: each directory asks for its inode, then for all
+ * of its blocks at once, and its entries are added to the tree when the last of them arrives, which asks for
+ * the inodes of its subdirectories. Every directory adds its own entries, so the tree is the same as with the
+ * other walks.
+ * @param img : The image holding the filesystem
  * @param ext2 : EXT2 information
- * @param inodeNum : The inode number to find
- * @return Structure containing the information of the inode
+ * @param root : Tree node of the root directory
+ * @return Whether the tree could be built (1) or not (0, the queue couldn't be prepared or memory ran out during
+ *         the walk: the tree is left empty)
  */
-static Inode getInode(FILE *fp, Ext2 *ext2, int inodeNum) {
+static int asyncTree(Image *img, Ext2 *ext2, struct TreeNode *root){
+    ImageQueue queue;
+    if(!IMAGE_queueInit(&queue, img, IMAGE_QUEUE_DEPTH)) return 0;
+    AsyncWalk walk = {&queue, ext2, 0};
 
-    //Calculate the block size
-    int blockSz = 1024 << ext2->block.s_log_block_size;
+    asyncOpen(&walk, 2, root);
+    ImageCompletion done;
+    while(IMAGE_queueWait(&queue, &done)){
+        AsyncDir *dir = (AsyncDir *) (uintptr_t) done.tag;
+        if(--dir->pending == 0) asyncAdvance(&walk, dir);
+    }
+    IMAGE_queueClose(&queue);
 
-    //Move to the superblock + 1 (where the group descriptor is), and read it (we need the inode table offset)
-    GroupDescriptor gd;
-    fseek(fp, (ext2->block.s_first_data_block + 1) * blockSz, SEEK_SET);
-    fread(&gd, sizeof(GroupDescriptor), 1, fp);
+    //A directory left out would go unnoticed: the other walk starts over (the nodes stay in the arena until TREE_free)
+    if(walk.failed){
+        root->firstChild = root->lastChild = NULL;
+        root->numChilds = 0;
+        return 0;
+    }
+    return 1;
+}
 
-    //Calculate relative inode position (inside a group) and block group in which it is
-    int relativeInode = (inodeNum - 1) % ext2->inode.s_inodes_per_group;    // Position of the inode inside the group
-    int blockGroup = (inodeNum - 1) / ext2->inode.s_inodes_per_group;       // Block group in which the inode is
+/**
+ * Starts reading a directory for the asynchronous tree walk, by asking for its inode (after an inode sweep
+ * it's already in memory, so its blocks are asked for straight away)
+ * @param walk : The walk
+ * @param inodeNum : Inode number of the directory
+ * @param node : Tree node of the directory
+ * @return Whether the directory could be started (1) or not (0, its inode doesn't exist or memory ran out)
+ */
+static int asyncOpen(AsyncWalk *walk, uint32_t inodeNum, struct TreeNode *node){
+    Ext2 *ext2 = walk->ext2;
+    uint64_t offset = inodeOffset(ext2, inodeNum);
+    if(offset == 0) return 0;
+    AsyncDir *dir = (AsyncDir *) calloc(1, sizeof(AsyncDir));
+    if(dir == NULL){
+        walk->failed = 1;
+        return 0;
+    }
+    dir->node = node;
+
+    if(ext2->sweep != NULL){
+        dir->it.inode = getInode(walk->queue->img, ext2, (int) inodeNum, 1);
+        asyncAdvance(walk, dir);
+        return 1;
+    }
+    if(!IMAGE_queueRead(walk->queue, &(dir->it.inode), sizeof(Inode), offset, (uint64_t) (uintptr_t) dir)){
+        walk->failed = 1;
+        free(dir);
+        return 0;
+    }
+    dir->pending = 1;
+    return 1;
+}
 
-    //Calculate the position of the inode in the inode table
-    int inodePos = relativeInode * ext2->inode.s_inode_size;
+/**
+ * Moves a directory of the asynchronous tree walk forward, once all of its reads completed: with its inode,
+ * all of its blocks are asked for; with its blocks, its entries are added to the tree and it's freed.
+ * @param walk : The walk
+ * @param dir : The directory
+ */
+static void asyncAdvance(AsyncWalk *walk, AsyncDir *dir){
+    ImageQueue *queue = walk->queue;
+    DirIterator *it = &(dir->it);
 
-    //Calculate the position of the inode table
-    int inodeTablePos =  gd.bg_inode_table + (blockGroup * ext2->block.s_block_per_group);
+    if(!dir->loaded){
+        dir->loaded = 1;
+        //Big directories have indirect blocks: those are read here, the directory blocks go to the queue
+        int opened = initDirectory(it, queue->img, walk->ext2);
+        if(opened && it->numBlocks > 0){
+            uint32_t blockSz = it->map.blockSize;
+            it->ahead = (unsigned char *) calloc(it->numBlocks, blockSz);
+            opened = it->ahead != NULL;
+            if(!opened) walk->failed = 1;
+            for(uint64_t b = 0; opened && b < it->numBlocks; b++){
+                uint32_t physical = mapBlock(&(it->map), b);
+                if(physical == 0) continue;
+                if(IMAGE_queueRead(queue, it->ahead + b * blockSz, blockSz, (uint64_t) physical * blockSz,
+                                   (uint64_t) (uintptr_t) dir)) dir->pending++;
+                else walk->failed = 1;
+            }
+        }
+        if(!opened && dir->pending == 0){
+            closeDirectory(it);
+            free(dir);
+            return;
+        }
+        if(dir->pending > 0) return;
+    }
 
-    //Move to the inode, read & return it
+    //Every block is here: add the entries, in directory order, and start reading the subdirectories
+    const DirectoryEntry *de;
+    while((de = nextEntry(it)) != NULL){
+        if(strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0 || strcmp(de->name, "lost+found") == 0) continue;
+
+        if(de->file_type == 2){
+            struct TreeNode *child = TREE_addChild(dir->node, (char *) de->name);
+            if(child == NULL) walk->failed = 1;
+            else asyncOpen(walk, de->inode, child);
+        }
+        else if(de->file_type == 1 && TREE_addChild(dir->node, (char *) de->name) == NULL) walk->failed = 1;
+    }
+    closeDirectory(it);
+    free(dir);
+}
+
+/**
+ * This function aims to get an inode table block through the inode cache.
+ * On a miss, the least recently used slot is replaced with the block.
+ * @param img : The image holding the filesystem
+ * @param ext2 : EXT2 information (holds the cache)
+ * @param blockNum : The inode table block wanted
+ * @return The contents of the block, or NULL if it can't be read
+ */
+static const unsigned char * getInodeBlock(Image *img, Ext2 *ext2, uint32_t blockNum){
+    InodeCache *cache = &(ext2->inodeCache);
+    uint32_t blockSz = 1024 << ext2->block.s_log_block_size;
+    cache->clock++;
+
+    //Look for the block, remembering the least recently used slot in case it's not there
+    InodeCacheSlot *victim = &(cache->slots[0]);
+    for(int i = 0; i < EXT2_INODE_CACHE_SLOTS; i++){
+        InodeCacheSlot *slot = &(cache->slots[i]);
+        if(slot->blockNum == blockNum && slot->data != NULL){
+            slot->lastUse = cache->clock;
+            return slot->data;
+        }
+        if(slot->lastUse < victim->lastUse) victim = slot;
+    }
+
+    //Miss: load the block into the victim slot
+    if(victim->data == NULL){
+        victim->data = (unsigned char *) malloc(blockSz);
+        if(victim->data == NULL) return NULL;
+    }
+    if(IMAGE_read(img, victim->data, blockSz, (uint64_t) blockNum * blockSz) != blockSz){
+        victim->blockNum = 0;
+        return NULL;
+    }
+    victim->blockNum = blockNum;
+    victim->lastUse = cache->clock;
+    return victim->data;
+}
+
+/**
+ * This function aims to find the inode by its inode number in the inode table
+ * @param img : The image holding the filesystem
+ * @param ext2 : EXT2 information (with the group descriptor table loaded)
+ * @param inodeNum : The inode number to find
+ * @param concurrent : Whether other threads may be reading inodes at the same time (1), which bypasses the inode cache
+ * @return Structure containing the information of the inode
+ */
+static Inode getInode(Image *img, Ext2 *ext2, int inodeNum, int concurrent) {
     Inode in;
-    fseek(fp, (inodeTablePos * blockSz) + inodePos, SEEK_SET);
-    fread(&in, sizeof(Inode), 1, fp);
+    memset(&in, 0, sizeof(Inode));
+
+    //Calculate the block size, and where the inode is
+    uint32_t blockSz = 1024 << ext2->block.s_log_block_size;
+    uint64_t offset = inodeOffset(ext2, (uint32_t) inodeNum);
+    if(inodeNum < 1 || offset == 0) return in;
+
+    //After an inode sweep, directories are answered from memory
+    if(ext2->sweep != NULL && (uint32_t) inodeNum <= ext2->sweep->count){
+        const InodeMeta *meta = &(ext2->sweep->meta[inodeNum - 1]);
+        if(meta->dirIndex != EXT2_NO_DIR){
+            in.i_mode = meta->i_mode;
+            in.i_links_count = meta->i_links_count;
+            in.i_blocks = meta->i_blocks;
+            in.i_size = (uint32_t) meta->size;
+            memcpy(in.i_block, ext2->sweep->dirBlocks[meta->dirIndex], sizeof(in.i_block));
+            return in;
+        }
+    }
+
+    //When the image is mapped, or the cache can't be shared, the inode is read straight from the image
+    if(img->map != NULL || concurrent){
+        IMAGE_read(img, &in, sizeof(Inode), offset);
+        return in;
+    }
+
+    //Otherwise, inodes close to each other share the same cached inode table block
+    const unsigned char *block = getInodeBlock(img, ext2, (uint32_t) (offset / blockSz));
+    if(block != NULL) memcpy(&in, block + offset % blockSz, sizeof(Inode));
     return in;
 }
 
+/**
+ * This function aims to find where an inode is in the image, from the inode table of its own group
+ * @param ext2 : EXT2 information (with the group descriptor table loaded)
+ * @param inodeNum : The inode number
+ * @return Byte offset of the inode, or 0 if there's no such inode
+ */
+static uint64_t inodeOffset(Ext2 *ext2, uint32_t inodeNum){
+    uint32_t blockSz = 1024 << ext2->block.s_log_block_size;
+
+    //Calculate relative inode position (inside a group) and block group in which it is
+    uint32_t relativeInode = (inodeNum - 1) % ext2->inode.s_inodes_per_group;    // Position of the inode inside the group
+    uint32_t blockGroup = (inodeNum - 1) / ext2->inode.s_inodes_per_group;       // Block group in which the inode is
+    if(inodeNum < 1 || blockGroup >= ext2->groupCount) return 0;
+
+    uint64_t inodePos = (uint64_t) relativeInode * ext2->inode.s_inode_size;
+    return (uint64_t) ext2->groups[blockGroup].bg_inode_table * blockSz + inodePos;
+}
+
 /**
  * This function aims to show the EXT2 information from the file as the linux command "cat" does
- * @param fspath : The path to the EXT2 file
- * @param filename : The name of the file to cat
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param filename : The path or the name of the file to cat
+ * @param index : Index of the image to find the file in (NULL to search the filesystem)
+ * @param out : Output where the file is printed
+ * @return Whether the file was found (1) or not (0)
  */
-void EXT2_catFile(char* fspath, char* filename){
-    FILE* fp = fopen(fspath, "rb"); // Binary Reading mode
-    if(fp == NULL){
-        printf("Error while opening the file %s\n", fspath);
-        return;
+int EXT2_catFile(Image *img, Ext2 *mounted, char* filename, Index *index, Output *out){
+    Ext2 ext2 = beginCommand(mounted);
+
+    int found = 0;
+    if(index != NULL){
+        //The index gives the inode of the file straight away
+        const IndexEntry *entry = INDEX_find(index, filename);
+        if(entry != NULL && entry->type == INDEX_FILE){
+            printFileContent(img, ext2, getInode(img, &ext2, (int) entry->location, 0), out);
+            found = 1;
+        }
+    }
+    else if(strchr(filename, '/') != NULL){
+        //A path: resolve it one component at a time, reading only the directories on it
+        uint32_t inodeNum = resolvePath(img, &ext2, filename);
+        if(inodeNum != 0){
+            Inode inode = getInode(img, &ext2, (int) inodeNum, 0);
+            if((inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFREG){
+                printFileContent(img, ext2, inode, out);
+                found = 1;
+            }
+        }
+    }
+    else{
+        //A bare name: search the whole tree from the root inode (2), the first match wins
+        found = pierceTree(img, &ext2, 2, 1, filename, NULL, 0, out);
+    }
+    if(!found) OUT_printf(out, "File not found\n\n");
+    freeCaches(&ext2);
+    return found;
+}
+
+/**
+ * This function aims to print the metadata of a file or directory, given its path
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param path : The path of the file or directory (from the root directory)
+ * @param out : Output where the metadata is printed
+ * @return Whether the file or directory was found (1) or not (0)
+ */
+int EXT2_statFile(Image *img, Ext2 *mounted, char *path, Output *out){
+    Ext2 ext2 = beginCommand(mounted);
+
+    uint32_t inodeNum = resolvePath(img, &ext2, path);
+    if(inodeNum == 0){
+        OUT_printf(out, "File not found\n\n");
+        freeCaches(&ext2);
+        return 0;
+    }
+
+    Inode inode = getInode(img, &ext2, (int) inodeNum, 0);
+    int isFile = (inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFREG;
+    int isDir = (inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR;
+    uint64_t size = inode.i_size | (isFile ? (uint64_t) inode.i_dir_acl << 32 : 0);
+
+    char modified[32];
+    struct tm tm;
+    asctime_r(gmtime_r(&(time_t) {inode.i_mtime}, &tm), modified);
+    OUT_printf(out, EXT2_PRINT_STAT, path, isFile ? "file" : isDir ? "directory" : "other", size,
+               inodeNum, inode.i_mode & 07777, inode.i_links_count, modified);
+    freeCaches(&ext2);
+    return 1;
+}
+
+/**
+ * Resolves an absolute path (e.g. /var/log/app.log) from the root directory
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param path : The path to resolve ("/" is the root directory)
+ * @return The inode number the path leads to, or 0 if some component doesn't exist
+ */
+uint32_t EXT2_resolve(Image *img, Ext2 *mounted, const char *path){
+    Ext2 ext2 = beginCommand(mounted);
+    uint32_t inodeNum = resolvePath(img, &ext2, path);
+    freeCaches(&ext2);
+    return inodeNum;
+}
+
+/**
+ * Reads an inode (only with IMAGE_read, so several threads can call it at the same time)
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param inodeNum : The inode number
+ * @param inode : Output, the inode
+ * @return Whether the inode is in use (1) or not (0)
+ */
+int EXT2_readInode(Image *img, Ext2 *mounted, uint32_t inodeNum, Inode *inode){
+    *inode = getInode(img, mounted, (int) inodeNum, 1);
+    return inode->i_mode != 0;
+}
+
+/**
+ * Opens a directory to go through its entries (see EXT2_readDir)
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param inodeNum : Inode number of the directory
+ * @param it : Output, the iterator (closed with EXT2_closeDir, even if it couldn't be opened)
+ * @return Whether the directory could be opened (1) or not (0, not a directory)
+ */
+int EXT2_openDir(Image *img, Ext2 *mounted, uint32_t inodeNum, DirIterator *it){
+    return openDirectory(it, img, mounted, inodeNum, 1);
+}
+
+/**
+ * Gets the next entry of a directory. Its name ends with '\0', and it's valid until the next call.
+ * @param it : The iterator
+ * @return The entry, or NULL when there are no more entries
+ */
+const DirectoryEntry * EXT2_readDir(DirIterator *it){
+    return nextEntry(it);
+}
+
+/**
+ * Closes a directory iterator
+ * @param it : The iterator
+ */
+void EXT2_closeDir(DirIterator *it){
+    closeDirectory(it);
+}
+
+/**
+ * Gets where the contents of a file are in the image, as runs of physically adjacent blocks (and holes)
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param inode : The inode of the file
+ * @param runs : Output, the runs (must be freed by the caller)
+ * @param count : Output, number of runs
+ * @return Whether the runs could be built (1) or not (0)
+ */
+int EXT2_fileRuns(Image *img, Ext2 *mounted, const Inode *inode, ImageRun **runs, uint32_t *count){
+    return fileRuns(img, mounted, inode, runs, count);
+}
+
+/**
+ * Gets the values an index of the image is validated with: the last write and mount times
+ * @param ext2 : The mounted filesystem
+ * @param stamp : Output, the values
+ */
+void EXT2_indexStamp(Ext2 *ext2, uint64_t stamp[2]){
+    stamp[0] = ext2->volume.s_wtime;
+    stamp[1] = ext2->volume.s_mtime;
+}
+
+/**
+ * Walks the whole filesystem adding every file and directory to an index
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param writer : The index being built
+ * @return Whether every entry could be added (1) or not (0)
+ */
+int EXT2_buildIndex(Image *img, Ext2 *mounted, IndexWriter *writer){
+    Ext2 ext2 = beginCommand(mounted);
+
+    //The index needs the size of every file: on big images, the sweep has them all
+    if(shouldSweep(img, &ext2)) sweepInodes(img, &ext2);
+    indexDirectory(img, &ext2, 2, writer, 1);
+
+    freeCaches(&ext2);
+    return !writer->failed;
+}
+
+/**
+ * Adds the entries of a directory to an index, and the entries of its subdirectories right after each of them
+ * @param img : The image holding the filesystem
+ * @param ext2 : EXT2 information
+ * @param inodeNum : Inode number of the directory
+ * @param writer : The index being built
+ * @param level : Level of the entries of this directory (1 for the root directory)
+ */
+static void indexDirectory(Image *img, Ext2 *ext2, uint32_t inodeNum, IndexWriter *writer, int level){
+    DirIterator it;
+    if(!openDirectory(&it, img, ext2, inodeNum, 0)) return;
+    planFrontier(img, ext2, &it);
+
+    const DirectoryEntry *de;
+    while((de = nextEntry(&it)) != NULL){
+        if(strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0 || strcmp(de->name, "lost+found") == 0) continue;
+        if(de->file_type != 1 && de->file_type != 2) continue;
+
+        //Sizes come from the sweep when there's one, and from the inode otherwise
+        uint64_t size;
+        if(ext2->sweep != NULL && de->inode <= ext2->sweep->count) size = ext2->sweep->meta[de->inode - 1].size;
+        else{
+            Inode inode = getInode(img, ext2, (int) de->inode, 0);
+            size = inode.i_size;
+            if(de->file_type == 1) size |= (uint64_t) inode.i_dir_acl << 32;
+        }
+
+        if(de->file_type == 2){
+            INDEX_add(writer, level, de->name, INDEX_DIR, de->inode, size);
+            indexDirectory(img, ext2, de->inode, writer, level + 1);
+        }
+        else INDEX_add(writer, level, de->name, INDEX_FILE, de->inode, size);
     }
+    closeDirectory(&it);
+}
 
-    //Reading the EXT2 file information
-    Ext2 ext2 = readInfo(fp);
+/**
+ * Looks up a name in a directory. Hashed directories are looked up through their index; the rest are
+ * scanned block by block.
+ * @param img : The image holding the filesystem
+ * @param ext2 : EXT2 information (with the group descriptor table loaded)
+ * @param dirInode : Inode number of the directory
+ * @param name : The name to look for (it doesn't need to end with '\0')
+ * @param nameLen : Length of the name
+ * @return The inode number of the entry, or 0 if the directory has no entry with that name
+ */
+static uint32_t lookup(Image *img, Ext2 *ext2, uint32_t dirInode, const char *name, size_t nameLen){
+    DirIterator it;
+    if(!openDirectory(&it, img, ext2, dirInode, 0)) return 0;
+
+    //Hashed directories go straight to the leaf block that can hold the name
+    uint32_t found = 0;
+    if(htreeLookup(&it, ext2, name, nameLen, &found)){
+        closeDirectory(&it);
+        return found;
+    }
 
-    //Start searching the file from the root inode (2)
-    int found = pierceTree(fp, &ext2, 2, 1, filename, NULL);
-    if(!found) printf("File not found\n\n");
-    fclose(fp);
+    //Otherwise (or if the index can't be used), every block is scanned
+    const DirectoryEntry *de;
+    while(found == 0 && (de = nextEntry(&it)) != NULL){
+        if(de->name_len == nameLen && memcmp(de->name, name, nameLen) == 0) found = de->inode;
+    }
+    closeDirectory(&it);
+    return found;
 }
 
 /**
- * This function aims to print the content of a file
+ * Reads a block of a directory, given its number inside the directory
+ * @param it : Iterator of the directory
+ * @param logical : Number of the block inside the directory
+ * @param buffer : Output, the contents of the block
+ * @return Whether the block could be read (1) or not (0)
  */
-static void printFileContent(FILE *fp, Ext2 ext2, Inode inode){
-    //Allocate memory for the first data block & add it
-    uint32_t dataBlocks[15];
-    dataBlocks[0] = inode.i_block[0];
-    uint32_t blockSize = 1024 << ext2.block.s_log_block_size;
+static int readDirectoryBlock(DirIterator *it, uint32_t logical, unsigned char *buffer){
+    if(logical >= it->numBlocks) return 0;
+    uint32_t physical = mapBlock(&(it->map), logical);
+    if(physical == 0) return 0;
+    return IMAGE_read(it->map.img, buffer, it->map.blockSize, (uint64_t) physical * it->map.blockSize) == it->map.blockSize;
+}
 
-    //Add the next 11 data blocks if they exist
-    int k;
-    for (k = 1; k < 12; k++) {
-        if (inode.i_block[k - 1] == 0) break;
-        dataBlocks[k] = inode.i_block[k];
+/**
+ * Looks for a name in one block of a directory
+ * @param it : Iterator of the directory (it's left pointing at the end of the block)
+ * @param logical : Number of the block inside the directory
+ * @param name : The name to look for
+ * @param nameLen : Length of the name
+ * @return The inode number of the entry, or 0 if the block has no entry with that name
+ */
+static uint32_t lookupInBlock(DirIterator *it, uint32_t logical, const char *name, size_t nameLen){
+    //Make the iterator go through that block alone
+    it->nextBlock = logical;
+    it->numBlocks = (uint64_t) logical + 1;
+    it->offset = 0;
+    it->blockLen = 0;
+
+    const DirectoryEntry *de;
+    while((de = nextEntry(it)) != NULL){
+        if(de->name_len == nameLen && memcmp(de->name, name, nameLen) == 0) return de->inode;
     }
+    return 0;
+}
 
-    //TODO: Add the indirect blocks (12-15)
+/**
+ * Looks up a name in a hashed directory (htree). The name is hashed, the index is descended from its root
+ * (block 0) to the leaf block holding that hash, and only that leaf is scanned (plus the next ones, while
+ * they continue a run of names with the same hash).
+ * @param it : Iterator of the directory, just opened
+ * @param ext2 : EXT2 information
+ * @param name : The name to look for
+ * @param nameLen : Length of the name
+ * @param inodeNum : Output, the inode number of the entry (0 if the directory has no entry with that name)
+ * @return Whether the index was used (1), or the directory has to be scanned linearly (0): the filesystem
+ *         doesn't have the dir_index feature, the directory isn't hashed, the index looks broken or the name
+ *         is . or .. (which are in block 0, before the index, and in no leaf)
+ */
+static int htreeLookup(DirIterator *it, Ext2 *ext2, const char *name, size_t nameLen, uint32_t *inodeNum){
+    FeatureInfo *feature = &(ext2->feature);
+    if(feature->s_rev_level < 1 || !(feature->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) return 0;
+    if(!(it->inode.i_flags & EXT2_INDEX_FL)) return 0;
+    if((nameLen == 1 && name[0] == '.') || (nameLen == 2 && name[0] == '.' && name[1] == '.')) return 0;
+
+    uint32_t blockSz = it->map.blockSize;
+    unsigned char *node = (unsigned char *) malloc(blockSz);
+    if(node == NULL) return 0;
+    if(!readDirectoryBlock(it, 0, node)){
+        free(node);
+        return 0;
+    }
+
+    //Root info: reserved (4 bytes), hash version, info length, index levels below the root, flags
+    uint8_t hashVersion = node[EXT2_HTREE_ROOT_INFO + 4];
+    uint8_t infoLength = node[EXT2_HTREE_ROOT_INFO + 5];
+    uint8_t levels = node[EXT2_HTREE_ROOT_INFO + 6];
+    if(hashVersion <= HTREE_HASH_TEA && (feature->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+        hashVersion += HTREE_HASH_LEGACY_UNSIGNED;
+
+    uint32_t hash;
+    if(levels > EXT2_HTREE_MAX_LEVELS || EXT2_HTREE_ROOT_INFO + infoLength + 8U > blockSz
+       || !HTREE_hash(name, nameLen, hashVersion, feature->s_hash_seed, &hash)){
+        free(node);
+        return 0;
+    }
 
-    //Loop through all the data blocks, and print them
-    uint32_t readBytes;
-    uint32_t remainingSize = inode.i_size;
-    for(int i = 0; i < k; i++){
+    //Index entries are (hash, block) pairs, sorted by hash. The first one holds the limit and the count
+    //of entries instead of a hash, and covers every hash below the second one.
+    uint32_t entriesPos = EXT2_HTREE_ROOT_INFO + infoLength;
+    uint32_t leaf = 0;
+    uint16_t count = 0;
+    int position = 0;
+    for(int level = 0; level <= levels; level++){
+        uint16_t limit;
+        memcpy(&limit, node + entriesPos, sizeof(uint16_t));
+        memcpy(&count, node + entriesPos + 2, sizeof(uint16_t));
+        if(count == 0 || count > limit || entriesPos + (uint32_t) count * 8 > blockSz){
+            free(node);
+            return 0;
+        }
 
-        //If the file size is bigger than the block size, we read the block size
-        if(inode.i_size > blockSize) readBytes = blockSize;
-        else readBytes = inode.i_size;
+        //Binary search of the last entry whose hash is not above the one of the name
+        int low = 1, high = count - 1;
+        position = 0;
+        while(low <= high){
+            int middle = (low + high) / 2;
+            uint32_t entryHash;
+            memcpy(&entryHash, node + entriesPos + middle * 8, sizeof(uint32_t));
+            if(entryHash > hash) high = middle - 1;
+            else{
+                position = middle;
+                low = middle + 1;
+            }
+        }
+        memcpy(&leaf, node + entriesPos + position * 8 + 4, sizeof(uint32_t));
+        leaf &= EXT2_HTREE_BLOCK_MASK;
 
-        //Allocate memory for the read bytes, read them, and print them
-        char *read = (char *) malloc(readBytes * sizeof(char));
-        fseek(fp, dataBlocks[i], SEEK_SET);
-        fread(read, readBytes * sizeof(char), 1, fp);
-        printf("%s", read);
-        free(read);
+        //Index nodes below the root start with an empty entry covering the whole block
+        if(level < levels){
+            if(!readDirectoryBlock(it, leaf, node)){
+                free(node);
+                return 0;
+            }
+            entriesPos = EXT2_DIR_ENTRY_HEADER;
+        }
+    }
 
-        //Update the file size (we read the block size)
-        remainingSize = remainingSize - readBytes;
+    //Scan the leaf, and the next ones while their first hash (without the lowest bit) is the same one
+    *inodeNum = lookupInBlock(it, leaf, name, nameLen);
+    for(int next = position + 1; *inodeNum == 0 && next < count; next++){
+        uint32_t entryHash;
+        memcpy(&entryHash, node + entriesPos + next * 8, sizeof(uint32_t));
+        if((entryHash & ~1U) != hash) break;
+        memcpy(&leaf, node + entriesPos + next * 8 + 4, sizeof(uint32_t));
+        leaf &= EXT2_HTREE_BLOCK_MASK;
+        *inodeNum = lookupInBlock(it, leaf, name, nameLen);
     }
-}
\ No newline at end of file
+    free(node);
+    return 1;
+}
+
+/**
+ * Resolves an absolute path (e.g. /var/log/app.log) from the root directory, one component at a time
+ * @param img : The image holding the filesystem
+ * @param ext2 : EXT2 information (with the group descriptor table loaded)
+ * @param path : The path to resolve (empty components, as in a//b, are skipped)
+ * @return The inode number the path leads to, or 0 if some component doesn't exist
+ */
+static uint32_t resolvePath(Image *img, Ext2 *ext2, const char *path){
+    uint32_t inodeNum = 2;
+
+    while(*path != '\0'){
+        //Skip the slashes, and take the component up to the next one
+        while(*path == '/') path++;
+        size_t len = strcspn(path, "/");
+        if(len == 0) break;
+
+        inodeNum = lookup(img, ext2, inodeNum, path, len);
+        if(inodeNum == 0) return 0;
+        path += len;
+    }
+    return inodeNum;
+}
+
+/**
+ * Gets the pointer at position index of an indirect block, reading the block only if it isn't cached at that level
+ * @param map : The block map
+ * @param level : Cache level (0 for blocks pointed to by i_block, 1 and 2 for the ones below them)
+ * @param blockNum : Number of the indirect block
+ * @param index : Position of the pointer inside the indirect block
+ * @return The block pointer, or 0 if it's a hole or can't be read
+ */
+static uint32_t indirectPointer(BlockMap *map, int level, uint32_t blockNum, uint32_t index){
+    if(blockNum == 0) return 0;
+
+    if(map->cachedNum[level] != blockNum){
+        if(map->cached[level] == NULL){
+            map->cached[level] = (uint32_t *) malloc(map->blockSize);
+            if(map->cached[level] == NULL) return 0;
+        }
+        if(IMAGE_read(map->img, map->cached[level], map->blockSize, (uint64_t) blockNum * map->blockSize) != map->blockSize){
+            map->cachedNum[level] = 0;
+            return 0;
+        }
+        map->cachedNum[level] = blockNum;
+    }
+    return map->cached[level][index];
+}
+
+/**
+ * Translates a block of a file (logical) into a block of the filesystem (physical).
+ * Indirect blocks are read lazily and cached, so reading a file sequentially reads each of them once.
+ * @param map : The block map of the file
+ * @param logical : Number of the block inside the file
+ * @return Physical block number, or 0 if the block is a hole
+ */
+static uint32_t mapBlock(BlockMap *map, uint64_t logical){
+    uint32_t physical;
+    mapExtent(map, logical, &physical);
+    return physical;
+}
+
+/**
+ * Translates a block of a file into a block of the filesystem, as mapBlock does, and tells how many blocks
+ * the answer covers: behind a 0 pointer to an indirect block, the whole hole is given at once.
+ * @param map : The block map of the file
+ * @param logical : Number of the block inside the file
+ * @param physical : Output, physical block number (0 if the block is a hole)
+ * @return Number of blocks from logical on that the answer covers (1 unless it's the hole of an indirect block)
+ */
+static uint64_t mapExtent(BlockMap *map, uint64_t logical, uint32_t *physical){
+    uint64_t ptrs = map->ptrsPerBlock;
+    const uint32_t *iblock = map->inode->i_block;
+    *physical = 0;
+
+    if(logical < EXT2_NDIR_BLOCKS){
+        *physical = iblock[logical];
+        return 1;
+    }
+    logical -= EXT2_NDIR_BLOCKS;
+
+    //Single indirect
+    if(logical < ptrs){
+        if(iblock[EXT2_IND_BLOCK] == 0) return ptrs - logical;
+        *physical = indirectPointer(map, 0, iblock[EXT2_IND_BLOCK], logical);
+        return 1;
+    }
+    logical -= ptrs;
+
+    //Double indirect
+    if(logical < ptrs * ptrs){
+        if(iblock[EXT2_DIND_BLOCK] == 0) return ptrs * ptrs - logical;
+        uint32_t ind = indirectPointer(map, 0, iblock[EXT2_DIND_BLOCK], logical / ptrs);
+        if(ind == 0) return ptrs - logical % ptrs;
+        *physical = indirectPointer(map, 1, ind, logical % ptrs);
+        return 1;
+    }
+    logical -= ptrs * ptrs;
+
+    //Triple indirect
+    if(logical < ptrs * ptrs * ptrs){
+        if(iblock[EXT2_TIND_BLOCK] == 0) return ptrs * ptrs * ptrs - logical;
+        uint32_t dind = indirectPointer(map, 0, iblock[EXT2_TIND_BLOCK], logical / (ptrs * ptrs));
+        if(dind == 0) return ptrs * ptrs - logical % (ptrs * ptrs);
+        uint32_t ind = indirectPointer(map, 1, dind, (logical / ptrs) % ptrs);
+        if(ind == 0) return ptrs - logical % ptrs;
+        *physical = indirectPointer(map, 2, ind, logical % ptrs);
+        return 1;
+    }
+    return 1;
+}
+
+/**
+ * Opens a directory to go through its entries. Every block of the directory (direct or behind indirect
+ * blocks) is loaded with a single read, and its entries are parsed in place. The iterator reads only with
+ * IMAGE_read, so different threads can go through different directories at the same time.
+ * @param it : The iterator to open
+ * @param img : The image holding the filesystem
+ * @param ext2 : EXT2 information (with the group descriptor table loaded)
+ * @param inodeNum : Inode number of the directory
+ * @param concurrent : Whether other threads may be reading inodes at the same time (see getInode)
+ * @return Whether the directory could be opened (1) or not (0)
+ */
+static int openDirectory(DirIterator *it, Image *img, Ext2 *ext2, uint32_t inodeNum, int concurrent){
+    memset(it, 0, sizeof(DirIterator));
+    it->inode = getInode(img, ext2, (int) inodeNum, concurrent);
+    return initDirectory(it, img, ext2);
+}
+
+/**
+ * Prepares a directory iterator whose inode was already read into it->inode
+ * @param it : The iterator (the rest of it zeroed)
+ * @param img : The image holding the filesystem
+ * @param ext2 : EXT2 information
+ * @return Whether the inode is a directory and the iterator could be prepared (1) or not (0)
+ */
+static int initDirectory(DirIterator *it, Image *img, Ext2 *ext2){
+    if((it->inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) return 0;
+
+    it->map.img = img;
+    it->map.blockSize = 1024 << ext2->block.s_log_block_size;
+    it->map.ptrsPerBlock = it->map.blockSize / sizeof(uint32_t);
+    it->map.inode = &(it->inode);
+    it->numBlocks = (it->inode.i_size + it->map.blockSize - 1) / it->map.blockSize;
+
+    it->block = (unsigned char *) malloc(it->map.blockSize + 1);
+    return it->block != NULL;
+}
+
+/**
+ * Gets the next entry of a directory (deleted entries are skipped). The entry points into the iterator's
+ * block, and its name is ended with '\0' in place: it's valid until the next call.
+ * @param it : The iterator
+ * @return The entry, or NULL when there are no more entries
+ */
+static const DirectoryEntry * nextEntry(DirIterator *it){
+    uint32_t blockSz = it->map.blockSize;
+
+    //Give back the byte used to end the previous name (it may be the start of the next entry)
+    if(it->terminator != NULL){
+        *(it->terminator) = it->savedByte;
+        it->terminator = NULL;
+    }
+
+    while(1){
+        //Load the next block of the directory, skipping holes and blocks that can't be read
+        if(it->offset + EXT2_DIR_ENTRY_HEADER > it->blockLen){
+            if(it->nextBlock >= it->numBlocks) return NULL;
+            it->offset = 0;
+            it->blockLen = 0;
+            //Blocks read beforehand are copied, since names get ended in place (holes & failed reads are zeros)
+            if(it->ahead != NULL){
+                memcpy(it->block, it->ahead + it->nextBlock++ * blockSz, blockSz);
+                it->blockLen = blockSz;
+                continue;
+            }
+            uint32_t physical = mapBlock(&(it->map), it->nextBlock++);
+            if(physical != 0 && IMAGE_read(it->map.img, it->block, blockSz, (uint64_t) physical * blockSz) == blockSz)
+                it->blockLen = blockSz;
+            continue;
+        }
+
+        DirectoryEntry *de = (DirectoryEntry *) (it->block + it->offset);
+        //A broken entry ends the block (a rec_len of 0 would never move forward)
+        if(de->rec_len < EXT2_DIR_ENTRY_HEADER || de->rec_len > it->blockLen - it->offset
+           || de->name_len > de->rec_len - EXT2_DIR_ENTRY_HEADER){
+            it->offset = it->blockLen;
+            continue;
+        }
+        it->offset += de->rec_len;
+        if(de->inode == 0) continue;
+
+        //End the name with '\0', keeping the byte it replaces (the block has one spare byte for the last entry)
+        it->terminator = (unsigned char *) de->name + de->name_len;
+        it->savedByte = *(it->terminator);
+        *(it->terminator) = '\0';
+        return de;
+    }
+}
+
+/**
+ * Goes back to the first entry of a directory
+ * @param it : The iterator
+ */
+static void rewindDirectory(DirIterator *it){
+    if(it->terminator != NULL){
+        *(it->terminator) = it->savedByte;
+        it->terminator = NULL;
+    }
+    it->nextBlock = 0;
+    it->offset = 0;
+    it->blockLen = 0;
+}
+
+/**
+ * Closes a directory iterator, freeing its buffers
+ * @param it : The iterator
+ */
+static void closeDirectory(DirIterator *it){
+    free(it->block);
+    free(it->ahead);
+    for(int i = 0; i < 3; i++) free(it->map.cached[i]);
+}
+
+/**
+ * Starts going through the runs of a file (see nextRun). Its size is cut to what its block pointers can
+ * address, so a broken size (i_size and the high bits in i_dir_acl) can't make the walk go on for ages.
+ * @param cur : Output, the cursor (freed with closeRuns)
+ * @param img : The image holding the filesystem
+ * @param ext2 : EXT2 information
+ * @param inode : The inode of the file (it must stay valid while the cursor is used)
+ */
+static void openRuns(RunCursor *cur, Image *img, Ext2 *ext2, const Inode *inode){
+    memset(cur, 0, sizeof(RunCursor));
+    cur->map.img = img;
+    cur->map.blockSize = 1024 << ext2->block.s_log_block_size;
+    cur->map.ptrsPerBlock = cur->map.blockSize / sizeof(uint32_t);
+    cur->map.inode = inode;
+
+    //Regular files keep the high 32 bits of their size in i_dir_acl
+    uint64_t size = inode->i_size;
+    if((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG) size |= (uint64_t) inode->i_dir_acl << 32;
+    uint64_t ptrs = cur->map.ptrsPerBlock;
+    uint64_t maxBlocks = EXT2_NDIR_BLOCKS + ptrs + ptrs * ptrs + ptrs * ptrs * ptrs;
+    cur->size = size / cur->map.blockSize >= maxBlocks ? maxBlocks * cur->map.blockSize : size;
+}
+
+/**
+ * Gives the next run of a file: physically adjacent blocks merged together, or a run of holes. Indirect
+ * blocks are read once each, as the runs get to them, and the hole behind a 0 pointer is skipped at once.
+ * @param cur : The cursor
+ * @param run : Output, the run
+ * @return Whether there was a run (1) or the file ended (0)
+ */
+static int nextRun(RunCursor *cur, ImageRun *run){
+    uint32_t blockSz = cur->map.blockSize;
+    uint64_t pos = cur->logical * blockSz;
+    if(pos >= cur->size) return 0;
+
+    *run = (ImageRun) {pos, IMAGE_HOLE, 0};
+    while(pos < cur->size){
+        uint32_t physical;
+        uint64_t blocks = mapExtent(&(cur->map), cur->logical, &physical);
+        uint64_t offset = physical == 0 ? IMAGE_HOLE : (uint64_t) physical * blockSz;
+
+        //The run goes on while the next block of the file is the next one on disk (or another hole)
+        if(run->length > 0 && (offset == IMAGE_HOLE ? run->offset != IMAGE_HOLE
+                                                    : run->offset == IMAGE_HOLE || run->offset + run->length != offset))
+            break;
+        uint64_t bytes = blocks * blockSz;
+        if(bytes > cur->size - pos) bytes = cur->size - pos;
+        if(run->length == 0) run->offset = offset;
+        run->length += bytes;
+        pos += bytes;
+        cur->logical += blocks;
+    }
+    return 1;
+}
+
+/**
+ * Frees the indirect blocks cached by a cursor
+ * @param cur : The cursor
+ */
+static void closeRuns(RunCursor *cur){
+    for(int i = 0; i < 3; i++) free(cur->map.cached[i]);
+}
+
+/**
+ * Gets where the contents of a file are in the image: all of its runs (see nextRun)
+ * @param img : The image holding the filesystem
+ * @param ext2 : EXT2 information
+ * @param inode : The inode of the file
+ * @param runs : Output, the runs (must be freed by the caller)
+ * @param count : Output, number of runs
+ * @return Whether the runs could be built (1) or not (0, out of memory)
+ */
+static int fileRuns(Image *img, Ext2 *ext2, const Inode *inode, ImageRun **runs, uint32_t *count){
+    RunCursor cur;
+    openRuns(&cur, img, ext2, inode);
+
+    *runs = NULL;
+    *count = 0;
+    uint32_t capacity = 0;
+    int ok = 1;
+    ImageRun run;
+    while(ok && nextRun(&cur, &run)){
+        if(*count == capacity){
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            ImageRun *bigger = (ImageRun *) realloc(*runs, capacity * sizeof(ImageRun));
+            if(bigger == NULL){
+                ok = 0;
+                break;
+            }
+            *runs = bigger;
+        }
+        (*runs)[(*count)++] = run;
+    }
+
+    closeRuns(&cur);
+    if(!ok){
+        free(*runs);
+        *runs = NULL;
+        *count = 0;
+    }
+    return ok;
+}
+
+/**
+ * This function aims to print the content of a file, a run at a time as the block map is read: physically
+ * adjacent blocks are copied to the output in one go, and the first bytes go out before the last indirect
+ * blocks are read.
+ * @param img : The image holding the filesystem
+ * @param ext2 : EXT2 information
+ * @param inode : The inode of the file to print
+ * @param out : Output where the raw contents are written
+ */
+static void printFileContent(Image *img, Ext2 ext2, Inode inode, Output *out){
+    RunCursor cur;
+    openRuns(&cur, img, &ext2, &inode);
+
+    //Holes (unallocated blocks) read as zeros
+    ImageRun run;
+    while(nextRun(&cur, &run)){
+        if(!OUT_copyRuns(out, img, &run, 1)) break;
+    }
+    closeRuns(&cur);
+}
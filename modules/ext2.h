@@ -7,15 +7,25 @@
 #include <time.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include "image.h"
+#include "htree.h"
+#include "index.h"
+#include "tree.h"
+#include "usage.h"
 
 #define EXT2_PRINT_INFO "\n------ Filesystem Information ------\n\n"
 
 #define EXT2_PRINT_INFO_INODE "\nINODE INFO:\n\tSize: %d\n\tNum inodes: %d\n\tFirst inode: %d\n\tInodes Group: %d\n\tFree inodes: %d\n"
 #define EXT2_PRINT_INFO_BLOCK "\nBLOCK INFO:\n\tBlock Size: %d\n\tReserved blocks: %d\n\tFree blocks: %d\n\tTotal blocks: %d\n\tFirst block: %d\n\tGroup blocks: %d\n\tGroup flags: %d\n"
 #define EXT2_PRINT_INFO_VOLUME "\nVOLUME INFO:\n\tVolume name: %s\n\tLast Checked: %s\tLast Mounted: %s\tLast Written: %s\n"
+#define EXT2_USAGE_MISMATCH "Mismatch. Free %s: the bitmaps count %" PRIu64 ", the superblock says %" PRIu32 ".\n"
+#define EXT2_USAGE_GROUP_MISMATCH "Mismatch. Group %" PRIu32 ": the bitmaps count %" PRIu32 " free blocks and %" PRIu32 " free inodes, its descriptor says %" PRIu16 " and %" PRIu16 ".\n"
+#define EXT2_USAGE_UNREADABLE "Error. The bitmaps of group %" PRIu32 " could not be read.\n"
+#define EXT2_PRINT_STAT "Path: %s\nType: %s\nSize: %" PRIu64 "\nInode: %" PRIu32 "\nMode: %04o\nLinks: %d\nModified: %s\n"
 
 // Superblock related constants
 #define EXT2_SUPERBLOCK_OFFSET 1024
+#define EXT2_SUPERBLOCK_SIZE 1024
 
 // EXT2 related constants
 #define EXT2_MAGIC_NUMBER_OFFSET 56
@@ -41,6 +51,12 @@
 #define S_LASTCHECK 64
 #define S_MTIME 44
 #define S_WTIME 48
+// Feature related offsets
+#define S_REV_LEVEL 76
+#define S_FEATURE_COMPAT 92
+#define S_HASH_SEED 236
+#define S_DEF_HASH_VERSION 252
+#define S_FLAGS 352
 
 
 
@@ -81,9 +97,31 @@ typedef struct{
     uint16_t rec_len;                       // displacement to the next directory entry from the start of the current directory entry
     uint8_t name_len;
     uint8_t file_type;
-    char name[255];
+    char name[256];                         // name_len bytes on disk, plus the '\0' we add when reading it
 } DirectoryEntry; //Directory Entry
 
+// Size of the fixed part of a directory entry (inode, rec_len, name_len & file_type)
+#define EXT2_DIR_ENTRY_HEADER 8
+
+// File type bits of i_mode
+#define EXT2_S_IFMT 0xF000
+#define EXT2_S_IFREG 0x8000
+#define EXT2_S_IFDIR 0x4000
+
+// Positions inside i_block
+#define EXT2_NDIR_BLOCKS 12                 // Number of direct blocks
+#define EXT2_IND_BLOCK 12                   // Single indirect block
+#define EXT2_DIND_BLOCK 13                  // Double indirect block
+#define EXT2_TIND_BLOCK 14                  // Triple indirect block
+
+// Hashed directories (htree)
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020    // The filesystem may have hashed directories
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002         // Names are hashed with unsigned characters
+#define EXT2_INDEX_FL 0x00001000                // i_flags bit of a hashed directory
+#define EXT2_HTREE_ROOT_INFO 24                 // Offset of the htree root info (after the . and .. entries)
+#define EXT2_HTREE_MAX_LEVELS 2                 // Index levels below the root, at most
+#define EXT2_HTREE_BLOCK_MASK 0x0fffffff        // Bits of the block of an index entry (the high ones are flags)
+
 /******************************** SUPERBLOCK information related ********************************/
 typedef struct {
     uint16_t s_inode_size;          // size of inode structure
@@ -110,37 +148,245 @@ typedef struct {
     uint32_t s_wtime;                 // last writing time
 } VolumeInfo;
 
+typedef struct {
+    uint32_t s_rev_level;             // revision level (features only exist from revision 1)
+    uint32_t s_feature_compat;        // compatible feature set
+    uint32_t s_hash_seed[4];          // seed of the directory hash
+    uint8_t s_def_hash_version;       // default hash version
+    uint32_t s_flags;                 // miscellaneous flags (signed or unsigned directory hash)
+} FeatureInfo;
+
+/******************************** In-memory caches ********************************/
+// Number of inode table blocks kept in the inode cache
+#define EXT2_INODE_CACHE_SLOTS 32
+
+typedef struct {
+    uint32_t bg_block_bitmap;           // block holding the block bitmap of the group
+    uint32_t bg_inode_bitmap;           // block holding the inode bitmap of the group
+    uint32_t bg_inode_table;            // first block of the inode table of the group
+    uint16_t bg_free_blocks_count;      // number of free blocks in the group, as counted by the filesystem
+    uint16_t bg_free_inodes_count;      // number of free inodes in the group, as counted by the filesystem
+    uint16_t bg_used_dirs_count;        // number of directories in the group
+} GroupInfo; //Compact copy of a Group Descriptor
+
+typedef struct {
+    uint32_t blockNum;                  // inode table block held in this slot (0 = empty)
+    uint32_t lastUse;                   // value of the cache clock when the slot was last used
+    unsigned char *data;                // contents of the block
+} InodeCacheSlot;
+
+typedef struct {
+    uint32_t clock;                     // incremented on every lookup, used to find the least recently used slot
+    InodeCacheSlot slots[EXT2_INODE_CACHE_SLOTS];
+} InodeCache;
+
+// Inode sweep: whole-image scans read every inode table sequentially instead of fetching inodes one by one.
+// It's used when the image is at least EXT2_SWEEP_MIN_IMAGE bytes, and fetching each directory inode with a
+// random read (counted as EXT2_RANDOM_READ_COST bytes of sequential reading) would cost more than the sweep.
+#define EXT2_SWEEP_MIN_IMAGE (64ULL * 1024 * 1024)
+#define EXT2_RANDOM_READ_COST (256 * 1024)
+#define EXT2_SWEEP_CHUNK (1024 * 1024)
+#define EXT2_NO_DIR UINT32_MAX
+
+typedef struct {
+    uint16_t i_mode;                    // type of file and permissions (0 = unused inode)
+    uint16_t i_links_count;             // number of hard links
+    uint32_t i_blocks;                  // number of 512-byte blocks reserved for the inode
+    uint64_t size;                      // full 64-bit size
+    uint32_t dirIndex;                  // position of the block pointers in InodeSweep.dirBlocks (EXT2_NO_DIR if not a directory)
+} InodeMeta;
+
+typedef struct {
+    uint32_t count;                     // number of entries in meta (= number of inodes)
+    InodeMeta *meta;                    // metadata of every inode, indexed by inode number - 1
+    uint32_t dirCount;                  // number of entries in dirBlocks
+    uint32_t (*dirBlocks)[15];          // i_block of every directory
+} InodeSweep;
+
 typedef struct {
     uint16_t mgnum;                    // magic number -> filesystem identifier
     InodeInfo inode;
     BlockInfo block;
     VolumeInfo volume;
+    FeatureInfo feature;
+    uint32_t groupCount;               // number of block groups
+    GroupInfo *groups;                 // group descriptor table (NULL until it's loaded)
+    InodeCache inodeCache;             // recently used inode table blocks
+    InodeSweep *sweep;                 // result of the inode sweep (NULL when inodes are fetched one by one)
 } Ext2;
 
+typedef struct {
+    Image *img;
+    uint32_t blockSize;
+    uint32_t ptrsPerBlock;          // Block pointers held by one indirect block
+    const Inode *inode;
+    uint32_t cachedNum[3];          // Number of the indirect block cached at each level (0 = none)
+    uint32_t *cached[3];            // Contents of the cached indirect blocks (single, double, triple level)
+} BlockMap;
+
+typedef struct {
+    Inode inode;                    // Inode of the directory (the block map points to it)
+    BlockMap map;
+    unsigned char *block;           // Current directory block, plus one byte to end the last name with '\0'
+    uint64_t numBlocks;             // Blocks of the directory
+    uint64_t nextBlock;             // Next block of the directory to load
+    uint32_t offset;                // Offset of the next entry inside the current block
+    uint32_t blockLen;              // Bytes of the current block still to parse (0 = load the next block)
+    unsigned char *terminator;      // Byte overwritten with the '\0' ending the last name returned
+    unsigned char savedByte;        // Its original value
+    unsigned char *ahead;           // Every block of the directory, when they were read beforehand (NULL to read them one by one)
+} DirIterator;
+
 /**
- * Function that checks if a file is an EXT2 filesystem
- * @param filepath: String with the path to the file
+ * Function that checks if an image holds an EXT2 filesystem (from the bytes probed when it was opened)
+ * @param img: The opened image
  * @return Whether the filesystem is EXT2 (1) or not (0)
  */
-int EXT2_isExt2(char* filepath);
+int EXT2_isExt2(Image *img);
+
+/**
+ * Function that mounts an EXT2 filesystem: parses its superblock and loads its group descriptor table.
+ * A mounted filesystem is only read afterwards, so several commands (and threads) can share it.
+ * @param img : The opened image
+ * @param ext2 : Output, the mounted filesystem
+ * @return Whether the filesystem could be mounted (1) or not (0)
+ */
+int EXT2_mount(Image *img, Ext2 *ext2);
+
+/**
+ * Function that frees what was loaded when the filesystem was mounted
+ * @param ext2 : The mounted filesystem
+ */
+void EXT2_unmount(Ext2 *ext2);
 
 /**
  * Function that prints the information of an EXT2 filesystem
- * @param filepath : String with the representation of the path to the file
+ * @param img : The opened image
+ * @param ext2 : The mounted filesystem
+ * @param out : Output where the information is printed
+ */
+void EXT2_printInfo(Image *img, Ext2 *ext2, Output *out);
+
+/**
+ * Function that prints how many blocks and inodes of an EXT2 filesystem are in use, counted from the bitmaps
+ * of every group (by a pool of threads), and flags the counters of the superblock and of the group
+ * descriptors that don't agree with them
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param out : Output where the report is printed
+ * @return Whether the counters agree with the bitmaps (1) or not (0)
  */
-void EXT2_printInfo(char* filepath);
+int EXT2_printUsage(Image *img, Ext2 *mounted, Output *out);
 
 /**
  * Function that prints the tree of an EXT2 filesystem
- * @param fspath : String with the representation of the path to the file
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param walk : How to walk the filesystem (TREE_WALK_*)
+ * @param out : Output where the tree is printed
+ * @return Whether the whole tree was printed (1) or not (0, memory ran out)
  */
-void EXT2_printTree(char* fspath);
+int EXT2_printTree(Image *img, Ext2 *mounted, int walk, Output *out);
+
+/**
+ * Function that walks a directory of an EXT2 filesystem, and everything below it, with a visitor. The directory
+ * itself is given first, at level 0 (with the path as its name), and left last.
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param path : The path of the directory (from the root directory)
+ * @param visitor : The visitor (when it asks for sizes, they are the inode sizes & the blocks it holds)
+ * @return Whether the directory could be walked (1) or not (0, it doesn't exist or isn't a directory)
+ */
+int EXT2_visitTree(Image *img, Ext2 *mounted, const char *path, TreeVisitor *visitor);
 
 /**
  * This function aims to show the EXT2 information from the file as the linux command "cat" does
- * @param fspath : The path to the EXT2 file
- * @param filename : The name of the file to cat
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param filename : The path or the name of the file to cat
+ * @param index : Index of the image to find the file in (NULL to search the filesystem)
+ * @param out : Output where the file is printed
+ * @return Whether the file was found (1) or not (0)
+ */
+int EXT2_catFile(Image *img, Ext2 *mounted, char* filename, Index *index, Output *out);
+
+/**
+ * This function aims to print the metadata of a file or directory, given its path
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param path : The path of the file or directory (from the root directory)
+ * @param out : Output where the metadata is printed
+ * @return Whether the file or directory was found (1) or not (0)
+ */
+int EXT2_statFile(Image *img, Ext2 *mounted, char *path, Output *out);
+
+/**
+ * Resolves an absolute path (e.g. /var/log/app.log) from the root directory
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param path : The path to resolve ("/" is the root directory)
+ * @return The inode number the path leads to, or 0 if some component doesn't exist
+ */
+uint32_t EXT2_resolve(Image *img, Ext2 *mounted, const char *path);
+
+/**
+ * Reads an inode (only with IMAGE_read, so several threads can call it at the same time)
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param inodeNum : The inode number
+ * @param inode : Output, the inode
+ * @return Whether the inode is in use (1) or not (0)
+ */
+int EXT2_readInode(Image *img, Ext2 *mounted, uint32_t inodeNum, Inode *inode);
+
+/**
+ * Opens a directory to go through its entries (see EXT2_readDir)
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param inodeNum : Inode number of the directory
+ * @param it : Output, the iterator (closed with EXT2_closeDir, even if it couldn't be opened)
+ * @return Whether the directory could be opened (1) or not (0, not a directory)
+ */
+int EXT2_openDir(Image *img, Ext2 *mounted, uint32_t inodeNum, DirIterator *it);
+
+/**
+ * Gets the next entry of a directory. Its name ends with '\0', and it's valid until the next call.
+ * @param it : The iterator
+ * @return The entry, or NULL when there are no more entries
+ */
+const DirectoryEntry * EXT2_readDir(DirIterator *it);
+
+/**
+ * Closes a directory iterator
+ * @param it : The iterator
+ */
+void EXT2_closeDir(DirIterator *it);
+
+/**
+ * Gets where the contents of a file are in the image, as runs of physically adjacent blocks (and holes)
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param inode : The inode of the file
+ * @param runs : Output, the runs (must be freed by the caller)
+ * @param count : Output, number of runs
+ * @return Whether the runs could be built (1) or not (0)
+ */
+int EXT2_fileRuns(Image *img, Ext2 *mounted, const Inode *inode, ImageRun **runs, uint32_t *count);
+
+/**
+ * Gets the values an index of the image is validated with: the last write and mount times
+ * @param ext2 : The mounted filesystem
+ * @param stamp : Output, the values
+ */
+void EXT2_indexStamp(Ext2 *ext2, uint64_t stamp[2]);
+
+/**
+ * Walks the whole filesystem adding every file and directory to an index
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param writer : The index being built
+ * @return Whether every entry could be added (1) or not (0)
  */
-void EXT2_catFile(char* fspath, char* filename);
+int EXT2_buildIndex(Image *img, Ext2 *mounted, IndexWriter *writer);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include "extract.h"
+#include "files.h"
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+// A regular file to extract
+typedef struct {
+    char *path;                     // Path on the host
+    uint64_t size;
+    ImageRun *runs;                 // Where the file is in the image
+    uint32_t count;                 // Number of runs
+    mode_t mode;                    // Permissions to give it once it's written
+    int64_t mtime;                  // Modification time (0 if it isn't known)
+    atomic_int failed;              // Set by the workers when one of its pieces couldn't be copied
+} ExtractFile;
+
+// A directory made on the host
+typedef struct {
+    char *path;
+    mode_t mode;
+    int64_t mtime;
+} ExtractDir;
+
+// Bytes of a file copied by one worker: they are all stored (holes are never part of a piece)
+typedef struct {
+    uint32_t file;                  // Index of the file
+    uint32_t run;                   // First run of the file holding the piece
+    uint64_t start;                 // Byte offset of the piece inside the file
+    uint64_t length;
+    uint64_t offset;                // Byte offset of the piece inside the image (the copy goes in this order)
+} ExtractPiece;
+
+typedef struct {
+    Image *img;
+    Ext2 *ext2;
+    Fat16 *fat16;
+    Output *out;
+    ExtractFile *files;
+    uint32_t numFiles, capFiles;
+    ExtractDir *dirs;
+    uint32_t numDirs, capDirs;
+    int *dirFds;                    // Open directories from the destination down to the one being walked
+    uint32_t numFds, capFds;
+    ExtractPiece *pieces;
+    uint32_t numPieces, capPieces;
+    atomic_uint nextPiece;          // Next piece to be taken by a worker
+    uint32_t skipped;               // Entries that are neither files nor directories
+    uint32_t failures;              // Entries that couldn't be made
+    uint64_t bytes;                 // Bytes of all the files
+} Extraction;
+
+static int pushDir(Extraction *ex, int fd);
+static int addDir(Extraction *ex, const FilesEntry *entry);
+static int addFile(Extraction *ex, const FilesEntry *entry);
+static int addPieces(Extraction *ex, uint32_t fileIndex);
+static int visitEntry(void *ctx, const FilesEntry *entry);
+static void leaveDirectory(void *ctx, const FilesEntry *entry);
+static void failEntry(void *ctx, const char *path);
+static int copyPiece(Extraction *ex, const ExtractPiece *piece, unsigned char **buffer);
+static int comparePieces(const void *a, const void *b);
+static void * copyWorker(void *arg);
+static void setTimes(const char *path, int64_t mtime);
+
+/**
+ * Makes a directory the one where the next entries of the walk go
+ * @param fd : The directory, open (closed here if it can't be kept)
+ * @return Whether it could be kept (1) or not (0)
+ */
+static int pushDir(Extraction *ex, int fd){
+    if(ex->numFds == ex->capFds){
+        uint32_t cap = ex->capFds == 0 ? 16 : ex->capFds * 2;
+        int *fds = (int *) realloc(ex->dirFds, cap * sizeof(int));
+        if(fds == NULL){
+            close(fd);
+            return 0;
+        }
+        ex->dirFds = fds;
+        ex->capFds = cap;
+    }
+    ex->dirFds[ex->numFds++] = fd;
+    return 1;
+}
+
+/**
+ * Makes a directory on the host, inside the one being walked, and remembers it to give it its permissions & time
+ * once everything is written. It's made relative to its parent, and a symbolic link found in its place isn't
+ * followed.
+ * @return Whether the directory could be made (1) or not (0)
+ */
+static int addDir(Extraction *ex, const FilesEntry *entry){
+    //It's made writable for us until the end, whatever its permissions are
+    int parent = ex->dirFds[ex->numFds - 1];
+    if(mkdirat(parent, entry->name, 0700) != 0 && errno != EEXIST) return 0;
+    int fd = openat(parent, entry->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0) return 0;
+
+    if(ex->numDirs == ex->capDirs){
+        uint32_t cap = ex->capDirs == 0 ? 64 : ex->capDirs * 2;
+        ExtractDir *dirs = (ExtractDir *) realloc(ex->dirs, cap * sizeof(ExtractDir));
+        if(dirs == NULL){
+            close(fd);
+            return 0;
+        }
+        ex->dirs = dirs;
+        ex->capDirs = cap;
+    }
+    char *copy = strdup(entry->path);
+    if(copy == NULL){
+        close(fd);
+        return 0;
+    }
+    if(!pushDir(ex, fd)){
+        free(copy);
+        return 0;
+    }
+    ex->dirs[ex->numDirs].path = copy;
+    ex->dirs[ex->numDirs].mode = entry->mode;
+    ex->dirs[ex->numDirs].mtime = entry->mtime;
+    ex->numDirs++;
+    return 1;
+}
+
+/**
+ * Creates a file on the host, inside the directory being walked, with its final size, and queues the pieces of
+ * its contents. Since nothing is written where the file has holes, they stay holes on the host as well.
+ * @param entry : The file, with its runs (the extraction frees them)
+ * @return Whether the file could be created (1) or not (0)
+ */
+static int addFile(Extraction *ex, const FilesEntry *entry){
+    int fd = openat(ex->dirFds[ex->numFds - 1], entry->name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    int sized = fd >= 0 && ftruncate(fd, (off_t) entry->size) == 0;
+    if(fd >= 0) close(fd);
+
+    char *copy = sized ? strdup(entry->path) : NULL;
+    if(copy != NULL && ex->numFiles == ex->capFiles){
+        uint32_t cap = ex->capFiles == 0 ? 256 : ex->capFiles * 2;
+        ExtractFile *files = (ExtractFile *) realloc(ex->files, cap * sizeof(ExtractFile));
+        if(files != NULL){
+            ex->files = files;
+            ex->capFiles = cap;
+        }
+    }
+    if(copy == NULL || ex->numFiles == ex->capFiles){
+        free(copy);
+        free(entry->runs);
+        return 0;
+    }
+
+    ExtractFile *file = &(ex->files[ex->numFiles]);
+    file->path = copy;
+    file->size = entry->size;
+    file->runs = entry->runs;
+    file->count = entry->count;
+    file->mode = entry->mode;
+    file->mtime = entry->mtime;
+    atomic_init(&(file->failed), 0);
+    ex->bytes += entry->size;
+    return addPieces(ex, ex->numFiles++);
+}
+
+/**
+ * Splits the stored bytes of a file into pieces of at most EXTRACT_PIECE_BYTES. Consecutive runs go in the same
+ * piece, and holes end it.
+ * @return Whether the pieces could be queued (1) or not (0)
+ */
+static int addPieces(Extraction *ex, uint32_t fileIndex){
+    const ExtractFile *file = &(ex->files[fileIndex]);
+    ExtractPiece piece = {fileIndex, 0, 0, 0, 0};
+
+    for(uint32_t r = 0; r <= file->count; r++){
+        int hole = r < file->count && file->runs[r].offset == IMAGE_HOLE;
+        uint64_t pos = r < file->count ? file->runs[r].logical : 0;
+        uint64_t left = (r < file->count && !hole) ? file->runs[r].length : 0;
+
+        do{
+            //Queue the current piece when it's full, at a hole, and after the last run
+            if(piece.length > 0 && (piece.length == EXTRACT_PIECE_BYTES || hole || r == file->count)){
+                if(ex->numPieces == ex->capPieces){
+                    uint32_t cap = ex->capPieces == 0 ? 256 : ex->capPieces * 2;
+                    ExtractPiece *pieces = (ExtractPiece *) realloc(ex->pieces, cap * sizeof(ExtractPiece));
+                    if(pieces == NULL) return 0;
+                    ex->pieces = pieces;
+                    ex->capPieces = cap;
+                }
+                ex->pieces[ex->numPieces++] = piece;
+                piece.length = 0;
+            }
+            if(left == 0) break;
+
+            if(piece.length == 0){
+                piece.run = r;
+                piece.start = pos;
+                piece.offset = file->runs[r].offset + (pos - file->runs[r].logical);
+            }
+            uint64_t take = EXTRACT_PIECE_BYTES - piece.length;
+            if(take > left) take = left;
+            piece.length += take;
+            pos += take;
+            left -= take;
+        } while(1);
+    }
+    return 1;
+}
+
+/**
+ * Takes an entry of the walk (FilesVisitor): directories are made and files created on the host as they are found
+ * @return For directories, whether they could be made (1) to walk their contents, or not (0)
+ */
+static int visitEntry(void *ctx, const FilesEntry *entry){
+    Extraction *ex = (Extraction *) ctx;
+    if(entry->type == FILES_OTHER){
+        ex->skipped++;
+        return 1;
+    }
+
+    int made = entry->type == FILES_DIR ? addDir(ex, entry) : addFile(ex, entry);
+    if(!made) failEntry(ctx, entry->path);
+    return made;
+}
+
+/**
+ * Closes a directory once the walk is done with its contents (FilesVisitor)
+ */
+static void leaveDirectory(void *ctx, const FilesEntry *entry){
+    Extraction *ex = (Extraction *) ctx;
+    (void) entry;
+    close(ex->dirFds[--ex->numFds]);
+}
+
+/**
+ * Reports an entry that couldn't be extracted (FilesVisitor)
+ */
+static void failEntry(void *ctx, const char *path){
+    Extraction *ex = (Extraction *) ctx;
+    OUT_printf(ex->out, ERR_EXTRACT_FILE, path);
+    ex->failures++;
+}
+
+/**
+ * Copies a piece of a file from the image. The kernel copies it by itself when it can (copy_file_range, not
+ * on direct images); otherwise it's written from the mapping of the image, or read into the worker's buffer first.
+ * @param buffer : Buffer of the worker (allocated the first time it's needed)
+ * @return Whether the piece was copied (1) or not (0)
+ */
+static int copyPiece(Extraction *ex, const ExtractPiece *piece, unsigned char **buffer){
+    const ExtractFile *file = &(ex->files[piece->file]);
+    int fd = open(file->path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0) return 0;
+
+    int kernelCopy = !ex->img->direct;
+    uint64_t end = piece->start + piece->length;
+    for(uint32_t r = piece->run; r < file->count && file->runs[r].logical < end; r++){
+        const ImageRun *run = &(file->runs[r]);
+        uint64_t from = run->logical > piece->start ? run->logical : piece->start;
+        uint64_t to = run->logical + run->length < end ? run->logical + run->length : end;
+        loff_t in = (loff_t) (run->offset + (from - run->logical));
+        loff_t outPos = (loff_t) from;
+        uint64_t left = to - from;
+
+        while(left > 0 && kernelCopy){
+            ssize_t copied = copy_file_range(ex->img->fd, &in, fd, &outPos, left, 0);
+            if(copied < 0 && errno == EINTR) continue;
+            if(copied <= 0) kernelCopy = 0;
+            else left -= (uint64_t) copied;
+        }
+
+        while(left > 0){
+            size_t chunk = left > EXTRACT_BUFFER ? EXTRACT_BUFFER : (size_t) left;
+            const void *data;
+            if(ex->img->map != NULL){
+                if((uint64_t) in + chunk > ex->img->size) break;
+                data = ex->img->map + in;
+            }
+            else{
+                if(*buffer == NULL) *buffer = (unsigned char *) malloc(EXTRACT_BUFFER);
+                if(*buffer == NULL || IMAGE_read(ex->img, *buffer, chunk, (uint64_t) in) != chunk) break;
+                data = *buffer;
+            }
+
+            ssize_t written = pwrite(fd, data, chunk, outPos);
+            if(written < 0 && errno == EINTR) continue;
+            if(written <= 0) break;
+            in += written;
+            outPos += written;
+            left -= (uint64_t) written;
+        }
+
+        if(left > 0){
+            close(fd);
+            return 0;
+        }
+    }
+    return close(fd) == 0;
+}
+
+/**
+ * Orders pieces by where they are in the image (qsort)
+ */
+static int comparePieces(const void *a, const void *b){
+    uint64_t x = ((const ExtractPiece *) a)->offset, y = ((const ExtractPiece *) b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Worker of the copy: takes pieces until there are none left
+ * @param arg : The extraction
+ * @return NULL
+ */
+static void * copyWorker(void *arg){
+    Extraction *ex = (Extraction *) arg;
+    unsigned char *buffer = NULL;
+
+    unsigned int i;
+    while((i = atomic_fetch_add(&(ex->nextPiece), 1)) < ex->numPieces){
+        const ExtractPiece *piece = &(ex->pieces[i]);
+        if(!copyPiece(ex, piece, &buffer)) atomic_store(&(ex->files[piece->file].failed), 1);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Gives a file or directory of the host its modification time (the access time is set to the same)
+ */
+static void setTimes(const char *path, int64_t mtime){
+    if(mtime == 0) return;
+    struct timespec times[2];
+    times[0].tv_sec = (time_t) mtime;
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+    utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+}
+
+/**
+ * Recreates the whole directory hierarchy of a filesystem under a directory of the host.
+ * The hierarchy is walked first (directories are made and files created with their final size), then the
+ * contents are copied by a pool of workers, in pieces, straight from the image to the files. Unallocated parts
+ * of sparse files aren't written, so they stay holes. Permissions (EXT2) and modification times are kept.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2)
+ * @param destDir : Directory of the host where the filesystem is extracted (made if it doesn't exist)
+ * @param out : Output where the summary and the errors are printed
+ * @return Whether everything was extracted (1) or not (0)
+ */
+int EXTRACT_run(Image *img, Ext2 *ext2, Fat16 *fat16, const char *destDir, Output *out){
+    Extraction ex;
+    memset(&ex, 0, sizeof(Extraction));
+    ex.img = img;
+    ex.ext2 = ext2;
+    ex.fat16 = fat16;
+    ex.out = out;
+    atomic_init(&(ex.nextPiece), 0);
+
+    //Make the destination, and the directories leading to it (an existing destination keeps its permissions)
+    char path[PATH_MAX];
+    size_t destLen = strlen(destDir);
+    int destFd = -1;
+    while(destLen > 1 && destDir[destLen - 1] == '/') destLen--;
+    if(destLen < PATH_MAX){
+        memcpy(path, destDir, destLen);
+        path[destLen] = '\0';
+        for(size_t i = 1; i <= destLen; i++){
+            if(path[i] != '/' && path[i] != '\0') continue;
+            char end = path[i];
+            path[i] = '\0';
+            mkdir(path, 0755);
+            path[i] = end;
+        }
+        destFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if(destFd < 0 || !pushDir(&ex, destFd)){
+        OUT_printf(out, ERR_EXTRACT_DEST, destDir);
+        return 0;
+    }
+
+    //Walk the hierarchy: directories are made and files created as they are found, each one inside its parent
+    FilesVisitor visitor = {visitEntry, leaveDirectory, failEntry, &ex, 1};
+    FILES_walk(img, ext2, fat16, path, &visitor);
+    close(ex.dirFds[0]);
+    free(ex.dirFds);
+
+    //Copy the contents: the workers take the pieces in the order they are in the image, so it's read front to back
+    qsort(ex.pieces, ex.numPieces, sizeof(ExtractPiece), comparePieces);
+    int threads = WALK_threads();
+    if((uint32_t) threads > ex.numPieces) threads = ex.numPieces > 0 ? (int) ex.numPieces : 1;
+    pthread_t workers[WALK_MAX_THREADS];
+    int started = 0;
+    while(started < threads - 1 && pthread_create(&workers[started], NULL, copyWorker, &ex) == 0) started++;
+    copyWorker(&ex);
+    for(int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+    //Permissions & times go last: writing a file changes its time, and filling a directory changes its own
+    uint32_t copiedFiles = 0;
+    for(uint32_t i = 0; i < ex.numFiles; i++){
+        ExtractFile *file = &(ex.files[i]);
+        if(atomic_load(&(file->failed))){
+            OUT_printf(out, ERR_EXTRACT_FILE, file->path);
+            ex.failures++;
+        }
+        else copiedFiles++;
+        chmod(file->path, file->mode);
+        setTimes(file->path, file->mtime);
+        free(file->path);
+        free(file->runs);
+    }
+    //Deepest directories first (each one was added before its subdirectories)
+    for(uint32_t i = ex.numDirs; i-- > 0;){
+        chmod(ex.dirs[i].path, ex.dirs[i].mode);
+        setTimes(ex.dirs[i].path, ex.dirs[i].mtime);
+        free(ex.dirs[i].path);
+    }
+
+    OUT_printf(out, EXTRACT_SUMMARY, copiedFiles, ex.bytes, ex.numDirs, destDir);
+    if(ex.skipped > 0) OUT_printf(out, EXTRACT_SKIPPED, ex.skipped);
+    OUT_printf(out, "\n");
+
+    free(ex.files);
+    free(ex.dirs);
+    free(ex.pieces);
+    return ex.failures == 0;
+}
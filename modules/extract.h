@@ -0,0 +1,41 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "image.h"
+#include "output.h"
+#include "ext2.h"
+#include "fat16.h"
+#include "walk.h"
+
+// Files are copied in pieces of at most this many bytes, so big files are shared among the workers too
+#define EXTRACT_PIECE_BYTES (8 * 1024 * 1024)
+// Buffer of each worker, used when the kernel can't copy from the image to the file by itself
+#define EXTRACT_BUFFER (1024 * 1024)
+
+#define ERR_EXTRACT_DEST "Error. The directory %s could not be created.\n\n"
+#define ERR_EXTRACT_FILE "Error. %s could not be extracted.\n"
+#define EXTRACT_SUMMARY "Extracted %" PRIu32 " files (%" PRIu64 " bytes) and %" PRIu32 " directories to %s\n"
+#define EXTRACT_SKIPPED "Skipped %" PRIu32 " entries that are neither files nor directories\n"
+
+/**
+ * Recreates the whole directory hierarchy of a filesystem under a directory of the host.
+ * The hierarchy is walked first (directories are made and files created with their final size), then the
+ * contents are copied by a pool of workers, in pieces, straight from the image to the files. Unallocated parts
+ * of sparse files aren't written, so they stay holes. Permissions (EXT2) and modification times are kept.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2)
+ * @param destDir : Directory of the host where the filesystem is extracted (made if it doesn't exist)
+ * @param out : Output where the summary and the errors are printed
+ * @return Whether everything was extracted (1) or not (0)
+ */
+int EXTRACT_run(Image *img, Ext2 *ext2, Fat16 *fat16, const char *destDir, Output *out);
+
+#endif
@@ -1,26 +1,73 @@
+#define _GNU_SOURCE
 #include "fat16.h"
 #include "tree.h"
+#include "image.h"
+#include "walk.h"
+#include "output.h"
+#include <sys/stat.h>
 
-static int pierceTree(FILE *fp, Fat16 fat16, int blockNum, int catFile, char *fileName, struct TreeNode *parent);
+static int pierceTree(Image *img, Fat16 fat16, uint32_t cluster, int catFile, char *fileName, TreeVisitor *visitor, int level, Output *out);
 static void cleanString(char *string, int size);
-static Fat16 readInfo(FILE *f);
-static void printFileContent(FILE *f, Fat16 fat16, int dataSectorStart, FatDirectoryEntry entry);
+static TreeSizes entrySizes(Fat16 fat16, const FatDirectoryEntry *de);
+static Fat16 readInfo(Image *img);
+static void printFileContent(Image *img, Fat16 fat16, int dataSectorStart, FatDirectoryEntry entry, Output *out);
+static void expandDirectory(WalkPool *pool, int worker, void *ctx, uint64_t dir, struct TreeNode *node);
+static int lookup(Image *img, Fat16 fat16, uint32_t cluster, const char *name, size_t nameLen, FatDirectoryEntry *entry);
+static int resolvePath(Image *img, Fat16 fat16, const char *path, FatDirectoryEntry *entry);
+static void indexDirectory(Image *img, Fat16 fat16, uint32_t cluster, IndexWriter *writer, int level);
+static uint16_t * loadFat(Image *img, Fat16 fat16, uint32_t *numEntries);
+static int fileRuns(Image *img, Fat16 fat16, int dataSectorStart, const FatDirectoryEntry *entry, ImageRun **runs, uint32_t *count);
+static int addEntries(const FatDirectoryEntry *entries, size_t count, struct TreeNode *node,
+                      void (*subdir)(void *ctx, uint16_t cluster, struct TreeNode *child), void *ctx, int *failed);
+static void pushSubdir(void *ctx, uint16_t cluster, struct TreeNode *child);
+static int readDirectory(Image *img, Fat16 fat16, uint32_t cluster, FatDirectoryEntry **entries, size_t *count);
+static int asyncTree(Image *img, Fat16 fat16, struct TreeNode *root);
+static void asyncOpen(void *ctx, uint16_t cluster, struct TreeNode *node);
+static int openDirectory(Image *img, Fat16 fat16, uint32_t cluster, FatDirIterator *it);
+static int nextChunk(FatDirIterator *it, uint64_t *pos, size_t *len);
+static size_t readChunk(FatDirIterator *it);
+static const FatDirectoryEntry * nextEntry(FatDirIterator *it);
+
+typedef struct {
+    Image *img;
+    Fat16 fat16;
+} WalkContext;
+
+// Worker of the parallel walk that expands a directory
+typedef struct {
+    WalkPool *pool;
+    int worker;
+} PushContext;
+
+// Asynchronous tree walk: the queue where every directory reads its clusters
+typedef struct {
+    Image *img;
+    ImageQueue *queue;
+    Fat16 fat16;
+    int failed;                     // Set if a read couldn't be queued or an entry couldn't be added (no memory)
+} AsyncWalk;
+
+// A directory of the asynchronous tree walk, read a cluster at a time (where it ends is only known once it's found)
+typedef struct {
+    struct TreeNode *node;          // Tree node where its entries go
+    FatDirIterator it;              // Where its next cluster is, and the buffer the cluster being read goes to
+} AsyncDir;
 
 /**
- * This function is used to check if the filesystem is FAT16 or not
- * @param filepath : The path to the file
+ * This function is used to check if the filesystem is FAT16 or not (from the bytes probed when the image was opened)
+ * @param img : The opened image
  * @return Returns the value of 1 if it's FAT16, 0 otherwise
  */
-int FAT16_isFat16(char* filepath){
+int FAT16_isFat16(Image *img){
     //To check whether it's FAT16, we need to look into the file system itself.
     //If the number of clusters is equal or more than 4085, but less than 65525 it's FAT16
     //If number of clusters was less than 4085 it's FAT12, and if it's more than 65525 it's FAT32
 
     //Reading the FAT16 file information
-    FILE* f = fopen(filepath, "rb"); // Binary Reading mode
-    if(f == NULL) return 0;
+    Fat16 fat16 = readInfo(img);
 
-    Fat16 fat16 = readInfo(f);
+    //A zeroed boot sector would make the divisions below fail
+    if(fat16.BPB_bytsPerSec == 0 || fat16.BPB_secPerClus == 0) return 0;
 
     int32_t FatStartSector = fat16.BPB_rsvdSecCnt;
     int32_t FatSectors = fat16.BPB_FATSz16 * fat16.BPB_numFATs;
@@ -31,8 +78,6 @@ int FAT16_isFat16(char* filepath){
 
     int32_t countOfClusters = DataSectors / fat16.BPB_secPerClus;
 
-    fclose(f);
-
     //Like said, if the number of clusters is equal or more than 4085, but less than 65525 it's FAT16
     if(countOfClusters >= 4085 && countOfClusters < 65525) return 1;
     return 0;
@@ -40,83 +85,232 @@ int FAT16_isFat16(char* filepath){
 
 /**
  * This function is used to read the FAT16 file information
- * @param f : The file pointer
+ * @param img : The image holding the filesystem
  * @return Returns the Fat16 structure
  */
-static Fat16 readInfo(FILE *f){
+static Fat16 readInfo(Image *img){
     //Reading the FAT16 file information
     Fat16 fat16;
+    memset(&fat16, 0, sizeof(Fat16));
+
+    //The boot sector was read when the image was opened: pick each field from it
+    if(img->probeLen < FAT16_BOOT_SECTOR_SIZE) return fat16;
+    const unsigned char *bs = img->probe;
 
-    fseek(f, 3, SEEK_SET);
-    fread(&(fat16.BS_oemName), sizeof(char) * 8, 1, f);
-    fseek(f, 11, SEEK_SET);
-    fread(&(fat16.BPB_bytsPerSec), sizeof(uint16_t), 1, f);
-    fseek(f, 13, SEEK_SET);
-    fread(&(fat16.BPB_secPerClus), sizeof(uint8_t), 1, f);
-    fseek(f, 22, SEEK_SET);
-    fread(&(fat16.BPB_FATSz16), sizeof(uint16_t), 1, f);
-    fseek(f, 14, SEEK_SET);
-    fread(&(fat16.BPB_rsvdSecCnt), sizeof(uint16_t), 1, f);
-    fseek(f, 16, SEEK_SET);
-    fread(&(fat16.BPB_numFATs), sizeof(uint8_t), 1, f);
-    fseek(f, 17, SEEK_SET);
-    fread(&(fat16.BPB_rootEntCnt), sizeof(uint16_t), 1, f);
-    fseek(f, 19, SEEK_SET);
-    fread(&(fat16.BPB_totSec16), sizeof(uint16_t), 1, f);
-    fseek(f, 43, SEEK_SET);
-    fread(&(fat16.BS_volLab), sizeof(char) * 11, 1, f);
+    memcpy(&(fat16.BS_oemName), bs + 3, sizeof(char) * 8);
+    memcpy(&(fat16.BPB_bytsPerSec), bs + 11, sizeof(uint16_t));
+    memcpy(&(fat16.BPB_secPerClus), bs + 13, sizeof(uint8_t));
+    memcpy(&(fat16.BPB_FATSz16), bs + 22, sizeof(uint16_t));
+    memcpy(&(fat16.BPB_rsvdSecCnt), bs + 14, sizeof(uint16_t));
+    memcpy(&(fat16.BPB_numFATs), bs + 16, sizeof(uint8_t));
+    memcpy(&(fat16.BPB_rootEntCnt), bs + 17, sizeof(uint16_t));
+    memcpy(&(fat16.BPB_totSec16), bs + 19, sizeof(uint16_t));
+    memcpy(&(fat16.BS_volLab), bs + 43, sizeof(char) * 11);
     fat16.BS_volLab[10] = '\0';
 
-    if(fat16.BPB_totSec16 == 0){
-        fseek(f, 32, SEEK_SET);
-        fread(&(fat16.BPB_totSec16), sizeof(uint32_t), 1, f);
-    }
+    if(fat16.BPB_totSec16 == 0)
+        memcpy(&(fat16.BPB_totSec16), bs + 32, sizeof(uint32_t));
 
     return fat16;
 }
 
-void FAT16_printInfo(char* filepath){
-    FILE *f = fopen(filepath, "rb"); // Binary Reading mode
-    if(f == NULL){
-        printf("Error while opening the file %s\n", filepath);
-        return;
-    }
+/**
+ * This function is used to mount a FAT16 filesystem: reads its boot sector and loads its first FAT.
+ * A mounted filesystem is only read afterwards, so several commands (and threads) can share it.
+ * @param img : The opened image
+ * @param fat16 : Output, the mounted filesystem
+ * @return Whether the filesystem could be mounted (1) or not (0)
+ */
+int FAT16_mount(Image *img, Fat16 *fat16){
+    *fat16 = readInfo(img);
+
+    // If the FAT can't be read now, files are still tried (reading it again) when they're printed
+    fat16->fat = loadFat(img, *fat16, &(fat16->fatEntries));
+    return 1;
+}
 
-    Fat16 fat16 = readInfo(f);
+/**
+ * This function is used to free what was loaded when the filesystem was mounted
+ * @param fat16 : The mounted filesystem
+ */
+void FAT16_unmount(Fat16 *fat16){
+    free(fat16->fat);
+    fat16->fat = NULL;
+    fat16->fatEntries = 0;
+}
 
-    printf(FAT16_PRINT_INFO, fat16.BS_oemName, fat16.BPB_bytsPerSec, fat16.BPB_secPerClus,
-           fat16.BPB_rsvdSecCnt, fat16.BPB_numFATs, fat16.BPB_rootEntCnt, fat16.BPB_FATSz16,
-           fat16.BS_volLab);
+/**
+ * This function is used to print the information of a FAT16 filesystem
+ * @param img : The opened image
+ * @param fat16 : The mounted filesystem
+ * @param out : Output where the information is printed
+ */
+void FAT16_printInfo(Image *img, Fat16 *fat16, Output *out){
+    (void) img;
+    OUT_printf(out, FAT16_PRINT_INFO, fat16->BS_oemName, fat16->BPB_bytsPerSec, fat16->BPB_secPerClus,
+           fat16->BPB_rsvdSecCnt, fat16->BPB_numFATs, fat16->BPB_rootEntCnt, fat16->BPB_FATSz16,
+           fat16->BS_volLab);
 }
 
-void FAT16_printTree(char* fspath){
-    FILE *f = fopen(fspath, "rb"); // Binary Reading mode
-    if(f == NULL){
-        printf("Error while opening the file %s\n", fspath);
-        return;
+/**
+ * This function is used to print how many clusters of a FAT16 filesystem are in use, free or bad, counted from
+ * the FAT loaded when it was mounted. The other copies of the FAT are checked against it, as is its size
+ * against the number of clusters of the boot sector (FAT16 keeps no free counters of its own).
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param out : Output where the report is printed
+ * @return Whether the FATs agree with each other and with the boot sector (1) or not (0)
+ */
+int FAT16_printUsage(Image *img, Fat16 *mounted, Output *out){
+    if(mounted->fat == NULL || mounted->BPB_secPerClus == 0 || mounted->BPB_bytsPerSec == 0){
+        OUT_printf(out, FAT16_USAGE_UNREADABLE);
+        return 0;
+    }
+
+    //Clusters of the data region, from the boot sector
+    uint64_t rootSectors = ((uint64_t) mounted->BPB_rootEntCnt * 32 + mounted->BPB_bytsPerSec - 1) / mounted->BPB_bytsPerSec;
+    uint64_t dataStart = mounted->BPB_rsvdSecCnt + (uint64_t) mounted->BPB_numFATs * mounted->BPB_FATSz16 + rootSectors;
+    uint64_t clusters = mounted->BPB_totSec16 > dataStart ? (mounted->BPB_totSec16 - dataStart) / mounted->BPB_secPerClus : 0;
+
+    //The first two entries don't stand for clusters
+    uint64_t inFat = mounted->fatEntries > FAT16_FIRST_CLUSTER ? mounted->fatEntries - FAT16_FIRST_CLUSTER : 0;
+    uint64_t counted = clusters < inFat ? clusters : inFat;
+    UsageFatCounts counts;
+    USAGE_countFat(mounted->fat + FAT16_FIRST_CLUSTER, counted, &counts);
+    uint64_t used = counted - counts.free - counts.bad;
+
+    OUT_printf(out, USAGE_PRINT);
+    OUT_printf(out, "Filesystem: FAT16\nCluster size: %d\n\n", mounted->BPB_secPerClus * mounted->BPB_bytsPerSec);
+    OUT_printf(out, USAGE_PRINT_LINE, "Clusters", used, counts.free, counted,
+               counted > 0 ? 100.0 * (double) used / (double) counted : 0.0);
+    OUT_printf(out, "Bad clusters: %" PRIu64 "\n\n", counts.bad);
+
+    int agree = 1;
+    if(inFat < clusters){
+        OUT_printf(out, FAT16_USAGE_SIZE_MISMATCH, inFat, clusters);
+        agree = 0;
     }
 
-    // Read the FAT16 info
-    Fat16 fat16 = readInfo(f);
+    //Every copy of the FAT should hold the same entries
+    size_t fatBytes = (size_t) mounted->fatEntries * sizeof(uint16_t);
+    uint16_t *copy = (uint16_t *) malloc(fatBytes);
+    for(int k = 1; copy != NULL && k < mounted->BPB_numFATs; k++){
+        uint64_t offset = ((uint64_t) mounted->BPB_rsvdSecCnt + (uint64_t) k * mounted->BPB_FATSz16) * mounted->BPB_bytsPerSec;
+        uint64_t differ = 0;
+        size_t got = IMAGE_read(img, copy, fatBytes, offset) / sizeof(uint16_t);
+        for(size_t i = 0; i < mounted->fatEntries; i++) differ += i >= got || copy[i] != mounted->fat[i];
+        if(differ > 0){
+            OUT_printf(out, FAT16_USAGE_COPY_MISMATCH, k + 1, differ);
+            agree = 0;
+        }
+    }
+    free(copy);
+
+    OUT_printf(out, agree ? USAGE_PRINT_OK : "\n");
+    return agree;
+}
+
+/**
+ * This function is used to print the tree of a FAT16 filesystem
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param walk : How to walk the filesystem (TREE_WALK_*)
+ * @param out : Output where the tree is printed
+ * @return Whether the whole tree was printed (1) or not (0, memory ran out)
+ */
+int FAT16_printTree(Image *img, Fat16 *mounted, int walk, Output *out){
+    Fat16 fat16 = *mounted;
     struct TreeNode rootNode;
-    rootNode.name = NULL;
-    rootNode.numChilds = 0;
 
-    // Pierce the tree in order to construct the tree
-    pierceTree(f, fat16, 2, 0, NULL, &rootNode);
+    // With a single CPU, or when asked to, the entries are printed as the walk finds them (constant memory)
+    int threads = WALK_threads();
+    int printed = 1;
+    if(walk == TREE_WALK_STREAM || (walk == TREE_WALK_PARALLEL && threads == 1)){
+        TreeVisitor visitor = TREE_streamVisitor(out);
+        TREE_streamBegin(out);
+        pierceTree(img, fat16, 0, 0, NULL, &visitor, 1, out);
+        TREE_streamEnd(out);
+    }
+    // Otherwise, construct the tree (with a thread per CPU, or with many reads in flight), and print it once it's complete
+    else if(TREE_init(&rootNode)){
+        int walked = 1;
+        // Without a queue of reads (or memory for them), the asynchronous walk falls back to the parallel one
+        if(walk != TREE_WALK_ASYNC || !asyncTree(img, fat16, &rootNode)){
+            WalkContext ctx = {img, fat16};
+            walked = WALK_run(threads, expandDirectory, &ctx, 0, &rootNode);
+        }
+
+        // Print & free the tree (a part of it would look like the whole one)
+        if(walked) TREE_print(&rootNode, out);
+        else OUT_printf(out, "Error while walking the tree\n");
+        TREE_free(&rootNode);
+        printed = walked;
+    }
+    else{
+        OUT_printf(out, "Error while allocating the tree\n");
+        printed = 0;
+    }
+    return printed;
+}
+
+/**
+ * This function is used to walk a directory of a FAT16 filesystem, and everything below it, with a visitor. The
+ * directory itself is given first, at level 0 (with the path as its name), and left last.
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param path : The path of the directory (from the root directory)
+ * @param visitor : The visitor (when it asks for sizes, they are the file sizes & the bytes of the clusters
+ *                  of their chains)
+ * @return Whether the directory could be walked (1) or not (0, it doesn't exist or isn't a directory)
+ */
+int FAT16_visitTree(Image *img, Fat16 *mounted, const char *path, TreeVisitor *visitor){
+    Fat16 fat16 = *mounted;
+    FatDirectoryEntry de;
+    if(!FAT16_resolve(img, mounted, path, &de) || !(de.fileAttr & FAT16_ATTR_DIRECTORY)) return 0;
+
+    // The root directory has no chain: it's the fixed region after the FATs
+    TreeSizes sizes = entrySizes(fat16, &de);
+    if(de.firstCluster == 0) sizes.size = sizes.allocated = (uint64_t) fat16.BPB_rootEntCnt * sizeof(FatDirectoryEntry);
+
+    visitor->visit(visitor->ctx, 0, path, 1, visitor->sizes ? &sizes : NULL);
+    pierceTree(img, fat16, de.firstCluster, 0, NULL, visitor, 1, NULL);
+    if(visitor->leave != NULL) visitor->leave(visitor->ctx, 0);
+    return 1;
+}
+
+/**
+ * This function is used to get the size of a directory entry, and the bytes of the clusters of its chain
+ * (directories have no size of their own in the entry: they get the bytes of their clusters)
+ * @param fat16 : The FAT16 structure (without a loaded FAT, the clusters are counted from the size)
+ * @param de : The directory entry
+ * @return The sizes
+ */
+static TreeSizes entrySizes(Fat16 fat16, const FatDirectoryEntry *de){
+    uint64_t clusterSize = (uint64_t) fat16.BPB_secPerClus * fat16.BPB_bytsPerSec;
+    TreeSizes sizes = {de->fSize, 0};
 
-    // Print & free the tree
-    TREE_print(&rootNode);
-    TREE_free(&rootNode);
+    if(fat16.fat == NULL) sizes.allocated = (sizes.size + clusterSize - 1) / clusterSize * clusterSize;
+    else{
+        //Follow the chain (at most once around the FAT, in case it loops)
+        uint32_t cluster = de->firstCluster;
+        uint32_t visited = 0;
+        while(cluster >= FAT16_FIRST_CLUSTER && cluster < fat16.fatEntries && cluster < FAT16_BAD_CLUSTER
+              && visited < fat16.fatEntries){
+            visited++;
+            cluster = fat16.fat[cluster];
+        }
+        sizes.allocated = (uint64_t) visited * clusterSize;
+    }
 
-    fclose(f);
+    if(de->fileAttr & FAT16_ATTR_DIRECTORY) sizes.size = sizes.allocated;
+    return sizes;
 }
 
 static void cleanString(char *string, int size) {
     int j = 0;
 
     // Iterate through the string
-    for(int i = 0; i <= size; i++){
+    for(int i = 0; i < size; i++){
         // If it's a space, exit the loop and add the null terminator
         if(string[i] != ' '){
             // If it's a capital letter, make it lower case
@@ -135,134 +329,784 @@ static void cleanString(char *string, int size) {
 }
 
 /**
- * Pierce the FAT16 tree recursively. It can have two behaviors:
- *  1. If catFile is 1, it will cat the file fileName if found and return 1 if successful, 0 otherwise
- *  2. If catFile is 0, it will construct the tree recursively, from the parent node. Return value will always be 0
- * @param fp : The file pointer
+ * This function is used to get the byte offset of the data region (where cluster 2 starts)
  * @param fat16 : The FAT16 structure
- * @param blockNum : The block number
- * @param catFile : Whether to cat the file (1) or not (0)
- * @param parent : The parent node to construct the tree (recursive call)
- * @return Whether the cat was successful (1) or not (0)
+ * @return Byte offset of the data region
  */
-static int pierceTree(FILE *fp, Fat16 fat16, int blockNum, int catFile, char *fileName, struct TreeNode *parent){
-
-    // The root directory has a size of 32 bytes per entry
-    // So, the root region starts at the first sector after the reserved sectors
-    // Multiplying by 32 we get the number of bytes that the root region occupies
-    int rootRegion = fat16.BPB_rootEntCnt * 32;
-
-    // Calculate the root region start -> After the reserved area and the 2 FATs
-    // The root directory region starts at the first sector after the reserved sectors & FAT tables
-    int rootRegionStart = (fat16.BPB_rsvdSecCnt + (fat16.BPB_numFATs * fat16.BPB_FATSz16))
-            * fat16.BPB_bytsPerSec;
-
-    // The data area region starts at the first sector after the root region
-    int dataAreaRegionEntry = ((blockNum - 2) * fat16.BPB_secPerClus * fat16.BPB_bytsPerSec)
-                                   + rootRegionStart;
-
-    //If we're not in the root directory, we have to add the root region size
-    //If blockNum == 2, we're in the directly followed address from the root directory,
-    // so we don't have to add it because it's already added in the dataAreaRegionEntry
-    //If blockNum != 2, we're in a different directory, so we have to add the root region size
-    if(blockNum != 2) dataAreaRegionEntry += rootRegion;
+static int dataRegionOffset(Fat16 fat16){
+    // The data region starts after the reserved sectors, the FATs and the root directory (32 bytes per entry)
+    return (fat16.BPB_rsvdSecCnt + (fat16.BPB_numFATs * fat16.BPB_FATSz16)) * fat16.BPB_bytsPerSec
+           + fat16.BPB_rootEntCnt * 32;
+}
 
-    //Position cursor at the desired region
-    fseek(fp, dataAreaRegionEntry, SEEK_SET);
+/**
+ * This function is used to get the printable name of a directory entry
+ * @param de : The directory entry
+ * @param name : Output, the cleaned 8-character name (at least 9 bytes)
+ * @param strCopy : Output, the name with its extension, as shown to the user (at least 13 bytes)
+ */
+static void entryName(const FatDirectoryEntry *de, char *name, char *strCopy){
+    char extension[4];
 
-    FatDirectoryEntry de;
-    char strCopy[12];
-    int lastCluster = -1;
+    //Clean the strings (remove spaces and convert to lowercase)
+    memcpy(name, de->long_name, 8);
+    memcpy(extension, de->extension, 3);
+    cleanString(name, 8);
+    cleanString(extension, 3);
 
-    for(int i = 0; 1; i++) {
-        fread(&de, sizeof(FatDirectoryEntry), 1, fp);
+    memset(strCopy, 0, 13);
+    //Move the name to a temporary string (ending with \0)
+    int j;
+    for(j = 0; j < 8 && name[j] != '~' && name[j] != '\0'; j++)
+        strCopy[j] = name[j];
 
-        if (de.long_name[0] == '\0') break;
+    //If we have an extension
+    if(extension[0] != '\0' && (extension[0] < '1' || extension[0] > '9')){
+        strCopy[j++] = '.';
+        for(int k = 0; k < 3; k++)
+            strCopy[j + k] = extension[k];
+    }
+}
 
-        //Clean the strings (remove spaces and convert to lowercase)
-        cleanString(de.long_name, 8);
-        cleanString(de.extension, 3);
+/**
+ * Pierce the FAT16 tree recursively. It can have two behaviors:
+ *  1. If catFile is 1, it will cat the file fileName if found and return 1 if successful, 0 otherwise
+ *  2. If catFile is 0, it will give every entry to the visitor, depth first. Return value will always be 0
+ * @param img : The image holding the filesystem
+ * @param fat16 : The FAT16 structure
+ * @param cluster : First cluster of the directory (0 for the root directory)
+ * @param catFile : Whether to cat the file (1) or not (0)
+ * @param visitor : The visitor that receives the entries when catFile is 0
+ * @param level : Level of the entries of this directory (1 for the root directory)
+ * @param out : Output where the file is printed when catFile is 1
+ * @return Whether the cat was successful (1) or not (0)
+ */
+static int pierceTree(Image *img, Fat16 fat16, uint32_t cluster, int catFile, char *fileName, TreeVisitor *visitor, int level, Output *out){
 
-        memset(strCopy, 0, 12);
-        //Move de.long_name to a temporary string (ending with \0)
-        int j;
-        for(j = 0; j < 8 && de.long_name[j] != '~' && de.long_name[j] != '\0'; j++)
-            strCopy[j] = de.long_name[j];
+    int dataSectorStart = dataRegionOffset(fat16);
+    FatDirectoryEntry *entries;
+    size_t count;
+    if(!readDirectory(img, fat16, cluster, &entries, &count)) return 0;
 
-        //If we have an extension
-        if(de.extension[0] != '\0' && (de.extension[0] < '1' || de.extension[0] > '9')){
-            strCopy[j++] = '.';
-            for(int k = 0; k < 3; k++)
-                strCopy[j + k] = de.extension[k];
-        }
+    char name[9];
+    char strCopy[13];
+    int found = 0;
 
-        if(de.firstCluster != 0 && lastCluster == de.firstCluster) continue;
-        lastCluster = de.firstCluster;
+    for(size_t i = 0; !found && i < count; i++) {
+        FatDirectoryEntry de = entries[i];
+        if((unsigned char) de.long_name[0] == FAT16_DELETED_ENTRY) continue;
+        entryName(&de, name, strCopy);
 
         // Directory: File Attribute = 16
         // File: File Attribute = 32
         //If we have a directory (and it is not . or ..), we have to go inside
-        if (de.fileAttr == 16 && strcmp(de.long_name, ".") != 0 && strcmp(de.long_name, "..") != 0) {
+        //(a directory pointing at no cluster would be the root directory again)
+        if (de.fileAttr == 16 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
             if(catFile == 0){
-                struct TreeNode *newNode = TREE_addChild(parent, strCopy);
-                pierceTree(fp, fat16, de.firstCluster, 0, NULL, newNode);
+                TreeSizes sizes = entrySizes(fat16, &de);
+                visitor->visit(visitor->ctx, level, strCopy, 1, visitor->sizes ? &sizes : NULL);
+                if(de.firstCluster >= FAT16_FIRST_CLUSTER)
+                    pierceTree(img, fat16, de.firstCluster, 0, NULL, visitor, level + 1, out);
+                if(visitor->leave != NULL) visitor->leave(visitor->ctx, level);
             }
-            else{ //catFile == 1, search for the file in the directory
-                //If we found the file, return 1 immediately
-                if(pierceTree(fp, fat16, de.firstCluster, 1, fileName, NULL))
-                    return 1;
+            else if(de.firstCluster >= FAT16_FIRST_CLUSTER){ //catFile == 1, search for the file in the directory
+                //If we found the file, stop here
+                found = pierceTree(img, fat16, de.firstCluster, 1, fileName, NULL, 0, out);
             }
-
-            fseek(fp, dataAreaRegionEntry + (i * sizeof(FatDirectoryEntry)), SEEK_SET);
         }
         else if(de.fileAttr == 32){ //If we have a file
             if(catFile == 1 && strcmp(strCopy, fileName) == 0){ //If we found the file
-                printFileContent(fp, fat16, rootRegionStart + rootRegion, de);
-                return 1;
+                printFileContent(img, fat16, dataSectorStart, de, out);
+                found = 1;
             }
-            else if(catFile == 0){ //If we're constructing the tree
-                TREE_addChild(parent, strCopy);
+            else if(catFile == 0){ //If we're visiting the tree
+                TreeSizes sizes = entrySizes(fat16, &de);
+                visitor->visit(visitor->ctx, level, strCopy, 0, visitor->sizes ? &sizes : NULL);
             }
         }
     }
 
+    free(entries);
+    return found;
+}
+
+/**
+ * Expands a directory for the parallel tree walk: adds its files and subdirectories to node, in directory
+ * order, and pushes the subdirectories to the walk once the whole directory is read (and their clusters
+ * hinted, see readDirectory). It only reads with IMAGE_read, which is safe to call from several threads.
+ * @param pool : The pool running the walk
+ * @param worker : Index of the worker running the function
+ * @param ctx : The WalkContext
+ * @param dir : First cluster of the directory (0 for the root directory)
+ * @param node : Tree node of the directory
+ */
+static void expandDirectory(WalkPool *pool, int worker, void *ctx, uint64_t dir, struct TreeNode *node){
+    WalkContext *walk = (WalkContext *) ctx;
+    FatDirectoryEntry *entries;
+    size_t count;
+    if(!readDirectory(walk->img, walk->fat16, (uint32_t) dir, &entries, &count)){
+        WALK_fail(pool);
+        return;
+    }
+
+    PushContext push = {pool, worker};
+    int failed = 0;
+    addEntries(entries, count, node, pushSubdir, &push, &failed);
+    free(entries);
+    if(failed) WALK_fail(pool);
+}
+
+/**
+ * Adds the files and subdirectories of a chunk of directory entries to a tree node, in directory order
+ * @param entries : The entries
+ * @param count : Number of entries
+ * @param node : Tree node of the directory
+ * @param subdir : Function called with every subdirectory added, to have it expanded
+ * @param ctx : Context passed to subdir
+ * @param failed : Output, set to 1 if an entry couldn't be added (no memory), left as it is otherwise
+ * @return Whether the end of the directory was found (1) or it goes on in the next chunk (0)
+ */
+static int addEntries(const FatDirectoryEntry *entries, size_t count, struct TreeNode *node,
+                      void (*subdir)(void *ctx, uint16_t cluster, struct TreeNode *child), void *ctx, int *failed){
+    char name[9];
+    char strCopy[13];
+
+    if(count == 0) return 1;
+    for(size_t i = 0; i < count; i++){
+        const FatDirectoryEntry *de = &entries[i];
+        if(de->long_name[0] == '\0') return 1;
+        if((unsigned char) de->long_name[0] == FAT16_DELETED_ENTRY) continue;
+
+        entryName(de, name, strCopy);
+        if(de->fileAttr == 16 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0){
+            //A directory pointing at no cluster would be the root directory again
+            struct TreeNode *child = TREE_addChild(node, strCopy);
+            if(child == NULL) *failed = 1;
+            else if(de->firstCluster >= FAT16_FIRST_CLUSTER) subdir(ctx, de->firstCluster, child);
+        }
+        else if(de->fileAttr == 32 && TREE_addChild(node, strCopy) == NULL)
+            *failed = 1;
+    }
     return 0;
 }
 
+/**
+ * Pushes a subdirectory to the parallel walk
+ * @param ctx : The PushContext of the worker
+ * @param cluster : First cluster of the subdirectory
+ * @param child : Tree node of the subdirectory
+ */
+static void pushSubdir(void *ctx, uint16_t cluster, struct TreeNode *child){
+    PushContext *push = (PushContext *) ctx;
+    WALK_push(push->pool, push->worker, cluster, child);
+}
+
+/**
+ * Reads every entry of a directory (up to its end mark) with a single pass over its clusters. On big images, the
+ * kernel is then hinted about the first cluster of each subdirectory (see IMAGE_planIssue), before the caller goes
+ * into any of them.
+ * @param img : The image holding the filesystem
+ * @param fat16 : The FAT16 structure
+ * @param cluster : First cluster of the directory (0 for the root directory)
+ * @param entries : Output, the entries (freed by the caller)
+ * @param count : Output, number of entries
+ * @return Whether the directory could be read (1) or not (0, out of memory)
+ */
+static int readDirectory(Image *img, Fat16 fat16, uint32_t cluster, FatDirectoryEntry **entries, size_t *count){
+    *entries = NULL;
+    *count = 0;
+    FatDirIterator it;
+    if(!openDirectory(img, fat16, cluster, &it)){
+        FAT16_closeDir(&it);
+        return 0;
+    }
+
+    ImagePlan plan;
+    IMAGE_planInit(&plan, img);
+    size_t capacity = 0;
+    int ok = 1;
+    const FatDirectoryEntry *de;
+    while(ok && (de = nextEntry(&it)) != NULL){
+        if(*count == capacity){
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            FatDirectoryEntry *bigger = (FatDirectoryEntry *) realloc(*entries, capacity * sizeof(FatDirectoryEntry));
+            if(bigger == NULL){
+                ok = 0;
+                break;
+            }
+            *entries = bigger;
+        }
+        (*entries)[(*count)++] = *de;
+
+        //Subdirectories, but not the . and .. entries (nor deleted ones)
+        if(plan.enabled && de->fileAttr == 16 && de->long_name[0] != '.'
+           && (unsigned char) de->long_name[0] != FAT16_DELETED_ENTRY && de->firstCluster >= FAT16_FIRST_CLUSTER)
+            IMAGE_planAdd(&plan, it.dataStart + (uint64_t) (de->firstCluster - FAT16_FIRST_CLUSTER) * it.chunkSize, it.chunkSize);
+    }
+    FAT16_closeDir(&it);
+
+    if(ok) IMAGE_planIssue(&plan);
+    IMAGE_planFree(&plan);
+    if(!ok){
+        free(*entries);
+        *entries = NULL;
+        *count = 0;
+    }
+    return ok;
+}
+
+/**
+ * Builds the tree of the filesystem from a single thread, keeping many reads in flight (IMAGE_QUEUE_DEPTH)
+ * instead of reading one cluster at a time. It's an event loop: every directory asks for its next cluster
+ * when the previous one arrives, and the subdirectories found in it start asking for their own.
+ * @param img : The image holding the filesystem
+ * @param fat16 : The FAT16 structure
+ * @param root : Tree node of the root directory
+ * @return Whether the tree could be built (1) or not (0, the queue couldn't be prepared or memory ran out during
+ *         the walk: the tree is left empty)
+ */
+static int asyncTree(Image *img, Fat16 fat16, struct TreeNode *root){
+    ImageQueue queue;
+    if(!IMAGE_queueInit(&queue, img, IMAGE_QUEUE_DEPTH)) return 0;
+    AsyncWalk walk = {img, &queue, fat16, 0};
+
+    asyncOpen(&walk, 0, root);
+    ImageCompletion done;
+    while(IMAGE_queueWait(&queue, &done)){
+        AsyncDir *dir = (AsyncDir *) (uintptr_t) done.tag;
+        size_t count = done.len / sizeof(FatDirectoryEntry);
+
+        //Ask for the next cluster of the chain, unless the directory ended in this one
+        uint64_t pos;
+        size_t len;
+        if(!addEntries(dir->it.entries, count, dir->node, asyncOpen, &walk, &(walk.failed)) && nextChunk(&(dir->it), &pos, &len)){
+            if(IMAGE_queueRead(&queue, dir->it.entries, len, pos, (uint64_t) (uintptr_t) dir)) continue;
+            walk.failed = 1;
+        }
+        FAT16_closeDir(&(dir->it));
+        free(dir);
+    }
+    IMAGE_queueClose(&queue);
+
+    //A directory left out would go unnoticed: the other walk starts over (the nodes stay in the arena until TREE_free)
+    if(walk.failed){
+        root->firstChild = root->lastChild = NULL;
+        root->numChilds = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Starts reading a directory for the asynchronous tree walk, by asking for its first cluster
+ * @param ctx : The AsyncWalk
+ * @param cluster : First cluster of the directory (0 for the root directory)
+ * @param node : Tree node of the directory
+ */
+static void asyncOpen(void *ctx, uint16_t cluster, struct TreeNode *node){
+    AsyncWalk *walk = (AsyncWalk *) ctx;
+    AsyncDir *dir = (AsyncDir *) malloc(sizeof(AsyncDir));
+    if(dir == NULL){
+        walk->failed = 1;
+        return;
+    }
+    dir->node = node;
+
+    //A directory without clusters is just empty; no memory for its buffer or its read fails the walk
+    uint64_t pos;
+    size_t len;
+    int opened = openDirectory(walk->img, walk->fat16, cluster, &(dir->it));
+    if(opened && nextChunk(&(dir->it), &pos, &len)){
+        if(IMAGE_queueRead(walk->queue, dir->it.entries, len, pos, (uint64_t) (uintptr_t) dir)) return;
+        walk->failed = 1;
+    }
+    else if(!opened) walk->failed = 1;
+    FAT16_closeDir(&(dir->it));
+    free(dir);
+}
+
 /**
  * This function is used to cat a file from a FAT16 filesystem
- * @param fspath : The path to the FAT16 filesystem
- * @param filename : The name of the file to cat
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param filename : The path or the name of the file to cat
+ * @param index : Index of the image to find the file in (NULL to search the filesystem)
+ * @param out : Output where the file is printed
+ * @return Whether the file was found (1) or not (0)
  */
-void FAT16_catFile(char* fspath, char* filename){
-    FILE *f = fopen(fspath, "rb"); // Binary Reading mode
-    if(f == NULL){
-        printf("Error while opening the file %s\n", fspath);
+int FAT16_catFile(Image *img, Fat16 *mounted, char* filename, Index *index, Output *out){
+    Fat16 fat16 = *mounted;
+
+    int found = 0;
+    if(index != NULL){
+        // The index gives the first cluster and the size of the file straight away
+        const IndexEntry *entry = INDEX_find(index, filename);
+        if(entry != NULL && entry->type == INDEX_FILE){
+            FatDirectoryEntry de;
+            memset(&de, 0, sizeof(FatDirectoryEntry));
+            de.firstCluster = (uint16_t) entry->location;
+            de.fSize = (uint32_t) entry->size;
+            printFileContent(img, fat16, dataRegionOffset(fat16), de, out);
+            found = 1;
+        }
+    }
+    else if(strchr(filename, '/') != NULL){
+        // A path: resolve it one component at a time, reading only the directories on it
+        FatDirectoryEntry de;
+        if(resolvePath(img, fat16, filename, &de) && !(de.fileAttr & FAT16_ATTR_DIRECTORY)){
+            printFileContent(img, fat16, dataRegionOffset(fat16), de, out);
+            found = 1;
+        }
+    }
+    else{
+        // A bare name: pierce the tree in cat file mode (whenever we find the file, we print it)
+        found = pierceTree(img, fat16, 0, 1, filename, NULL, 0, out);
+    }
+    if(!found) OUT_printf(out, "File not found\n\n");
+    return found;
+}
+
+/**
+ * This function is used to print the metadata of a file or directory, given its path
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param path : The path of the file or directory (from the root directory)
+ * @param out : Output where the metadata is printed
+ * @return Whether the file or directory was found (1) or not (0)
+ */
+int FAT16_statFile(Image *img, Fat16 *mounted, char *path, Output *out){
+    FatDirectoryEntry de;
+    if(!FAT16_resolve(img, mounted, path, &de)){
+        OUT_printf(out, "File not found\n\n");
+        return 0;
+    }
+
+    // Modification date & time, as packed in the entry (years from 1980, seconds halved)
+    OUT_printf(out, FAT16_PRINT_STAT, path, (de.fileAttr & FAT16_ATTR_DIRECTORY) ? "directory" : "file",
+               de.fSize, de.firstCluster, de.fileAttr,
+               1980 + (de.dChange >> 9), (de.dChange >> 5) & 0xF, de.dChange & 0x1F,
+               de.tChange >> 11, (de.tChange >> 5) & 0x3F, (de.tChange & 0x1F) * 2);
+    return 1;
+}
+
+/**
+ * This function is used to resolve an absolute path (e.g. /docs/inner/d.txt) from the root directory
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param path : The path to resolve (names are compared ignoring case)
+ * @param entry : Output, the directory entry the path leads to. The root directory ("/") gets an entry of
+ *                its own: a directory with cluster 0, as the .. entries pointing to it have.
+ * @return Whether the path exists (1) or not (0)
+ */
+int FAT16_resolve(Image *img, Fat16 *mounted, const char *path, FatDirectoryEntry *entry){
+    if(path[strspn(path, "/")] == '\0'){
+        memset(entry, 0, sizeof(FatDirectoryEntry));
+        entry->fileAttr = FAT16_ATTR_DIRECTORY;
+        return 1;
+    }
+    return resolvePath(img, *mounted, path, entry);
+}
+
+/**
+ * This function is used to open a directory to go through its entries (see FAT16_readDir)
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param cluster : First cluster of the directory (0 for the root directory)
+ * @param it : Output, the iterator (closed with FAT16_closeDir)
+ * @return Whether the directory could be opened (1) or not (0)
+ */
+int FAT16_openDir(Image *img, Fat16 *mounted, uint16_t cluster, FatDirIterator *it){
+    return openDirectory(img, *mounted, cluster, it);
+}
+
+/**
+ * This function is used to get the next entry of a directory. Deleted entries, long name entries, the
+ * volume label and the . and .. entries are skipped. The directory is read a cluster at a time, following
+ * its cluster chain.
+ * @param it : The iterator
+ * @param name : Output, the name of the entry as shown to the user (at least 13 bytes)
+ * @return The entry (valid until the next call), or NULL when there are no more entries
+ */
+const FatDirectoryEntry * FAT16_readDir(FatDirIterator *it, char *name){
+    char shortName[9];
+
+    const FatDirectoryEntry *de;
+    while((de = nextEntry(it)) != NULL){
+        if((unsigned char) de->long_name[0] == FAT16_DELETED_ENTRY || (de->fileAttr & FAT16_ATTR_VOLUME_ID)) continue;
+
+        entryName(de, shortName, name);
+        if(strcmp(shortName, ".") == 0 || strcmp(shortName, "..") == 0) continue;
+        return de;
+    }
+    return NULL;
+}
+
+/**
+ * This function is used to close a directory iterator
+ * @param it : The iterator
+ */
+void FAT16_closeDir(FatDirIterator *it){
+    free(it->entries);
+    it->entries = NULL;
+}
+
+/**
+ * Opens a directory to read its entries a cluster at a time (see nextChunk and readChunk)
+ * @param img : The image holding the filesystem
+ * @param fat16 : The FAT16 structure
+ * @param cluster : First cluster of the directory (below FAT16_FIRST_CLUSTER for the root directory)
+ * @param it : Output, the iterator (closed with FAT16_closeDir)
+ * @return Whether the directory could be opened (1) or not (0)
+ */
+static int openDirectory(Image *img, Fat16 fat16, uint32_t cluster, FatDirIterator *it){
+    memset(it, 0, sizeof(FatDirIterator));
+    it->img = img;
+    it->fat = fat16.fat;
+    it->fatEntries = fat16.fatEntries;
+    it->dataStart = (uint64_t) dataRegionOffset(fat16);
+    it->chunkSize = (size_t) fat16.BPB_secPerClus * fat16.BPB_bytsPerSec;
+
+    // The root directory is a region of its own, right before the data region, with room for BPB_rootEntCnt entries
+    it->root = cluster < FAT16_FIRST_CLUSTER;
+    it->rootLeft = (uint64_t) fat16.BPB_rootEntCnt * sizeof(FatDirectoryEntry);
+    it->pos = it->dataStart - it->rootLeft;
+    it->cluster = cluster;
+
+    it->entries = (FatDirectoryEntry *) malloc(it->chunkSize);
+    return it->entries != NULL;
+}
+
+/**
+ * Gives where the next chunk of a directory is, and moves the iterator past it: the next piece of the root
+ * directory region, or the next cluster of the chain of any other directory. The chain ends at an end of
+ * chain or bad cluster mark, at a value that isn't a cluster, or once it has visited more clusters than the
+ * FAT holds (it loops).
+ * @param it : The iterator
+ * @param pos : Output, image offset of the chunk
+ * @param len : Output, bytes of the chunk
+ * @return Whether there is a next chunk (1) or the directory has no more clusters (0)
+ */
+static int nextChunk(FatDirIterator *it, uint64_t *pos, size_t *len){
+    if(it->root){
+        if(it->rootLeft == 0) return 0;
+        *pos = it->pos;
+        *len = it->rootLeft < it->chunkSize ? (size_t) it->rootLeft : it->chunkSize;
+        it->pos += *len;
+        it->rootLeft -= *len;
+        return *len >= sizeof(FatDirectoryEntry);
+    }
+
+    if(it->cluster < FAT16_FIRST_CLUSTER || it->cluster >= FAT16_BAD_CLUSTER) return 0;
+    if(it->fat != NULL && (it->cluster >= it->fatEntries || it->visited >= it->fatEntries)) return 0;
+
+    *pos = it->dataStart + (uint64_t) (it->cluster - FAT16_FIRST_CLUSTER) * it->chunkSize;
+    *len = it->chunkSize;
+    it->visited++;
+    it->cluster = it->fat != NULL ? it->fat[it->cluster] : it->cluster + 1;
+    return 1;
+}
+
+/**
+ * Reads the next chunk of a directory into the iterator
+ * @param it : The iterator
+ * @return Number of entries read (0 when the directory has no more clusters)
+ */
+static size_t readChunk(FatDirIterator *it){
+    uint64_t pos;
+    size_t len;
+    it->next = 0;
+    it->count = nextChunk(it, &pos, &len) ? IMAGE_read(it->img, it->entries, len, pos) / sizeof(FatDirectoryEntry) : 0;
+    return it->count;
+}
+
+/**
+ * Gives the next entry of a directory as it is on disk, deleted and long name entries included
+ * @param it : The iterator
+ * @return The entry (valid until the next call), or NULL at the end of the directory
+ */
+static const FatDirectoryEntry * nextEntry(FatDirIterator *it){
+    if(it->ended || (it->next == it->count && readChunk(it) == 0)){
+        it->ended = 1;
+        return NULL;
+    }
+    const FatDirectoryEntry *de = &(it->entries[it->next++]);
+    if(de->long_name[0] == '\0'){
+        it->ended = 1;
+        return NULL;
+    }
+    return de;
+}
+
+/**
+ * This function is used to get where the contents of a file are in the image, as runs of clusters that
+ * follow each other on disk
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param entry : The directory entry of the file
+ * @param runs : Output, the runs (must be freed by the caller)
+ * @param count : Output, number of runs
+ * @return Whether the runs could be built (1) or not (0)
+ */
+int FAT16_fileRuns(Image *img, Fat16 *mounted, const FatDirectoryEntry *entry, ImageRun **runs, uint32_t *count){
+    return fileRuns(img, *mounted, dataRegionOffset(*mounted), entry, runs, count);
+}
+
+/**
+ * This function is used to get the modification time of a directory entry
+ * @param entry : The directory entry
+ * @return Seconds since the epoch, or 0 if the entry has no date
+ */
+int64_t FAT16_entryTime(const FatDirectoryEntry *entry){
+    if(entry->dChange == 0) return 0;
+
+    // Years from 1980 (7 bits), month (4 bits), day (5 bits); hours (5 bits), minutes (6 bits), seconds halved (5 bits)
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = 80 + (entry->dChange >> 9);
+    tm.tm_mon = ((entry->dChange >> 5) & 0xF) - 1;
+    tm.tm_mday = entry->dChange & 0x1F;
+    tm.tm_hour = entry->tChange >> 11;
+    tm.tm_min = (entry->tChange >> 5) & 0x3F;
+    tm.tm_sec = (entry->tChange & 0x1F) * 2;
+    return (int64_t) timegm(&tm);
+}
+
+/**
+ * This function is used to get the values an index of the image is validated with: the size and the
+ * modification time of the image (FAT16 doesn't keep a write time of its own)
+ * @param img : The opened image
+ * @param stamp : Output, the values
+ */
+void FAT16_indexStamp(Image *img, uint64_t stamp[2]){
+    struct stat st;
+    stamp[0] = img->size;
+    stamp[1] = 0;
+    if(fstat(img->fd, &st) == 0) stamp[1] = (uint64_t) st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+}
+
+/**
+ * This function is used to walk the whole filesystem adding every file and directory to an index
+ * @param img : The opened image
+ * @param mounted : The mounted filesystem
+ * @param writer : The index being built
+ * @return Whether every entry could be added (1) or not (0)
+ */
+int FAT16_buildIndex(Image *img, Fat16 *mounted, IndexWriter *writer){
+    indexDirectory(img, *mounted, 0, writer, 1);
+    return !writer->failed;
+}
+
+/**
+ * Adds the entries of a directory to an index, and the entries of its subdirectories right after each of
+ * them. The directory is read whole first, following its cluster chain (see readDirectory).
+ * @param img : The image holding the filesystem
+ * @param fat16 : The FAT16 structure
+ * @param cluster : First cluster of the directory (0 for the root directory)
+ * @param writer : The index being built
+ * @param level : Level of the entries of this directory (1 for the root directory)
+ */
+static void indexDirectory(Image *img, Fat16 fat16, uint32_t cluster, IndexWriter *writer, int level){
+    FatDirectoryEntry *entries;
+    size_t count;
+    if(!readDirectory(img, fat16, cluster, &entries, &count)){
+        writer->failed = 1;
         return;
     }
 
-    // Read the FAT16 info
-    Fat16 fat16 = readInfo(f);
-    struct TreeNode rootNode;
-    rootNode.name = NULL;
-    rootNode.numChilds = 0;
+    char name[9];
+    char strCopy[13];
+    for(size_t i = 0; i < count; i++){
+        const FatDirectoryEntry *de = &entries[i];
+        // Same entries as the tree: directories (but . and ..) and files, none of them deleted
+        if((unsigned char) de->long_name[0] == FAT16_DELETED_ENTRY) continue;
+        entryName(de, name, strCopy);
+        if(de->fileAttr == 16 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0){
+            INDEX_add(writer, level, strCopy, INDEX_DIR, de->firstCluster, de->fSize);
+            if(de->firstCluster >= FAT16_FIRST_CLUSTER) indexDirectory(img, fat16, de->firstCluster, writer, level + 1);
+        }
+        else if(de->fileAttr == 32)
+            INDEX_add(writer, level, strCopy, INDEX_FILE, de->firstCluster, de->fSize);
+    }
+    free(entries);
+}
+
+/**
+ * Looks up a name in a directory. Names are compared as they're shown to the user, ignoring case
+ * (as FAT does). The directory is read a cluster at a time, following its cluster chain.
+ * @param img : The image holding the filesystem
+ * @param fat16 : The FAT16 structure
+ * @param cluster : First cluster of the directory (0 for the root directory)
+ * @param name : The name to look for (it doesn't need to end with '\0')
+ * @param nameLen : Length of the name
+ * @param entry : Output, the directory entry found
+ * @return Whether the name was found (1) or not (0)
+ */
+static int lookup(Image *img, Fat16 fat16, uint32_t cluster, const char *name, size_t nameLen, FatDirectoryEntry *entry){
+    // Display names are at most 12 characters long (8 + '.' + 3)
+    if(nameLen > 12) return 0;
+
+    FatDirIterator it;
+    if(!openDirectory(img, fat16, cluster, &it)){
+        FAT16_closeDir(&it);
+        return 0;
+    }
 
-    // Pierce the tree in cat file mode (whenever we find the file, we print it)
-    int found = pierceTree(f, fat16, 2, 1, filename, NULL);
-    if(!found) printf("File not found\n\n");
-    fclose(f);
+    char shortName[9];
+    char strCopy[13];
+    int found = 0;
+    const FatDirectoryEntry *de;
+
+    while(!found && (de = nextEntry(&it)) != NULL){
+        // Skip deleted entries, long name entries and the volume label
+        if((unsigned char) de->long_name[0] == FAT16_DELETED_ENTRY || (de->fileAttr & FAT16_ATTR_VOLUME_ID)) continue;
+
+        entryName(de, shortName, strCopy);
+        if(strlen(strCopy) == nameLen && strncasecmp(strCopy, name, nameLen) == 0){
+            *entry = *de;
+            found = 1;
+        }
+    }
+    FAT16_closeDir(&it);
+    return found;
 }
 
-static void printFileContent(FILE *f, Fat16 fat16, int dataSectorStart, FatDirectoryEntry entry){
-    // Calculate the base byte of the file (first byte of the first cluster)
-    int bytePos = (((entry.firstCluster - 2) * fat16.BPB_secPerClus) * fat16.BPB_bytsPerSec) + dataSectorStart;
+/**
+ * Resolves an absolute path (e.g. /docs/inner/d.txt) from the root directory, one component at a time
+ * @param img : The image holding the filesystem
+ * @param fat16 : The FAT16 structure
+ * @param path : The path to resolve (empty components, as in a//b, are skipped)
+ * @param entry : Output, the directory entry the path leads to
+ * @return Whether the path exists (1) or not (0). The root directory itself has no entry, so it doesn't resolve.
+ */
+static int resolvePath(Image *img, Fat16 fat16, const char *path, FatDirectoryEntry *entry){
+    uint32_t cluster = 0;
+    int found = 0;
+
+    while(*path != '\0'){
+        // Skip the slashes, and take the component up to the next one
+        while(*path == '/') path++;
+        size_t len = strcspn(path, "/");
+        if(len == 0) break;
 
-    // Print the file contents, byte by byte
-    char c;
-    for (uint32_t i = 0; i < entry.fSize; i++){
-        fseek(f, bytePos + i, SEEK_SET);
-        fread(&c, sizeof(char), 1, f);
-        printf("%c", c);
+        // Only directories can have components after them
+        if(found && !(entry->fileAttr & FAT16_ATTR_DIRECTORY)) return 0;
+        if(!lookup(img, fat16, cluster, path, len, entry)) return 0;
+        found = 1;
+
+        // The .. entries of first level directories point to cluster 0, which is the root directory
+        cluster = entry->firstCluster;
+        path += len;
+    }
+    return found;
+}
+
+/**
+ * This function is used to load the first FAT of the filesystem into memory
+ * @param img : The image holding the filesystem
+ * @param fat16 : The FAT16 structure
+ * @param numEntries : Output, number of entries in the loaded FAT
+ * @return The FAT (must be freed by the caller), or NULL on error
+ */
+static uint16_t * loadFat(Image *img, Fat16 fat16, uint32_t *numEntries){
+    size_t fatBytes = (size_t) fat16.BPB_FATSz16 * fat16.BPB_bytsPerSec;
+    uint16_t *fat = (uint16_t *) malloc(fatBytes);
+    if(fat == NULL) return NULL;
+
+    if(IMAGE_read(img, fat, fatBytes, (uint64_t) fat16.BPB_rsvdSecCnt * fat16.BPB_bytsPerSec) != fatBytes){
+        free(fat);
+        return NULL;
     }
 
-}
\ No newline at end of file
+    *numEntries = fatBytes / sizeof(uint16_t);
+    return fat;
+}
+
+/**
+ * This function is used to get where the contents of a file are in the image, following its cluster chain
+ * in the FAT. Clusters that follow each other on disk are merged into runs.
+ * @param img : The image holding the filesystem
+ * @param fat16 : The FAT16 structure
+ * @param dataSectorStart : Byte offset of the data region (cluster 2)
+ * @param entry : The directory entry of the file
+ * @param runs : Output, the runs (must be freed by the caller)
+ * @param count : Output, number of runs
+ * @return Whether the runs could be built (1) or not (0)
+ */
+static int fileRuns(Image *img, Fat16 fat16, int dataSectorStart, const FatDirectoryEntry *entry, ImageRun **runs, uint32_t *count){
+    // The FAT loaded when the filesystem was mounted is used if there's one
+    uint32_t numEntries = fat16.fatEntries;
+    uint16_t *fat = fat16.fat;
+    if(fat == NULL) fat = loadFat(img, fat16, &numEntries);
+    if(fat == NULL) return 0;
+
+    uint32_t clusterSize = (uint32_t) fat16.BPB_secPerClus * fat16.BPB_bytsPerSec;
+    uint32_t remaining = entry->fSize;
+    uint64_t logical = 0;
+
+    *runs = NULL;
+    *count = 0;
+    uint32_t capacity = 0;
+    int ok = 1;
+
+    uint32_t cluster = entry->firstCluster;
+    uint32_t visited = 0;
+    while(remaining > 0 && cluster >= FAT16_FIRST_CLUSTER && cluster < numEntries){
+        //Extend the run while the next cluster of the chain is the next one on disk
+        uint32_t runStart = cluster;
+        uint32_t runLength = 1;
+        uint32_t next = fat[cluster];
+        while(next == cluster + 1 && next < numEntries && (uint64_t) runLength * clusterSize < remaining){
+            cluster = next;
+            runLength++;
+            next = fat[cluster];
+        }
+
+        //The last run may only be partially used by the file
+        uint64_t runBytes = (uint64_t) runLength * clusterSize;
+        if(runBytes > remaining) runBytes = remaining;
+        if(*count == capacity){
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            ImageRun *bigger = (ImageRun *) realloc(*runs, capacity * sizeof(ImageRun));
+            if(bigger == NULL){
+                ok = 0;
+                break;
+            }
+            *runs = bigger;
+        }
+        uint64_t runPos = (uint64_t) (runStart - FAT16_FIRST_CLUSTER) * clusterSize + dataSectorStart;
+        (*runs)[(*count)++] = (ImageRun) {logical, runPos, runBytes};
+        remaining -= runBytes;
+        logical += runBytes;
+
+        //Guard against loops in a corrupted FAT
+        visited += runLength;
+        if(visited >= numEntries || next >= FAT16_BAD_CLUSTER) break;
+        cluster = next;
+    }
+
+    if(fat != fat16.fat) free(fat);
+    if(!ok){
+        free(*runs);
+        *runs = NULL;
+        *count = 0;
+    }
+    return ok;
+}
+
+/**
+ * This function is used to print the contents of a file. Its clusters are merged into runs of clusters
+ * that follow each other on disk, and each run is copied in one go.
+ * @param img : The image holding the filesystem
+ * @param fat16 : The FAT16 structure
+ * @param dataSectorStart : Byte offset of the data region (cluster 2)
+ * @param entry : The directory entry of the file
+ * @param out : Output where the raw contents are written
+ */
+static void printFileContent(Image *img, Fat16 fat16, int dataSectorStart, FatDirectoryEntry entry, Output *out){
+    ImageRun *runs;
+    uint32_t count;
+    if(!fileRuns(img, fat16, dataSectorStart, &entry, &runs, &count)) return;
+
+    OUT_copyRuns(out, img, runs, count);
+    free(runs);
+}
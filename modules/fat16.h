@@ -3,14 +3,39 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include "image.h"
+#include "index.h"
+#include "tree.h"
+#include "usage.h"
 
+// Size of the boot sector, which holds the BPB
+#define FAT16_BOOT_SECTOR_SIZE 512
+
+// FAT entry values
+#define FAT16_FIRST_CLUSTER 2           // First cluster of the data region
+#define FAT16_BAD_CLUSTER 0xFFF7        // Cluster marked as bad
+#define FAT16_END_OF_CHAIN 0xFFF8       // Values from here up mark the last cluster of a file
+
+// Directory entry values
+#define FAT16_ATTR_READ_ONLY 0x01
+#define FAT16_DELETED_ENTRY 0xE5        // First byte of the name of a deleted entry
+#define FAT16_ATTR_VOLUME_ID 0x08       // Volume label (also set on long name entries)
+#define FAT16_ATTR_DIRECTORY 0x10
+
+#define FAT16_PRINT_STAT "Path: %s\nType: %s\nSize: %" PRIu32 "\nFirst cluster: %d\nAttributes: 0x%02x\nModified: %04d-%02d-%02d %02d:%02d:%02d\n\n"
 #define FAT16_PRINT_INFO "\n------ Filesystem Information ------\n\nFilesystem: FAT16\n\nSystem name: %s\nSector Size: %d\nSectors per cluster: %d\nReserved sectors: %d\n# of FATs: %d\nMax root entries: %d\nSector per FAT: %d\nLabel: %s\n\n"
 
+#define FAT16_USAGE_COPY_MISMATCH "Mismatch. FAT %d differs from the first one in %" PRIu64 " entries.\n"
+#define FAT16_USAGE_SIZE_MISMATCH "Mismatch. The FAT has room for %" PRIu64 " clusters, the boot sector gives %" PRIu64 ".\n"
+#define FAT16_USAGE_UNREADABLE "Error. The FAT could not be read.\n\n"
+
 typedef struct {
     char long_name[8];
     char extension[3];
@@ -33,11 +58,43 @@ typedef struct {
     uint32_t BPB_totSec16;          //Total count of sectors on the volume
     uint16_t BPB_FATSz16;           //Count of sectors occupied by ONE FAT
     char BS_volLab[11];             //Volume label
+    uint16_t *fat;                  //First FAT, loaded when the filesystem is mounted (NULL if it couldn't be read)
+    uint32_t fatEntries;            //Number of entries in fat
 } Fat16;
 
-int FAT16_isFat16(char* fspath);
-void FAT16_printInfo(char* fspath);
-void FAT16_printTree(char* fspath);
-void FAT16_catFile(char* fspath, char* filename);
+typedef struct {
+    Image *img;
+    const uint16_t *fat;            // FAT followed from cluster to cluster (NULL if it couldn't be read: clusters are taken as contiguous)
+    uint32_t fatEntries;            // Number of entries in fat
+    uint64_t dataStart;             // Image offset of the data region (where cluster 2 starts)
+    int root;                       // Whether it's the root directory, which has a region of its own instead of clusters
+    uint64_t pos;                   // Image offset of the next chunk of the root directory region
+    uint64_t rootLeft;              // Bytes of the root directory region not read yet
+    uint32_t cluster;               // Next cluster of entries to read (other directories)
+    uint32_t visited;               // Clusters read so far, to stop on a chain that loops
+    size_t chunkSize;               // Bytes of a cluster
+    FatDirectoryEntry *entries;     // Current cluster of entries
+    size_t count;                   // Entries in it
+    size_t next;                    // Next entry to look at
+    int ended;                      // Set once the end of the directory was found
+} FatDirIterator;
+
+int FAT16_isFat16(Image *img);
+int FAT16_mount(Image *img, Fat16 *fat16);
+void FAT16_unmount(Fat16 *fat16);
+void FAT16_printInfo(Image *img, Fat16 *fat16, Output *out);
+int FAT16_printUsage(Image *img, Fat16 *mounted, Output *out);
+int FAT16_printTree(Image *img, Fat16 *mounted, int walk, Output *out);
+int FAT16_visitTree(Image *img, Fat16 *mounted, const char *path, TreeVisitor *visitor);
+int FAT16_catFile(Image *img, Fat16 *mounted, char* filename, Index *index, Output *out);
+int FAT16_statFile(Image *img, Fat16 *mounted, char *path, Output *out);
+void FAT16_indexStamp(Image *img, uint64_t stamp[2]);
+int FAT16_buildIndex(Image *img, Fat16 *mounted, IndexWriter *writer);
+int FAT16_resolve(Image *img, Fat16 *mounted, const char *path, FatDirectoryEntry *entry);
+int FAT16_openDir(Image *img, Fat16 *mounted, uint16_t cluster, FatDirIterator *it);
+const FatDirectoryEntry * FAT16_readDir(FatDirIterator *it, char *name);
+void FAT16_closeDir(FatDirIterator *it);
+int64_t FAT16_entryTime(const FatDirectoryEntry *entry);
+int FAT16_fileRuns(Image *img, Fat16 *mounted, const FatDirectoryEntry *entry, ImageRun **runs, uint32_t *count);
 
 #endif
\ No newline at end of file
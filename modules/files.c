@@ -0,0 +1,170 @@
+#include "files.h"
+#include <limits.h>
+
+typedef struct {
+    Image *img;
+    Ext2 *ext2;
+    Fat16 *fat16;
+    char *path;                     // PATH_MAX bytes, holding the path of the directory being walked
+    FilesVisitor *visitor;
+} FilesWalk;
+
+static int validName(const char *name);
+static int joinPath(FilesWalk *walk, size_t dirLen, const char *name);
+static void giveEntry(FilesWalk *walk, FilesEntry *entry, uint32_t dirNum, uint32_t parentNum);
+static void walkExt2(FilesWalk *walk, uint32_t inodeNum, uint32_t parentNum);
+static void walkFat16(FilesWalk *walk, uint16_t cluster);
+
+/**
+ * Tells whether a name can be appended to a path, as a single component that stays below the directory
+ * @return Whether it can (1) or not (0)
+ */
+static int validName(const char *name){
+    return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && strchr(name, '/') == NULL;
+}
+
+/**
+ * Appends a name to the path of the directory being walked
+ * @param dirLen : Length of the path of the directory
+ * @return Whether the name fits (1) or not (0)
+ */
+static int joinPath(FilesWalk *walk, size_t dirLen, const char *name){
+    size_t nameLen = strlen(name);
+    if(dirLen + 1 + nameLen >= PATH_MAX) return 0;
+    walk->path[dirLen] = '/';
+    memcpy(walk->path + dirLen + 1, name, nameLen + 1);
+    return 1;
+}
+
+/**
+ * Gives an entry to the visitor: files with their runs (if asked for), and directories followed by their contents
+ * @param entry : The entry (its path is the path of the walk)
+ * @param dirNum : For directories, their inode (EXT2) or first cluster (FAT16)
+ * @param parentNum : For EXT2 directories, the inode of their parent
+ */
+static void giveEntry(FilesWalk *walk, FilesEntry *entry, uint32_t dirNum, uint32_t parentNum){
+    FilesVisitor *visitor = walk->visitor;
+
+    if(entry->type == FILES_FILE && visitor->runs){
+        int mapped = entry->inode != NULL ? EXT2_fileRuns(walk->img, walk->ext2, entry->inode, &(entry->runs), &(entry->count))
+                                          : FAT16_fileRuns(walk->img, walk->fat16, entry->fatEntry, &(entry->runs), &(entry->count));
+        if(!mapped){
+            visitor->fail(visitor->ctx, entry->path);
+            return;
+        }
+    }
+
+    if(!visitor->visit(visitor->ctx, entry) || entry->type != FILES_DIR) return;
+    if(entry->inode != NULL) walkExt2(walk, dirNum, parentNum);
+    else walkFat16(walk, (uint16_t) dirNum);
+    if(visitor->leave != NULL) visitor->leave(visitor->ctx, entry);
+}
+
+/**
+ * Walks an EXT2 directory. Its own entry (.) and its parent's (..) are skipped; any other entry with those names
+ * is a failure.
+ * @param inodeNum : Inode of the directory
+ * @param parentNum : Inode of its parent
+ */
+static void walkExt2(FilesWalk *walk, uint32_t inodeNum, uint32_t parentNum){
+    FilesVisitor *visitor = walk->visitor;
+    size_t dirLen = strlen(walk->path);
+    DirIterator it;
+    if(!EXT2_openDir(walk->img, walk->ext2, inodeNum, &it)){
+        EXT2_closeDir(&it);
+        visitor->fail(visitor->ctx, dirLen > 0 ? walk->path : "/");
+        return;
+    }
+
+    const DirectoryEntry *de;
+    while((de = EXT2_readDir(&it)) != NULL){
+        if((strcmp(de->name, ".") == 0 && de->inode == inodeNum)
+           || (strcmp(de->name, "..") == 0 && de->inode == parentNum))
+            continue;
+
+        Inode inode;
+        if(!validName(de->name) || !joinPath(walk, dirLen, de->name)){
+            visitor->fail(visitor->ctx, de->name);
+            continue;
+        }
+        if(!EXT2_readInode(walk->img, walk->ext2, de->inode, &inode)){
+            visitor->fail(visitor->ctx, walk->path);
+            walk->path[dirLen] = '\0';
+            continue;
+        }
+
+        FilesEntry entry;
+        memset(&entry, 0, sizeof(FilesEntry));
+        entry.path = walk->path;
+        entry.name = walk->path + dirLen + 1;
+        entry.type = (inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR ? FILES_DIR
+                   : (inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFREG ? FILES_FILE : FILES_OTHER;
+        entry.size = inode.i_size | (entry.type == FILES_FILE ? (uint64_t) inode.i_dir_acl << 32 : 0);
+        entry.mode = inode.i_mode & 07777;
+        entry.mtime = inode.i_mtime;
+        entry.inode = &inode;
+
+        giveEntry(walk, &entry, de->inode, inodeNum);
+        walk->path[dirLen] = '\0';
+    }
+    EXT2_closeDir(&it);
+}
+
+/**
+ * Walks a FAT16 directory (its . and .. entries are skipped by FAT16_readDir)
+ * @param cluster : First cluster of the directory (below FAT16_FIRST_CLUSTER for the root directory)
+ */
+static void walkFat16(FilesWalk *walk, uint16_t cluster){
+    FilesVisitor *visitor = walk->visitor;
+    size_t dirLen = strlen(walk->path);
+    FatDirIterator it;
+    if(!FAT16_openDir(walk->img, walk->fat16, cluster, &it)){
+        FAT16_closeDir(&it);
+        visitor->fail(visitor->ctx, dirLen > 0 ? walk->path : "/");
+        return;
+    }
+
+    char name[13];
+    const FatDirectoryEntry *de;
+    while((de = FAT16_readDir(&it, name)) != NULL){
+        if(!validName(name) || !joinPath(walk, dirLen, name)){
+            visitor->fail(visitor->ctx, name);
+            continue;
+        }
+
+        //FAT16 has no permissions: the read-only attribute is the only one that matters here
+        FilesEntry entry;
+        memset(&entry, 0, sizeof(FilesEntry));
+        entry.path = walk->path;
+        entry.name = walk->path + dirLen + 1;
+        entry.type = (de->fileAttr & FAT16_ATTR_DIRECTORY) ? FILES_DIR : FILES_FILE;
+        entry.size = de->fSize;
+        entry.mode = ((de->fileAttr & FAT16_ATTR_READ_ONLY) ? 0444 : 0644) | (entry.type == FILES_DIR ? 0111 : 0);
+        entry.mtime = FAT16_entryTime(de);
+        entry.fatEntry = de;
+
+        //A directory pointing at the root (or at no cluster at all) would never end
+        if(entry.type == FILES_DIR && de->firstCluster < FAT16_FIRST_CLUSTER) visitor->fail(visitor->ctx, walk->path);
+        else giveEntry(walk, &entry, de->firstCluster, 0);
+        walk->path[dirLen] = '\0';
+    }
+    FAT16_closeDir(&it);
+}
+
+/**
+ * Walks every entry of a filesystem, depth first, and gives it to a visitor. Names that can't be part of a path
+ * (empty, "." or ".." other than the entries of the directory itself and its parent, or with a '/', which a
+ * crafted image can hold) are given to the visitor's fail function instead, and so are the directories and files
+ * that can't be read.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2)
+ * @param path : Path of the root directory ("" to start paths with '/'), in a buffer of PATH_MAX bytes that
+ *               the walk uses for the entries too
+ * @param visitor : The visitor
+ */
+void FILES_walk(Image *img, Ext2 *ext2, Fat16 *fat16, char *path, FilesVisitor *visitor){
+    FilesWalk walk = {img, ext2, fat16, path, visitor};
+    if(ext2 != NULL) walkExt2(&walk, 2, 2);            // Root inode (2), its own parent
+    else walkFat16(&walk, 0);
+}
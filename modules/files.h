@@ -0,0 +1,60 @@
+#ifndef FILES_H
+#define FILES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "image.h"
+#include "ext2.h"
+#include "fat16.h"
+
+// Types of the entries found by FILES_walk
+#define FILES_FILE 0
+#define FILES_DIR 1
+#define FILES_OTHER 2                   // Neither a regular file nor a directory (EXT2 links, devices...)
+
+// An entry of the filesystem, as given to the visitor of FILES_walk
+typedef struct {
+    const char *path;               // Path of the entry: the path given to the walk, '/' and the names down to it
+    const char *name;               // Its name (never empty, "." or "..", and without '/')
+    int type;                       // FILES_FILE, FILES_DIR or FILES_OTHER
+    uint64_t size;
+    mode_t mode;                    // Permissions (FAT16 has none: 0444 or 0644 from the read-only attribute, plus 0111 on directories)
+    int64_t mtime;                  // Modification time (0 if it isn't known)
+    const Inode *inode;             // Its inode (EXT2, NULL on FAT16)
+    const FatDirectoryEntry *fatEntry;  // Its directory entry (FAT16, NULL on EXT2)
+    ImageRun *runs;                 // Where a file is in the image, when the visitor asks for it (the visitor frees them)
+    uint32_t count;                 // Number of runs
+} FilesEntry;
+
+typedef struct {
+    /**
+     * Called with every entry, depth first: the contents of a directory come right after it
+     * @return For directories, whether to walk their contents (1) or not (0)
+     */
+    int (*visit)(void *ctx, const FilesEntry *entry);
+    // Called after the contents of a directory (NULL if it isn't needed)
+    void (*leave)(void *ctx, const FilesEntry *entry);
+    // Called with the path (or the name, if the path doesn't fit) of an entry that couldn't be read
+    void (*fail)(void *ctx, const char *path);
+    void *ctx;
+    int runs;                       // Whether the files come with their runs (1) or not (0)
+} FilesVisitor;
+
+/**
+ * Walks every entry of a filesystem, depth first, and gives it to a visitor. Names that can't be part of a path
+ * (empty, "." or ".." other than the entries of the directory itself and its parent, or with a '/', which a
+ * crafted image can hold) are given to the visitor's fail function instead, and so are the directories and files
+ * that can't be read.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2)
+ * @param path : Path of the root directory ("" to start paths with '/'), in a buffer of PATH_MAX bytes that
+ *               the walk uses for the entries too
+ * @param visitor : The visitor
+ */
+void FILES_walk(Image *img, Ext2 *ext2, Fat16 *fat16, char *path, FilesVisitor *visitor);
+
+#endif
@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include "find.h"
+#include "tree.h"
+#include "walk.h"
+#include <fnmatch.h>
+#include <limits.h>
+#include <strings.h>
+#include <stdatomic.h>
+
+typedef struct {
+    Image *img;
+    Ext2 *ext2;
+    Fat16 *fat16;
+    const FindMatcher *matcher;
+    const FindOptions *options;
+    Output *out;
+    pthread_mutex_t lock;           // Taken to print (workers share the output)
+    atomic_ulong matches;           // Matches claimed so far (may go past the maximum: only those below it print)
+    atomic_int stop;                // Set once the maximum number of matches is reached
+    atomic_uint failures;
+} FindSearch;
+
+static int sameBytes(const char *a, const char *b, size_t len, int ignoreCase);
+static int joinPath(char *path, const char *dir, const char *name);
+static int report(FindSearch *search, const char *name, const char *path, int isDir);
+static void failEntry(FindSearch *search, const char *dirPath, const char *name);
+static int ext2IsDir(FindSearch *search, const DirectoryEntry *de);
+static void expandExt2(WalkPool *pool, int worker, void *ctx, uint64_t dir, struct TreeNode *node);
+static void expandFat16(WalkPool *pool, int worker, void *ctx, uint64_t dir, struct TreeNode *node);
+
+/**
+ * Compares two strings of the same length (memcmp, which compares many bytes at a time, when case matters)
+ * @return Whether they are equal (1) or not (0)
+ */
+static int sameBytes(const char *a, const char *b, size_t len, int ignoreCase){
+    return ignoreCase ? strncasecmp(a, b, len) == 0 : memcmp(a, b, len) == 0;
+}
+
+/**
+ * Compiles a pattern. Globs are matched against the name of each entry, or against its whole path when they have
+ * a '/'; regular expressions (POSIX extended) are searched for in the whole path.
+ * @param matcher : Output, the compiled pattern (freed with FIND_freeMatcher)
+ * @param pattern : The pattern (it must stay valid while the matcher is used)
+ * @param regex : Whether the pattern is a regular expression (1) or a glob (0)
+ * @param ignoreCase : Whether to ignore case (1) or not (0)
+ * @return Whether the pattern could be compiled (1) or not (0)
+ */
+int FIND_compile(FindMatcher *matcher, const char *pattern, int regex, int ignoreCase){
+    memset(matcher, 0, sizeof(FindMatcher));
+    matcher->pattern = pattern;
+    matcher->patternLen = strlen(pattern);
+    matcher->ignoreCase = ignoreCase;
+
+    if(regex){
+        matcher->kind = FIND_MATCH_REGEX;
+        matcher->onPath = 1;
+        return regcomp(&(matcher->regex), pattern, REG_EXTENDED | REG_NOSUB | (ignoreCase ? REG_ICASE : 0)) == 0;
+    }
+
+    //Names never have a '/': a pattern with one is meant for the whole path
+    matcher->onPath = strchr(pattern, '/') != NULL;
+    matcher->prefixLen = strcspn(pattern, "*?[\\");
+    if(matcher->prefixLen == matcher->patternLen) matcher->kind = FIND_MATCH_LITERAL;
+    else if(pattern[matcher->prefixLen] == '*' && strpbrk(pattern + matcher->prefixLen + 1, "*?[\\") == NULL){
+        matcher->kind = FIND_MATCH_AFFIX;
+        matcher->suffix = pattern + matcher->prefixLen + 1;
+        matcher->suffixLen = matcher->patternLen - matcher->prefixLen - 1;
+    }
+    else matcher->kind = FIND_MATCH_GLOB;
+    return 1;
+}
+
+/**
+ * Matches an entry against a compiled pattern
+ * @param matcher : The compiled pattern
+ * @param name : Name of the entry
+ * @param nameLen : Length of the name
+ * @param path : Path of the entry (from the root directory, starting with '/')
+ * @return Whether the entry matches (1) or not (0)
+ */
+int FIND_match(const FindMatcher *matcher, const char *name, size_t nameLen, const char *path){
+    if(matcher->kind == FIND_MATCH_REGEX) return regexec(&(matcher->regex), path, 0, NULL, 0) == 0;
+
+    const char *subject = matcher->onPath ? path : name;
+    size_t len = matcher->onPath ? strlen(path) : nameLen;
+
+    //Most names are told apart by their length or their first bytes, before any wildcard is looked at
+    if(matcher->kind == FIND_MATCH_LITERAL)
+        return len == matcher->patternLen && sameBytes(subject, matcher->pattern, len, matcher->ignoreCase);
+    if(len < matcher->prefixLen + matcher->suffixLen || !sameBytes(subject, matcher->pattern, matcher->prefixLen, matcher->ignoreCase))
+        return 0;
+    if(matcher->kind == FIND_MATCH_AFFIX)
+        return sameBytes(subject + len - matcher->suffixLen, matcher->suffix, matcher->suffixLen, matcher->ignoreCase);
+    return fnmatch(matcher->pattern, subject, matcher->ignoreCase ? FNM_CASEFOLD : 0) == 0;
+}
+
+/**
+ * Frees a compiled pattern
+ * @param matcher : The compiled pattern
+ */
+void FIND_freeMatcher(FindMatcher *matcher){
+    if(matcher->kind == FIND_MATCH_REGEX) regfree(&(matcher->regex));
+}
+
+/**
+ * Builds the path of an entry
+ * @param path : Output, the path (PATH_MAX bytes)
+ * @param dir : Path of the directory of the entry ("" for the root directory)
+ * @param name : Name of the entry
+ * @return Whether the path fits (1) or not (0)
+ */
+static int joinPath(char *path, const char *dir, const char *name){
+    return snprintf(path, PATH_MAX, "%s/%s", dir, name) < PATH_MAX;
+}
+
+/**
+ * Prints an entry if it matches the search
+ * @param isDir : Whether the entry is a directory (1), a regular file (0) or something else (-1)
+ * @return Whether it was printed (1) or not (0)
+ */
+static int report(FindSearch *search, const char *name, const char *path, int isDir){
+    int type = search->options->type;
+    if((type == FIND_TYPE_FILE && isDir != 0) || (type == FIND_TYPE_DIR && isDir != 1)) return 0;
+    if(!FIND_match(search->matcher, name, strlen(name), path)) return 0;
+
+    //Only the first matches up to the maximum are printed, whichever worker finds them
+    uint64_t max = search->options->maxResults;
+    if(max > 0){
+        unsigned long claimed = atomic_fetch_add(&(search->matches), 1);
+        if(claimed >= max) return 0;
+        if(claimed + 1 == max) atomic_store(&(search->stop), 1);
+    }
+
+    pthread_mutex_lock(&(search->lock));
+    OUT_printf(search->out, "%s\n", path);
+    pthread_mutex_unlock(&(search->lock));
+    return 1;
+}
+
+/**
+ * Reports an entry that can't be searched (its path is too long, or its node or inode can't be had): the search
+ * goes on without it, but fails in the end
+ * @param dirPath : Path of the directory of the entry ("" for the root directory)
+ * @param name : Name of the entry
+ */
+static void failEntry(FindSearch *search, const char *dirPath, const char *name){
+    pthread_mutex_lock(&(search->lock));
+    OUT_printf(search->out, ERR_FIND_ENTRY, dirPath, name);
+    pthread_mutex_unlock(&(search->lock));
+    atomic_fetch_add(&(search->failures), 1);
+}
+
+/**
+ * Tells the type of an EXT2 entry. It comes from the entry itself (file_type), so no inode is read, unless the
+ * filesystem doesn't record types in its entries (file_type 0).
+ * @param de : The entry
+ * @return Whether the entry is a directory (1), a regular file (0), something else (-1) or can't be told (-2)
+ */
+static int ext2IsDir(FindSearch *search, const DirectoryEntry *de){
+    if(de->file_type == 2) return 1;
+    if(de->file_type == 1) return 0;
+    if(de->file_type != 0) return -1;
+
+    Inode inode;
+    if(!EXT2_readInode(search->img, search->ext2, de->inode, &inode)) return -2;
+    if((inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR) return 1;
+    return (inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFREG ? 0 : -1;
+}
+
+/**
+ * Expands an EXT2 directory for the parallel walk: matches its entries, and pushes its subdirectories with a node
+ * named after their path
+ * @param dir : Inode of the directory
+ * @param node : Node of the directory (its name is its path, NULL for the root directory)
+ */
+static void expandExt2(WalkPool *pool, int worker, void *ctx, uint64_t dir, struct TreeNode *node){
+    FindSearch *search = (FindSearch *) ctx;
+    const char *dirPath = node->name != NULL ? node->name : "";
+    if(atomic_load(&(search->stop))) return;
+
+    DirIterator it;
+    if(!EXT2_openDir(search->img, search->ext2, (uint32_t) dir, &it)){
+        EXT2_closeDir(&it);
+        pthread_mutex_lock(&(search->lock));
+        OUT_printf(search->out, ERR_FIND_DIR, node->name != NULL ? dirPath : "/");
+        pthread_mutex_unlock(&(search->lock));
+        atomic_fetch_add(&(search->failures), 1);
+        return;
+    }
+
+    char path[PATH_MAX];
+    int printed = 0;
+    const DirectoryEntry *de;
+    while(!atomic_load(&(search->stop)) && (de = EXT2_readDir(&it)) != NULL){
+        if(strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0) continue;
+
+        int isDir = ext2IsDir(search, de);
+        if(isDir == -2 || !joinPath(path, dirPath, de->name)){
+            failEntry(search, dirPath, de->name);
+            continue;
+        }
+        printed |= report(search, de->name, path, isDir);
+        if(isDir == 1){
+            struct TreeNode *child = TREE_addChild(node, path);
+            if(child != NULL) WALK_push(pool, worker, de->inode, child);
+            else failEntry(search, dirPath, de->name);
+        }
+    }
+    EXT2_closeDir(&it);
+
+    //The matches of each directory go out together, as soon as it's read
+    if(printed){
+        pthread_mutex_lock(&(search->lock));
+        OUT_flush(search->out);
+        pthread_mutex_unlock(&(search->lock));
+    }
+}
+
+/**
+ * Expands a FAT16 directory for the parallel walk: matches its entries, and pushes its subdirectories with a node
+ * named after their path
+ * @param dir : First cluster of the directory (below FAT16_FIRST_CLUSTER for the root directory)
+ * @param node : Node of the directory (its name is its path, NULL for the root directory)
+ */
+static void expandFat16(WalkPool *pool, int worker, void *ctx, uint64_t dir, struct TreeNode *node){
+    FindSearch *search = (FindSearch *) ctx;
+    const char *dirPath = node->name != NULL ? node->name : "";
+    if(atomic_load(&(search->stop))) return;
+
+    FatDirIterator it;
+    if(!FAT16_openDir(search->img, search->fat16, (uint16_t) dir, &it)){
+        pthread_mutex_lock(&(search->lock));
+        OUT_printf(search->out, ERR_FIND_DIR, node->name != NULL ? dirPath : "/");
+        pthread_mutex_unlock(&(search->lock));
+        atomic_fetch_add(&(search->failures), 1);
+        return;
+    }
+
+    char name[13];
+    char path[PATH_MAX];
+    int printed = 0;
+    const FatDirectoryEntry *de;
+    while(!atomic_load(&(search->stop)) && (de = FAT16_readDir(&it, name)) != NULL){
+        if(!joinPath(path, dirPath, name)){
+            failEntry(search, dirPath, name);
+            continue;
+        }
+
+        int isDir = (de->fileAttr & FAT16_ATTR_DIRECTORY) != 0;
+        printed |= report(search, name, path, isDir);
+        //A directory pointing at the root (or at no cluster at all) would never end
+        if(isDir && de->firstCluster >= FAT16_FIRST_CLUSTER){
+            struct TreeNode *child = TREE_addChild(node, path);
+            if(child != NULL) WALK_push(pool, worker, de->firstCluster, child);
+            else failEntry(search, dirPath, name);
+        }
+    }
+    FAT16_closeDir(&it);
+
+    //The matches of each directory go out together, as soon as it's read
+    if(printed){
+        pthread_mutex_lock(&(search->lock));
+        OUT_flush(search->out);
+        pthread_mutex_unlock(&(search->lock));
+    }
+}
+
+/**
+ * Searches the whole filesystem for the entries matching a pattern, printing their paths as they are found.
+ * The directories are read in parallel (a worker per CPU, see WALK_run), so the paths come in no particular
+ * order, and the walk stops as soon as the maximum number of matches is printed.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2, names are matched ignoring case)
+ * @param pattern : The pattern (see FIND_compile)
+ * @param options : Type of entries, kind of pattern and maximum number of matches
+ * @param out : Output where the paths are printed
+ * @return Whether the search could be done (1) or not (0)
+ */
+int FIND_run(Image *img, Ext2 *ext2, Fat16 *fat16, const char *pattern, const FindOptions *options, Output *out){
+    FindMatcher matcher;
+    if(!FIND_compile(&matcher, pattern, options->regex, fat16 != NULL)){
+        OUT_printf(out, ERR_FIND_REGEX, pattern);
+        return 0;
+    }
+
+    FindSearch search;
+    memset(&search, 0, sizeof(FindSearch));
+    search.img = img;
+    search.ext2 = ext2;
+    search.fat16 = fat16;
+    search.matcher = &matcher;
+    search.options = options;
+    search.out = out;
+    pthread_mutex_init(&(search.lock), NULL);
+    atomic_init(&(search.matches), 0);
+    atomic_init(&(search.stop), 0);
+    atomic_init(&(search.failures), 0);
+
+    //The nodes only carry the path of each directory to the worker that reads it
+    struct TreeNode rootNode;
+    int walked = TREE_init(&rootNode);
+    if(walked){
+        if(ext2 != NULL) walked = WALK_run(WALK_threads(), expandExt2, &search, 2, &rootNode);      // Root inode (2)
+        else walked = WALK_run(WALK_threads(), expandFat16, &search, 0, &rootNode);
+        TREE_free(&rootNode);
+    }
+    if(!walked) OUT_printf(out, ERR_FIND_WALK);
+
+    pthread_mutex_destroy(&(search.lock));
+    FIND_freeMatcher(&matcher);
+    return walked && atomic_load(&(search.failures)) == 0;
+}
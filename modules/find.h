@@ -0,0 +1,91 @@
+#ifndef FIND_H
+#define FIND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <regex.h>
+#include "image.h"
+#include "output.h"
+#include "ext2.h"
+#include "fat16.h"
+
+// Entries reported by a search
+#define FIND_TYPE_ANY 0
+#define FIND_TYPE_FILE 1                // Regular files
+#define FIND_TYPE_DIR 2                 // Directories
+
+// Ways a pattern is matched, from the cheapest one
+#define FIND_MATCH_LITERAL 0            // No wildcards: the same length & bytes
+#define FIND_MATCH_AFFIX 1              // A single '*': a literal prefix and a literal suffix
+#define FIND_MATCH_GLOB 2               // Any glob (fnmatch), after checking its literal prefix
+#define FIND_MATCH_REGEX 3              // Extended regular expression, searched for in the whole path
+
+#define ERR_FIND_REGEX "Error. %s is not a valid regular expression.\n\n"
+#define ERR_FIND_DIR "Error. %s could not be read.\n"
+#define ERR_FIND_ENTRY "Error. %s/%s could not be searched.\n"
+#define ERR_FIND_WALK "Error. The directories could not be walked.\n\n"
+
+typedef struct {
+    int regex;                      // Whether the pattern is a regular expression (1) or a glob (0)
+    int type;                       // Entries to report (FIND_TYPE_*)
+    uint64_t maxResults;            // Matches after which the search stops (0 for no limit)
+} FindOptions;
+
+// A pattern, compiled once for every name it's matched against
+typedef struct {
+    int kind;                       // FIND_MATCH_*
+    int onPath;                     // Whether it's matched against the whole path (it has a '/') or the name
+    int ignoreCase;                 // Whether case is ignored (FAT16 names)
+    const char *pattern;
+    size_t patternLen;
+    size_t prefixLen;               // Bytes of the pattern before its first wildcard
+    const char *suffix;             // Bytes after the '*' (FIND_MATCH_AFFIX)
+    size_t suffixLen;
+    regex_t regex;                  // Compiled expression (FIND_MATCH_REGEX)
+} FindMatcher;
+
+/**
+ * Compiles a pattern. Globs are matched against the name of each entry, or against its whole path when they have
+ * a '/'; regular expressions (POSIX extended) are searched for in the whole path.
+ * @param matcher : Output, the compiled pattern (freed with FIND_freeMatcher)
+ * @param pattern : The pattern (it must stay valid while the matcher is used)
+ * @param regex : Whether the pattern is a regular expression (1) or a glob (0)
+ * @param ignoreCase : Whether to ignore case (1) or not (0)
+ * @return Whether the pattern could be compiled (1) or not (0)
+ */
+int FIND_compile(FindMatcher *matcher, const char *pattern, int regex, int ignoreCase);
+
+/**
+ * Matches an entry against a compiled pattern
+ * @param matcher : The compiled pattern
+ * @param name : Name of the entry
+ * @param nameLen : Length of the name
+ * @param path : Path of the entry (from the root directory, starting with '/')
+ * @return Whether the entry matches (1) or not (0)
+ */
+int FIND_match(const FindMatcher *matcher, const char *name, size_t nameLen, const char *path);
+
+/**
+ * Frees a compiled pattern
+ * @param matcher : The compiled pattern
+ */
+void FIND_freeMatcher(FindMatcher *matcher);
+
+/**
+ * Searches the whole filesystem for the entries matching a pattern, printing their paths as they are found.
+ * The directories are read in parallel (a worker per CPU, see WALK_run), so the paths come in no particular
+ * order, and the walk stops as soon as the maximum number of matches is printed.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2, names are matched ignoring case)
+ * @param pattern : The pattern (see FIND_compile)
+ * @param options : Type of entries, kind of pattern and maximum number of matches
+ * @param out : Output where the paths are printed
+ * @return Whether the search could be done (1) or not (0)
+ */
+int FIND_run(Image *img, Ext2 *ext2, Fat16 *fat16, const char *pattern, const FindOptions *options, Output *out);
+
+#endif
@@ -0,0 +1,269 @@
+#include "frag.h"
+#include "files.h"
+#include <limits.h>
+
+// A file of the worst list
+typedef struct {
+    char *path;
+    uint64_t size;
+    uint32_t extents;
+} FragFile;
+
+// Cluster chains of a whole FAT, followed once: for each cluster, what's left of the chain from it
+typedef struct {
+    uint32_t *lengths;              // Clusters from the cluster to the end of the chain
+    uint32_t *breaks;               // Times the chain jumps to a cluster that isn't the next one on disk
+} FragChains;
+
+typedef struct {
+    Image *img;
+    Ext2 *ext2;
+    Fat16 *fat16;
+    FragChains chains;
+    int all;
+    Output *out;
+    uint32_t files;
+    uint32_t fragmented;            // Files with more than one extent
+    uint64_t extents;
+    uint64_t bytes;                 // Bytes of the files stored in extents
+    uint32_t histogram[FRAG_BUCKETS];
+    FragFile worst[FRAG_WORST];     // Most fragmented files found so far (unordered)
+    uint32_t numWorst;
+    uint32_t failures;
+} FragReport;
+
+static void addFile(FragReport *report, const char *path, uint64_t size, uint32_t extents, uint64_t bytes);
+static uint64_t indirectBlocksBefore(uint64_t logical, uint64_t ptrs);
+static void addExt2File(FragReport *report, const FilesEntry *entry);
+static int buildChains(const Fat16 *fat16, FragChains *chains);
+static void addFat16File(FragReport *report, const FilesEntry *entry);
+static int visitEntry(void *ctx, const FilesEntry *entry);
+static void failEntry(void *ctx, const char *path);
+static int compareWorst(const void *a, const void *b);
+
+/**
+ * Counts a file in the report, keeping it if it's among the most fragmented ones
+ * @param extents : Extents of the file
+ * @param bytes : Bytes of the file stored in its extents
+ */
+static void addFile(FragReport *report, const char *path, uint64_t size, uint32_t extents, uint64_t bytes){
+    report->files++;
+    report->extents += extents;
+    report->bytes += bytes;
+    if(extents > 1) report->fragmented++;
+
+    //Bucket 0 holds the empty files, 1 the contiguous ones, and then each bucket doubles
+    int bucket = extents <= 1 ? (int) extents : 2;
+    for(uint32_t top = 2; bucket < FRAG_BUCKETS - 1 && extents > top; top *= 2) bucket++;
+    report->histogram[bucket]++;
+
+    if(report->all) OUT_printf(report->out, FRAG_PRINT_FILE, extents, size, path);
+
+    //Replace the least fragmented of the worst files, once the list is full
+    if(extents <= 1) return;
+    uint32_t slot = report->numWorst;
+    if(slot == FRAG_WORST){
+        slot = 0;
+        for(uint32_t i = 1; i < FRAG_WORST; i++)
+            if(report->worst[i].extents < report->worst[slot].extents) slot = i;
+        if(report->worst[slot].extents >= extents) return;
+        free(report->worst[slot].path);
+    }
+    char *copy = strdup(path);
+    if(copy == NULL) return;
+    report->worst[slot].path = copy;
+    report->worst[slot].size = size;
+    report->worst[slot].extents = extents;
+    if(slot == report->numWorst) report->numWorst++;
+}
+
+/**
+ * Counts the indirect blocks an EXT2 file starts using at one of its blocks. They are written right before the
+ * blocks they point to, so the gap they leave between two runs of the file doesn't break an extent.
+ * @param logical : Block of the file
+ * @param ptrs : Block pointers held by one indirect block
+ * @return Number of indirect blocks (0 to 3)
+ */
+static uint64_t indirectBlocksBefore(uint64_t logical, uint64_t ptrs){
+    uint64_t single = EXT2_NDIR_BLOCKS, dbl = single + ptrs, triple = dbl + ptrs * ptrs;
+    if(logical == single) return 1;
+    if(logical < dbl) return 0;
+    if(logical < triple) return (logical - dbl) % ptrs != 0 ? 0 : logical == dbl ? 2 : 1;
+    if((logical - triple) % ptrs != 0) return 0;
+    return logical == triple ? 3 : (logical - triple) % (ptrs * ptrs) == 0 ? 2 : 1;
+}
+
+/**
+ * Counts the extents of an EXT2 file. The runs already merge the blocks that follow each other on disk. Two runs
+ * are still one extent when only the indirect blocks of the file are between them.
+ * @param entry : The file, with its runs (freed here)
+ */
+static void addExt2File(FragReport *report, const FilesEntry *entry){
+    uint64_t blockSz = 1024 << report->ext2->block.s_log_block_size;
+    uint32_t extents = 0;
+    uint64_t bytes = 0, end = IMAGE_HOLE;
+    for(uint32_t r = 0; r < entry->count; r++){
+        const ImageRun *run = &(entry->runs[r]);
+        if(run->offset == IMAGE_HOLE){
+            end = IMAGE_HOLE;
+            continue;
+        }
+        uint64_t gap = indirectBlocksBefore(run->logical / blockSz, blockSz / sizeof(uint32_t)) * blockSz;
+        if(end == IMAGE_HOLE || run->offset != end + gap) extents++;
+        end = run->offset + run->length;
+        bytes += run->length;
+    }
+    free(entry->runs);
+    addFile(report, entry->path, entry->size, extents, bytes);
+}
+
+/**
+ * Follows every cluster chain of the FAT once. Each chain is walked until a cluster that was already done (or
+ * its end), and then unwound, so every cluster is visited a single time whatever the number of files.
+ * A chain that loops is cut where it meets itself.
+ * @param fat16 : The mounted filesystem (with its FAT loaded)
+ * @param chains : Output, what's left of the chain from each cluster
+ * @return Whether the chains could be followed (1) or not (0, out of memory)
+ */
+static int buildChains(const Fat16 *fat16, FragChains *chains){
+    uint32_t n = fat16->fatEntries;
+    chains->lengths = (uint32_t *) calloc(n, sizeof(uint32_t));
+    chains->breaks = (uint32_t *) calloc(n, sizeof(uint32_t));
+    uint32_t *stack = (uint32_t *) malloc(n * sizeof(uint32_t));
+    if(chains->lengths == NULL || chains->breaks == NULL || stack == NULL){
+        free(chains->lengths);
+        free(chains->breaks);
+        free(stack);
+        return 0;
+    }
+
+    //A cluster is done once its length is set; while its chain is being walked, its break count is UINT32_MAX
+    for(uint32_t first = FAT16_FIRST_CLUSTER; first < n; first++){
+        uint32_t top = 0, cluster = first;
+        while(cluster >= FAT16_FIRST_CLUSTER && cluster < n && cluster < FAT16_BAD_CLUSTER
+              && chains->lengths[cluster] == 0 && chains->breaks[cluster] != UINT32_MAX){
+            chains->breaks[cluster] = UINT32_MAX;
+            stack[top++] = cluster;
+            cluster = fat16->fat[cluster];
+        }
+
+        while(top > 0){
+            cluster = stack[--top];
+            uint32_t next = fat16->fat[cluster];
+            int continues = next >= FAT16_FIRST_CLUSTER && next < n && next < FAT16_BAD_CLUSTER && chains->lengths[next] != 0;
+            chains->lengths[cluster] = continues ? chains->lengths[next] + 1 : 1;
+            chains->breaks[cluster] = continues ? chains->breaks[next] + (next != cluster + 1) : 0;
+        }
+    }
+    free(stack);
+    return 1;
+}
+
+/**
+ * Counts the extents of a FAT16 file, from the chains of the whole FAT
+ * @param entry : The file
+ */
+static void addFat16File(FragReport *report, const FilesEntry *entry){
+    uint32_t clusterBytes = (uint32_t) report->fat16->BPB_secPerClus * report->fat16->BPB_bytsPerSec;
+    uint16_t first = entry->fatEntry->firstCluster;
+    int stored = first >= FAT16_FIRST_CLUSTER && first < report->fat16->fatEntries;
+    uint32_t extents = stored ? report->chains.breaks[first] + 1 : 0;
+    uint64_t bytes = stored ? (uint64_t) report->chains.lengths[first] * clusterBytes : 0;
+    addFile(report, entry->path, entry->size, extents, bytes < entry->size ? bytes : entry->size);
+}
+
+/**
+ * Takes an entry of the walk (FilesVisitor): regular files are counted
+ * @return 1, to walk the contents of every directory
+ */
+static int visitEntry(void *ctx, const FilesEntry *entry){
+    FragReport *report = (FragReport *) ctx;
+    if(entry->type != FILES_FILE) return 1;
+    if(entry->inode != NULL) addExt2File(report, entry);
+    else addFat16File(report, entry);
+    return 1;
+}
+
+/**
+ * Reports an entry the walk couldn't read (FilesVisitor)
+ */
+static void failEntry(void *ctx, const char *path){
+    FragReport *report = (FragReport *) ctx;
+    OUT_printf(report->out, ERR_FRAG_FILE, path);
+    report->failures++;
+}
+
+/**
+ * Orders the worst files by extents, most first (qsort)
+ */
+static int compareWorst(const void *a, const void *b){
+    uint32_t x = ((const FragFile *) a)->extents, y = ((const FragFile *) b)->extents;
+    return x > y ? -1 : x < y;
+}
+
+/**
+ * Reports how the files of a filesystem are laid out in the image: every file's block map (EXT2, with its
+ * indirect blocks, which don't break an extent) or cluster chain (FAT16) is collapsed into extents, runs of
+ * physically contiguous blocks.
+ * The report has the number of files and extents, a histogram of extents per file, and the most fragmented
+ * files. The FAT16 chains are followed once for the whole FAT, not once per file.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2)
+ * @param all : Whether to list every file with its extents as well (1) or not (0)
+ * @param out : Output where the report is printed
+ * @return Whether every file could be read (1) or not (0)
+ */
+int FRAG_run(Image *img, Ext2 *ext2, Fat16 *fat16, int all, Output *out){
+    FragReport report;
+    memset(&report, 0, sizeof(FragReport));
+    report.img = img;
+    report.ext2 = ext2;
+    report.fat16 = fat16;
+    report.all = all;
+    report.out = out;
+
+    if(fat16 != NULL && (fat16->fat == NULL || !buildChains(fat16, &(report.chains)))){
+        OUT_printf(out, ERR_FRAG_FILE, "The FAT");
+        return 0;
+    }
+
+    //Only the EXT2 files need their runs: the FAT16 ones are looked up in the chains
+    char path[PATH_MAX] = "";
+    FilesVisitor visitor = {visitEntry, NULL, failEntry, &report, ext2 != NULL};
+    OUT_printf(out, FRAG_PRINT);
+    FILES_walk(img, ext2, fat16, path, &visitor);
+    if(all && report.files > 0) OUT_printf(out, "\n");
+
+    OUT_printf(out, FRAG_PRINT_SUMMARY, report.files, report.fragmented,
+               report.files > 0 ? 100.0 * report.fragmented / report.files : 0.0, report.extents,
+               report.files > 0 ? (double) report.extents / report.files : 0.0,
+               report.extents > 0 ? report.bytes / report.extents : 0);
+
+    //Histogram: one line per bucket that has files
+    OUT_printf(out, "\nExtents per file:\n");
+    for(int b = 0; b < FRAG_BUCKETS; b++){
+        if(report.histogram[b] == 0) continue;
+        uint32_t low = b <= 2 ? (uint32_t) b : (1u << (b - 2)) + 1, high = b <= 2 ? (uint32_t) b : 1u << (b - 1);
+        char range[32];
+        if(b == FRAG_BUCKETS - 1) snprintf(range, sizeof(range), "%" PRIu32 "+", low);
+        else if(low == high) snprintf(range, sizeof(range), "%" PRIu32, low);
+        else snprintf(range, sizeof(range), "%" PRIu32 "-%" PRIu32, low, high);
+        OUT_printf(out, "%12s: %10" PRIu32 " files (%.1f%%)\n", range, report.histogram[b],
+                   100.0 * report.histogram[b] / report.files);
+    }
+
+    if(report.numWorst > 0){
+        OUT_printf(out, "\nMost fragmented files:\n");
+        qsort(report.worst, report.numWorst, sizeof(FragFile), compareWorst);
+        for(uint32_t i = 0; i < report.numWorst; i++){
+            OUT_printf(out, FRAG_PRINT_FILE, report.worst[i].extents, report.worst[i].size, report.worst[i].path);
+            free(report.worst[i].path);
+        }
+    }
+    OUT_printf(out, "\n");
+
+    free(report.chains.lengths);
+    free(report.chains.breaks);
+    return report.failures == 0;
+}
@@ -0,0 +1,39 @@
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "image.h"
+#include "output.h"
+#include "ext2.h"
+#include "fat16.h"
+
+// Files listed as the most fragmented ones
+#define FRAG_WORST 10
+// Buckets of the histogram: 0 extents, 1, 2, 3-4, 5-8... and the last one for everything above
+#define FRAG_BUCKETS 12
+
+#define ERR_FRAG_FILE "Error. %s could not be read.\n"
+#define FRAG_PRINT "\n------ Fragmentation ------\n\n"
+#define FRAG_PRINT_FILE "%10" PRIu32 " extents %14" PRIu64 " bytes  %s\n"
+#define FRAG_PRINT_SUMMARY "Files: %" PRIu32 " (%" PRIu32 " fragmented, %.1f%%)\nExtents: %" PRIu64 " (%.2f per file, %" PRIu64 " bytes on average)\n"
+
+/**
+ * Reports how the files of a filesystem are laid out in the image: every file's block map (EXT2, with its
+ * indirect blocks, which don't break an extent) or cluster chain (FAT16) is collapsed into extents, runs of
+ * physically contiguous blocks.
+ * The report has the number of files and extents, a histogram of extents per file, and the most fragmented
+ * files. The FAT16 chains are followed once for the whole FAT, not once per file.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2)
+ * @param all : Whether to list every file with its extents as well (1) or not (0)
+ * @param out : Output where the report is printed
+ * @return Whether every file could be read (1) or not (0)
+ */
+int FRAG_run(Image *img, Ext2 *ext2, Fat16 *fat16, int all, Output *out);
+
+#endif
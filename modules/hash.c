@@ -0,0 +1,488 @@
+#include "hash.h"
+#include "walk.h"
+#include "files.h"
+#include <limits.h>
+
+// A regular file to hash
+typedef struct {
+    char *path;
+    uint64_t size;
+    ImageRun *runs;                 // Where the file is in the image
+    uint32_t count;                 // Number of runs
+    uint64_t offset;                // Image offset of its first stored byte (IMAGE_HOLE if it has none)
+    uint64_t stored;                // Bytes it takes in the image (holes aren't stored)
+    uint64_t index;                 // Position of the file in the list of files (--dups)
+    uint64_t digest;
+    int failed;                     // Set when the file couldn't be read
+    int done;                       // Set once it's been hashed
+} HashFile;
+
+// A group of copies (--dups): files with the same size & digest, next to each other in the sorted list
+typedef struct {
+    uint64_t first;
+    uint64_t count;
+    uint64_t wasted;
+} HashGroup;
+
+typedef struct {
+    Image *img;
+    Ext2 *ext2;
+    Fat16 *fat16;
+    Output *out;
+    int dups;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;          // Signaled when a file is queued, or the queue is closed
+    pthread_cond_t hashed;          // Signaled when a worker finishes a file
+    HashFile *queue;                // Ring of HASH_QUEUE files, taken in order by the workers
+    uint64_t added;                 // Files queued so far
+    uint64_t taken;                 // Files taken by the workers
+    uint64_t retired;               // Files printed (or given back to the list, for --dups)
+    int closed;                     // Set once every file is queued
+    int numWorkers;
+    ImagePlan plan;
+    uint64_t planned;               // Bytes added to the plan since it was last issued
+    uint32_t plannedFiles;          // Files added to the plan since it was last issued
+    HashFile *files;                // Every file, for --dups
+    uint64_t numFiles, capFiles;
+    uint64_t count;                 // Files hashed (or found, for --dups)
+    uint64_t bytes;                 // Bytes of those files
+    uint32_t failures;
+} Hashing;
+
+static void addFile(Hashing *h, const char *path, uint64_t size, ImageRun *runs, uint32_t count);
+static void queueFile(Hashing *h, const HashFile *file);
+static void retireFiles(Hashing *h, uint64_t upTo);
+static void retireFile(Hashing *h, HashFile *file);
+static int visitEntry(void *ctx, const FilesEntry *entry);
+static void failEntry(void *ctx, const char *path);
+static int hashZeros(Xxh64State *state, uint64_t len);
+static int hashFile(Hashing *h, HashFile *file, unsigned char **buffer);
+static void * hashWorker(void *arg);
+static void findDuplicates(Hashing *h);
+static int compareSizes(const void *a, const void *b);
+static int compareOffsets(const void *a, const void *b);
+static int compareCopies(const void *a, const void *b);
+static int compareGroups(const void *a, const void *b);
+
+// Zeros hashed for the holes of sparse files
+static unsigned char zeros[64 * 1024];
+
+/**
+ * Takes a file found by the walk: it's queued to be hashed right away, or kept in the list of files (--dups)
+ * @param runs : The runs of the file (freed once it's been hashed)
+ */
+static void addFile(Hashing *h, const char *path, uint64_t size, ImageRun *runs, uint32_t count){
+    HashFile file;
+    memset(&file, 0, sizeof(HashFile));
+    file.path = strdup(path);
+    file.size = size;
+    file.runs = runs;
+    file.count = count;
+    file.offset = IMAGE_HOLE;
+    for(uint32_t r = 0; r < count; r++){
+        if(runs[r].offset == IMAGE_HOLE) continue;
+        if(file.offset == IMAGE_HOLE) file.offset = runs[r].offset;
+        file.stored += runs[r].length;
+    }
+
+    if(file.path != NULL && h->dups && h->numFiles == h->capFiles){
+        uint64_t cap = h->capFiles == 0 ? 256 : h->capFiles * 2;
+        HashFile *files = (HashFile *) realloc(h->files, cap * sizeof(HashFile));
+        if(files != NULL){
+            h->files = files;
+            h->capFiles = cap;
+        }
+    }
+    if(file.path == NULL || (h->dups && h->numFiles == h->capFiles)){
+        OUT_printf(h->out, ERR_HASH_FILE, path);
+        h->failures++;
+        free(file.path);
+        free(runs);
+        return;
+    }
+
+    if(!h->dups) queueFile(h, &file);
+    else{
+        file.index = h->numFiles;
+        h->files[h->numFiles++] = file;
+    }
+}
+
+/**
+ * Hands a file to the workers. When the queue is full, the oldest files are retired first (waiting for them
+ * to be hashed), so the walk never gets more than HASH_QUEUE files ahead of the workers.
+ * @param file : The file (copied into the queue)
+ */
+static void queueFile(Hashing *h, const HashFile *file){
+    if(h->added - h->retired == HASH_QUEUE) retireFiles(h, h->retired + 1);
+
+    //The stored bytes of the queued files are hinted a batch at a time, sorted, before the workers get to them
+    h->plannedFiles++;
+    for(uint32_t r = 0; r < file->count && h->planned < HASH_PLAN_BYTES; r++){
+        if(file->runs[r].offset == IMAGE_HOLE) continue;
+        uint64_t length = file->runs[r].length;
+        if(length > HASH_PLAN_BYTES - h->planned) length = HASH_PLAN_BYTES - h->planned;
+        IMAGE_planAdd(&(h->plan), file->runs[r].offset, length);
+        h->planned += length;
+    }
+    if(h->planned >= HASH_PLAN_BYTES || h->plannedFiles == HASH_PLAN_FILES){
+        IMAGE_planIssue(&(h->plan));
+        h->planned = 0;
+        h->plannedFiles = 0;
+    }
+
+    pthread_mutex_lock(&(h->lock));
+    HashFile *slot = &(h->queue[h->added % HASH_QUEUE]);
+    *slot = *file;
+    //Without workers (none could be started), the file is hashed here
+    if(h->numWorkers == 0){
+        unsigned char *buffer = NULL;
+        slot->failed = !hashFile(h, slot, &buffer);
+        slot->done = 1;
+        free(buffer);
+    }
+    h->added++;
+    pthread_cond_signal(&(h->queued));
+    pthread_mutex_unlock(&(h->lock));
+
+    //Print what's already hashed, without waiting for the rest
+    retireFiles(h, 0);
+}
+
+/**
+ * Retires the hashed files, in the order they were queued, until one isn't hashed yet
+ * @param upTo : Number of files that must be retired before returning (waiting for them if needed)
+ */
+static void retireFiles(Hashing *h, uint64_t upTo){
+    pthread_mutex_lock(&(h->lock));
+    while(h->retired < h->added){
+        HashFile *slot = &(h->queue[h->retired % HASH_QUEUE]);
+        if(!slot->done){
+            if(h->retired >= upTo) break;
+            pthread_cond_wait(&(h->hashed), &(h->lock));
+            continue;
+        }
+
+        //The slot can be queued again once it's retired: it's printed from a copy, without the lock
+        HashFile file = *slot;
+        h->retired++;
+        pthread_mutex_unlock(&(h->lock));
+        retireFile(h, &file);
+        pthread_mutex_lock(&(h->lock));
+    }
+    pthread_mutex_unlock(&(h->lock));
+}
+
+/**
+ * Prints the digest of a hashed file, or gives it back to the list of files (--dups)
+ */
+static void retireFile(Hashing *h, HashFile *file){
+    if(file->failed){
+        OUT_printf(h->out, ERR_HASH_FILE, file->path);
+        h->failures++;
+    }
+    else if(!h->dups){
+        OUT_printf(h->out, HASH_PRINT_FILE, file->digest, file->size, file->path);
+        h->count++;
+        h->bytes += file->size;
+    }
+
+    if(h->dups){
+        h->files[file->index].digest = file->digest;
+        h->files[file->index].failed = file->failed;
+        h->files[file->index].done = 1;
+    }
+    else{
+        free(file->path);
+        free(file->runs);
+    }
+}
+
+/**
+ * Takes an entry of the walk (FilesVisitor): regular files are hashed, with the runs the walk gives them
+ * @return 1, to walk the contents of every directory
+ */
+static int visitEntry(void *ctx, const FilesEntry *entry){
+    if(entry->type == FILES_FILE) addFile((Hashing *) ctx, entry->path, entry->size, entry->runs, entry->count);
+    return 1;
+}
+
+/**
+ * Reports an entry the walk couldn't read (FilesVisitor)
+ */
+static void failEntry(void *ctx, const char *path){
+    Hashing *h = (Hashing *) ctx;
+    OUT_printf(h->out, ERR_HASH_FILE, path);
+    h->failures++;
+}
+
+/**
+ * Adds zeros to a hash (the holes of a sparse file read as zeros)
+ * @return 1
+ */
+static int hashZeros(Xxh64State *state, uint64_t len){
+    while(len > 0){
+        size_t chunk = len > sizeof(zeros) ? sizeof(zeros) : (size_t) len;
+        XXH64_update(state, zeros, chunk);
+        len -= chunk;
+    }
+    return 1;
+}
+
+/**
+ * Hashes the contents of a file, run after run. Mapped images are hashed in place; otherwise the runs are read
+ * into the worker's buffer a piece at a time.
+ * @param file : The file (its digest is set)
+ * @param buffer : Buffer of the worker (allocated the first time it's needed)
+ * @return Whether the whole file could be read (1) or not (0)
+ */
+static int hashFile(Hashing *h, HashFile *file, unsigned char **buffer){
+    Xxh64State state;
+    XXH64_init(&state, 0);
+
+    uint64_t pos = 0;
+    for(uint32_t r = 0; r < file->count && pos < file->size; r++){
+        const ImageRun *run = &(file->runs[r]);
+        if(run->logical >= file->size) break;
+        if(run->logical > pos) hashZeros(&state, run->logical - pos);
+
+        uint64_t left = run->length < file->size - run->logical ? run->length : file->size - run->logical;
+        pos = run->logical + left;
+        if(run->offset == IMAGE_HOLE){
+            hashZeros(&state, left);
+            continue;
+        }
+
+        uint64_t offset = run->offset;
+        if(h->img->map != NULL){
+            if(offset > h->img->size || left > h->img->size - offset) return 0;
+            XXH64_update(&state, h->img->map + offset, (size_t) left);
+            continue;
+        }
+        if(*buffer == NULL) *buffer = (unsigned char *) malloc(HASH_BUFFER);
+        if(*buffer == NULL) return 0;
+        while(left > 0){
+            size_t chunk = left > HASH_BUFFER ? HASH_BUFFER : (size_t) left;
+            if(IMAGE_read(h->img, *buffer, chunk, offset) != chunk) return 0;
+            XXH64_update(&state, *buffer, chunk);
+            offset += chunk;
+            left -= chunk;
+        }
+    }
+    //Whatever the runs don't reach is a hole as well
+    if(pos < file->size) hashZeros(&state, file->size - pos);
+
+    file->digest = XXH64_digest(&state);
+    return 1;
+}
+
+/**
+ * Worker of the pool: takes the queued files, in order, until the queue is closed and empty
+ * @param arg : The hashing
+ * @return NULL
+ */
+static void * hashWorker(void *arg){
+    Hashing *h = (Hashing *) arg;
+    unsigned char *buffer = NULL;
+
+    pthread_mutex_lock(&(h->lock));
+    while(1){
+        while(h->taken == h->added && !h->closed) pthread_cond_wait(&(h->queued), &(h->lock));
+        if(h->taken == h->added) break;
+        HashFile *file = &(h->queue[h->taken++ % HASH_QUEUE]);
+        pthread_mutex_unlock(&(h->lock));
+
+        int ok = hashFile(h, file, &buffer);
+
+        pthread_mutex_lock(&(h->lock));
+        file->failed = !ok;
+        file->done = 1;
+        pthread_cond_signal(&(h->hashed));
+    }
+    pthread_mutex_unlock(&(h->lock));
+
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Hashes the files of the list that have the size of another one (in the order they are in the image), and
+ * prints the groups of copies: the ones wasting the most space first
+ */
+static void findDuplicates(Hashing *h){
+    //Files whose size no other file has can't have a copy. Empty files are all the same, but waste nothing.
+    if(h->numFiles > 0) qsort(h->files, h->numFiles, sizeof(HashFile), compareSizes);
+    HashFile **candidates = (HashFile **) malloc((h->numFiles > 0 ? h->numFiles : 1) * sizeof(HashFile *));
+    if(candidates == NULL){
+        OUT_printf(h->out, ERR_HASH_FILE, "The list of files");
+        h->failures++;
+        return;
+    }
+    uint64_t numCandidates = 0;
+    for(uint64_t i = 0; i < h->numFiles; i++){
+        HashFile *file = &(h->files[i]);
+        file->index = i;
+        int shared = (i > 0 && file[-1].size == file->size) || (i + 1 < h->numFiles && file[1].size == file->size);
+        if(file->size > 0 && shared) candidates[numCandidates++] = file;
+        else{
+            free(file->runs);
+            file->runs = NULL;
+        }
+        h->count++;
+        h->bytes += file->size;
+    }
+
+    //The workers get them in the order they are in the image, so it's read front to back
+    qsort(candidates, numCandidates, sizeof(HashFile *), compareOffsets);
+    for(uint64_t i = 0; i < numCandidates; i++) queueFile(h, candidates[i]);
+    free(candidates);
+    IMAGE_planIssue(&(h->plan));
+    retireFiles(h, h->added);
+
+    //Copies end up next to each other: same size, then same digest
+    if(h->numFiles > 0) qsort(h->files, h->numFiles, sizeof(HashFile), compareCopies);
+    HashGroup *groups = NULL;
+    uint64_t numGroups = 0, capGroups = 0, extra = 0, wasted = 0;
+    for(uint64_t i = 0, end = 1; i < h->numFiles; i = end, end = i + 1){
+        const HashFile *first = &(h->files[i]);
+        if(!first->done || first->failed) continue;
+        while(end < h->numFiles && h->files[end].size == first->size && h->files[end].digest == first->digest
+              && h->files[end].done && !h->files[end].failed) end++;
+        if(end - i < 2) continue;
+
+        //One copy is kept (the one taking the least space): the others are wasted
+        uint64_t stored = 0, kept = first->stored;
+        for(uint64_t j = i; j < end; j++){
+            stored += h->files[j].stored;
+            if(h->files[j].stored < kept) kept = h->files[j].stored;
+        }
+
+        if(numGroups == capGroups){
+            uint64_t cap = capGroups == 0 ? 64 : capGroups * 2;
+            HashGroup *bigger = (HashGroup *) realloc(groups, cap * sizeof(HashGroup));
+            if(bigger == NULL){
+                OUT_printf(h->out, ERR_HASH_FILE, "The list of duplicates");
+                h->failures++;
+                break;
+            }
+            groups = bigger;
+            capGroups = cap;
+        }
+        groups[numGroups++] = (HashGroup) {i, end - i, stored - kept};
+        extra += end - i - 1;
+        wasted += stored - kept;
+    }
+
+    if(numGroups > 0) qsort(groups, numGroups, sizeof(HashGroup), compareGroups);
+    for(uint64_t g = 0; g < numGroups; g++){
+        const HashFile *first = &(h->files[groups[g].first]);
+        OUT_printf(h->out, HASH_PRINT_GROUP, groups[g].count, first->size, first->digest, groups[g].wasted);
+        for(uint64_t i = 0; i < groups[g].count; i++) OUT_printf(h->out, HASH_PRINT_COPY, first[i].path);
+        OUT_printf(h->out, "\n");
+    }
+    OUT_printf(h->out, HASH_PRINT_DUPS_SUMMARY, h->count, h->added, numGroups, extra, wasted);
+    free(groups);
+}
+
+/**
+ * Orders files by size (qsort)
+ */
+static int compareSizes(const void *a, const void *b){
+    uint64_t x = ((const HashFile *) a)->size, y = ((const HashFile *) b)->size;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Orders pointers to files by where their first byte is in the image (qsort)
+ */
+static int compareOffsets(const void *a, const void *b){
+    uint64_t x = (*(HashFile * const *) a)->offset, y = (*(HashFile * const *) b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Orders files by size, then by digest, then by path (qsort)
+ */
+static int compareCopies(const void *a, const void *b){
+    const HashFile *x = (const HashFile *) a, *y = (const HashFile *) b;
+    if(x->size != y->size) return x->size < y->size ? -1 : 1;
+    if(x->digest != y->digest) return x->digest < y->digest ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+/**
+ * Orders groups of copies by the space they waste, most first (qsort)
+ */
+static int compareGroups(const void *a, const void *b){
+    uint64_t x = ((const HashGroup *) a)->wasted, y = ((const HashGroup *) b)->wasted;
+    return x > y ? -1 : x < y;
+}
+
+/**
+ * Hashes the contents of every regular file of a filesystem with XXH64. The walk of the tree feeds a pool of
+ * workers (one per CPU), each one hashing whole files straight from the image, and the digests are printed in
+ * the order of the walk, with the size and the path of each file.
+ * With dups, the files are grouped by size first: only the ones that have the size of another file are hashed,
+ * and the files with the same size & digest are reported as copies, with the space the extra ones take in the
+ * image.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2)
+ * @param dups : Whether to report the duplicate files (1) or every digest (0)
+ * @param out : Output where the digests or the duplicates are printed
+ * @return Whether every file could be read (1) or not (0)
+ */
+int HASH_run(Image *img, Ext2 *ext2, Fat16 *fat16, int dups, Output *out){
+    Hashing h;
+    memset(&h, 0, sizeof(Hashing));
+    h.img = img;
+    h.ext2 = ext2;
+    h.fat16 = fat16;
+    h.dups = dups;
+    h.out = out;
+    h.queue = (HashFile *) malloc(HASH_QUEUE * sizeof(HashFile));
+    if(h.queue == NULL){
+        OUT_printf(out, ERR_HASH_FILE, "The queue of files");
+        return 0;
+    }
+    pthread_mutex_init(&(h.lock), NULL);
+    pthread_cond_init(&(h.queued), NULL);
+    pthread_cond_init(&(h.hashed), NULL);
+    IMAGE_planInit(&(h.plan), img);
+
+    //The workers wait for the walk to queue files (--dups queues them once the walk is over)
+    int threads = WALK_threads();
+    pthread_t workers[WALK_MAX_THREADS];
+    while(h.numWorkers < threads && pthread_create(&workers[h.numWorkers], NULL, hashWorker, &h) == 0) h.numWorkers++;
+
+    char path[PATH_MAX] = "";
+    FilesVisitor visitor = {visitEntry, NULL, failEntry, &h, 1};
+    OUT_printf(out, dups ? HASH_PRINT_DUPS : HASH_PRINT);
+    FILES_walk(img, ext2, fat16, path, &visitor);
+
+    if(dups) findDuplicates(&h);
+    else{
+        IMAGE_planIssue(&(h.plan));
+        retireFiles(&h, h.added);
+        OUT_printf(out, HASH_PRINT_SUMMARY, h.count, h.bytes);
+    }
+
+    //Every file is hashed: the workers are done once they see the queue closed
+    pthread_mutex_lock(&(h.lock));
+    h.closed = 1;
+    pthread_cond_broadcast(&(h.queued));
+    pthread_mutex_unlock(&(h.lock));
+    for(int i = 0; i < h.numWorkers; i++) pthread_join(workers[i], NULL);
+
+    for(uint64_t i = 0; i < h.numFiles; i++){
+        free(h.files[i].path);
+        free(h.files[i].runs);
+    }
+    free(h.files);
+    free(h.queue);
+    IMAGE_planFree(&(h.plan));
+    pthread_cond_destroy(&(h.queued));
+    pthread_cond_destroy(&(h.hashed));
+    pthread_mutex_destroy(&(h.lock));
+    return h.failures == 0;
+}
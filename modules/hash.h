@@ -0,0 +1,50 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "image.h"
+#include "output.h"
+#include "ext2.h"
+#include "fat16.h"
+#include "xxh64.h"
+
+// Files handed to the workers and not printed yet: the walk waits when it's this far ahead of them
+#define HASH_QUEUE 1024
+// Bytes read at a time by a worker, when the image isn't mapped
+#define HASH_BUFFER (1024 * 1024)
+// Queued files are hinted to the kernel a batch at a time (see ImagePlan), ahead of the workers: after this
+// many bytes or files, whichever comes first
+#define HASH_PLAN_BYTES (64ULL * 1024 * 1024)
+#define HASH_PLAN_FILES (HASH_QUEUE / 4)
+
+#define ERR_HASH_FILE "Error. %s could not be read.\n"
+#define HASH_PRINT "\n------ Hashes (XXH64) ------\n\n"
+#define HASH_PRINT_FILE "%016" PRIx64 " %14" PRIu64 "  %s\n"
+#define HASH_PRINT_SUMMARY "\nFiles: %" PRIu64 " (%" PRIu64 " bytes)\n\n"
+#define HASH_PRINT_DUPS "\n------ Duplicates (XXH64) ------\n\n"
+#define HASH_PRINT_GROUP "%" PRIu64 " files of %" PRIu64 " bytes (%016" PRIx64 "), %" PRIu64 " bytes wasted:\n"
+#define HASH_PRINT_COPY "    %s\n"
+#define HASH_PRINT_DUPS_SUMMARY "Files: %" PRIu64 " (%" PRIu64 " hashed, having the size of another one)\nDuplicates: %" PRIu64 " groups, %" PRIu64 " extra copies, %" PRIu64 " bytes wasted\n\n"
+
+/**
+ * Hashes the contents of every regular file of a filesystem with XXH64. The walk of the tree feeds a pool of
+ * workers (one per CPU), each one hashing whole files straight from the image, and the digests are printed in
+ * the order of the walk, with the size and the path of each file.
+ * With dups, the files are grouped by size first: only the ones that have the size of another file are hashed,
+ * and the files with the same size & digest are reported as copies, with the space the extra ones take in the
+ * image.
+ * @param img : The image
+ * @param ext2 : The mounted EXT2 filesystem (NULL if the image holds FAT16)
+ * @param fat16 : The mounted FAT16 filesystem (NULL if the image holds EXT2)
+ * @param dups : Whether to report the duplicate files (1) or every digest (0)
+ * @param out : Output where the digests or the duplicates are printed
+ * @return Whether every file could be read (1) or not (0)
+ */
+int HASH_run(Image *img, Ext2 *ext2, Fat16 *fat16, int dups, Output *out);
+
+#endif
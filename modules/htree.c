@@ -0,0 +1,180 @@
+#include "htree.h"
+
+// Largest hash value: the one after it marks the end of the directory when reading it by hash
+#define HTREE_EOF 0x7FFFFFFFU
+
+// Half MD4 round functions and constants
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = rotateLeft(a, s))
+#define K2 0x5A827999
+#define K3 0x6ED9EBA1
+
+// TEA constant
+#define TEA_DELTA 0x9E3779B9
+
+static uint32_t rotateLeft(uint32_t value, int shift){
+    return (value << shift) | (value >> (32 - shift));
+}
+
+/**
+ * Mixes 32 bytes of the name into the hash buffer (half of an MD4 transform)
+ * @param buf : The hash buffer
+ * @param in : 8 words of the name
+ */
+static void halfMd4Transform(uint32_t buf[4], const uint32_t in[8]){
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    ROUND(F, a, b, c, d, in[0], 3);
+    ROUND(F, d, a, b, c, in[1], 7);
+    ROUND(F, c, d, a, b, in[2], 11);
+    ROUND(F, b, c, d, a, in[3], 19);
+    ROUND(F, a, b, c, d, in[4], 3);
+    ROUND(F, d, a, b, c, in[5], 7);
+    ROUND(F, c, d, a, b, in[6], 11);
+    ROUND(F, b, c, d, a, in[7], 19);
+
+    ROUND(G, a, b, c, d, in[1] + K2, 3);
+    ROUND(G, d, a, b, c, in[3] + K2, 5);
+    ROUND(G, c, d, a, b, in[5] + K2, 9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2, 3);
+    ROUND(G, d, a, b, c, in[2] + K2, 5);
+    ROUND(G, c, d, a, b, in[4] + K2, 9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    ROUND(H, a, b, c, d, in[3] + K3, 3);
+    ROUND(H, d, a, b, c, in[7] + K3, 9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3, 3);
+    ROUND(H, d, a, b, c, in[5] + K3, 9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/**
+ * Mixes 16 bytes of the name into the hash buffer (16 rounds of TEA)
+ * @param buf : The hash buffer
+ * @param in : 4 words of the name
+ */
+static void teaTransform(uint32_t buf[4], const uint32_t in[4]){
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+
+    for(int n = 0; n < 16; n++){
+        sum += TEA_DELTA;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/**
+ * Hash of the first htree implementation (legacy)
+ * @param name : The name
+ * @param len : Length of the name
+ * @param isUnsigned : Whether the characters are taken as unsigned (1) or signed (0)
+ * @return The hash
+ */
+static uint32_t legacyHash(const char *name, size_t len, int isUnsigned){
+    uint32_t hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+
+    for(size_t i = 0; i < len; i++){
+        int c = isUnsigned ? (int) (unsigned char) name[i] : (int) (signed char) name[i];
+        uint32_t hash = hash1 + (hash0 ^ (uint32_t) (c * 7152373));
+        if(hash & 0x80000000) hash -= 0x7FFFFFFF;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+/**
+ * Packs (up to) num words of the name into buf, padding them with the length of the name
+ * @param name : The part of the name still to hash
+ * @param len : Its length
+ * @param buf : Output, num words
+ * @param num : Number of words to fill
+ * @param isUnsigned : Whether the characters are taken as unsigned (1) or signed (0)
+ */
+static void nameToWords(const char *name, size_t len, uint32_t *buf, int num, int isUnsigned){
+    uint32_t pad = (uint32_t) len | ((uint32_t) len << 8);
+    pad |= pad << 16;
+
+    uint32_t value = pad;
+    if(len > (size_t) num * 4) len = num * 4;
+    for(size_t i = 0; i < len; i++){
+        int c = isUnsigned ? (int) (unsigned char) name[i] : (int) (signed char) name[i];
+        value = (uint32_t) c + (value << 8);
+        if(i % 4 == 3){
+            *buf++ = value;
+            value = pad;
+            num--;
+        }
+    }
+    if(--num >= 0) *buf++ = value;
+    while(--num >= 0) *buf++ = pad;
+}
+
+/**
+ * Computes the hash of a directory entry name, as used to place it in a hashed directory (htree).
+ * The lowest bit of the hash is always 0: in the htree it flags blocks continuing a run of equal hashes.
+ * @param name : The name (it doesn't need to end with '\0')
+ * @param len : Length of the name
+ * @param version : Hash version (HTREE_HASH_*)
+ * @param seed : Hash seed of the filesystem (s_hash_seed), all zeros to use the default one
+ * @param hash : Output, the hash of the name
+ * @return Whether the hash version is supported (1) or not (0)
+ */
+int HTREE_hash(const char *name, size_t len, int version, const uint32_t seed[4], uint32_t *hash){
+    uint32_t buf[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+    uint32_t in[8];
+
+    if(seed[0] != 0 || seed[1] != 0 || seed[2] != 0 || seed[3] != 0) memcpy(buf, seed, sizeof(buf));
+
+    int isUnsigned = version >= HTREE_HASH_LEGACY_UNSIGNED;
+    switch(version){
+        case HTREE_HASH_LEGACY:
+        case HTREE_HASH_LEGACY_UNSIGNED:
+            *hash = legacyHash(name, len, isUnsigned);
+            break;
+        case HTREE_HASH_HALF_MD4:
+        case HTREE_HASH_HALF_MD4_UNSIGNED:
+            //32 bytes at a time
+            while(len > 0){
+                nameToWords(name, len, in, 8, isUnsigned);
+                halfMd4Transform(buf, in);
+                if(len <= 32) break;
+                name += 32;
+                len -= 32;
+            }
+            *hash = buf[1];
+            break;
+        case HTREE_HASH_TEA:
+        case HTREE_HASH_TEA_UNSIGNED:
+            //16 bytes at a time
+            while(len > 0){
+                nameToWords(name, len, in, 4, isUnsigned);
+                teaTransform(buf, in);
+                if(len <= 16) break;
+                name += 16;
+                len -= 16;
+            }
+            *hash = buf[0];
+            break;
+        default:
+            return 0;
+    }
+
+    *hash &= ~1U;
+    if(*hash == (HTREE_EOF << 1)) *hash = (HTREE_EOF - 1) << 1;
+    return 1;
+}
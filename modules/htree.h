@@ -0,0 +1,28 @@
+#ifndef HTREE_H
+#define HTREE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// Hash versions, as stored in the htree root (and in s_def_hash_version)
+#define HTREE_HASH_LEGACY 0
+#define HTREE_HASH_HALF_MD4 1
+#define HTREE_HASH_TEA 2
+#define HTREE_HASH_LEGACY_UNSIGNED 3
+#define HTREE_HASH_HALF_MD4_UNSIGNED 4
+#define HTREE_HASH_TEA_UNSIGNED 5
+
+/**
+ * Computes the hash of a directory entry name, as used to place it in a hashed directory (htree).
+ * The lowest bit of the hash is always 0: in the htree it flags blocks continuing a run of equal hashes.
+ * @param name : The name (it doesn't need to end with '\0')
+ * @param len : Length of the name
+ * @param version : Hash version (HTREE_HASH_*)
+ * @param seed : Hash seed of the filesystem (s_hash_seed), all zeros to use the default one
+ * @param hash : Output, the hash of the name
+ * @return Whether the hash version is supported (1) or not (0)
+ */
+int HTREE_hash(const char *name, size_t len, int version, const uint32_t seed[4], uint32_t *hash);
+
+#endif
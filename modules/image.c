@@ -0,0 +1,761 @@
+#define _GNU_SOURCE
+#include "image.h"
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// io_uring of a queue: the submission & completion rings, mapped from the kernel
+struct ImageRing {
+    int fd;
+    unsigned char *sq, *cq;         // Mapped rings (the same mapping when the kernel has IORING_FEAT_SINGLE_MMAP)
+    size_t sqLen, cqLen;
+    struct io_uring_sqe *sqes;
+    size_t sqesLen;
+    uint32_t *sqHead, *sqTail, *sqMask, *sqArray;
+    uint32_t *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+};
+
+// Cache of the small reads of a direct image: a few aligned blocks, in sets of IMAGE_DIRECT_WAYS, evicting the
+// least recently used block of a set. The lock is only held to look blocks up and to copy them.
+struct ImageCache {
+    pthread_mutex_t lock;
+    unsigned char *data;                        // IMAGE_DIRECT_BLOCKS blocks, aligned
+    uint64_t blocks[IMAGE_DIRECT_BLOCKS];       // Block of the image held by each slot (UINT64_MAX: none)
+    uint32_t lengths[IMAGE_DIRECT_BLOCKS];      // Valid bytes of each slot (the last block may be short)
+    uint64_t lastUse[IMAGE_DIRECT_BLOCKS];
+    uint64_t clock;
+};
+
+static size_t preadFull(int fd, void *dst, size_t len, uint64_t offset);
+static void * alignedAlloc(size_t len);
+static struct ImageCache * createCache(void);
+static size_t cachedRead(Image *img, uint64_t block, size_t inBlock, void *dst, size_t len);
+static size_t directRead(Image *img, void *dst, size_t len, uint64_t offset);
+static int compareRanges(const void *a, const void *b);
+static struct ImageRing * setupRing(uint32_t depth);
+static void freeRing(struct ImageRing *ring);
+static void drainRing(ImageQueue *queue);
+
+/**
+ * Opens a partition image read-only and tries to map it into memory. The first IMAGE_PROBE_SIZE bytes are
+ * read in one go into img->probe, so that the filesystem can be detected and its superblock parsed from memory.
+ * The same Image is then handed to every command.
+ * With IMAGE_DIRECT the image is read with O_DIRECT instead, and never mapped.
+ * @param img : Image structure to fill
+ * @param path : Path to the partition image
+ * @param flags : 0 or IMAGE_DIRECT
+ * @return Whether the image could be opened (1) or not (0, with errno set to EINVAL if O_DIRECT isn't supported)
+ */
+int IMAGE_open(Image *img, const char *path, int flags){
+    memset(img, 0, sizeof(Image));
+    img->path = path;
+    img->direct = (flags & IMAGE_DIRECT) != 0;
+
+    img->fd = open(path, img->direct ? O_RDONLY | O_DIRECT : O_RDONLY);
+    if(img->fd < 0) return 0;
+
+    //Block devices report a size of 0 in st_size, so we ask for the end of the file instead
+    off_t end = lseek(img->fd, 0, SEEK_END);
+    if(end <= 0){
+        close(img->fd);
+        img->fd = -1;
+        return 0;
+    }
+    img->size = (uint64_t) end;
+
+    if(img->direct){
+        //Everything is read through the cache and aligned buffers: the window must be aligned too
+        img->cache = createCache();
+        img->windowCap = IMAGE_WINDOW_SIZE;
+        img->window = (unsigned char *) alignedAlloc(img->windowCap);
+        if(img->cache == NULL || img->window == NULL){
+            IMAGE_close(img);
+            errno = ENOMEM;
+            return 0;
+        }
+        img->probeLen = directRead(img, img->probe, img->size < IMAGE_PROBE_SIZE ? img->size : IMAGE_PROBE_SIZE, 0);
+        //Some filesystems (e.g. tmpfs) take O_DIRECT at open and refuse it at the first read
+        if(img->probeLen == 0){
+            IMAGE_close(img);
+            errno = EINVAL;
+            return 0;
+        }
+        return 1;
+    }
+
+    //Read the start of the image (where the boot sector & the superblock are) with a single read
+    img->probeLen = preadFull(img->fd, img->probe, IMAGE_PROBE_SIZE, 0);
+
+    //Map the whole image. If it can't be done (e.g. 32-bit address space), we fall back to pread
+    void *map = mmap(NULL, img->size, PROT_READ, MAP_SHARED, img->fd, 0);
+    if(map != MAP_FAILED){
+        img->map = (const unsigned char *) map;
+        return 1;
+    }
+
+    img->windowCap = IMAGE_WINDOW_SIZE;
+    img->window = (unsigned char *) malloc(img->windowCap);
+    if(img->window == NULL){
+        close(img->fd);
+        img->fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Closes the image, unmapping it and releasing the fallback buffer (and the cache of direct reads)
+ * @param img : The image to close
+ */
+void IMAGE_close(Image *img){
+    if(img->map != NULL) munmap((void *) img->map, img->size);
+    free(img->window);
+    if(img->cache != NULL){
+        pthread_mutex_destroy(&(img->cache->lock));
+        free(img->cache->data);
+        free(img->cache);
+    }
+    if(img->fd >= 0) close(img->fd);
+
+    img->map = NULL;
+    img->window = NULL;
+    img->cache = NULL;
+    img->fd = -1;
+}
+
+/**
+ * Reads exactly len bytes at offset with pread, retrying on short reads
+ * @return Number of bytes read
+ */
+static size_t preadFull(int fd, void *dst, size_t len, uint64_t offset){
+    size_t done = 0;
+    while(done < len){
+        ssize_t r = pread(fd, (char *) dst + done, len - done, (off_t) (offset + done));
+        if(r <= 0) break;
+        done += (size_t) r;
+    }
+    return done;
+}
+
+/**
+ * Allocates a buffer aligned for direct reads
+ * @param len : Bytes of the buffer
+ * @return The buffer (released with free), or NULL
+ */
+static void * alignedAlloc(size_t len){
+    void *buf;
+    if(posix_memalign(&buf, IMAGE_DIRECT_ALIGN, len) != 0) return NULL;
+    return buf;
+}
+
+/**
+ * Allocates an empty cache for the small reads of a direct image
+ * @return The cache, or NULL
+ */
+static struct ImageCache * createCache(void){
+    struct ImageCache *cache = (struct ImageCache *) calloc(1, sizeof(struct ImageCache));
+    if(cache == NULL) return NULL;
+    cache->data = (unsigned char *) alignedAlloc((size_t) IMAGE_DIRECT_BLOCKS * IMAGE_DIRECT_ALIGN);
+    if(cache->data == NULL){
+        free(cache);
+        return NULL;
+    }
+    for(int i = 0; i < IMAGE_DIRECT_BLOCKS; i++) cache->blocks[i] = UINT64_MAX;
+    pthread_mutex_init(&(cache->lock), NULL);
+    return cache;
+}
+
+/**
+ * Copies bytes of one aligned block of a direct image, from the cache, reading the block into it if it isn't there
+ * @param img : The image
+ * @param block : Number of the block (offset / IMAGE_DIRECT_ALIGN)
+ * @param inBlock : Offset of the first byte inside the block
+ * @param dst : Destination buffer
+ * @param len : Number of bytes (they don't go past the block)
+ * @return Number of bytes copied (less than len at the end of the image, or if it can't be read)
+ */
+static size_t cachedRead(Image *img, uint64_t block, size_t inBlock, void *dst, size_t len){
+    struct ImageCache *cache = img->cache;
+    uint32_t set = (uint32_t) (block % (IMAGE_DIRECT_BLOCKS / IMAGE_DIRECT_WAYS)) * IMAGE_DIRECT_WAYS;
+
+    pthread_mutex_lock(&(cache->lock));
+    for(uint32_t i = set; i < set + IMAGE_DIRECT_WAYS; i++){
+        if(cache->blocks[i] != block) continue;
+        size_t got = cache->lengths[i] > inBlock ? cache->lengths[i] - inBlock : 0;
+        if(got > len) got = len;
+        memcpy(dst, cache->data + (size_t) i * IMAGE_DIRECT_ALIGN + inBlock, got);
+        cache->lastUse[i] = ++cache->clock;
+        pthread_mutex_unlock(&(cache->lock));
+        return got;
+    }
+    pthread_mutex_unlock(&(cache->lock));
+
+    //Miss: read the block without holding the lock, so other threads keep hitting the cache meanwhile
+    unsigned char buf[IMAGE_DIRECT_ALIGN] __attribute__((aligned(IMAGE_DIRECT_ALIGN)));
+    size_t length = preadFull(img->fd, buf, IMAGE_DIRECT_ALIGN, block * IMAGE_DIRECT_ALIGN);
+    size_t got = length > inBlock ? length - inBlock : 0;
+    if(got > len) got = len;
+    memcpy(dst, buf + inBlock, got);
+    if(length == 0) return 0;
+
+    pthread_mutex_lock(&(cache->lock));
+    uint32_t victim = set;
+    for(uint32_t i = set; i < set + IMAGE_DIRECT_WAYS; i++){
+        //Another thread may have read it too
+        if(cache->blocks[i] == block){
+            victim = i;
+            break;
+        }
+        if(cache->lastUse[i] < cache->lastUse[victim]) victim = i;
+    }
+    memcpy(cache->data + (size_t) victim * IMAGE_DIRECT_ALIGN, buf, length);
+    cache->blocks[victim] = block;
+    cache->lengths[victim] = (uint32_t) length;
+    cache->lastUse[victim] = ++cache->clock;
+    pthread_mutex_unlock(&(cache->lock));
+    return got;
+}
+
+/**
+ * Reads bytes of a direct image (the range must be inside it). Small reads go through the cache, big ones
+ * are read in aligned pieces through a bounce buffer.
+ * @param img : The image
+ * @param dst : Destination buffer (any alignment)
+ * @param len : Number of bytes
+ * @param offset : Byte offset inside the image
+ * @return Number of bytes read
+ */
+static size_t directRead(Image *img, void *dst, size_t len, uint64_t offset){
+    size_t done = 0;
+    if(len < IMAGE_DIRECT_BYPASS){
+        while(done < len){
+            uint64_t pos = offset + done;
+            size_t inBlock = (size_t) (pos % IMAGE_DIRECT_ALIGN);
+            size_t chunk = IMAGE_DIRECT_ALIGN - inBlock < len - done ? IMAGE_DIRECT_ALIGN - inBlock : len - done;
+            size_t got = cachedRead(img, pos / IMAGE_DIRECT_ALIGN, inBlock, (char *) dst + done, chunk);
+            done += got;
+            if(got < chunk) break;
+        }
+        return done;
+    }
+
+    //File contents: read once, they aren't kept
+    size_t head = (size_t) (offset % IMAGE_DIRECT_ALIGN);
+    size_t span = (head + len + IMAGE_DIRECT_ALIGN - 1) / IMAGE_DIRECT_ALIGN * IMAGE_DIRECT_ALIGN;
+    size_t bounceLen = span < IMAGE_DIRECT_BOUNCE ? span : IMAGE_DIRECT_BOUNCE;
+    unsigned char *bounce = (unsigned char *) alignedAlloc(bounceLen);
+    if(bounce == NULL) return 0;
+
+    uint64_t pos = offset - head;
+    while(done < len){
+        size_t want = head + (len - done);
+        want = (want + IMAGE_DIRECT_ALIGN - 1) / IMAGE_DIRECT_ALIGN * IMAGE_DIRECT_ALIGN;
+        if(want > bounceLen) want = bounceLen;
+        size_t got = preadFull(img->fd, bounce, want, pos);
+        if(got <= head) break;
+
+        size_t chunk = got - head < len - done ? got - head : len - done;
+        memcpy((char *) dst + done, bounce + head, chunk);
+        done += chunk;
+        pos += got;
+        head = 0;
+        if(got < want) break;
+    }
+    free(bounce);
+    return done;
+}
+
+/**
+ * Returns a pointer to len bytes of the image starting at offset.
+ * When the image is mapped the pointer points straight into the mapping and stays valid until IMAGE_close.
+ * Otherwise the bytes are pread into the fallback buffer, and the pointer is only valid until the next
+ * IMAGE_get call on the same image.
+ * @param img : The image
+ * @param offset : Byte offset inside the image
+ * @param len : Number of bytes wanted
+ * @return Pointer to the bytes, or NULL if the range is outside the image
+ */
+const void * IMAGE_get(Image *img, uint64_t offset, size_t len){
+    if(offset > img->size || len > img->size - offset) return NULL;
+
+    //Zero-copy path
+    if(img->map != NULL) return img->map + offset;
+
+    //The range is already in the fallback buffer
+    if(offset >= img->windowOffset && offset + len <= img->windowOffset + img->windowLen)
+        return img->window + (offset - img->windowOffset);
+
+    //Direct images are read from an aligned offset, in whole blocks
+    uint64_t start = img->direct ? offset - offset % IMAGE_DIRECT_ALIGN : offset;
+    size_t need = (size_t) (offset - start) + len;
+    if(img->direct) need = (need + IMAGE_DIRECT_ALIGN - 1) / IMAGE_DIRECT_ALIGN * IMAGE_DIRECT_ALIGN;
+
+    //Grow the fallback buffer if a single request is bigger than it
+    if(need > img->windowCap){
+        unsigned char *bigger = img->direct ? (unsigned char *) alignedAlloc(need)
+                                            : (unsigned char *) realloc(img->window, need);
+        if(bigger == NULL) return NULL;
+        if(img->direct) free(img->window);
+        img->window = bigger;
+        img->windowCap = need;
+    }
+
+    //Fill the whole buffer, so that the following small reads (next entries, next inodes) hit it. Direct
+    //reads are kept to what's needed instead, since nothing is read ahead for us: a read past the end of
+    //the image just comes back short.
+    size_t fill = img->direct ? need : img->windowCap;
+    if(!img->direct && fill > img->size - offset) fill = img->size - offset;
+
+    img->windowLen = preadFull(img->fd, img->window, fill, start);
+    img->windowOffset = start;
+    if(img->windowLen < (size_t) (offset - start) + len) return NULL;
+
+    return img->window + (offset - start);
+}
+
+/**
+ * Copies len bytes of the image starting at offset into dst
+ * @param img : The image
+ * @param dst : Destination buffer
+ * @param len : Number of bytes to copy
+ * @param offset : Byte offset inside the image
+ * @return Number of bytes copied (less than len if the range goes past the end of the image)
+ */
+size_t IMAGE_read(Image *img, void *dst, size_t len, uint64_t offset){
+    if(offset >= img->size) return 0;
+    if(len > img->size - offset) len = img->size - offset;
+
+    if(img->map != NULL){
+        memcpy(dst, img->map + offset, len);
+        return len;
+    }
+    if(img->direct) return directRead(img, dst, len, offset);
+    return preadFull(img->fd, dst, len, offset);
+}
+
+/**
+ * Writes len bytes to fd, retrying on short writes
+ * @return Whether all the bytes were written (1) or not (0)
+ */
+static int writeFull(int fd, const void *src, size_t len){
+    size_t done = 0;
+    while(done < len){
+        ssize_t w = write(fd, (const char *) src + done, len - done);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) return 0;
+        done += (size_t) w;
+    }
+    return 1;
+}
+
+/**
+ * Copies len bytes of the image starting at offset to an output file descriptor.
+ * The copy is done in the kernel with sendfile when possible (not on direct images), and with large writes otherwise.
+ * Callers that also print through stdio must flush it before calling this function.
+ * @param img : The image
+ * @param outFd : Destination file descriptor
+ * @param offset : Byte offset inside the image
+ * @param len : Number of bytes to copy
+ * @return Whether all the bytes were copied (1) or not (0)
+ */
+int IMAGE_copyTo(Image *img, int outFd, uint64_t offset, uint64_t len){
+    if(offset > img->size || len > img->size - offset) return 0;
+
+    //Kernel-side copy: the data never goes through user space (sendfile would go through the page cache)
+    off_t pos = (off_t) offset;
+    while(len > 0 && !img->direct){
+        ssize_t sent = sendfile(outFd, img->fd, &pos, len);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) break;
+        len -= (uint64_t) sent;
+    }
+    if(len == 0) return 1;
+    offset = (uint64_t) pos;
+
+    //sendfile is not supported for this pair of descriptors (or the image is direct): write from the image instead
+    while(len > 0){
+        size_t chunk = len > IMAGE_WINDOW_SIZE ? IMAGE_WINDOW_SIZE : (size_t) len;
+        const void *data = IMAGE_get(img, offset, chunk);
+        if(data == NULL || !writeFull(outFd, data, chunk)) return 0;
+
+        offset += chunk;
+        len -= chunk;
+    }
+    return 1;
+}
+
+/**
+ * Copies bytes of a file into dst, given where the file is in the image. The run holding pos is found
+ * with a binary search, so reading any part of the file costs the same. It can be called from several threads.
+ * @param img : The image
+ * @param runs : The runs of the file, in order and one after the other (the last one ends the file)
+ * @param count : Number of runs
+ * @param dst : Destination buffer
+ * @param len : Number of bytes to copy
+ * @param pos : Byte offset inside the file
+ * @return Number of bytes copied (less than len at the end of the file, or if the image can't be read)
+ */
+size_t IMAGE_readRuns(Image *img, const ImageRun *runs, uint32_t count, void *dst, size_t len, uint64_t pos){
+    //Last run starting at or before pos
+    uint32_t low = 0, high = count;
+    while(high - low > 1){
+        uint32_t mid = low + (high - low) / 2;
+        if(runs[mid].logical <= pos) low = mid;
+        else high = mid;
+    }
+
+    size_t done = 0;
+    for(uint32_t i = low; i < count && done < len; i++){
+        const ImageRun *run = &runs[i];
+        if(pos < run->logical || pos - run->logical >= run->length) break;
+
+        uint64_t inRun = pos - run->logical;
+        size_t chunk = run->length - inRun < len - done ? (size_t) (run->length - inRun) : len - done;
+        if(run->offset == IMAGE_HOLE) memset((char *) dst + done, 0, chunk);
+        else{
+            size_t got = IMAGE_read(img, (char *) dst + done, chunk, run->offset + inRun);
+            if(got < chunk) return done + got;
+        }
+        done += chunk;
+        pos += chunk;
+    }
+    return done;
+}
+
+/**
+ * Prepares a read planner for an image
+ * @param plan : The planner to initialize
+ * @param img : The image
+ */
+void IMAGE_planInit(ImagePlan *plan, Image *img){
+    memset(plan, 0, sizeof(ImagePlan));
+    plan->img = img;
+    //Hints fill the page cache, which direct images stay out of
+    plan->enabled = img->size >= IMAGE_PLAN_MIN_IMAGE && !img->direct;
+}
+
+/**
+ * Adds a range that's about to be read to a planner (nothing is done if the image isn't worth planning)
+ * @param plan : The planner
+ * @param offset : Byte offset inside the image
+ * @param length : Bytes of the range
+ */
+void IMAGE_planAdd(ImagePlan *plan, uint64_t offset, uint64_t length){
+    if(!plan->enabled || length == 0 || offset >= plan->img->size) return;
+
+    if(plan->count == plan->cap){
+        size_t cap = plan->cap == 0 ? 64 : plan->cap * 2;
+        ImageRange *bigger = (ImageRange *) realloc(plan->ranges, cap * sizeof(ImageRange));
+        //Hints are optional: without memory, the range just isn't hinted
+        if(bigger == NULL) return;
+        plan->ranges = bigger;
+        plan->cap = cap;
+    }
+    plan->ranges[plan->count].offset = offset;
+    plan->ranges[plan->count].length = length;
+    plan->count++;
+}
+
+/**
+ * Orders ranges by offset (qsort)
+ */
+static int compareRanges(const void *a, const void *b){
+    uint64_t x = ((const ImageRange *) a)->offset, y = ((const ImageRange *) b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Hints the planned ranges to the kernel (posix_fadvise WILLNEED): sorted by offset, with close ranges
+ * merged, so the device reads them in ascending order. The planner is emptied, to plan the next step.
+ * @param plan : The planner
+ */
+void IMAGE_planIssue(ImagePlan *plan){
+    if(plan->count == 0) return;
+    qsort(plan->ranges, plan->count, sizeof(ImageRange), compareRanges);
+
+    uint64_t start = plan->ranges[0].offset;
+    uint64_t end = start + plan->ranges[0].length;
+    for(size_t i = 1; i <= plan->count; i++){
+        if(i < plan->count && plan->ranges[i].offset <= end + IMAGE_PLAN_GAP){
+            uint64_t rangeEnd = plan->ranges[i].offset + plan->ranges[i].length;
+            if(rangeEnd > end) end = rangeEnd;
+            continue;
+        }
+        posix_fadvise(plan->img->fd, (off_t) start, (off_t) (end - start), POSIX_FADV_WILLNEED);
+        if(i < plan->count){
+            start = plan->ranges[i].offset;
+            end = start + plan->ranges[i].length;
+        }
+    }
+    plan->count = 0;
+}
+
+/**
+ * Frees the ranges of a planner
+ * @param plan : The planner
+ */
+void IMAGE_planFree(ImagePlan *plan){
+    free(plan->ranges);
+    plan->ranges = NULL;
+    plan->count = plan->cap = 0;
+}
+
+/**
+ * Sets up an io_uring, with raw system calls (no liburing needed)
+ * @param depth : Entries of the submission ring
+ * @return The ring, or NULL if the kernel doesn't have io_uring or doesn't let us use it
+ */
+static struct ImageRing * setupRing(uint32_t depth){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int) syscall(__NR_io_uring_setup, depth, &params);
+    if(fd < 0) return NULL;
+
+    struct ImageRing *ring = (struct ImageRing *) calloc(1, sizeof(struct ImageRing));
+    if(ring == NULL){
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->sqLen = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cqLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(ring->cqLen > ring->sqLen) ring->sqLen = ring->cqLen;
+        ring->cqLen = ring->sqLen;
+    }
+    ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    void *sq = mmap(NULL, ring->sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *cq = sq;
+    if(sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+        cq = mmap(NULL, ring->cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ring->sq = sq == MAP_FAILED ? NULL : (unsigned char *) sq;
+    ring->cq = cq == MAP_FAILED ? NULL : (unsigned char *) cq;
+    ring->sqes = sqes == MAP_FAILED ? NULL : (struct io_uring_sqe *) sqes;
+    if(ring->sq == NULL || ring->cq == NULL || ring->sqes == NULL){
+        freeRing(ring);
+        return NULL;
+    }
+
+    ring->sqHead = (uint32_t *) (ring->sq + params.sq_off.head);
+    ring->sqTail = (uint32_t *) (ring->sq + params.sq_off.tail);
+    ring->sqMask = (uint32_t *) (ring->sq + params.sq_off.ring_mask);
+    ring->sqArray = (uint32_t *) (ring->sq + params.sq_off.array);
+    ring->cqHead = (uint32_t *) (ring->cq + params.cq_off.head);
+    ring->cqTail = (uint32_t *) (ring->cq + params.cq_off.tail);
+    ring->cqMask = (uint32_t *) (ring->cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (ring->cq + params.cq_off.cqes);
+    return ring;
+}
+
+/**
+ * Unmaps the rings of an io_uring and closes it (the reads the kernel took must be over, see drainRing)
+ * @param ring : The ring
+ */
+static void freeRing(struct ImageRing *ring){
+    if(ring->sqes != NULL) munmap(ring->sqes, ring->sqesLen);
+    if(ring->cq != NULL && ring->cq != ring->sq) munmap(ring->cq, ring->cqLen);
+    if(ring->sq != NULL) munmap(ring->sq, ring->sqLen);
+    close(ring->fd);
+    free(ring);
+}
+
+/**
+ * Waits until the kernel is done with the reads it took from the ring of a queue. Closing a ring doesn't
+ * cancel them right away: they could still write into buffers that the caller frees once they are redone
+ * with pread. The reads the kernel didn't take yet are only in the ring, and are left for pread.
+ * @param queue : The queue (with its ring)
+ */
+static void drainRing(ImageQueue *queue){
+    struct ImageRing *ring = queue->ring;
+    uint32_t notTaken = *(ring->sqTail) - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    uint32_t taken = queue->inFlight > notTaken ? queue->inFlight - notTaken : 0;
+
+    //Their completions are dropped: the reads are done again with pread, in the order they were queued
+    uint32_t head = *(ring->cqHead);
+    while(taken > 0){
+        uint32_t tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        if(tail == head){
+            sched_yield();
+            continue;
+        }
+        taken -= tail - head > taken ? taken : tail - head;
+        head = tail;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Prepares a queue of asynchronous reads on an image, on io_uring if the kernel lets us set one up
+ * @param queue : The queue to initialize
+ * @param img : The image
+ * @param depth : Reads given to the kernel at once
+ * @return Whether the queue could be prepared (1) or not (0, out of memory)
+ */
+int IMAGE_queueInit(ImageQueue *queue, Image *img, uint32_t depth){
+    memset(queue, 0, sizeof(ImageQueue));
+    queue->img = img;
+    //Reads of direct images must be aligned: they go through IMAGE_read and its cache instead
+    queue->ring = img->direct ? NULL : setupRing(depth);
+    if(queue->ring == NULL) return 1;
+
+    //The kernel may round the ring up: we use the depth asked for
+    queue->slots = (ImageRequest *) malloc(depth * sizeof(ImageRequest));
+    queue->freeSlots = (uint32_t *) malloc(depth * sizeof(uint32_t));
+    if(queue->slots == NULL || queue->freeSlots == NULL){
+        IMAGE_queueClose(queue);
+        return 0;
+    }
+    for(uint32_t i = 0; i < depth; i++) queue->freeSlots[i] = depth - 1 - i;
+    queue->numSlots = queue->numFree = depth;
+    return 1;
+}
+
+/**
+ * Queues a read. It's given to the kernel the next time IMAGE_queueWait is called (with as many other reads
+ * as fit in the ring); dst must stay valid until the read completes.
+ * @param queue : The queue
+ * @param dst : Destination buffer
+ * @param len : Number of bytes to read
+ * @param offset : Byte offset inside the image
+ * @param tag : Value given back with the completion
+ * @return Whether the read could be queued (1) or not (0, out of memory)
+ */
+int IMAGE_queueRead(ImageQueue *queue, void *dst, size_t len, uint64_t offset, uint64_t tag){
+    if(queue->waitTail == queue->waitCap){
+        //Move the requests to the front, and only grow the array if that doesn't make room
+        size_t live = queue->waitTail - queue->waitHead;
+        if(queue->waitHead > 0) memmove(queue->waiting, queue->waiting + queue->waitHead, live * sizeof(ImageRequest));
+        queue->waitHead = 0;
+        queue->waitTail = live;
+        if(live == queue->waitCap){
+            size_t cap = queue->waitCap == 0 ? IMAGE_QUEUE_DEPTH : queue->waitCap * 2;
+            ImageRequest *bigger = (ImageRequest *) realloc(queue->waiting, cap * sizeof(ImageRequest));
+            if(bigger == NULL) return 0;
+            queue->waiting = bigger;
+            queue->waitCap = cap;
+        }
+    }
+
+    uint64_t size = queue->img->size;
+    ImageRequest *req = &(queue->waiting[queue->waitTail++]);
+    req->dst = dst;
+    req->len = offset >= size ? 0 : (len > size - offset ? (size_t) (size - offset) : len);
+    req->offset = offset;
+    req->tag = tag;
+    return 1;
+}
+
+/**
+ * Takes a read the kernel was given and didn't complete, once its ring is dropped, to do it with pread
+ * @param queue : The queue (with reads in flight)
+ * @return The request of the read (its slot is free again)
+ */
+static ImageRequest * takeInFlight(ImageQueue *queue){
+    for(uint32_t slot = 0; slot < queue->numSlots; slot++){
+        uint32_t i = 0;
+        while(i < queue->numFree && queue->freeSlots[i] != slot) i++;
+        if(i < queue->numFree) continue;
+
+        queue->freeSlots[queue->numFree++] = slot;
+        queue->inFlight--;
+        return &(queue->slots[slot]);
+    }
+    queue->inFlight = 0;
+    return NULL;
+}
+
+/**
+ * Gives the queued reads to the kernel, and waits until one of them completes. If the kernel stops taking
+ * them, the ring is dropped, and the reads it had and those still queued are done with pread.
+ * @param queue : The queue
+ * @param done : Output, the read that completed
+ * @return Whether a read completed (1) or none is left (0)
+ */
+int IMAGE_queueWait(ImageQueue *queue, ImageCompletion *done){
+    struct ImageRing *ring = queue->ring;
+
+    //Without io_uring, the reads the dropped ring had go first, and then the oldest request is read now
+    if(ring == NULL){
+        ImageRequest *req = queue->inFlight > 0 ? takeInFlight(queue) : NULL;
+        if(req == NULL && queue->waitHead == queue->waitTail) return 0;
+        if(req == NULL) req = &(queue->waiting[queue->waitHead++]);
+        done->tag = req->tag;
+        done->len = IMAGE_read(queue->img, req->dst, req->len, req->offset);
+        return 1;
+    }
+
+    //Fill the free slots of the ring with the oldest requests
+    uint32_t toSubmit = 0;
+    uint32_t tail = *(ring->sqTail);
+    while(queue->numFree > 0 && queue->waitHead < queue->waitTail){
+        uint32_t slot = queue->freeSlots[--queue->numFree];
+        ImageRequest *req = &(queue->slots[slot]);
+        *req = queue->waiting[queue->waitHead++];
+
+        uint32_t index = tail & *(ring->sqMask);
+        struct io_uring_sqe *sqe = &(ring->sqes[index]);
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = queue->img->fd;
+        sqe->addr = (uint64_t) (uintptr_t) req->dst;
+        sqe->len = (uint32_t) req->len;
+        sqe->off = req->offset;
+        sqe->user_data = slot;
+        ring->sqArray[index] = index;
+        tail++;
+        toSubmit++;
+    }
+    if(toSubmit > 0) __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+    queue->inFlight += toSubmit;
+    if(queue->inFlight == 0) return 0;
+
+    //Submit, and wait for a completion if there isn't one already
+    uint32_t head = *(ring->cqHead);
+    while(toSubmit > 0 || head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)){
+        int entered = (int) syscall(__NR_io_uring_enter, ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY){
+            //The reads the kernel took must be over before the ring goes away
+            drainRing(queue);
+            freeRing(ring);
+            queue->ring = NULL;
+            return IMAGE_queueWait(queue, done);
+        }
+        if(entered > 0) toSubmit -= (uint32_t) entered > toSubmit ? toSubmit : (uint32_t) entered;
+    }
+
+    struct io_uring_cqe *cqe = &(ring->cqes[head & *(ring->cqMask)]);
+    uint32_t slot = (uint32_t) cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+
+    ImageRequest *req = &(queue->slots[slot]);
+    queue->freeSlots[queue->numFree++] = slot;
+    queue->inFlight--;
+
+    //Short or failed reads (e.g. a kernel without IORING_OP_READ) are finished with pread
+    size_t got = res > 0 ? (size_t) res : 0;
+    if(got < req->len) got += IMAGE_read(queue->img, (char *) req->dst + got, req->len - got, req->offset + got);
+    done->tag = req->tag;
+    done->len = got;
+    return 1;
+}
+
+/**
+ * Closes a queue (every read must have completed)
+ * @param queue : The queue
+ */
+void IMAGE_queueClose(ImageQueue *queue){
+    if(queue->ring != NULL) freeRing(queue->ring);
+    free(queue->slots);
+    free(queue->freeSlots);
+    free(queue->waiting);
+    memset(queue, 0, sizeof(ImageQueue));
+}
@@ -0,0 +1,237 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+// Size of the window used by the pread fallback when the image can't be mapped
+#define IMAGE_WINDOW_SIZE (256 * 1024)
+// Bytes read from the start of the image when it's opened (boot sector & EXT2 superblock)
+#define IMAGE_PROBE_SIZE 4096
+
+// Flag of IMAGE_open: read the image with O_DIRECT, around the page cache. Nothing is mapped, every read is
+// done in aligned blocks, and small reads (metadata) go through a fixed cache of our own, so a scan costs
+// the same memory whatever the size of the image and doesn't evict the pages of other programs.
+#define IMAGE_DIRECT 1
+// Alignment of the offsets, lengths and buffers of direct reads (a multiple of every logical block size)
+#define IMAGE_DIRECT_ALIGN 4096
+// Blocks of IMAGE_DIRECT_ALIGN bytes held by the cache of direct reads, and how many of them share a set
+#define IMAGE_DIRECT_BLOCKS 256
+#define IMAGE_DIRECT_WAYS 4
+// Direct reads of at least this many bytes skip the cache (file contents): they are read in place, through
+// a bounce buffer of at most IMAGE_DIRECT_BOUNCE bytes
+#define IMAGE_DIRECT_BYPASS (64 * 1024)
+#define IMAGE_DIRECT_BOUNCE (1024 * 1024)
+
+struct ImageCache;
+
+typedef struct {
+    const char *path;               // Path the image was opened from
+    int fd;                         // File descriptor of the partition image
+    uint64_t size;                  // Size of the image in bytes
+    const unsigned char *map;       // Read-only mapping of the whole image (NULL if it couldn't be mapped)
+    unsigned char *window;          // Fallback buffer, used when map is NULL
+    size_t windowCap;               // Capacity of the fallback buffer
+    uint64_t windowOffset;          // Image offset of the first byte held in the fallback buffer
+    size_t windowLen;               // Number of valid bytes in the fallback buffer
+    unsigned char probe[IMAGE_PROBE_SIZE];  // First bytes of the image, read once when it's opened
+    size_t probeLen;                // Number of valid bytes in probe (the image may be smaller)
+    int direct;                     // Whether the image was opened with IMAGE_DIRECT
+    struct ImageCache *cache;       // Cache of the small direct reads (NULL unless direct)
+} Image;
+
+// Run of a file: bytes of the file that are contiguous in the image
+#define IMAGE_HOLE UINT64_MAX           // Offset of runs that aren't stored (sparse files): they read as zeros
+
+// Read planner (ImagePlan): whole-image scans hint the kernel about the reads of their next steps, sorted by
+// offset, so a cold image is read front to back instead of jumping around. Small images aren't worth it
+// (the kernel's own readahead and the page cache cover them), and ranges closer than IMAGE_PLAN_GAP are
+// hinted as one: reading the gap costs less than seeking over it.
+#define IMAGE_PLAN_MIN_IMAGE (64ULL * 1024 * 1024)
+#define IMAGE_PLAN_GAP (64 * 1024)
+
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} ImageRange;
+
+typedef struct {
+    Image *img;
+    int enabled;                    // Whether the image is big enough to plan its reads
+    ImageRange *ranges;             // Ranges about to be read (in any order)
+    size_t count, cap;
+} ImagePlan;
+
+// Asynchronous reads (ImageQueue): how many of them the kernel is given at once
+#define IMAGE_QUEUE_DEPTH 64
+
+typedef struct {
+    void *dst;                      // Where the bytes go
+    size_t len;                     // Bytes wanted (cut at the end of the image)
+    uint64_t offset;                // Byte offset inside the image
+    uint64_t tag;                   // Value of the caller, given back when the read completes
+} ImageRequest;
+
+typedef struct {
+    uint64_t tag;                   // Tag of the request
+    size_t len;                     // Bytes read (less than asked if the image couldn't be read)
+} ImageCompletion;
+
+struct ImageRing;
+
+// Reads that are kept in flight together, completing in any order. They go through io_uring when the
+// kernel has it; otherwise they are done one at a time with pread, as they are waited for.
+typedef struct {
+    Image *img;
+    struct ImageRing *ring;         // io_uring shared with the kernel (NULL when reads are done with pread)
+    ImageRequest *slots;            // Request of each read given to the kernel, by slot
+    uint32_t numSlots;
+    uint32_t *freeSlots;            // Slots not in use
+    uint32_t numFree;
+    uint32_t inFlight;              // Reads given to the kernel and not completed yet
+    ImageRequest *waiting;          // Requests not given to the kernel yet (first in, first out)
+    size_t waitHead, waitTail, waitCap;
+} ImageQueue;
+
+typedef struct {
+    uint64_t logical;               // Byte offset of the run inside the file
+    uint64_t offset;                // Byte offset of the run inside the image (IMAGE_HOLE for holes)
+    uint64_t length;                // Bytes of the run
+} ImageRun;
+
+/**
+ * Opens a partition image read-only and tries to map it into memory. The first IMAGE_PROBE_SIZE bytes are
+ * read in one go into img->probe, so that the filesystem can be detected and its superblock parsed from memory.
+ * The same Image is then handed to every command.
+ * With IMAGE_DIRECT the image is read with O_DIRECT instead, and never mapped.
+ * @param img : Image structure to fill
+ * @param path : Path to the partition image
+ * @param flags : 0 or IMAGE_DIRECT
+ * @return Whether the image could be opened (1) or not (0, with errno set to EINVAL if O_DIRECT isn't supported)
+ */
+int IMAGE_open(Image *img, const char *path, int flags);
+
+/**
+ * Closes the image, unmapping it and releasing the fallback buffer (and the cache of direct reads)
+ * @param img : The image to close
+ */
+void IMAGE_close(Image *img);
+
+/**
+ * Returns a pointer to len bytes of the image starting at offset.
+ * When the image is mapped the pointer points straight into the mapping and stays valid until IMAGE_close.
+ * Otherwise the bytes are pread into the fallback buffer, and the pointer is only valid until the next
+ * IMAGE_get call on the same image.
+ * @param img : The image
+ * @param offset : Byte offset inside the image
+ * @param len : Number of bytes wanted
+ * @return Pointer to the bytes, or NULL if the range is outside the image
+ */
+const void * IMAGE_get(Image *img, uint64_t offset, size_t len);
+
+/**
+ * Copies len bytes of the image starting at offset into dst
+ * @param img : The image
+ * @param dst : Destination buffer
+ * @param len : Number of bytes to copy
+ * @param offset : Byte offset inside the image
+ * @return Number of bytes copied (less than len if the range goes past the end of the image)
+ */
+size_t IMAGE_read(Image *img, void *dst, size_t len, uint64_t offset);
+
+/**
+ * Copies len bytes of the image starting at offset to an output file descriptor.
+ * The copy is done in the kernel with sendfile when possible (not on direct images), and with large writes otherwise.
+ * Callers that also print through stdio must flush it before calling this function.
+ * @param img : The image
+ * @param outFd : Destination file descriptor
+ * @param offset : Byte offset inside the image
+ * @param len : Number of bytes to copy
+ * @return Whether all the bytes were copied (1) or not (0)
+ */
+int IMAGE_copyTo(Image *img, int outFd, uint64_t offset, uint64_t len);
+
+/**
+ * Copies bytes of a file into dst, given where the file is in the image. The run holding pos is found
+ * with a binary search, so reading any part of the file costs the same. It can be called from several threads.
+ * @param img : The image
+ * @param runs : The runs of the file, in order and one after the other (the last one ends the file)
+ * @param count : Number of runs
+ * @param dst : Destination buffer
+ * @param len : Number of bytes to copy
+ * @param pos : Byte offset inside the file
+ * @return Number of bytes copied (less than len at the end of the file, or if the image can't be read)
+ */
+size_t IMAGE_readRuns(Image *img, const ImageRun *runs, uint32_t count, void *dst, size_t len, uint64_t pos);
+
+/**
+ * Prepares a read planner for an image
+ * @param plan : The planner to initialize
+ * @param img : The image
+ */
+void IMAGE_planInit(ImagePlan *plan, Image *img);
+
+/**
+ * Adds a range that's about to be read to a planner (nothing is done if the image isn't worth planning)
+ * @param plan : The planner
+ * @param offset : Byte offset inside the image
+ * @param length : Bytes of the range
+ */
+void IMAGE_planAdd(ImagePlan *plan, uint64_t offset, uint64_t length);
+
+/**
+ * Hints the planned ranges to the kernel (posix_fadvise WILLNEED): sorted by offset, with close ranges
+ * merged, so the device reads them in ascending order. The planner is emptied, to plan the next step.
+ * @param plan : The planner
+ */
+void IMAGE_planIssue(ImagePlan *plan);
+
+/**
+ * Frees the ranges of a planner
+ * @param plan : The planner
+ */
+void IMAGE_planFree(ImagePlan *plan);
+
+/**
+ * Prepares a queue of asynchronous reads on an image, on io_uring if the kernel lets us set one up
+ * @param queue : The queue to initialize
+ * @param img : The image
+ * @param depth : Reads given to the kernel at once
+ * @return Whether the queue could be prepared (1) or not (0, out of memory)
+ */
+int IMAGE_queueInit(ImageQueue *queue, Image *img, uint32_t depth);
+
+/**
+ * Queues a read. It's given to the kernel the next time IMAGE_queueWait is called (with as many other reads
+ * as fit in the ring); dst must stay valid until the read completes.
+ * @param queue : The queue
+ * @param dst : Destination buffer
+ * @param len : Number of bytes to read
+ * @param offset : Byte offset inside the image
+ * @param tag : Value given back with the completion
+ * @return Whether the read could be queued (1) or not (0, out of memory)
+ */
+int IMAGE_queueRead(ImageQueue *queue, void *dst, size_t len, uint64_t offset, uint64_t tag);
+
+/**
+ * Gives the queued reads to the kernel, and waits until one of them completes. If the kernel stops taking
+ * them, the ring is dropped, and the reads it had and those still queued are done with pread.
+ * @param queue : The queue
+ * @param done : Output, the read that completed
+ * @return Whether a read completed (1) or none is left (0)
+ */
+int IMAGE_queueWait(ImageQueue *queue, ImageCompletion *done);
+
+/**
+ * Closes a queue (every read must have completed)
+ * @param queue : The queue
+ */
+void IMAGE_queueClose(ImageQueue *queue);
+
+#endif
@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+#include "index.h"
+#include "tree.h"
+#include <strings.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct {
+    const IndexEntry *entries;
+    const char *strings;
+    int caseless;
+} SortContext;
+
+/**
+ * Compares two names or paths, ignoring case or not
+ */
+static int compareNames(const char *a, const char *b, int caseless){
+    return caseless ? strcasecmp(a, b) : strcmp(a, b);
+}
+
+/**
+ * Orders positions of entries by path (qsort_r comparator)
+ */
+static int byPathOrder(const void *a, const void *b, void *arg){
+    SortContext *ctx = (SortContext *) arg;
+    const IndexEntry *ea = &(ctx->entries[*(const uint32_t *) a]);
+    const IndexEntry *eb = &(ctx->entries[*(const uint32_t *) b]);
+    return compareNames(ctx->strings + ea->path, ctx->strings + eb->path, ctx->caseless);
+}
+
+/**
+ * Orders positions of entries by name, and by position for equal names (qsort_r comparator)
+ */
+static int byNameOrder(const void *a, const void *b, void *arg){
+    SortContext *ctx = (SortContext *) arg;
+    uint32_t pa = *(const uint32_t *) a, pb = *(const uint32_t *) b;
+    const IndexEntry *ea = &(ctx->entries[pa]);
+    const IndexEntry *eb = &(ctx->entries[pb]);
+
+    int cmp = compareNames(ctx->strings + ea->path + ea->nameStart, ctx->strings + eb->path + eb->nameStart, ctx->caseless);
+    if(cmp != 0) return cmp;
+    return pa < pb ? -1 : pa > pb;
+}
+
+/**
+ * Builds the path of the index of an image
+ * @return Whether the path fits in buffer (1) or not (0)
+ */
+static int indexPath(char *buffer, size_t size, const char *imagePath){
+    return snprintf(buffer, size, "%s%s", imagePath, INDEX_SUFFIX) < (int) size;
+}
+
+/**
+ * Maps the index of an image, if it exists and was built from the same image
+ * @param index : Output, the mapped index
+ * @param imagePath : Path of the image
+ * @param fsType : Filesystem of the image
+ * @param stamp : Values identifying the current state of the image
+ * @return Whether a valid index was mapped (1) or it has to be built (0)
+ */
+int INDEX_load(Index *index, const char *imagePath, uint32_t fsType, const uint64_t stamp[2]){
+    memset(index, 0, sizeof(Index));
+    index->fd = -1;
+
+    char path[INDEX_MAX_PATH];
+    if(!indexPath(path, sizeof(path), imagePath)) return 0;
+    index->fd = open(path, O_RDONLY);
+    if(index->fd < 0) return 0;
+
+    struct stat st;
+    if(fstat(index->fd, &st) != 0 || (size_t) st.st_size < sizeof(IndexHeader)){
+        INDEX_close(index);
+        return 0;
+    }
+    index->mapSize = (size_t) st.st_size;
+    index->map = mmap(NULL, index->mapSize, PROT_READ, MAP_SHARED, index->fd, 0);
+    if(index->map == MAP_FAILED){
+        index->map = NULL;
+        INDEX_close(index);
+        return 0;
+    }
+
+    //The index must be of this version, for this filesystem, built from this same state of the image, and complete
+    const IndexHeader *header = (const IndexHeader *) index->map;
+    uint64_t expected = sizeof(IndexHeader) + (uint64_t) header->count * (sizeof(IndexEntry) + 2 * sizeof(uint32_t))
+                        + header->stringsLen;
+    if(memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || header->fsType != fsType
+       || header->stamp[0] != stamp[0] || header->stamp[1] != stamp[1] || expected != index->mapSize){
+        INDEX_close(index);
+        return 0;
+    }
+
+    index->header = header;
+    index->entries = (const IndexEntry *) (header + 1);
+    index->byPath = (const uint32_t *) (index->entries + header->count);
+    index->byName = index->byPath + header->count;
+    index->strings = (const char *) (index->byName + header->count);
+    return 1;
+}
+
+/**
+ * Unmaps an index
+ * @param index : The index
+ */
+void INDEX_close(Index *index){
+    if(index->map != NULL) munmap(index->map, index->mapSize);
+    if(index->fd >= 0) close(index->fd);
+    index->map = NULL;
+    index->fd = -1;
+}
+
+/**
+ * Gets the full path of an entry
+ * @param index : The index
+ * @param entry : The entry
+ * @return The path ('\0' ended)
+ */
+const char * INDEX_path(Index *index, const IndexEntry *entry){
+    return index->strings + entry->path;
+}
+
+/**
+ * Writes path in its canonical form (/a/b): repeated slashes and . are dropped, and .. goes up one level
+ * @return Whether it fits in buffer (1) or not (0)
+ */
+static int normalizePath(const char *path, char *buffer, size_t size){
+    size_t len = 0;
+
+    while(*path != '\0'){
+        while(*path == '/') path++;
+        size_t component = strcspn(path, "/");
+        if(component == 0) break;
+
+        if(component == 1 && path[0] == '.'){
+            //Stays in the same directory
+        }
+        else if(component == 2 && path[0] == '.' && path[1] == '.'){
+            while(len > 0 && buffer[len - 1] != '/') len--;
+            if(len > 0) len--;
+        }
+        else{
+            if(len + 1 + component + 1 > size) return 0;
+            buffer[len++] = '/';
+            memcpy(buffer + len, path, component);
+            len += component;
+        }
+        path += component;
+    }
+    buffer[len] = '\0';
+    return 1;
+}
+
+/**
+ * Finds an entry of the index
+ * @param index : The index
+ * @param file : A full path (/dir/file.txt), or a bare name, which gives the first file with that name in tree order
+ * @return The entry, or NULL if there's none
+ */
+const IndexEntry * INDEX_find(Index *index, const char *file){
+    int caseless = (index->header->flags & INDEX_CASELESS) != 0;
+    uint32_t count = index->header->count;
+
+    if(strchr(file, '/') != NULL){
+        //Binary search of the path
+        char path[INDEX_MAX_PATH];
+        if(!normalizePath(file, path, sizeof(path))) return NULL;
+
+        uint32_t low = 0, high = count;
+        while(low < high){
+            uint32_t middle = low + (high - low) / 2;
+            const IndexEntry *entry = &(index->entries[index->byPath[middle]]);
+            int cmp = compareNames(index->strings + entry->path, path, caseless);
+            if(cmp == 0) return entry;
+            if(cmp < 0) low = middle + 1;
+            else high = middle;
+        }
+        return NULL;
+    }
+
+    //Bare name: first entry with that name (equal names are sorted in tree order), skipping directories
+    uint32_t low = 0, high = count;
+    while(low < high){
+        uint32_t middle = low + (high - low) / 2;
+        const IndexEntry *entry = &(index->entries[index->byName[middle]]);
+        if(compareNames(index->strings + entry->path + entry->nameStart, file, caseless) < 0) low = middle + 1;
+        else high = middle;
+    }
+    for(; low < count; low++){
+        const IndexEntry *entry = &(index->entries[index->byName[low]]);
+        if(compareNames(index->strings + entry->path + entry->nameStart, file, caseless) != 0) break;
+        if(entry->type == INDEX_FILE) return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Prints the tree stored in an index, the same way --tree prints it
+ * @param index : The index
+ * @param out : The output
+ */
+void INDEX_printTree(Index *index, Output *out){
+    TREE_streamBegin(out);
+    for(uint32_t i = 0; i < index->header->count; i++){
+        const IndexEntry *entry = &(index->entries[i]);
+        TREE_printEntry(out, entry->level, index->strings + entry->path + entry->nameStart);
+    }
+    TREE_streamEnd(out);
+}
+
+/**
+ * Starts building an index
+ * @param writer : The writer to initialize
+ */
+void INDEX_writerInit(IndexWriter *writer){
+    memset(writer, 0, sizeof(IndexWriter));
+}
+
+/**
+ * Adds an entry to the index being built. Entries must come in tree order (depth first), as the visitors get them.
+ * @param writer : The writer
+ * @param level : Depth of the entry (1 = entry of the root directory)
+ * @param name : Name of the entry
+ * @param type : INDEX_FILE or INDEX_DIR
+ * @param location : Inode number (EXT2) or first cluster (FAT16)
+ * @param size : Size in bytes
+ */
+void INDEX_add(IndexWriter *writer, int level, const char *name, int type, uint64_t location, uint64_t size){
+    if(writer->failed) return;
+    //Each entry is at most one level below the previous one
+    int maxLevel = writer->count == 0 ? 1 : writer->entries[writer->count - 1].level + 1;
+    if(level < 1 || level > maxLevel || level > UINT16_MAX){
+        writer->failed = 1;
+        return;
+    }
+
+    //The path of the entry is the one of the last entry added one level up, plus its name
+    uint32_t parentStart = 0, parentLen = 0;
+    if(level > 1){
+        const IndexEntry *parent = &(writer->entries[writer->lastAtLevel[level - 2]]);
+        parentStart = parent->path;
+        parentLen = parent->pathLen;
+    }
+
+    size_t nameLen = strlen(name);
+    size_t pathLen = parentLen + 1 + nameLen;
+    if(pathLen >= INDEX_MAX_PATH){
+        writer->failed = 1;
+        return;
+    }
+
+    //Make room for the entry, its path and its slot in lastAtLevel
+    if(writer->count == writer->capacity){
+        uint32_t capacity = writer->capacity == 0 ? 1024 : writer->capacity * 2;
+        IndexEntry *entries = (IndexEntry *) realloc(writer->entries, capacity * sizeof(IndexEntry));
+        if(entries == NULL){
+            writer->failed = 1;
+            return;
+        }
+        writer->entries = entries;
+        writer->capacity = capacity;
+    }
+    if(writer->stringsLen + pathLen + 1 > writer->stringsCapacity){
+        size_t capacity = writer->stringsCapacity == 0 ? 64 * 1024 : writer->stringsCapacity * 2;
+        while(capacity < writer->stringsLen + pathLen + 1) capacity *= 2;
+        //Paths are referenced with 32-bit offsets
+        char *strings = capacity > UINT32_MAX ? NULL : (char *) realloc(writer->strings, capacity);
+        if(strings == NULL){
+            writer->failed = 1;
+            return;
+        }
+        writer->strings = strings;
+        writer->stringsCapacity = capacity;
+    }
+    if((uint32_t) level > writer->levels){
+        uint32_t levels = writer->levels == 0 ? 64 : writer->levels * 2;
+        uint32_t *lastAtLevel = (uint32_t *) realloc(writer->lastAtLevel, levels * sizeof(uint32_t));
+        if(lastAtLevel == NULL){
+            writer->failed = 1;
+            return;
+        }
+        writer->lastAtLevel = lastAtLevel;
+        writer->levels = levels;
+    }
+
+    char *path = writer->strings + writer->stringsLen;
+    memcpy(path, writer->strings + parentStart, parentLen);
+    path[parentLen] = '/';
+    memcpy(path + parentLen + 1, name, nameLen + 1);
+
+    IndexEntry *entry = &(writer->entries[writer->count++]);
+    memset(entry, 0, sizeof(IndexEntry));
+    entry->location = location;
+    entry->size = size;
+    entry->path = (uint32_t) writer->stringsLen;
+    entry->pathLen = (uint16_t) pathLen;
+    entry->nameStart = (uint16_t) (parentLen + 1);
+    entry->level = (uint16_t) level;
+    entry->type = (uint8_t) type;
+
+    writer->lastAtLevel[level - 1] = writer->count - 1;
+    writer->stringsLen += pathLen + 1;
+}
+
+/**
+ * Writes all the bytes to a file descriptor, retrying on short writes
+ * @return Whether everything was written (1) or not (0)
+ */
+static int writeAll(int fd, const void *data, size_t len){
+    const char *bytes = (const char *) data;
+    while(len > 0){
+        ssize_t w = write(fd, bytes, len);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) return 0;
+        bytes += w;
+        len -= (size_t) w;
+    }
+    return 1;
+}
+
+/**
+ * Sorts the entries and writes the index beside the image (through a temporary file, so readers never see half of it)
+ * @param writer : The writer
+ * @param imagePath : Path of the image
+ * @param fsType : Filesystem of the image
+ * @param flags : INDEX_CASELESS...
+ * @param stamp : Values identifying the current state of the image
+ * @return Whether the index could be written (1) or not (0)
+ */
+int INDEX_save(IndexWriter *writer, const char *imagePath, uint32_t fsType, uint32_t flags, const uint64_t stamp[2]){
+    if(writer->failed) return 0;
+
+    char path[INDEX_MAX_PATH];
+    char tmpPath[INDEX_MAX_PATH];
+    if(!indexPath(path, sizeof(path), imagePath)) return 0;
+    if(snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int) getpid()) >= (int) sizeof(tmpPath)) return 0;
+
+    //Sort the positions of the entries by path and by name
+    uint32_t count = writer->count;
+    uint32_t *sorted = (uint32_t *) malloc(2 * (size_t) (count > 0 ? count : 1) * sizeof(uint32_t));
+    if(sorted == NULL) return 0;
+    for(uint32_t i = 0; i < count; i++) sorted[i] = sorted[count + i] = i;
+    SortContext ctx = {writer->entries, writer->strings, (flags & INDEX_CASELESS) != 0};
+    qsort_r(sorted, count, sizeof(uint32_t), byPathOrder, &ctx);
+    qsort_r(sorted + count, count, sizeof(uint32_t), byNameOrder, &ctx);
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(IndexHeader));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.fsType = fsType;
+    header.flags = flags;
+    header.stamp[0] = stamp[0];
+    header.stamp[1] = stamp[1];
+    header.count = count;
+    header.stringsLen = writer->stringsLen;
+
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        free(sorted);
+        return 0;
+    }
+    int ok = writeAll(fd, &header, sizeof(IndexHeader))
+             && writeAll(fd, writer->entries, count * sizeof(IndexEntry))
+             && writeAll(fd, sorted, 2 * (size_t) count * sizeof(uint32_t))
+             && writeAll(fd, writer->strings, writer->stringsLen);
+    free(sorted);
+
+    if(close(fd) != 0) ok = 0;
+    if(ok && rename(tmpPath, path) != 0) ok = 0;
+    if(!ok) unlink(tmpPath);
+    return ok;
+}
+
+/**
+ * Frees the memory of a writer
+ * @param writer : The writer
+ */
+void INDEX_writerFree(IndexWriter *writer){
+    free(writer->entries);
+    free(writer->strings);
+    free(writer->lastAtLevel);
+    memset(writer, 0, sizeof(IndexWriter));
+}
@@ -0,0 +1,141 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "output.h"
+
+// The index of an image is stored beside it, in <image path><INDEX_SUFFIX>
+#define INDEX_SUFFIX ".fsidx"
+#define INDEX_MAGIC "FSUIDX01"
+#define INDEX_MAX_PATH 4096
+
+// Types of entries
+#define INDEX_FILE 1
+#define INDEX_DIR 2
+
+// Flags of an index
+#define INDEX_CASELESS 0x1              // Names are compared ignoring case (FAT16)
+
+typedef struct {
+    char magic[8];                  // INDEX_MAGIC (holds the version of the format)
+    uint32_t fsType;                // Filesystem of the image the index was built from
+    uint32_t flags;                 // INDEX_CASELESS...
+    uint64_t stamp[2];              // Values read from the image when the index was built; if they change, it's stale
+    uint32_t count;                 // Number of entries
+    uint32_t reserved;
+    uint64_t stringsLen;            // Bytes of paths, after the sorted arrays
+} IndexHeader;
+
+typedef struct {
+    uint64_t location;              // Inode number (EXT2) or first cluster (FAT16)
+    uint64_t size;                  // Size in bytes
+    uint32_t path;                  // Offset of the full path ('\0' ended) in the strings
+    uint16_t pathLen;
+    uint16_t nameStart;             // Offset of the name inside the path (after the last '/')
+    uint16_t level;                 // Depth of the entry (1 = entry of the root directory)
+    uint8_t type;                   // INDEX_FILE or INDEX_DIR
+    uint8_t reserved[5];
+} IndexEntry;
+
+// File layout: IndexHeader, entries (in tree order), entries sorted by path, entries sorted by name, strings
+typedef struct {
+    int fd;
+    void *map;
+    size_t mapSize;
+    const IndexHeader *header;
+    const IndexEntry *entries;
+    const uint32_t *byPath;         // Positions of the entries, sorted by path
+    const uint32_t *byName;         // Positions of the entries, sorted by name (and by position for equal names)
+    const char *strings;
+} Index;
+
+typedef struct {
+    IndexEntry *entries;
+    uint32_t count;
+    uint32_t capacity;
+    char *strings;
+    size_t stringsLen;
+    size_t stringsCapacity;
+    uint32_t *lastAtLevel;          // Position of the last entry added at each level (the parent of the next level)
+    uint32_t levels;                // Levels lastAtLevel has room for
+    int failed;                     // Set when an entry couldn't be added (no memory, path too long)
+} IndexWriter;
+
+/**
+ * Maps the index of an image, if it exists and was built from the same image
+ * @param index : Output, the mapped index
+ * @param imagePath : Path of the image
+ * @param fsType : Filesystem of the image
+ * @param stamp : Values identifying the current state of the image
+ * @return Whether a valid index was mapped (1) or it has to be built (0)
+ */
+int INDEX_load(Index *index, const char *imagePath, uint32_t fsType, const uint64_t stamp[2]);
+
+/**
+ * Unmaps an index
+ * @param index : The index
+ */
+void INDEX_close(Index *index);
+
+/**
+ * Finds an entry of the index
+ * @param index : The index
+ * @param file : A full path (/dir/file.txt), or a bare name, which gives the first file with that name in tree order
+ * @return The entry, or NULL if there's none
+ */
+const IndexEntry * INDEX_find(Index *index, const char *file);
+
+/**
+ * Gets the full path of an entry
+ * @param index : The index
+ * @param entry : The entry
+ * @return The path ('\0' ended)
+ */
+const char * INDEX_path(Index *index, const IndexEntry *entry);
+
+/**
+ * Prints the tree stored in an index, the same way --tree prints it
+ * @param index : The index
+ * @param out : The output
+ */
+void INDEX_printTree(Index *index, Output *out);
+
+/**
+ * Starts building an index
+ * @param writer : The writer to initialize
+ */
+void INDEX_writerInit(IndexWriter *writer);
+
+/**
+ * Adds an entry to the index being built. Entries must come in tree order (depth first), as the visitors get them.
+ * @param writer : The writer
+ * @param level : Depth of the entry (1 = entry of the root directory)
+ * @param name : Name of the entry
+ * @param type : INDEX_FILE or INDEX_DIR
+ * @param location : Inode number (EXT2) or first cluster (FAT16)
+ * @param size : Size in bytes
+ */
+void INDEX_add(IndexWriter *writer, int level, const char *name, int type, uint64_t location, uint64_t size);
+
+/**
+ * Sorts the entries and writes the index beside the image (through a temporary file, so readers never see half of it)
+ * @param writer : The writer
+ * @param imagePath : Path of the image
+ * @param fsType : Filesystem of the image
+ * @param flags : INDEX_CASELESS...
+ * @param stamp : Values identifying the current state of the image
+ * @return Whether the index could be written (1) or not (0)
+ */
+int INDEX_save(IndexWriter *writer, const char *imagePath, uint32_t fsType, uint32_t flags, const uint64_t stamp[2]);
+
+/**
+ * Frees the memory of a writer
+ * @param writer : The writer
+ */
+void INDEX_writerFree(IndexWriter *writer);
+
+#endif
@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include "libfsutils.h"
+#include "volume.h"
+#include <errno.h>
+#include <limits.h>
+
+struct FsVolume {
+    Volume vol;
+};
+
+struct FsFile {
+    FsVolume *vol;
+    uint64_t size;
+    ImageRun *runs;                 // Where the file is in the image
+    uint32_t count;                 // Number of runs
+};
+
+struct FsDir {
+    FsVolume *vol;
+    DirIterator ext2;               // Iterator, when the volume is EXT2
+    FatDirIterator fat16;           // Iterator, when the volume is FAT16
+};
+
+static int ext2Type(uint16_t mode);
+
+/**
+ * Gets the type of an EXT2 inode
+ * @param mode : i_mode of the inode
+ * @return FS_TYPE_*
+ */
+static int ext2Type(uint16_t mode){
+    if((mode & EXT2_S_IFMT) == EXT2_S_IFREG) return FS_TYPE_FILE;
+    if((mode & EXT2_S_IFMT) == EXT2_S_IFDIR) return FS_TYPE_DIR;
+    return FS_TYPE_OTHER;
+}
+
+/**
+ * Opens an image and mounts the filesystem it holds (EXT2 or FAT16)
+ * @param imagePath : Path of the image
+ * @return The volume, or NULL if the image can't be opened or its filesystem isn't supported
+ */
+FsVolume * fs_open(const char *imagePath){
+    FsVolume *vol = (FsVolume *) malloc(sizeof(FsVolume));
+    if(vol == NULL){
+        errno = ENOMEM;
+        return NULL;
+    }
+    if(!VOLUME_open(&(vol->vol), imagePath, 0, NULL)){
+        free(vol);
+        errno = EINVAL;
+        return NULL;
+    }
+    return vol;
+}
+
+/**
+ * Closes a volume (the files and directories opened from it must be closed first)
+ * @param vol : The volume
+ */
+void fs_close(FsVolume *vol){
+    if(vol == NULL) return;
+    VOLUME_close(&(vol->vol));
+    free(vol);
+}
+
+/**
+ * Gets the metadata of a file or directory
+ * @param vol : The volume
+ * @param path : Absolute path inside the volume ("/" is the root directory; FAT16 names ignore case)
+ * @param st : Output, the metadata
+ * @return Whether the path exists (1) or not (0)
+ */
+int fs_stat(FsVolume *vol, const char *path, FsStat *st){
+    Volume *v = &(vol->vol);
+    memset(st, 0, sizeof(FsStat));
+
+    if(v->fs == VOLUME_EXT2){
+        Inode inode;
+        uint32_t inodeNum = EXT2_resolve(&(v->img), &(v->ext2), path);
+        if(inodeNum == 0 || !EXT2_readInode(&(v->img), &(v->ext2), inodeNum, &inode)){
+            errno = ENOENT;
+            return 0;
+        }
+        st->type = ext2Type(inode.i_mode);
+        st->size = inode.i_size;
+        if(st->type == FS_TYPE_FILE) st->size |= (uint64_t) inode.i_dir_acl << 32;
+        st->location = inodeNum;
+        st->mode = inode.i_mode & 07777;
+        st->links = inode.i_links_count;
+        st->mtime = inode.i_mtime;
+    }
+    else{
+        FatDirectoryEntry de;
+        if(!FAT16_resolve(&(v->img), &(v->fat16), path, &de)){
+            errno = ENOENT;
+            return 0;
+        }
+        st->type = (de.fileAttr & FAT16_ATTR_DIRECTORY) ? FS_TYPE_DIR : FS_TYPE_FILE;
+        st->size = de.fSize;
+        st->location = de.firstCluster;
+        st->mode = de.fileAttr;
+        st->links = 1;
+        st->mtime = FAT16_entryTime(&de);
+    }
+    return 1;
+}
+
+/**
+ * Opens a regular file to read it with fs_pread. Where every byte of the file is in the image is worked out
+ * here, once (block map or cluster chain), so reads at any offset go straight to the image.
+ * @param vol : The volume
+ * @param path : Absolute path of the file
+ * @return The file, or NULL if it doesn't exist or isn't a regular file
+ */
+FsFile * fs_lookup(FsVolume *vol, const char *path){
+    Volume *v = &(vol->vol);
+    FsFile *file = (FsFile *) calloc(1, sizeof(FsFile));
+    if(file == NULL){
+        errno = ENOMEM;
+        return NULL;
+    }
+    file->vol = vol;
+
+    int found = 0, isFile = 0, mapped = 0;
+    if(v->fs == VOLUME_EXT2){
+        Inode inode;
+        uint32_t inodeNum = EXT2_resolve(&(v->img), &(v->ext2), path);
+        found = inodeNum != 0 && EXT2_readInode(&(v->img), &(v->ext2), inodeNum, &inode);
+        isFile = found && ext2Type(inode.i_mode) == FS_TYPE_FILE;
+        if(isFile){
+            file->size = inode.i_size | ((uint64_t) inode.i_dir_acl << 32);
+            mapped = EXT2_fileRuns(&(v->img), &(v->ext2), &inode, &(file->runs), &(file->count));
+        }
+    }
+    else{
+        FatDirectoryEntry de;
+        found = FAT16_resolve(&(v->img), &(v->fat16), path, &de);
+        isFile = found && !(de.fileAttr & FAT16_ATTR_DIRECTORY);
+        if(isFile){
+            file->size = de.fSize;
+            mapped = FAT16_fileRuns(&(v->img), &(v->fat16), &de, &(file->runs), &(file->count));
+        }
+    }
+
+    if(!mapped){
+        errno = !found ? ENOENT : !isFile ? EISDIR : ENOMEM;
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+/**
+ * Gets the size of an opened file
+ * @param file : The file
+ * @return Size in bytes
+ */
+uint64_t fs_size(FsFile *file){
+    return file->size;
+}
+
+/**
+ * Reads bytes of a file, like pread
+ * @param file : The file
+ * @param buf : Destination buffer
+ * @param len : Number of bytes to read
+ * @param offset : Byte offset inside the file
+ * @return Number of bytes read (less than len at the end of the file, 0 past it), or -1 on error
+ */
+ssize_t fs_pread(FsFile *file, void *buf, size_t len, uint64_t offset){
+    if(offset >= file->size || len == 0) return 0;
+    if(len > file->size - offset) len = (size_t) (file->size - offset);
+    if(len > SSIZE_MAX) len = SSIZE_MAX;
+
+    size_t got = IMAGE_readRuns(&(file->vol->vol.img), file->runs, file->count, buf, len, offset);
+    //Nothing at all means the image couldn't be read (a broken chain just gives a shorter file)
+    if(got == 0){
+        errno = EIO;
+        return -1;
+    }
+    return (ssize_t) got;
+}
+
+/**
+ * Closes a file opened with fs_lookup
+ * @param file : The file
+ */
+void fs_release(FsFile *file){
+    if(file == NULL) return;
+    free(file->runs);
+    free(file);
+}
+
+/**
+ * Opens a directory to go through its entries with fs_readdir
+ * @param vol : The volume
+ * @param path : Absolute path of the directory
+ * @return The directory, or NULL if it doesn't exist or isn't a directory
+ */
+FsDir * fs_opendir(FsVolume *vol, const char *path){
+    Volume *v = &(vol->vol);
+    FsDir *dir = (FsDir *) calloc(1, sizeof(FsDir));
+    if(dir == NULL){
+        errno = ENOMEM;
+        return NULL;
+    }
+    dir->vol = vol;
+
+    int found, opened = 0;
+    if(v->fs == VOLUME_EXT2){
+        uint32_t inodeNum = EXT2_resolve(&(v->img), &(v->ext2), path);
+        found = inodeNum != 0;
+        if(found){
+            opened = EXT2_openDir(&(v->img), &(v->ext2), inodeNum, &(dir->ext2));
+            if(!opened) EXT2_closeDir(&(dir->ext2));
+        }
+    }
+    else{
+        FatDirectoryEntry de;
+        found = FAT16_resolve(&(v->img), &(v->fat16), path, &de);
+        if(found && (de.fileAttr & FAT16_ATTR_DIRECTORY))
+            opened = FAT16_openDir(&(v->img), &(v->fat16), de.firstCluster, &(dir->fat16));
+    }
+
+    if(!opened){
+        errno = found ? ENOTDIR : ENOENT;
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+/**
+ * Gets the next entry of a directory (. and .. are skipped)
+ * @param dir : The directory
+ * @param entry : Output, the entry
+ * @return Whether there was an entry (1) or the directory has no more (0)
+ */
+int fs_readdir(FsDir *dir, FsDirent *entry){
+    Volume *v = &(dir->vol->vol);
+
+    if(v->fs == VOLUME_EXT2){
+        const DirectoryEntry *de;
+        while((de = EXT2_readDir(&(dir->ext2))) != NULL){
+            if(strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0) continue;
+
+            memcpy(entry->name, de->name, de->name_len + 1);
+            entry->location = de->inode;
+            //The type is in the entry, unless the filesystem doesn't store it there
+            if(de->file_type == 1) entry->type = FS_TYPE_FILE;
+            else if(de->file_type == 2) entry->type = FS_TYPE_DIR;
+            else if(de->file_type != 0) entry->type = FS_TYPE_OTHER;
+            else{
+                Inode inode;
+                if(EXT2_readInode(&(v->img), &(v->ext2), de->inode, &inode)) entry->type = ext2Type(inode.i_mode);
+                else entry->type = FS_TYPE_OTHER;
+            }
+            return 1;
+        }
+        return 0;
+    }
+
+    const FatDirectoryEntry *de = FAT16_readDir(&(dir->fat16), entry->name);
+    if(de == NULL) return 0;
+    entry->type = (de->fileAttr & FAT16_ATTR_DIRECTORY) ? FS_TYPE_DIR : FS_TYPE_FILE;
+    entry->location = de->firstCluster;
+    return 1;
+}
+
+/**
+ * Closes a directory opened with fs_opendir
+ * @param dir : The directory
+ */
+void fs_closedir(FsDir *dir){
+    if(dir == NULL) return;
+    if(dir->vol->vol.fs == VOLUME_EXT2) EXT2_closeDir(&(dir->ext2));
+    else FAT16_closeDir(&(dir->fat16));
+    free(dir);
+}
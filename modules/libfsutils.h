@@ -0,0 +1,116 @@
+#ifndef LIBFSUTILS_H
+#define LIBFSUTILS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// libfsutils: reads EXT2 and FAT16 images in-process (built with make lib, as libfsutils.a and libfsutils.so).
+// Functions returning a pointer give NULL on error, the rest 0 (or -1 for fs_pread); errno tells why.
+// A volume can be used from several threads at the same time, as can each file opened from it.
+
+// Symbols exported by the shared library (everything else stays inside it)
+#define FS_API __attribute__((visibility("default")))
+
+// Types of entries
+#define FS_TYPE_FILE 1
+#define FS_TYPE_DIR 2
+#define FS_TYPE_OTHER 3                 // Symbolic links, devices... (EXT2)
+
+#define FS_NAME_MAX 255
+
+typedef struct FsVolume FsVolume;
+typedef struct FsFile FsFile;
+typedef struct FsDir FsDir;
+
+typedef struct {
+    int type;                       // FS_TYPE_*
+    uint64_t size;                  // Size in bytes
+    uint64_t location;              // Inode number (EXT2) or first cluster (FAT16)
+    uint32_t mode;                  // Permission bits (EXT2) or attributes (FAT16)
+    uint32_t links;                 // Hard links (always 1 on FAT16)
+    int64_t mtime;                  // Last modification, in seconds since the epoch (0 if it isn't known)
+} FsStat;
+
+typedef struct {
+    char name[FS_NAME_MAX + 1];
+    int type;                       // FS_TYPE_*
+    uint64_t location;              // Inode number (EXT2) or first cluster (FAT16)
+} FsDirent;
+
+/**
+ * Opens an image and mounts the filesystem it holds (EXT2 or FAT16)
+ * @param imagePath : Path of the image
+ * @return The volume, or NULL if the image can't be opened or its filesystem isn't supported
+ */
+FS_API FsVolume * fs_open(const char *imagePath);
+
+/**
+ * Closes a volume (the files and directories opened from it must be closed first)
+ * @param vol : The volume
+ */
+FS_API void fs_close(FsVolume *vol);
+
+/**
+ * Gets the metadata of a file or directory
+ * @param vol : The volume
+ * @param path : Absolute path inside the volume ("/" is the root directory; FAT16 names ignore case)
+ * @param st : Output, the metadata
+ * @return Whether the path exists (1) or not (0)
+ */
+FS_API int fs_stat(FsVolume *vol, const char *path, FsStat *st);
+
+/**
+ * Opens a regular file to read it with fs_pread. Where every byte of the file is in the image is worked out
+ * here, once (block map or cluster chain), so reads at any offset go straight to the image.
+ * @param vol : The volume
+ * @param path : Absolute path of the file
+ * @return The file, or NULL if it doesn't exist or isn't a regular file
+ */
+FS_API FsFile * fs_lookup(FsVolume *vol, const char *path);
+
+/**
+ * Gets the size of an opened file
+ * @param file : The file
+ * @return Size in bytes
+ */
+FS_API uint64_t fs_size(FsFile *file);
+
+/**
+ * Reads bytes of a file, like pread
+ * @param file : The file
+ * @param buf : Destination buffer
+ * @param len : Number of bytes to read
+ * @param offset : Byte offset inside the file
+ * @return Number of bytes read (less than len at the end of the file, 0 past it), or -1 on error
+ */
+FS_API ssize_t fs_pread(FsFile *file, void *buf, size_t len, uint64_t offset);
+
+/**
+ * Closes a file opened with fs_lookup
+ * @param file : The file
+ */
+FS_API void fs_release(FsFile *file);
+
+/**
+ * Opens a directory to go through its entries with fs_readdir
+ * @param vol : The volume
+ * @param path : Absolute path of the directory
+ * @return The directory, or NULL if it doesn't exist or isn't a directory
+ */
+FS_API FsDir * fs_opendir(FsVolume *vol, const char *path);
+
+/**
+ * Gets the next entry of a directory (. and .. are skipped)
+ * @param dir : The directory
+ * @param entry : Output, the entry
+ * @return Whether there was an entry (1) or the directory has no more (0)
+ */
+FS_API int fs_readdir(FsDir *dir, FsDirent *entry);
+
+/**
+ * Closes a directory opened with fs_opendir
+ * @param dir : The directory
+ */
+FS_API void fs_closedir(FsDir *dir);
+
+#endif
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include "output.h"
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+Output OUT_stdout;
+
+static int writevFull(int fd, struct iovec *iov, int count);
+static int writeOut(Output *out, struct iovec *iov, int count);
+
+/**
+ * Flushes the standard output (registered with atexit)
+ */
+static void flushStdout(void){
+    OUT_close(&OUT_stdout);
+}
+
+/**
+ * Opens the standard output, and makes sure it's flushed when the program exits
+ */
+void OUT_init(void){
+    if(OUT_open(&OUT_stdout, STDOUT_FILENO)) atexit(flushStdout);
+}
+
+/**
+ * Opens an output over a file descriptor, choosing its buffer size from the kind of file it is
+ * @param out : The output to open
+ * @param fd : The file descriptor
+ * @return Whether the output could be opened (1) or not (0)
+ */
+int OUT_open(Output *out, int fd){
+    memset(out, 0, sizeof(Output));
+    out->fd = fd;
+
+    struct stat st;
+    if(isatty(fd)) out->kind = OUT_TERMINAL;
+    else if(fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) out->kind = OUT_PIPE;
+    else if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) out->kind = OUT_FILE;
+    else if(fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode)) out->kind = OUT_SOCKET;
+    else out->kind = OUT_OTHER;
+
+    out->capacity = out->kind == OUT_TERMINAL ? OUT_TERMINAL_BUFFER : OUT_BULK_BUFFER;
+    out->buffer = (char *) malloc(out->capacity);
+    if(out->buffer == NULL){
+        out->capacity = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Opens an output over a connection of --serve: everything written to it is sent as OUT_FRAME_DATA frames
+ * @param out : The output to open
+ * @param fd : The file descriptor of the connection
+ * @return Whether the output could be opened (1) or not (0)
+ */
+int OUT_openFramed(Output *out, int fd){
+    if(!OUT_open(out, fd)) return 0;
+    out->framed = 1;
+    return 1;
+}
+
+/**
+ * Flushes an output, then sends a frame of its own (only for framed outputs)
+ * @param out : The output
+ * @param type : OUT_FRAME_*
+ * @param payload : Bytes of the frame
+ * @param len : Number of bytes (up to OUT_FRAME_MAX)
+ * @return Whether the frame was sent (1) or not (0)
+ */
+int OUT_writeFrame(Output *out, uint32_t type, const void *payload, uint32_t len){
+    OUT_flush(out);
+    if(!out->framed || out->failed || len > OUT_FRAME_MAX) return 0;
+
+    OutFrame header = {type, len};
+    struct iovec iov[2] = {{&header, sizeof(OutFrame)}, {(void *) payload, len}};
+    if(!writevFull(out->fd, iov, 2)) out->failed = 1;
+    return !out->failed;
+}
+
+/**
+ * Flushes and closes an output (the file descriptor itself is left open)
+ * @param out : The output
+ */
+void OUT_close(Output *out){
+    if(out->buffer == NULL) return;
+    OUT_flush(out);
+    free(out->buffer);
+    out->buffer = NULL;
+    out->capacity = 0;
+}
+
+/**
+ * Writes all the given buffers with writev, retrying on short writes
+ * @return Whether everything was written (1) or not (0)
+ */
+static int writevFull(int fd, struct iovec *iov, int count){
+    while(count > 0){
+        ssize_t w = writev(fd, iov, count);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) return 0;
+
+        //Skip the buffers already written, and the written part of the next one
+        while(count > 0 && (size_t) w >= iov->iov_len){
+            w -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (char *) iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Writes one or two buffers to the file descriptor of an output, as a single frame when it's framed
+ * @param out : The output
+ * @param iov : The buffers (their total can't be over OUT_FRAME_MAX + the capacity of the buffer)
+ * @param count : Number of buffers (1 or 2)
+ * @return Whether everything was written (1) or not (0)
+ */
+static int writeOut(Output *out, struct iovec *iov, int count){
+    if(!out->framed) return writevFull(out->fd, iov, count);
+
+    //The frame header goes in the same writev
+    struct iovec framed[3];
+    OutFrame header = {OUT_FRAME_DATA, 0};
+    framed[0].iov_base = &header;
+    framed[0].iov_len = sizeof(OutFrame);
+    for(int i = 0; i < count; i++){
+        framed[i + 1] = iov[i];
+        header.length += (uint32_t) iov[i].iov_len;
+    }
+    return writevFull(out->fd, framed, count + 1);
+}
+
+/**
+ * Writes everything in the buffer to the file descriptor
+ * @param out : The output
+ */
+void OUT_flush(Output *out){
+    if(out->used == 0) return;
+
+    struct iovec iov = {out->buffer, out->used};
+    if(!out->failed && !writeOut(out, &iov, 1)) out->failed = 1;
+    out->used = 0;
+}
+
+/**
+ * Writes bytes to an output. Writes bigger than the buffer skip it, going out with a single writev
+ * together with whatever was buffered.
+ * @param out : The output
+ * @param bytes : The bytes to write
+ * @param len : Number of bytes
+ */
+void OUT_write(Output *out, const void *bytes, size_t len){
+    if(out->used + len <= out->capacity){
+        memcpy(out->buffer + out->used, bytes, len);
+        out->used += len;
+        return;
+    }
+
+    //Big write: send the buffer and the bytes together, without copying them
+    if(len >= out->capacity){
+        //Frames have a limited size: bigger writes go as several of them
+        while(out->framed && len > OUT_FRAME_MAX){
+            OUT_write(out, bytes, OUT_FRAME_MAX);
+            bytes = (const char *) bytes + OUT_FRAME_MAX;
+            len -= OUT_FRAME_MAX;
+        }
+
+        struct iovec iov[2] = {{out->buffer, out->used}, {(void *) bytes, len}};
+        if(!out->failed && !writeOut(out, iov, 2)) out->failed = 1;
+        out->used = 0;
+        return;
+    }
+
+    OUT_flush(out);
+    memcpy(out->buffer, bytes, len);
+    out->used = len;
+}
+
+/**
+ * Writes formatted text to an output, like printf
+ * @param out : The output
+ * @param format : printf format
+ */
+void OUT_printf(Output *out, const char *format, ...){
+    va_list args;
+
+    //Format straight into the buffer when the text fits in what's left of it
+    va_start(args, format);
+    int len = vsnprintf(out->buffer + out->used, out->capacity - out->used, format, args);
+    va_end(args);
+    if(len < 0) return;
+    if(out->used + len < out->capacity){
+        out->used += len;
+        return;
+    }
+
+    //It didn't fit: format it apart and write it
+    char *text = (char *) malloc(len + 1);
+    if(text == NULL) return;
+    va_start(args, format);
+    vsnprintf(text, len + 1, format, args);
+    va_end(args);
+    OUT_write(out, text, len);
+    free(text);
+}
+
+/**
+ * Writes len zero bytes to an output
+ * @param out : The output
+ * @param len : Number of zero bytes
+ */
+void OUT_zeros(Output *out, uint64_t len){
+    static const char zeros[4096];
+    while(len > 0){
+        size_t chunk = len > sizeof(zeros) ? sizeof(zeros) : (size_t) len;
+        OUT_write(out, zeros, chunk);
+        len -= chunk;
+    }
+}
+
+/**
+ * Copies a range of an image to an output. Files and pipes get it copied in the kernel (zero-copy);
+ * terminals get it through the buffer, straight from the image.
+ * @param out : The output
+ * @param img : The image
+ * @param offset : Byte offset inside the image
+ * @param len : Number of bytes
+ * @return Whether all the bytes were copied (1) or not (0)
+ */
+int OUT_copyFromImage(Output *out, Image *img, uint64_t offset, uint64_t len){
+    if(offset > img->size || len > img->size - offset) return 0;
+
+    //Framed outputs: each chunk goes after the header of its frame, copied in the kernel too
+    if(out->framed){
+        OUT_flush(out);
+        while(len > 0 && !out->failed){
+            uint32_t chunk = len > OUT_FRAME_MAX ? OUT_FRAME_MAX : (uint32_t) len;
+            struct iovec iov = {&(OutFrame) {OUT_FRAME_DATA, chunk}, sizeof(OutFrame)};
+            //Once the header is out, the frame must be completed for the stream to make sense
+            if(!writevFull(out->fd, &iov, 1) || !IMAGE_copyTo(img, out->fd, offset, chunk)) out->failed = 1;
+            offset += chunk;
+            len -= chunk;
+        }
+        return !out->failed;
+    }
+
+    if(out->kind == OUT_FILE || out->kind == OUT_PIPE || out->kind == OUT_SOCKET){
+        //Whatever was buffered goes first
+        OUT_flush(out);
+
+        //File to file: copy_file_range can even share the blocks, if the filesystem supports it (direct
+        //images are left to IMAGE_copyTo, which reads them without the page cache)
+        if(out->kind == OUT_FILE && !img->direct){
+            loff_t pos = (loff_t) offset;
+            while(len > 0){
+                ssize_t copied = copy_file_range(img->fd, &pos, out->fd, NULL, len, 0);
+                if(copied < 0 && errno == EINTR) continue;
+                if(copied <= 0) break;
+                len -= (uint64_t) copied;
+            }
+            offset = (uint64_t) pos;
+            if(len == 0) return 1;
+        }
+
+        //Pipes, sockets, and files on which copy_file_range isn't supported, use sendfile
+        return IMAGE_copyTo(img, out->fd, offset, len);
+    }
+
+    //Terminals: copy through the buffer
+    while(len > 0){
+        size_t chunk = len > IMAGE_WINDOW_SIZE ? IMAGE_WINDOW_SIZE : (size_t) len;
+        const void *data = IMAGE_get(img, offset, chunk);
+        if(data == NULL) return 0;
+        OUT_write(out, data, chunk);
+
+        offset += chunk;
+        len -= chunk;
+    }
+    return !out->failed;
+}
+
+/**
+ * Copies a whole file to an output, given where the file is in the image (holes are written as zeros)
+ * @param out : The output
+ * @param img : The image
+ * @param runs : The runs of the file, in order
+ * @param count : Number of runs
+ * @return Whether all the bytes were copied (1) or not (0)
+ */
+int OUT_copyRuns(Output *out, Image *img, const ImageRun *runs, uint32_t count){
+    for(uint32_t i = 0; i < count; i++){
+        if(runs[i].offset == IMAGE_HOLE) OUT_zeros(out, runs[i].length);
+        else if(!OUT_copyFromImage(out, img, runs[i].offset, runs[i].length)) return 0;
+    }
+    return !out->failed;
+}
@@ -0,0 +1,134 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "image.h"
+
+// Buffer sizes: terminals get a small buffer so output shows up promptly, pipes & files a big one
+#define OUT_TERMINAL_BUFFER (8 * 1024)
+#define OUT_BULK_BUFFER (1024 * 1024)
+
+// Kinds of output, detected when the output is opened
+#define OUT_TERMINAL 0
+#define OUT_PIPE 1
+#define OUT_FILE 2
+#define OUT_OTHER 3
+#define OUT_SOCKET 4
+
+// Framed outputs (the connections of --serve) send everything as frames: an OutFrame header, then length bytes
+#define OUT_FRAME_REQUEST 1             // Client to daemon: the arguments of a command, each one '\0' ended
+#define OUT_FRAME_DATA 2                // Daemon to client: output of the command
+#define OUT_FRAME_END 3                 // Daemon to client: the command finished, the payload is its exit status (uint32_t)
+#define OUT_FRAME_MAX (1U << 30)        // Largest payload of a frame
+
+typedef struct {
+    uint32_t type;                  // OUT_FRAME_*
+    uint32_t length;                // Bytes of payload after the header
+} OutFrame;
+
+typedef struct {
+    int fd;                         // File descriptor everything ends up in
+    int kind;                       // OUT_TERMINAL, OUT_PIPE, OUT_FILE, OUT_SOCKET or OUT_OTHER
+    int framed;                     // Whether the output is sent as OUT_FRAME_DATA frames
+    char *buffer;
+    size_t used;
+    size_t capacity;
+    int failed;                     // Set when a write fails (e.g. the reader of a pipe went away)
+} Output;
+
+// Standard output, used by every command (opened by OUT_init)
+extern Output OUT_stdout;
+
+/**
+ * Opens the standard output, and makes sure it's flushed when the program exits
+ */
+void OUT_init(void);
+
+/**
+ * Opens an output over a file descriptor, choosing its buffer size from the kind of file it is
+ * @param out : The output to open
+ * @param fd : The file descriptor
+ * @return Whether the output could be opened (1) or not (0)
+ */
+int OUT_open(Output *out, int fd);
+
+/**
+ * Opens an output over a connection of --serve: everything written to it is sent as OUT_FRAME_DATA frames
+ * @param out : The output to open
+ * @param fd : The file descriptor of the connection
+ * @return Whether the output could be opened (1) or not (0)
+ */
+int OUT_openFramed(Output *out, int fd);
+
+/**
+ * Flushes an output, then sends a frame of its own (only for framed outputs)
+ * @param out : The output
+ * @param type : OUT_FRAME_*
+ * @param payload : Bytes of the frame
+ * @param len : Number of bytes (up to OUT_FRAME_MAX)
+ * @return Whether the frame was sent (1) or not (0)
+ */
+int OUT_writeFrame(Output *out, uint32_t type, const void *payload, uint32_t len);
+
+/**
+ * Flushes and closes an output (the file descriptor itself is left open)
+ * @param out : The output
+ */
+void OUT_close(Output *out);
+
+/**
+ * Writes everything in the buffer to the file descriptor
+ * @param out : The output
+ */
+void OUT_flush(Output *out);
+
+/**
+ * Writes bytes to an output. Writes bigger than the buffer skip it, going out with a single writev
+ * together with whatever was buffered.
+ * @param out : The output
+ * @param bytes : The bytes to write
+ * @param len : Number of bytes
+ */
+void OUT_write(Output *out, const void *bytes, size_t len);
+
+/**
+ * Writes formatted text to an output, like printf
+ * @param out : The output
+ * @param format : printf format
+ */
+void OUT_printf(Output *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Writes len zero bytes to an output
+ * @param out : The output
+ * @param len : Number of zero bytes
+ */
+void OUT_zeros(Output *out, uint64_t len);
+
+/**
+ * Copies a range of an image to an output. Files, pipes and sockets get it copied in the kernel (zero-copy);
+ * terminals get it through the buffer, straight from the image.
+ * @param out : The output
+ * @param img : The image
+ * @param offset : Byte offset inside the image
+ * @param len : Number of bytes
+ * @return Whether all the bytes were copied (1) or not (0)
+ */
+int OUT_copyFromImage(Output *out, Image *img, uint64_t offset, uint64_t len);
+
+/**
+ * Copies a whole file to an output, given where the file is in the image (holes are written as zeros)
+ * @param out : The output
+ * @param img : The image
+ * @param runs : The runs of the file, in order
+ * @param count : Number of runs
+ * @return Whether all the bytes were copied (1) or not (0)
+ */
+int OUT_copyRuns(Output *out, Image *img, const ImageRun *runs, uint32_t count);
+
+#endif
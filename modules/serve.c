@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include "serve.h"
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// An image kept open by the daemon
+typedef struct ServedVolume {
+    Volume vol;
+    dev_t dev;                      // Identity & state of the image when it was opened: if they change, it's reopened
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int users;                      // Commands running on it
+    int stale;                      // Set when a newer version of the image was opened (freed by its last user)
+    struct ServedVolume *next;
+} ServedVolume;
+
+static pthread_mutex_t volumesLock = PTHREAD_MUTEX_INITIALIZER;
+static ServedVolume *volumes = NULL;
+
+static int readFull(int fd, void *buf, size_t len);
+static int connectTo(const char *socketPath);
+static ServedVolume * findVolume(const char *path, const struct stat *st);
+static ServedVolume * acquireVolume(const char *path, Output *out);
+static void releaseVolume(ServedVolume *served);
+static void * serveClient(void *arg);
+static int runRequest(char *request, uint32_t len, Output *out);
+
+/**
+ * Reads exactly len bytes, retrying on short reads
+ * @return Whether all the bytes were read (1) or the connection ended first (0)
+ */
+static int readFull(int fd, void *buf, size_t len){
+    while(len > 0){
+        ssize_t r = read(fd, buf, len);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return 0;
+        buf = (char *) buf + r;
+        len -= (size_t) r;
+    }
+    return 1;
+}
+
+/**
+ * Connects to a UNIX socket
+ * @param socketPath : Path of the socket
+ * @return The connected socket, or -1 if nobody is listening on it
+ */
+static int connectTo(const char *socketPath){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -1;
+    if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Finds the open volume of an image, dropping it if the image changed since it was opened. The caller holds
+ * volumesLock.
+ * @param path : Absolute path of the image
+ * @param st : Current identity & state of the image
+ * @return The volume, or NULL if the image isn't open (or was, as it was before)
+ */
+static ServedVolume * findVolume(const char *path, const struct stat *st){
+    ServedVolume **link = &volumes;
+    while(*link != NULL && strcmp((*link)->vol.path, path) != 0) link = &((*link)->next);
+
+    ServedVolume *served = *link;
+    if(served != NULL && (served->dev != st->st_dev || served->ino != st->st_ino || served->size != st->st_size
+                          || served->mtime.tv_sec != st->st_mtim.tv_sec || served->mtime.tv_nsec != st->st_mtim.tv_nsec)){
+        //The image changed: drop the old volume (now, or when its last command ends)
+        *link = served->next;
+        served->stale = 1;
+        if(served->users == 0){
+            VOLUME_close(&(served->vol));
+            free(served);
+        }
+        served = NULL;
+    }
+    return served;
+}
+
+/**
+ * Gets the open volume of an image, opening it if it isn't open yet or if the image changed since it was.
+ * The image is opened without holding volumesLock, so commands on other images don't wait for it.
+ * @param path : Absolute path of the image
+ * @param out : Output where errors are printed
+ * @return The volume (give it back with releaseVolume), or NULL if it can't be opened
+ */
+static ServedVolume * acquireVolume(const char *path, Output *out){
+    struct stat st;
+    if(stat(path, &st) != 0){
+        OUT_printf(out, ERR_FS_NOT_SUPPORTED, path);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&volumesLock);
+    ServedVolume *served = findVolume(path, &st);
+    if(served != NULL) served->users++;
+    pthread_mutex_unlock(&volumesLock);
+    if(served != NULL) return served;
+
+    ServedVolume *opened = (ServedVolume *) calloc(1, sizeof(ServedVolume));
+    if(opened == NULL || !VOLUME_open(&(opened->vol), path, 0, out)){
+        free(opened);
+        return NULL;
+    }
+    opened->dev = st.st_dev;
+    opened->ino = st.st_ino;
+    opened->size = st.st_size;
+    opened->mtime = st.st_mtim;
+
+    //Another command may have opened the same image meanwhile: the first one in is kept
+    pthread_mutex_lock(&volumesLock);
+    served = findVolume(path, &st);
+    if(served == NULL){
+        opened->next = volumes;
+        volumes = opened;
+        served = opened;
+        opened = NULL;
+    }
+    served->users++;
+    pthread_mutex_unlock(&volumesLock);
+
+    if(opened != NULL){
+        VOLUME_close(&(opened->vol));
+        free(opened);
+    }
+    return served;
+}
+
+/**
+ * Gives back a volume got with acquireVolume
+ * @param served : The volume
+ */
+static void releaseVolume(ServedVolume *served){
+    pthread_mutex_lock(&volumesLock);
+    served->users--;
+    int drop = served->stale && served->users == 0;
+    pthread_mutex_unlock(&volumesLock);
+
+    if(drop){
+        VOLUME_close(&(served->vol));
+        free(served);
+    }
+}
+
+/**
+ * Runs the command of a request
+ * @param request : The arguments of the command, each one '\0' ended (the image is the second one)
+ * @param len : Bytes of the request
+ * @param out : Output of the connection
+ * @return Exit status of the command
+ */
+static int runRequest(char *request, uint32_t len, Output *out){
+    //Split the arguments, as main gets them (argv[0] is the program)
+    char *argv[VOLUME_MAX_ARGS + 1] = {"fsutils"};
+    int argc = 1;
+    for(uint32_t pos = 0; len > 0 && request[len - 1] == '\0' && pos < len; pos += strlen(request + pos) + 1){
+        if(argc > VOLUME_MAX_ARGS) break;
+        argv[argc++] = request + pos;
+    }
+    if(argc < VOLUME_MIN_ARGS || argc > VOLUME_MAX_ARGS){
+        OUT_printf(out, ERR_ARGS);
+        return 1;
+    }
+
+    ServedVolume *served = acquireVolume(argv[2], out);
+    if(served == NULL) return 1;
+    int status = VOLUME_run(&(served->vol), argc, argv, out);
+    releaseVolume(served);
+    return status;
+}
+
+/**
+ * Answers the requests of a client, one after the other, until it disconnects
+ * @param arg : The socket of the client (malloc'd int)
+ * @return NULL
+ */
+static void * serveClient(void *arg){
+    int fd = *(int *) arg;
+    free(arg);
+
+    Output out;
+    char *request = (char *) malloc(SERVE_MAX_REQUEST);
+    if(request != NULL && OUT_openFramed(&out, fd)){
+        OutFrame frame;
+        while(readFull(fd, &frame, sizeof(OutFrame))){
+            if(frame.type != OUT_FRAME_REQUEST || frame.length > SERVE_MAX_REQUEST) break;
+            if(!readFull(fd, request, frame.length)) break;
+
+            uint32_t status = (uint32_t) runRequest(request, frame.length, &out);
+            if(!OUT_writeFrame(&out, OUT_FRAME_END, &status, sizeof(status))) break;
+        }
+        OUT_close(&out);
+    }
+
+    free(request);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Runs the daemon: listens on a UNIX socket and answers the commands clients send, each client from a thread
+ * of its own. Images stay open and mounted between commands (reopened when they change), so the commands
+ * find their filesystem information, FAT and pages already loaded.
+ * @param socketPath : Path of the socket
+ * @return Only returns if the socket can't be served (1)
+ */
+int SERVE_run(const char *socketPath){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(addr.sun_path)){
+        fprintf(stderr, ERR_SERVE, socketPath);
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    //A socket left behind by a daemon that's gone can be replaced, but not one that's being served
+    int other = connectTo(socketPath);
+    struct stat st;
+    if(other >= 0) close(other);
+    else if(stat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socketPath);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(other >= 0 || listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0
+       || listen(listener, SERVE_BACKLOG) != 0){
+        fprintf(stderr, ERR_SERVE, socketPath);
+        if(listener >= 0) close(listener);
+        return 1;
+    }
+
+    //Clients going away make writes fail, instead of killing the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while(1){
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) continue;
+            break;
+        }
+
+        pthread_t thread;
+        int *arg = (int *) malloc(sizeof(int));
+        if(arg != NULL) *arg = fd;
+        if(arg == NULL || pthread_create(&thread, &attr, serveClient, arg) != 0){
+            free(arg);
+            close(fd);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    close(listener);
+    fprintf(stderr, ERR_SERVE, socketPath);
+    return 1;
+}
+
+/**
+ * Sends a command to a daemon, and copies what it answers to the standard output
+ * @param socketPath : Path of the socket of the daemon
+ * @param argc : Number of arguments
+ * @param argv : Arguments, as given to fsutils (the paths of the host are made absolute before sending them)
+ * @param status : Output, the exit status of the command
+ * @return Whether the daemon could be reached (1) or the command has to run here (0)
+ */
+int SERVE_forward(const char *socketPath, int argc, char *argv[], int *status){
+    //The daemon may run from another directory: send the image (and the destination of --extract) as absolute paths
+    char image[PATH_MAX], dest[PATH_MAX];
+    char request[SERVE_MAX_REQUEST];
+    uint32_t len = 0;
+    for(int i = 1; i < argc; i++){
+        const char *arg = (i == 2 && realpath(argv[i], image) != NULL) ? image : argv[i];
+        if(i == 3 && strcmp(argv[1], "--extract") == 0 && argv[i][0] != '/' && getcwd(dest, sizeof(dest)) != NULL){
+            size_t cwdLen = strlen(dest);
+            if(cwdLen + 1 + strlen(argv[i]) >= sizeof(dest)) return 0;
+            dest[cwdLen] = '/';
+            strcpy(dest + cwdLen + 1, argv[i]);
+            arg = dest;
+        }
+        size_t argLen = strlen(arg) + 1;
+        if(len + argLen > sizeof(request)) return 0;
+        memcpy(request + len, arg, argLen);
+        len += (uint32_t) argLen;
+    }
+
+    int fd = connectTo(socketPath);
+    if(fd < 0) return 0;
+
+    Output conn;
+    char *chunk = (char *) malloc(SERVE_READ_CHUNK);
+    int ended = 0;
+    if(chunk != NULL && OUT_openFramed(&conn, fd)){
+        if(OUT_writeFrame(&conn, OUT_FRAME_REQUEST, request, len)){
+            //Copy the output of the command until it ends
+            OutFrame frame;
+            while(!ended && readFull(fd, &frame, sizeof(OutFrame))){
+                if(frame.type == OUT_FRAME_END){
+                    uint32_t code = 1;
+                    ended = frame.length == sizeof(code) && readFull(fd, &code, sizeof(code));
+                    *status = (int) code;
+                    break;
+                }
+                if(frame.type != OUT_FRAME_DATA) break;
+
+                uint32_t left = frame.length;
+                while(left > 0){
+                    size_t want = left > SERVE_READ_CHUNK ? SERVE_READ_CHUNK : left;
+                    ssize_t r = read(fd, chunk, want);
+                    if(r < 0 && errno == EINTR) continue;
+                    if(r <= 0) break;
+                    OUT_write(&OUT_stdout, chunk, (size_t) r);
+                    left -= (uint32_t) r;
+                }
+                if(left > 0) break;
+            }
+        }
+        OUT_close(&conn);
+    }
+
+    free(chunk);
+    close(fd);
+    if(!ended){
+        OUT_flush(&OUT_stdout);
+        fprintf(stderr, ERR_SERVE_LOST);
+        *status = 1;
+    }
+    return 1;
+}
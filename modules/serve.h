@@ -0,0 +1,45 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "output.h"
+#include "volume.h"
+
+// Environment variable with the socket of a daemon: when it's set, commands are sent to it instead of run here
+#define SERVE_SOCKET_ENV "FSUTILS_SOCKET"
+
+// Connections waiting to be accepted
+#define SERVE_BACKLOG 64
+// Largest request (the arguments of a command)
+#define SERVE_MAX_REQUEST (4 * INDEX_MAX_PATH)
+// Bytes of output the client reads at a time
+#define SERVE_READ_CHUNK (256 * 1024)
+
+#define ERR_SERVE "Error. Could not serve on %s.\n"
+#define ERR_SERVE_LOST "Error. The connection to the fsutils daemon was lost.\n"
+
+/**
+ * Runs the daemon: listens on a UNIX socket and answers the commands clients send, each client from a thread
+ * of its own. Images stay open and mounted between commands (reopened when they change), so the commands
+ * find their filesystem information, FAT and pages already loaded.
+ * @param socketPath : Path of the socket
+ * @return Only returns if the socket can't be served (1)
+ */
+int SERVE_run(const char *socketPath);
+
+/**
+ * Sends a command to a daemon, and copies what it answers to the standard output
+ * @param socketPath : Path of the socket of the daemon
+ * @param argc : Number of arguments
+ * @param argv : Arguments, as given to fsutils (the path of the image is made absolute before sending it)
+ * @param status : Output, the exit status of the command
+ * @return Whether the daemon could be reached (1) or the command has to run here (0)
+ */
+int SERVE_forward(const char *socketPath, int argc, char *argv[], int *status);
+
+#endif
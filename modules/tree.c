@@ -1,63 +1,171 @@
 #include "tree.h"
 
+/**
+ * Creates a new chunk, linked in front of the previous one
+ * @param previous : The chunk being replaced (NULL for the first one)
+ * @param size : Minimum usable size
+ * @return The new chunk, or NULL if there's no memory left
+ */
+static struct TreeChunk * newChunk(struct TreeChunk *previous, size_t size){
+    if(size < TREE_CHUNK_SIZE) size = TREE_CHUNK_SIZE;
+
+    struct TreeChunk *chunk = (struct TreeChunk *) malloc(sizeof(struct TreeChunk) + size);
+    if(chunk == NULL) return NULL;
+    chunk->next = previous;
+    chunk->size = size;
+    atomic_init(&(chunk->used), 0);
+    return chunk;
+}
+
+/**
+ * Bumps size bytes from an arena space. Threads only contend on an atomic add, unless the chunk is full,
+ * in which case the first thread to notice replaces it under the lock.
+ * @param arena : The arena
+ * @param space : The space of the arena to allocate from (nodes or names)
+ * @param size : Number of bytes (already rounded to the alignment the space needs)
+ * @return The allocated memory, or NULL if there's no memory left
+ */
+static void * arenaAlloc(struct TreeArena *arena, _Atomic(struct TreeChunk *) *space, size_t size){
+    while(1){
+        struct TreeChunk *chunk = atomic_load(space);
+        size_t offset = atomic_fetch_add(&(chunk->used), size);
+        if(offset + size <= chunk->size) return chunk->data + offset;
+
+        pthread_mutex_lock(&(arena->lock));
+        if(atomic_load(space) == chunk){
+            struct TreeChunk *fresh = newChunk(chunk, size);
+            if(fresh == NULL){
+                pthread_mutex_unlock(&(arena->lock));
+                return NULL;
+            }
+            atomic_store(space, fresh);
+        }
+        pthread_mutex_unlock(&(arena->lock));
+    }
+}
+
+//Initializes the root node of a new tree
+int TREE_init(struct TreeNode *root){
+    memset(root, 0, sizeof(struct TreeNode));
+
+    struct TreeArena *arena = (struct TreeArena *) malloc(sizeof(struct TreeArena));
+    if(arena == NULL) return 0;
+
+    struct TreeChunk *nodes = newChunk(NULL, TREE_CHUNK_SIZE);
+    struct TreeChunk *names = newChunk(NULL, TREE_CHUNK_SIZE);
+    if(nodes == NULL || names == NULL){
+        free(nodes);
+        free(names);
+        free(arena);
+        return 0;
+    }
+
+    atomic_init(&(arena->nodes), nodes);
+    atomic_init(&(arena->names), names);
+    pthread_mutex_init(&(arena->lock), NULL);
+    root->arena = arena;
+    return 1;
+}
+
 struct TreeNode * TREE_addChild(struct TreeNode *parent, char *name){
-    // Add a child to the parent node
-    struct TreeNode * node = (struct TreeNode *) malloc(sizeof(struct TreeNode));
+    struct TreeArena *arena = parent->arena;
+
+    // Nodes are rounded up to pointer alignment, names are packed one after another
+    size_t nodeSize = (sizeof(struct TreeNode) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    size_t nameSize = strlen(name) + 1;
+    struct TreeNode * node = (struct TreeNode *) arenaAlloc(arena, &(arena->nodes), nodeSize);
+    char *nameCopy = (char *) arenaAlloc(arena, &(arena->names), nameSize);
+    if(node == NULL || nameCopy == NULL) return NULL;
+
     // Copy the name of the node
-    node->name = (char *) malloc(strlen(name) * sizeof(char));
-    strcpy(node->name, name);
+    memcpy(nameCopy, name, nameSize);
+    node->name = nameCopy;
+    node->firstChild = NULL;
+    node->lastChild = NULL;
+    node->nextSibling = NULL;
     node->numChilds = 0;
-    parent->numChilds++;
+    node->arena = arena;
 
-    //Reallocate memory for the array of child nodes in the parent
-    if(parent->numChilds == 1)
-        parent->child = (struct TreeNode **) malloc(parent->numChilds * sizeof(struct TreeNode *));
-    else
-        parent->child = (struct TreeNode **) realloc(parent->child, parent->numChilds * sizeof(struct TreeNode *));
+    // Append the node to the list of children of the parent (keeps the order in which they were added)
+    if(parent->lastChild == NULL) parent->firstChild = node;
+    else parent->lastChild->nextSibling = node;
+    parent->lastChild = node;
+    parent->numChilds++;
 
-    parent->child[parent->numChilds - 1] = node;
     return node;
 }
 
-void printNode(struct TreeNode * node, int level) {
+void TREE_printEntry(Output *out, int level, const char *name){
+    // The prefixes only depend on the depth of the entry
     for (int i = 0; i < level - 1; i++)
-        printf("│   ");  // Print vertical bars with indentation
+        OUT_write(out, "│   ", sizeof("│   ") - 1);  // Print vertical bars with indentation
 
-    if (level > 0) printf("├── ");  // Print horizontal bar for non-root nodes
+    if (level > 0) OUT_write(out, "├── ", sizeof("├── ") - 1);  // Print horizontal bar for non-root nodes
     //else if (last) printf("└── ");  // Print horizontal bar for the last child node
 
-    if(node->name != NULL) printf("%s\n", node->name);  // Print the name of the node
+    OUT_write(out, name, strlen(name));  // Print the name of the node
+    OUT_write(out, "\n", 1);
+}
+
+void printNode(Output *out, struct TreeNode * node, int level) {
+    if(node->name != NULL) TREE_printEntry(out, level, node->name);
 
     // Recursively print the child nodes
-    for (int i = 0; i < node->numChilds; i++)
-        printNode(node->child[i], level + 1);
+    for (struct TreeNode *child = node->firstChild; child != NULL; child = child->nextSibling)
+        printNode(out, child, level + 1);
 }
 
-void TREE_print(struct TreeNode *root) {
+void TREE_print(struct TreeNode *root, Output *out) {
     if (root == NULL) {
-        printf("Tree is empty.\n\n");
+        OUT_printf(out, "Tree is empty.\n\n");
         return;
     }
 
-    printf("\n");
-    printNode(root, 0);  // Start printing from the root node at level 0
-    printf("\n\n");
+    TREE_streamBegin(out);
+    printNode(out, root, 0);  // Start printing from the root node at level 0
+    TREE_streamEnd(out);
 }
-
 void TREE_free(struct TreeNode * root) {
-    if (root == NULL) return;
-
-    // Recursively free the child nodes
-    for (int i = 0; i < root->numChilds; i++){
-        TREE_free(root->child[i]);
+    if (root == NULL || root->arena == NULL) return;
+    struct TreeArena *arena = root->arena;
 
-        //Free the node itself (this is done here because the recursive call above can't free the node itself)
-        free(root->child[i]);
+    // Every node and name lives in the arena chunks, so freeing the chunks frees the whole tree
+    struct TreeChunk *chunks[2] = {atomic_load(&(arena->nodes)), atomic_load(&(arena->names))};
+    for (int i = 0; i < 2; i++){
+        while (chunks[i] != NULL){
+            struct TreeChunk *next = chunks[i]->next;
+            free(chunks[i]);
+            chunks[i] = next;
+        }
     }
 
-    // Free the name of the node
-    if(root->name != NULL) free(root->name);
+    pthread_mutex_destroy(&(arena->lock));
+    free(arena);
+
+    root->arena = NULL;
+    root->firstChild = NULL;
+    root->lastChild = NULL;
+    root->numChilds = 0;
+}
 
-    // Free the array of child nodes
-    free(root->child);
-}
\ No newline at end of file
+void TREE_streamBegin(Output *out){
+    OUT_write(out, "\n", 1);
+}
+
+void TREE_streamEnd(Output *out){
+    OUT_write(out, "\n\n", 2);
+}
+
+/**
+ * Visitor function that prints the entries
+ */
+static void printVisit(void *ctx, int level, const char *name, int isDir, const TreeSizes *sizes){
+    (void) isDir;
+    (void) sizes;
+    TREE_printEntry((Output *) ctx, level, name);
+}
+
+TreeVisitor TREE_streamVisitor(Output *out){
+    TreeVisitor visitor = {printVisit, NULL, out, 0};
+    return visitor;
+}
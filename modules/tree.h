@@ -4,20 +4,79 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "output.h"
+
+// Size of each chunk of the arenas where nodes and names are stored
+#define TREE_CHUNK_SIZE (1024 * 1024)
+
+struct TreeChunk {
+    struct TreeChunk *next;         // Previously filled chunk
+    size_t size;                    // Usable bytes in data
+    atomic_size_t used;             // Bytes handed out (may go past size when the chunk runs out)
+    char data[];
+};
+
+struct TreeArena {
+    _Atomic(struct TreeChunk *) nodes;      // Chunk where nodes are bumped from
+    _Atomic(struct TreeChunk *) names;      // Chunk where names are copied to (no alignment padding)
+    pthread_mutex_t lock;                   // Taken only to replace a full chunk
+};
 
 struct TreeNode {
     char *name;
-    struct TreeNode ** child;
+    struct TreeNode *firstChild;
+    struct TreeNode *lastChild;
+    struct TreeNode *nextSibling;
     int numChilds;
+    struct TreeArena *arena;        // Arena holding the whole tree (shared by every node)
 };
 
-//Adds a child to the tree, given the root node and the name of the child
+// Ways of walking a filesystem to print its tree
+#define TREE_WALK_PARALLEL 0            // Build the tree with a thread per CPU, then print it
+#define TREE_WALK_STREAM 1              // Print the entries as they are found (constant memory)
+#define TREE_WALK_ASYNC 2               // Build the tree from one thread that keeps many reads in flight, then print it
+
+// Sizes of an entry, for the visitors that ask for them
+typedef struct {
+    uint64_t size;                  // Size in bytes
+    uint64_t allocated;             // Bytes of the blocks or clusters it takes in the image
+} TreeSizes;
+
+// Receives the entries of a walk in depth-first order (level 1 = entries of the root directory)
+typedef struct {
+    void (*visit)(void *ctx, int level, const char *name, int isDir, const TreeSizes *sizes);
+    void (*leave)(void *ctx, int level);    // Called after the last entry of each directory (NULL if not needed)
+    void *ctx;
+    int sizes;                      // Whether the walk finds the sizes of the entries (visit gets NULL otherwise)
+} TreeVisitor;
+
+//Initializes the root node of a new tree
+int TREE_init(struct TreeNode *root);
+
+//Adds a child to the tree, given the parent node and the name of the child.
+//Different threads may add children to different parents at the same time.
 struct TreeNode * TREE_addChild(struct TreeNode *parent, char *name);
 
-//Prints the tree, given the root node
-void TREE_print(struct TreeNode *root);
+//Prints the tree to an output, given the root node
+void TREE_print(struct TreeNode *root, Output *out);
 
 //Frees the tree, given the root node
 void TREE_free(struct TreeNode *root);
 
+//Starts printing a tree in streaming mode (entries are printed as they arrive, without building the tree)
+void TREE_streamBegin(Output *out);
+
+//Prints one entry of the tree, given its level (the output is the same as TREE_print's)
+void TREE_printEntry(Output *out, int level, const char *name);
+
+//Ends a tree printed in streaming mode
+void TREE_streamEnd(Output *out);
+
+//Returns a visitor that prints every entry it receives to out
+TreeVisitor TREE_streamVisitor(Output *out);
+
 #endif
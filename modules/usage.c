@@ -0,0 +1,72 @@
+#include "usage.h"
+#include "fat16.h"
+
+// The counting loops are built twice on x86-64: with the popcnt instruction, and without it for older CPUs.
+// The loader picks one when the program starts.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define USAGE_POPCNT __attribute__((target_clones("popcnt", "default")))
+#else
+#define USAGE_POPCNT
+#endif
+
+// Lanes of a 64-bit word holding four FAT entries
+#define USAGE_LOW_BITS 0x7FFF7FFF7FFF7FFFULL
+#define USAGE_LANES(value) (0x0001000100010001ULL * (uint16_t) (value))
+
+static uint64_t zeroLanes(uint64_t word);
+
+/**
+ * Counts the bits that are set in a bitmap, 64 at a time (with the popcnt instruction, on CPUs that have it)
+ * @param bits : The bitmap (bit 0 is the lowest bit of the first byte, as in EXT2 bitmaps)
+ * @param numBits : Bits to count (the bits after them in the last byte are ignored)
+ * @return Number of bits set
+ */
+USAGE_POPCNT uint64_t USAGE_countBits(const unsigned char *bits, uint64_t numBits){
+    uint64_t set = 0, bytes = numBits / 8;
+    uint64_t i = 0;
+
+    for(; i + 8 <= bytes; i += 8){
+        uint64_t word;
+        memcpy(&word, bits + i, sizeof(word));
+        set += (uint64_t) __builtin_popcountll(word);
+    }
+    for(; i < bytes; i++) set += (uint64_t) __builtin_popcount(bits[i]);
+
+    //Bits of a last, partial byte
+    if(numBits % 8 != 0) set += (uint64_t) __builtin_popcount(bits[bytes] & ((1u << (numBits % 8)) - 1));
+    return set;
+}
+
+/**
+ * Marks the lanes of a word that are zero (SWAR: no carry crosses from one lane into the next)
+ * @param word : Four FAT entries
+ * @return The word, with the top bit of each zero lane set and every other bit clear
+ */
+static uint64_t zeroLanes(uint64_t word){
+    uint64_t lowSet = (word & USAGE_LOW_BITS) + USAGE_LOW_BITS;
+    return ~(lowSet | word | USAGE_LOW_BITS);
+}
+
+/**
+ * Counts the free and the bad entries of a FAT. Four entries are compared at a time, as the lanes of a
+ * 64-bit word, so the scan goes as fast as the FAT can be read.
+ * @param fat : The entries
+ * @param count : Number of entries
+ * @param counts : Output, the counts
+ */
+USAGE_POPCNT void USAGE_countFat(const uint16_t *fat, uint64_t count, UsageFatCounts *counts){
+    const uint64_t bad = USAGE_LANES(FAT16_BAD_CLUSTER);
+    counts->free = counts->bad = 0;
+
+    uint64_t i = 0;
+    for(; i + 4 <= count; i += 4){
+        uint64_t word;
+        memcpy(&word, fat + i, sizeof(word));
+        counts->free += (uint64_t) __builtin_popcountll(zeroLanes(word));
+        counts->bad += (uint64_t) __builtin_popcountll(zeroLanes(word ^ bad));
+    }
+    for(; i < count; i++){
+        counts->free += fat[i] == 0;
+        counts->bad += fat[i] == FAT16_BAD_CLUSTER;
+    }
+}
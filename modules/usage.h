@@ -0,0 +1,36 @@
+#ifndef USAGE_H
+#define USAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#define USAGE_PRINT "\n------ Usage ------\n\n"
+#define USAGE_PRINT_LINE "%s: %" PRIu64 " used, %" PRIu64 " free, %" PRIu64 " in total (%.1f%% used)\n"
+#define USAGE_PRINT_OK "The counters of the filesystem agree with what's allocated.\n\n"
+
+typedef struct {
+    uint64_t free;                  // Entries that are 0x0000
+    uint64_t bad;                   // Entries marked as bad clusters (FAT16_BAD_CLUSTER)
+} UsageFatCounts;
+
+/**
+ * Counts the bits that are set in a bitmap, 64 at a time (with the popcnt instruction, on CPUs that have it)
+ * @param bits : The bitmap (bit 0 is the lowest bit of the first byte, as in EXT2 bitmaps)
+ * @param numBits : Bits to count (the bits after them in the last byte are ignored)
+ * @return Number of bits set
+ */
+uint64_t USAGE_countBits(const unsigned char *bits, uint64_t numBits);
+
+/**
+ * Counts the free and the bad entries of a FAT. Four entries are compared at a time, as the lanes of a
+ * 64-bit word, so the scan goes as fast as the FAT can be read.
+ * @param fat : The entries
+ * @param count : Number of entries
+ * @param counts : Output, the counts
+ */
+void USAGE_countFat(const uint16_t *fat, uint64_t count, UsageFatCounts *counts);
+
+#endif
@@ -0,0 +1,198 @@
+#include "volume.h"
+#include <errno.h>
+
+static int openIndex(Volume *vol, Index *index);
+
+/**
+ * Opens an image and mounts the filesystem it holds
+ * @param vol : Output, the volume
+ * @param path : Path of the image
+ * @param flags : Flags of IMAGE_open (0, or IMAGE_DIRECT to read the image around the page cache)
+ * @param out : Output where errors are printed (NULL not to print them)
+ * @return Whether the volume could be opened (1) or not (0)
+ */
+int VOLUME_open(Volume *vol, const char *path, int flags, Output *out){
+    memset(vol, 0, sizeof(Volume));
+    vol->path = strdup(path);
+    if(vol->path == NULL) return 0;
+
+    //Open the image once: its first bytes are read here, and the same handle is used by every command
+    if(!IMAGE_open(&(vol->img), vol->path, flags)){
+        int noDirect = (flags & IMAGE_DIRECT) && errno == EINVAL;
+        if(out != NULL) OUT_printf(out, noDirect ? ERR_DIRECT : ERR_FS_NOT_SUPPORTED, path);
+        free(vol->path);
+        return 0;
+    }
+
+    //Check if the image holds EXT2 or FAT16, and mount it
+    int supported = 1, mounted = 0;
+    if(EXT2_isExt2(&(vol->img))){
+        vol->fs = VOLUME_EXT2;
+        mounted = EXT2_mount(&(vol->img), &(vol->ext2));
+    }
+    else if(FAT16_isFat16(&(vol->img))){
+        vol->fs = VOLUME_FAT16;
+        mounted = FAT16_mount(&(vol->img), &(vol->fat16));
+    }
+    else supported = 0;
+
+    if(!mounted){
+        if(out != NULL) OUT_printf(out, supported ? ERR_MOUNT : ERR_FS_NOT_SUPPORTED, path);
+        IMAGE_close(&(vol->img));
+        free(vol->path);
+        return 0;
+    }
+    pthread_mutex_init(&(vol->lock), NULL);
+    return 1;
+}
+
+/**
+ * Unmounts the filesystem of a volume and closes its image
+ * @param vol : The volume
+ */
+void VOLUME_close(Volume *vol){
+    if(vol->fs == VOLUME_EXT2) EXT2_unmount(&(vol->ext2));
+    else FAT16_unmount(&(vol->fat16));
+
+    pthread_mutex_destroy(&(vol->lock));
+    IMAGE_close(&(vol->img));
+    free(vol->path);
+    vol->path = NULL;
+}
+
+/**
+ * Maps the index of a volume, building it first when it's missing or stale (one command at a time)
+ * @param vol : The volume
+ * @param index : Output, the mapped index
+ * @return Whether the index could be mapped (1) or not (0)
+ */
+static int openIndex(Volume *vol, Index *index){
+    uint64_t stamp[2];
+    if(vol->fs == VOLUME_EXT2) EXT2_indexStamp(&(vol->ext2), stamp);
+    else FAT16_indexStamp(&(vol->img), stamp);
+    if(INDEX_load(index, vol->path, vol->fs, stamp)) return 1;
+
+    pthread_mutex_lock(&(vol->lock));
+    //Another command may have built it while we waited
+    int loaded = INDEX_load(index, vol->path, vol->fs, stamp);
+    if(!loaded){
+        //Missing or stale: walk the filesystem once and save it for the next runs
+        IndexWriter writer;
+        INDEX_writerInit(&writer);
+        int built = vol->fs == VOLUME_EXT2 ? EXT2_buildIndex(&(vol->img), &(vol->ext2), &writer)
+                                           : FAT16_buildIndex(&(vol->img), &(vol->fat16), &writer);
+        int saved = built && INDEX_save(&writer, vol->path, vol->fs, vol->fs == VOLUME_FAT16 ? INDEX_CASELESS : 0, stamp);
+        INDEX_writerFree(&writer);
+        loaded = saved && INDEX_load(index, vol->path, vol->fs, stamp);
+    }
+    pthread_mutex_unlock(&(vol->lock));
+    return loaded;
+}
+
+/**
+ * Runs a command on a volume (--info, --usage, --frag, --du, --hash, --dups, --find, --tree, --cat, --stat or --extract). Several commands can run on the same volume at
+ * the same time.
+ * @param vol : The volume (opened from argv[2])
+ * @param argc : Number of arguments
+ * @param argv : Arguments, as given to fsutils
+ * @param out : Output where the command prints
+ * @return Exit status of the command (0 if it ran, 1 if the arguments were wrong or it failed)
+ */
+int VOLUME_run(Volume *vol, int argc, char *argv[], Output *out){
+    Image *img = &(vol->img);
+    int isExt2 = vol->fs == VOLUME_EXT2;
+    int status = 0;
+
+    //The fallback reads of unmapped images share a buffer: commands on them take turns
+    int serial = img->map == NULL;
+    if(serial) pthread_mutex_lock(&(vol->lock));
+
+    //If the info option is selected, try to get the info from the file
+    if(argc == 3 && strcmp(argv[1], "--info") == 0){
+        if(isExt2) EXT2_printInfo(img, &(vol->ext2), out);
+        else FAT16_printInfo(img, &(vol->fat16), out);
+    }
+    else if(argc == 3 && strcmp(argv[1], "--usage") == 0){
+        //Counters that don't agree with the bitmaps (or FATs that don't agree) make the command fail
+        if(isExt2 ? !EXT2_printUsage(img, &(vol->ext2), out) : !FAT16_printUsage(img, &(vol->fat16), out)) status = 1;
+    }
+    else if(strcmp(argv[1], "--frag") == 0 && (argc == 3 || (argc == 4 && strcmp(argv[3], "--all") == 0))){
+        if(!FRAG_run(img, isExt2 ? &(vol->ext2) : NULL, isExt2 ? NULL : &(vol->fat16), argc == 4, out)) status = 1;
+    }
+    else if((argc == 3 || argc == 4) && strcmp(argv[1], "--du") == 0){
+        if(!DU_run(img, isExt2 ? &(vol->ext2) : NULL, isExt2 ? NULL : &(vol->fat16), argc == 4 ? argv[3] : "/", out)) status = 1;
+    }
+    else if(argc == 3 && (strcmp(argv[1], "--hash") == 0 || strcmp(argv[1], "--dups") == 0)){
+        int dups = strcmp(argv[1], "--dups") == 0;
+        if(!HASH_run(img, isExt2 ? &(vol->ext2) : NULL, isExt2 ? NULL : &(vol->fat16), dups, out)) status = 1;
+    }
+    else if(argc == 4 && strcmp(argv[1], "--stat") == 0){
+        if(isExt2 ? !EXT2_statFile(img, &(vol->ext2), argv[3], out) : !FAT16_statFile(img, &(vol->fat16), argv[3], out)) status = 1;
+    }
+    else if(argc == 4 && strcmp(argv[1], "--extract") == 0){
+        if(!EXTRACT_run(img, isExt2 ? &(vol->ext2) : NULL, isExt2 ? NULL : &(vol->fat16), argv[3], out)) status = 1;
+    }
+    else if(strcmp(argv[1], "--find") == 0 && argc >= 4){
+        //Options go after the pattern
+        FindOptions options = {0, FIND_TYPE_ANY, 0};
+        int valid = 1;
+        for(int i = 4; i < argc && valid; i++){
+            if(strcmp(argv[i], "--regex") == 0) options.regex = 1;
+            else if(strcmp(argv[i], "--type") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "f") == 0 || strcmp(argv[i + 1], "d") == 0))
+                options.type = argv[++i][0] == 'f' ? FIND_TYPE_FILE : FIND_TYPE_DIR;
+            else if(strcmp(argv[i], "--max-results") == 0 && i + 1 < argc){
+                char *end;
+                i++;
+                options.maxResults = strtoull(argv[i], &end, 10);
+                valid = argv[i][0] >= '0' && argv[i][0] <= '9' && *end == '\0' && options.maxResults > 0;
+            }
+            else valid = 0;
+        }
+
+        if(!valid){
+            OUT_printf(out, ERR_ARGS);
+            status = 1;
+        }
+        else if(!FIND_run(img, isExt2 ? &(vol->ext2) : NULL, isExt2 ? NULL : &(vol->fat16), argv[3], &options, out)) status = 1;
+    }
+    else if(strcmp(argv[1], "--tree") == 0 || (strcmp(argv[1], "--cat") == 0 && argc >= 4)){
+        //Options go after the path of the image (and after the file, for --cat)
+        int isTree = strcmp(argv[1], "--tree") == 0;
+        int walk = TREE_WALK_PARALLEL, useIndex = 0, valid = 1;
+        for(int i = isTree ? 3 : 4; i < argc; i++){
+            if(isTree && strcmp(argv[i], "--stream") == 0 && walk == TREE_WALK_PARALLEL) walk = TREE_WALK_STREAM;
+            else if(isTree && strcmp(argv[i], "--async") == 0 && walk == TREE_WALK_PARALLEL) walk = TREE_WALK_ASYNC;
+            else if(strcmp(argv[i], "--index") == 0) useIndex = 1;
+            else valid = 0;
+        }
+
+        Index index;
+        int indexed = 0;
+        if(valid && useIndex){
+            //The index lock is the same one: release it while the index is opened
+            if(serial) pthread_mutex_unlock(&(vol->lock));
+            indexed = openIndex(vol, &index);
+            if(serial) pthread_mutex_lock(&(vol->lock));
+            if(!indexed) OUT_printf(out, ERR_INDEX, argv[2]);
+        }
+
+        if(!valid){
+            OUT_printf(out, ERR_ARGS);
+            status = 1;
+        }
+        else if(isTree && indexed) INDEX_printTree(&index, out);
+        else if(isTree && isExt2) status = !EXT2_printTree(img, &(vol->ext2), walk, out);
+        else if(isTree) status = !FAT16_printTree(img, &(vol->fat16), walk, out);
+        else if(isExt2) status = !EXT2_catFile(img, &(vol->ext2), argv[3], indexed ? &index : NULL, out);
+        else status = !FAT16_catFile(img, &(vol->fat16), argv[3], indexed ? &index : NULL, out);
+
+        if(indexed) INDEX_close(&index);
+    }
+    else{
+        OUT_printf(out, ERR_ARGS);
+        status = 1;
+    }
+
+    if(serial) pthread_mutex_unlock(&(vol->lock));
+    return status;
+}
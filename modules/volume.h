@@ -0,0 +1,71 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "image.h"
+#include "output.h"
+#include "index.h"
+#include "ext2.h"
+#include "fat16.h"
+#include "extract.h"
+#include "frag.h"
+#include "du.h"
+#include "hash.h"
+#include "find.h"
+
+#define ERR_ARGS "Error. Please, provide correct arguments for fsutils to work. Use --help for more info.\n\n"
+#define ERR_INDEX "Warning. The index of %s could not be built, reading the filesystem instead.\n"
+#define ERR_MOUNT "Error. The filesystem of %s could not be read.\n\n"
+#define ERR_FS_NOT_SUPPORTED "Error. %s does not exist or has a Filesystem not supported. Only EXT2 and FAT16 are supported.\n\n"
+#define ERR_DIRECT "Error. %s can't be read with --direct: the filesystem it's on doesn't support O_DIRECT.\n\n"
+
+// Filesystems of a volume (also stored in the indexes)
+#define VOLUME_EXT2 0
+#define VOLUME_FAT16 1
+
+// Arguments of a command on a volume: fsutils <command> <image> [more arguments], at most 9 in total
+// (fsutils --find <image> <pattern> --regex --type f --max-results 10)
+#define VOLUME_MIN_ARGS 3
+#define VOLUME_MAX_ARGS 9
+
+typedef struct {
+    char *path;                     // Path of the image (the image keeps a pointer to it)
+    Image img;
+    int fs;                         // VOLUME_EXT2 or VOLUME_FAT16
+    Ext2 ext2;                      // Mounted filesystem, when fs is VOLUME_EXT2
+    Fat16 fat16;                    // Mounted filesystem, when fs is VOLUME_FAT16
+    pthread_mutex_t lock;           // Held while building the index, and while running commands on unmapped images
+} Volume;
+
+/**
+ * Opens an image and mounts the filesystem it holds
+ * @param vol : Output, the volume
+ * @param path : Path of the image
+ * @param flags : Flags of IMAGE_open (0, or IMAGE_DIRECT to read the image around the page cache)
+ * @param out : Output where errors are printed (NULL not to print them)
+ * @return Whether the volume could be opened (1) or not (0)
+ */
+int VOLUME_open(Volume *vol, const char *path, int flags, Output *out);
+
+/**
+ * Unmounts the filesystem of a volume and closes its image
+ * @param vol : The volume
+ */
+void VOLUME_close(Volume *vol);
+
+/**
+ * Runs a command on a volume (--info, --usage, --frag, --du, --hash, --dups, --find, --tree, --cat, --stat or --extract). Several commands can run on the same volume at
+ * the same time.
+ * @param vol : The volume (opened from argv[2])
+ * @param argc : Number of arguments
+ * @param argv : Arguments, as given to fsutils
+ * @param out : Output where the command prints
+ * @return Exit status of the command (0 if it ran, 1 if the arguments were wrong or it failed)
+ */
+int VOLUME_run(Volume *vol, int argc, char *argv[], Output *out);
+
+#endif
@@ -0,0 +1,195 @@
+#include "walk.h"
+#include <sched.h>
+#include <unistd.h>
+
+typedef struct {
+    WalkPool *pool;
+    int index;
+} WorkerArgs;
+
+static int popTask(WalkDeque *dq, WalkTask *task);
+static int stealTask(WalkDeque *dq, WalkTask *task);
+static void * workerLoop(void *arg);
+static void freePool(WalkPool *pool, int ready);
+
+/**
+ * Returns the number of workers worth using for a parallel walk (one per online CPU, at most WALK_MAX_THREADS)
+ * @return Number of workers
+ */
+int WALK_threads(void){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 1) return 1;
+    if(cpus > WALK_MAX_THREADS) return WALK_MAX_THREADS;
+    return (int) cpus;
+}
+
+/**
+ * Pushes a directory to be expanded on the deque of the given worker
+ * @param pool : The pool running the walk
+ * @param worker : Index of the worker pushing the task
+ * @param dir : Directory to expand
+ * @param node : Tree node of the directory (if there is no memory for the task, the walk fails, see WALK_run)
+ */
+void WALK_push(WalkPool *pool, int worker, uint64_t dir, struct TreeNode *node){
+    WalkDeque *dq = &(pool->deques[worker]);
+
+    pthread_mutex_lock(&(dq->lock));
+    if(dq->tail == dq->capacity){
+        //Move the live tasks to the front, and only grow the array if that doesn't make room
+        int live = dq->tail - dq->head;
+        if(dq->head > 0) memmove(dq->tasks, dq->tasks + dq->head, live * sizeof(WalkTask));
+        dq->head = 0;
+        dq->tail = live;
+        if(live == dq->capacity){
+            WalkTask *tasks = (WalkTask *) realloc(dq->tasks, 2 * dq->capacity * sizeof(WalkTask));
+            if(tasks == NULL){
+                pthread_mutex_unlock(&(dq->lock));
+                WALK_fail(pool);
+                return;
+            }
+            dq->tasks = tasks;
+            dq->capacity *= 2;
+        }
+    }
+    dq->tasks[dq->tail].dir = dir;
+    dq->tasks[dq->tail].node = node;
+    dq->tail++;
+    atomic_fetch_add(&(pool->pending), 1);
+    pthread_mutex_unlock(&(dq->lock));
+}
+
+/**
+ * Makes the walk fail (WALK_run returns 0), for an expand function that couldn't add an entry to its node
+ * @param pool : The pool running the walk
+ */
+void WALK_fail(WalkPool *pool){
+    atomic_store(&(pool->failed), 1);
+}
+
+/**
+ * Takes the newest task of a worker's own deque
+ * @return Whether a task was taken (1) or the deque was empty (0)
+ */
+static int popTask(WalkDeque *dq, WalkTask *task){
+    int found = 0;
+    pthread_mutex_lock(&(dq->lock));
+    if(dq->tail > dq->head){
+        *task = dq->tasks[--dq->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&(dq->lock));
+    return found;
+}
+
+/**
+ * Takes the oldest task of another worker's deque (the oldest tasks are the ones closest to the root,
+ * so they usually carry the most work with them)
+ * @return Whether a task was stolen (1) or the deque was empty (0)
+ */
+static int stealTask(WalkDeque *dq, WalkTask *task){
+    int found = 0;
+    pthread_mutex_lock(&(dq->lock));
+    if(dq->tail > dq->head){
+        *task = dq->tasks[dq->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&(dq->lock));
+    return found;
+}
+
+/**
+ * Main loop of every worker: run own tasks, steal when there are none, and stop when no task is pending anywhere
+ */
+static void * workerLoop(void *arg){
+    WorkerArgs *args = (WorkerArgs *) arg;
+    WalkPool *pool = args->pool;
+    int me = args->index;
+    WalkTask task;
+
+    while(1){
+        int found = popTask(&(pool->deques[me]), &task);
+
+        //Try the other workers, starting with the next one so that thieves spread out
+        for(int i = 1; !found && i < pool->numWorkers; i++)
+            found = stealTask(&(pool->deques[(me + i) % pool->numWorkers]), &task);
+
+        if(found){
+            pool->expand(pool, me, pool->ctx, task.dir, task.node);
+            atomic_fetch_sub(&(pool->pending), 1);
+        }
+        else if(atomic_load(&(pool->pending)) == 0) break;
+        else sched_yield();
+    }
+    return NULL;
+}
+
+/**
+ * Walks a directory hierarchy with a pool of work-stealing threads.
+ * Each worker expands directories from its own deque (newest first), and steals the oldest task of the
+ * other workers when it runs out. Since every directory is expanded by a single worker, the children of
+ * each node keep the directory order, and the resulting tree is the same as with a sequential walk.
+ * @param threads : Number of worker threads
+ * @param expand : Function that expands one directory
+ * @param ctx : Context passed to expand
+ * @param root : Root directory
+ * @param rootNode : Tree node of the root directory
+ * @return Whether the whole hierarchy was walked (1) or not (0, memory ran out)
+ */
+int WALK_run(int threads, WalkExpandFn expand, void *ctx, uint64_t root, struct TreeNode *rootNode){
+    if(threads < 1) threads = 1;
+    if(threads > WALK_MAX_THREADS) threads = WALK_MAX_THREADS;
+
+    WalkPool *pool = (WalkPool *) calloc(1, sizeof(WalkPool));
+    if(pool == NULL) return 0;
+    pool->numWorkers = threads;
+    pool->expand = expand;
+    pool->ctx = ctx;
+    atomic_init(&(pool->pending), 0);
+    atomic_init(&(pool->failed), 0);
+
+    int ready = 0;
+    while(ready < threads){
+        pool->deques[ready].tasks = (WalkTask *) malloc(WALK_DEQUE_CAPACITY * sizeof(WalkTask));
+        if(pool->deques[ready].tasks == NULL) break;
+        pthread_mutex_init(&(pool->deques[ready].lock), NULL);
+        pool->deques[ready].capacity = WALK_DEQUE_CAPACITY;
+        ready++;
+    }
+    if(ready < threads){
+        freePool(pool, ready);
+        return 0;
+    }
+
+    WALK_push(pool, 0, root, rootNode);
+
+    //Worker 0 is the calling thread
+    pthread_t tids[WALK_MAX_THREADS];
+    WorkerArgs args[WALK_MAX_THREADS];
+    int started = 1;
+    for(int i = 0; i < threads; i++){
+        args[i].pool = pool;
+        args[i].index = i;
+    }
+    for(int i = 1; i < threads; i++){
+        if(pthread_create(&tids[i], NULL, workerLoop, &args[i]) != 0) break;
+        started++;
+    }
+    workerLoop(&args[0]);
+    for(int i = 1; i < started; i++) pthread_join(tids[i], NULL);
+
+    int walked = !atomic_load(&(pool->failed));
+    freePool(pool, threads);
+    return walked;
+}
+
+/**
+ * Frees a pool
+ * @param ready : Number of deques that were set up
+ */
+static void freePool(WalkPool *pool, int ready){
+    for(int i = 0; i < ready; i++){
+        pthread_mutex_destroy(&(pool->deques[i].lock));
+        free(pool->deques[i].tasks);
+    }
+    free(pool);
+}
@@ -0,0 +1,87 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "tree.h"
+
+// Maximum number of worker threads used by a parallel walk
+#define WALK_MAX_THREADS 64
+// Initial capacity of each worker's deque
+#define WALK_DEQUE_CAPACITY 64
+
+typedef struct {
+    uint64_t dir;                   // Directory to expand (inode number, cluster number...)
+    struct TreeNode *node;          // Tree node where the entries of the directory are added
+} WalkTask;
+
+typedef struct {
+    pthread_mutex_t lock;
+    WalkTask *tasks;
+    int head;                       // Oldest task (taken by thieves)
+    int tail;                       // One past the newest task (pushed & popped by the owner)
+    int capacity;
+} WalkDeque;
+
+typedef struct WalkPool WalkPool;
+
+/**
+ * Expands a directory: adds its entries to node (in directory order) and pushes its subdirectories with WALK_push.
+ * It runs concurrently on different directories, so it must only touch node and its new children.
+ * @param pool : The pool running the walk
+ * @param worker : Index of the worker running the function
+ * @param ctx : Context given to WALK_run
+ * @param dir : Directory to expand
+ * @param node : Tree node of the directory
+ */
+typedef void (*WalkExpandFn)(WalkPool *pool, int worker, void *ctx, uint64_t dir, struct TreeNode *node);
+
+struct WalkPool {
+    int numWorkers;
+    WalkDeque deques[WALK_MAX_THREADS];
+    atomic_long pending;            // Tasks pushed but not finished yet
+    atomic_int failed;              // Set if memory ran out (some directories were left out of the walk)
+    WalkExpandFn expand;
+    void *ctx;
+};
+
+/**
+ * Returns the number of workers worth using for a parallel walk (one per online CPU, at most WALK_MAX_THREADS)
+ * @return Number of workers
+ */
+int WALK_threads(void);
+
+/**
+ * Pushes a directory to be expanded on the deque of the given worker
+ * @param pool : The pool running the walk
+ * @param worker : Index of the worker pushing the task
+ * @param dir : Directory to expand
+ * @param node : Tree node of the directory (if there is no memory for the task, the walk fails, see WALK_run)
+ */
+void WALK_push(WalkPool *pool, int worker, uint64_t dir, struct TreeNode *node);
+
+/**
+ * Makes the walk fail (WALK_run returns 0), for an expand function that couldn't add an entry to its node
+ * @param pool : The pool running the walk
+ */
+void WALK_fail(WalkPool *pool);
+
+/**
+ * Walks a directory hierarchy with a pool of work-stealing threads.
+ * Each worker expands directories from its own deque (newest first), and steals the oldest task of the
+ * other workers when it runs out. Since every directory is expanded by a single worker, the children of
+ * each node keep the directory order, and the resulting tree is the same as with a sequential walk.
+ * @param threads : Number of worker threads
+ * @param expand : Function that expands one directory
+ * @param ctx : Context passed to expand
+ * @param root : Root directory
+ * @param rootNode : Tree node of the root directory
+ * @return Whether the whole hierarchy was walked (1) or not (0, memory ran out)
+ */
+int WALK_run(int threads, WalkExpandFn expand, void *ctx, uint64_t root, struct TreeNode *rootNode);
+
+#endif
@@ -0,0 +1,158 @@
+#include "xxh64.h"
+
+#define XXH64_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME3 0x165667B19E3779F9ULL
+#define XXH64_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME5 0x27D4EB2F165667C5ULL
+
+#define XXH64_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t read64(const unsigned char *p);
+static uint32_t read32(const unsigned char *p);
+static uint64_t round64(uint64_t acc, uint64_t input);
+static uint64_t mergeRound(uint64_t acc, uint64_t value);
+static const unsigned char * consumeStripes(uint64_t acc[4], const unsigned char *p, const unsigned char *end);
+
+/**
+ * Reads a little endian 64-bit value (from any address)
+ */
+static uint64_t read64(const unsigned char *p){
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * Reads a little endian 32-bit value (from any address)
+ */
+static uint32_t read32(const unsigned char *p){
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * Mixes 8 bytes of input into the accumulator of a lane
+ */
+static uint64_t round64(uint64_t acc, uint64_t input){
+    acc += input * XXH64_PRIME2;
+    acc = XXH64_ROTL(acc, 31);
+    return acc * XXH64_PRIME1;
+}
+
+/**
+ * Folds the accumulator of a lane into the hash, when it's being finished
+ */
+static uint64_t mergeRound(uint64_t acc, uint64_t value){
+    acc ^= round64(0, value);
+    return acc * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+/**
+ * Runs the rounds of every whole stripe of a range. The four lanes don't depend on each other, so the CPU
+ * works on them at the same time.
+ * @param acc : The accumulators of the lanes
+ * @param p : First byte of the range
+ * @param end : One past the last byte of the range
+ * @return First byte that wasn't consumed (less than a stripe before end)
+ */
+static const unsigned char * consumeStripes(uint64_t acc[4], const unsigned char *p, const unsigned char *end){
+    uint64_t v1 = acc[0], v2 = acc[1], v3 = acc[2], v4 = acc[3];
+    while(end - p >= XXH64_STRIPE){
+        v1 = round64(v1, read64(p));
+        v2 = round64(v2, read64(p + 8));
+        v3 = round64(v3, read64(p + 16));
+        v4 = round64(v4, read64(p + 24));
+        p += XXH64_STRIPE;
+    }
+    acc[0] = v1;
+    acc[1] = v2;
+    acc[2] = v3;
+    acc[3] = v4;
+    return p;
+}
+
+/**
+ * Starts an XXH64 hash
+ * @param state : The state to initialize
+ * @param seed : Seed of the hash (0 gives the digests of xxhsum -H1)
+ */
+void XXH64_init(Xxh64State *state, uint64_t seed){
+    memset(state, 0, sizeof(Xxh64State));
+    state->acc[0] = seed + XXH64_PRIME1 + XXH64_PRIME2;
+    state->acc[1] = seed + XXH64_PRIME2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - XXH64_PRIME1;
+}
+
+/**
+ * Adds bytes to an XXH64 hash. They can be given in pieces of any size: the digest is the same as if they were
+ * given at once.
+ * @param state : The state
+ * @param data : The bytes
+ * @param len : Number of bytes
+ */
+void XXH64_update(Xxh64State *state, const void *data, size_t len){
+    const unsigned char *p = (const unsigned char *) data;
+    const unsigned char *end = p + len;
+    state->totalLen += len;
+
+    //Complete the stripe left by the previous call first
+    if(state->buffered > 0){
+        size_t take = XXH64_STRIPE - state->buffered;
+        if(take > len) take = len;
+        memcpy(state->buffer + state->buffered, p, take);
+        state->buffered += take;
+        p += take;
+        if(state->buffered < XXH64_STRIPE) return;
+        consumeStripes(state->acc, state->buffer, state->buffer + XXH64_STRIPE);
+        state->buffered = 0;
+    }
+
+    //Whole stripes are read straight from the input, and what's left waits for the next call
+    p = consumeStripes(state->acc, p, end);
+    memcpy(state->buffer, p, (size_t) (end - p));
+    state->buffered = (uint32_t) (end - p);
+}
+
+/**
+ * Finishes an XXH64 hash (the state isn't changed, so more bytes can still be added)
+ * @param state : The state
+ * @return The digest of the bytes given so far
+ */
+uint64_t XXH64_digest(const Xxh64State *state){
+    uint64_t h;
+    if(state->totalLen >= XXH64_STRIPE){
+        const uint64_t *acc = state->acc;
+        h = XXH64_ROTL(acc[0], 1) + XXH64_ROTL(acc[1], 7) + XXH64_ROTL(acc[2], 12) + XXH64_ROTL(acc[3], 18);
+        for(int i = 0; i < 4; i++) h = mergeRound(h, acc[i]);
+    }
+    //Short inputs never ran a round: the seed is in acc[2] as it was given
+    else h = state->acc[2] + XXH64_PRIME5;
+    h += state->totalLen;
+
+    //The bytes of the last, partial stripe
+    const unsigned char *p = state->buffer, *end = state->buffer + state->buffered;
+    for(; end - p >= 8; p += 8){
+        h ^= round64(0, read64(p));
+        h = XXH64_ROTL(h, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+    }
+    if(end - p >= 4){
+        h ^= (uint64_t) read32(p) * XXH64_PRIME1;
+        h = XXH64_ROTL(h, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+        p += 4;
+    }
+    for(; p < end; p++){
+        h ^= *p * XXH64_PRIME5;
+        h = XXH64_ROTL(h, 11) * XXH64_PRIME1;
+    }
+
+    //Avalanche
+    h ^= h >> 33;
+    h *= XXH64_PRIME2;
+    h ^= h >> 29;
+    h *= XXH64_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,41 @@
+#ifndef XXH64_H
+#define XXH64_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// Bytes consumed by each round: four 64-bit lanes, each with an accumulator of its own
+#define XXH64_STRIPE 32
+
+typedef struct {
+    uint64_t totalLen;              // Bytes given so far
+    uint64_t acc[4];                // Accumulators of the lanes
+    unsigned char buffer[XXH64_STRIPE];  // Bytes of a stripe that isn't complete yet
+    uint32_t buffered;
+} Xxh64State;
+
+/**
+ * Starts an XXH64 hash
+ * @param state : The state to initialize
+ * @param seed : Seed of the hash (0 gives the digests of xxhsum -H1)
+ */
+void XXH64_init(Xxh64State *state, uint64_t seed);
+
+/**
+ * Adds bytes to an XXH64 hash. They can be given in pieces of any size: the digest is the same as if they were
+ * given at once.
+ * @param state : The state
+ * @param data : The bytes
+ * @param len : Number of bytes
+ */
+void XXH64_update(Xxh64State *state, const void *data, size_t len);
+
+/**
+ * Finishes an XXH64 hash (the state isn't changed, so more bytes can still be added)
+ * @param state : The state
+ * @return The digest of the bytes given so far
+ */
+uint64_t XXH64_digest(const Xxh64State *state);
+
+#endif